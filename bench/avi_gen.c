@@ -0,0 +1,752 @@
+/*
+
+  mjpeg_webserver - Web server optimized for JPEGs from a webcam or AVI file.
+
+  Copyright 2004-2024 - Michael Kohn (mike@mikekohn.net)
+  https://www.mikekohn.net/
+
+  This program falls under the GPLv3 license.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+// Synthetic MJPEG AVI generator for testing and benchmarking without
+// a camera. Every frame is the same small JPEG (or the -j files) with a
+// comment segment holding the frame number so frames can be told apart.
+
+// OpenDML files start a new RIFF AVIX chunk every 1GB.
+#define RIFF_SEGMENT_SIZE (1024LL * 1024 * 1024)
+
+// Room for this many ix## entries in the super index.
+#define SUPER_INDEX_ENTRIES 256
+
+#define AVIF_HASINDEX 0x10
+
+typedef struct IndexEntry
+{
+  char ckid[4];
+  int64_t offset;
+  uint32_t length;
+} IndexEntry;
+
+typedef struct Writer
+{
+  FILE *out;
+  int opendml;
+  int sparse;
+  int audio;
+  uint32_t rate;
+  uint32_t scale;
+  int width;
+  int height;
+  int64_t riff_ptr;
+  int64_t movi_ptr;
+  int64_t avih_ptr;
+  int64_t strh_ptr;
+  int64_t indx_ptr;
+  int64_t dmlh_ptr;
+  IndexEntry *index;
+  int index_len;
+  int index_alloc;
+  int64_t idx1_movi_ptr;
+  int idx1_len;
+  int segments;
+  int segment_frames;
+  int total_frames;
+  uint32_t biggest_frame;
+} Writer;
+
+static uint8_t test_jpeg[] =
+{
+  0xff, 0xd8, 0xff, 0xe0, 0x00, 0x10, 0x4a, 0x46, 0x49, 0x46, 0x00, 0x01,
+  0x01, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0xff, 0xdb, 0x00, 0x43,
+  0x00, 0x06, 0x04, 0x05, 0x06, 0x05, 0x04, 0x06, 0x06, 0x05, 0x06, 0x07,
+  0x07, 0x06, 0x08, 0x0a, 0x10, 0x0a, 0x0a, 0x09, 0x09, 0x0a, 0x14, 0x0e,
+  0x0f, 0x0c, 0x10, 0x17, 0x14, 0x18, 0x18, 0x17, 0x14, 0x16, 0x16, 0x1a,
+  0x1d, 0x25, 0x1f, 0x1a, 0x1b, 0x23, 0x1c, 0x16, 0x16, 0x20, 0x2c, 0x20,
+  0x23, 0x26, 0x27, 0x29, 0x2a, 0x29, 0x19, 0x1f, 0x2d, 0x30, 0x2d, 0x28,
+  0x30, 0x25, 0x28, 0x29, 0x28, 0xff, 0xdb, 0x00, 0x43, 0x01, 0x07, 0x07,
+  0x07, 0x0a, 0x08, 0x0a, 0x13, 0x0a, 0x0a, 0x13, 0x28, 0x1a, 0x16, 0x1a,
+  0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28,
+  0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28,
+  0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28,
+  0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28,
+  0x28, 0x28, 0xff, 0xc0, 0x00, 0x11, 0x08, 0x00, 0x30, 0x00, 0x40, 0x03,
+  0x01, 0x22, 0x00, 0x02, 0x11, 0x01, 0x03, 0x11, 0x01, 0xff, 0xc4, 0x00,
+  0x1f, 0x00, 0x00, 0x01, 0x05, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05,
+  0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0xff, 0xc4, 0x00, 0xb5, 0x10, 0x00,
+  0x02, 0x01, 0x03, 0x03, 0x02, 0x04, 0x03, 0x05, 0x05, 0x04, 0x04, 0x00,
+  0x00, 0x01, 0x7d, 0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21,
+  0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81,
+  0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24,
+  0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25,
+  0x26, 0x27, 0x28, 0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a,
+  0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56,
+  0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+  0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86,
+  0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99,
+  0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3,
+  0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6,
+  0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9,
+  0xda, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1,
+  0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xff, 0xc4, 0x00,
+  0x1f, 0x01, 0x00, 0x03, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+  0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05,
+  0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0xff, 0xc4, 0x00, 0xb5, 0x11, 0x00,
+  0x02, 0x01, 0x02, 0x04, 0x04, 0x03, 0x04, 0x07, 0x05, 0x04, 0x04, 0x00,
+  0x01, 0x02, 0x77, 0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31,
+  0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71, 0x13, 0x22, 0x32, 0x81, 0x08,
+  0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0, 0x15,
+  0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18,
+  0x19, 0x1a, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39,
+  0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55,
+  0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+  0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84,
+  0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97,
+  0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa,
+  0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4,
+  0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7,
+  0xd8, 0xd9, 0xda, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea,
+  0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xff, 0xda, 0x00,
+  0x0c, 0x03, 0x01, 0x00, 0x02, 0x11, 0x03, 0x11, 0x00, 0x3f, 0x00, 0xf9,
+  0xc4, 0x47, 0x4f, 0x11, 0xd5, 0xa1, 0x1d, 0x3c, 0x47, 0x5d, 0x0e, 0x67,
+  0xa1, 0x0a, 0x85, 0x61, 0x1d, 0x3c, 0x47, 0x56, 0x44, 0x74, 0xf1, 0x1d,
+  0x43, 0x99, 0xd3, 0x0a, 0x85, 0x61, 0x1d, 0x3c, 0x47, 0x56, 0x44, 0x75,
+  0x20, 0x8e, 0xa1, 0xcc, 0xea, 0x85, 0x42, 0xa8, 0x8e, 0xa4, 0x11, 0xd5,
+  0x91, 0x1d, 0x3c, 0x47, 0x50, 0xe6, 0x74, 0xc2, 0xa1, 0x54, 0x47, 0x4f,
+  0x11, 0xd5, 0xa1, 0x1d, 0x3c, 0x47, 0x50, 0xe6, 0x7c, 0xa4, 0x2a, 0x15,
+  0x84, 0x74, 0xf1, 0x1d, 0x59, 0x11, 0xd3, 0xc4, 0x75, 0x0e, 0x67, 0x4c,
+  0x2a, 0x15, 0x84, 0x74, 0xf1, 0x1d, 0x5a, 0x11, 0xd3, 0xc4, 0x75, 0x0e,
+  0x67, 0x4c, 0x2a, 0x15, 0x44, 0x75, 0x20, 0x8e, 0xac, 0x88, 0xe9, 0xe2,
+  0x3a, 0x87, 0x33, 0xa6, 0x15, 0x0a, 0xa2, 0x3a, 0x78, 0x8e, 0xad, 0x08,
+  0xe9, 0xe2, 0x3a, 0x87, 0x33, 0xe5, 0x61, 0x50, 0xac, 0x23, 0xa7, 0x88,
+  0xea, 0xc8, 0x8e, 0x9e, 0x23, 0xa8, 0x73, 0x3a, 0x61, 0x50, 0xac, 0x23,
+  0xa7, 0x88, 0xea, 0xd0, 0x8e, 0x9e, 0x23, 0xa8, 0x73, 0x3a, 0x61, 0x50,
+  0xaa, 0x23, 0xa9, 0x04, 0x75, 0x64, 0x47, 0x4f, 0x11, 0xd6, 0x6e, 0x67,
+  0x4c, 0x2a, 0x1f, 0xff, 0xd9
+};
+
+static void write_int16(FILE *out, int n)
+{
+  putc(n & 0xff, out);
+  putc((n >> 8) & 0xff, out);
+}
+
+static void write_int32(FILE *out, uint32_t n)
+{
+  putc(n & 0xff, out);
+  putc((n >> 8) & 0xff, out);
+  putc((n >> 16) & 0xff, out);
+  putc((n >> 24) & 0xff, out);
+}
+
+static void write_int64(FILE *out, uint64_t n)
+{
+  write_int32(out, n & 0xffffffff);
+  write_int32(out, n >> 32);
+}
+
+static void write_fourcc(FILE *out, const char *fourcc)
+{
+  fwrite(fourcc, 1, 4, out);
+}
+
+static void write_zeros(FILE *out, int count)
+{
+  while (count-- > 0) { putc(0, out); }
+}
+
+static void patch_int32(FILE *out, int64_t offset, uint32_t n)
+{
+  int64_t ptr = ftello(out);
+
+  fseeko(out, offset, SEEK_SET);
+  write_int32(out, n);
+  fseeko(out, ptr, SEEK_SET);
+}
+
+// Writes the chunk header with a placeholder size. Returns where the
+// header is so end_chunk() can fill in the size.
+static int64_t begin_chunk(FILE *out, const char *fourcc)
+{
+  int64_t ptr = ftello(out);
+
+  write_fourcc(out, fourcc);
+  write_int32(out, 0);
+
+  return ptr;
+}
+
+static int64_t begin_list(FILE *out, const char *list, const char *type)
+{
+  int64_t ptr = begin_chunk(out, list);
+
+  write_fourcc(out, type);
+
+  return ptr;
+}
+
+static void end_chunk(FILE *out, int64_t ptr)
+{
+  int64_t length = ftello(out) - ptr - 8;
+
+  if ((length & 1) != 0) { putc(0, out); }
+
+  patch_int32(out, ptr + 4, length);
+}
+
+static int add_index(Writer *writer, const char *ckid, int64_t offset, uint32_t length)
+{
+  IndexEntry *index;
+
+  if (writer->index_len == writer->index_alloc)
+  {
+    writer->index_alloc = (writer->index_alloc == 0) ? 4096 : writer->index_alloc * 2;
+
+    index = realloc(writer->index, sizeof(IndexEntry) * writer->index_alloc);
+
+    if (index == NULL)
+    {
+      printf("Error: Out of memory\n");
+      return -1;
+    }
+
+    writer->index = index;
+  }
+
+  memcpy(writer->index[writer->index_len].ckid, ckid, 4);
+  writer->index[writer->index_len].offset = offset;
+  writer->index[writer->index_len].length = length;
+  writer->index_len++;
+
+  return 0;
+}
+
+static void write_headers(Writer *writer)
+{
+  FILE *out = writer->out;
+  int64_t hdrl, strl, chunk, odml;
+  int t;
+
+  writer->riff_ptr = begin_list(out, "RIFF", "AVI ");
+
+  hdrl = begin_list(out, "LIST", "hdrl");
+
+  chunk = begin_chunk(out, "avih");
+  write_int32(out, (uint64_t)1000000 * writer->scale / writer->rate);
+  write_int32(out, 0);
+  write_int32(out, 0);
+  write_int32(out, AVIF_HASINDEX);
+  writer->avih_ptr = ftello(out);
+  write_int32(out, 0);
+  write_int32(out, 0);
+  write_int32(out, writer->audio ? 2 : 1);
+  write_int32(out, 0);
+  write_int32(out, writer->width);
+  write_int32(out, writer->height);
+  write_zeros(out, 16);
+  end_chunk(out, chunk);
+
+  strl = begin_list(out, "LIST", "strl");
+
+  chunk = begin_chunk(out, "strh");
+  write_fourcc(out, "vids");
+  write_fourcc(out, "MJPG");
+  write_int32(out, 0);
+  write_int32(out, 0);
+  write_int32(out, 0);
+  write_int32(out, writer->scale);
+  write_int32(out, writer->rate);
+  write_int32(out, 0);
+  writer->strh_ptr = ftello(out);
+  write_int32(out, 0);
+  write_int32(out, 0);
+  write_int32(out, 0xffffffff);
+  write_int32(out, 0);
+  write_int16(out, 0);
+  write_int16(out, 0);
+  write_int16(out, writer->width);
+  write_int16(out, writer->height);
+  end_chunk(out, chunk);
+
+  chunk = begin_chunk(out, "strf");
+  write_int32(out, 40);
+  write_int32(out, writer->width);
+  write_int32(out, writer->height);
+  write_int16(out, 1);
+  write_int16(out, 24);
+  write_fourcc(out, "MJPG");
+  write_int32(out, writer->width * writer->height * 3);
+  write_zeros(out, 16);
+  end_chunk(out, chunk);
+
+  // The super index is filled in as each RIFF segment is finished.
+  if (writer->opendml)
+  {
+    writer->indx_ptr = begin_chunk(out, "indx");
+    write_int16(out, 4);
+    putc(0, out);
+    putc(0, out);
+    write_int32(out, 0);
+    write_fourcc(out, "00dc");
+    write_zeros(out, 12);
+
+    for (t = 0; t < SUPER_INDEX_ENTRIES; t++) { write_zeros(out, 16); }
+
+    end_chunk(out, writer->indx_ptr);
+  }
+
+  end_chunk(out, strl);
+
+  if (writer->audio)
+  {
+    strl = begin_list(out, "LIST", "strl");
+
+    chunk = begin_chunk(out, "strh");
+    write_fourcc(out, "auds");
+    write_int32(out, 0);
+    write_int32(out, 0);
+    write_int32(out, 0);
+    write_int32(out, 0);
+    write_int32(out, 1);
+    write_int32(out, 8000);
+    write_zeros(out, 36);
+    end_chunk(out, chunk);
+
+    chunk = begin_chunk(out, "strf");
+    write_int16(out, 1);
+    write_int16(out, 1);
+    write_int32(out, 8000);
+    write_int32(out, 8000);
+    write_int16(out, 1);
+    write_int16(out, 8);
+    write_int16(out, 0);
+    end_chunk(out, chunk);
+
+    end_chunk(out, strl);
+  }
+
+  if (writer->opendml)
+  {
+    odml = begin_list(out, "LIST", "odml");
+    writer->dmlh_ptr = begin_chunk(out, "dmlh");
+    write_zeros(out, 248);
+    end_chunk(out, writer->dmlh_ptr);
+    end_chunk(out, odml);
+  }
+
+  end_chunk(out, hdrl);
+
+  writer->movi_ptr = begin_list(out, "LIST", "movi");
+  writer->idx1_movi_ptr = writer->movi_ptr + 8;
+}
+
+static int write_chunk(Writer *writer, const char *ckid, const uint8_t *data, uint32_t length)
+{
+  FILE *out = writer->out;
+  int64_t ptr;
+
+  write_fourcc(out, ckid);
+  write_int32(out, length);
+
+  ptr = ftello(out);
+
+  if (data == NULL)
+  {
+    // Sparse file: leave a hole where the frame would be.
+    fseeko(out, length + (length & 1), SEEK_CUR);
+  }
+    else
+  {
+    fwrite(data, 1, length, out);
+
+    if ((length & 1) != 0) { putc(0, out); }
+  }
+
+  return add_index(writer, ckid, ptr, length);
+}
+
+// Writes the ix## standard index for the frames in this RIFF segment
+// and adds it to the super index.
+static void write_std_index(Writer *writer)
+{
+  FILE *out = writer->out;
+  int64_t ix, entry;
+  int count = 0;
+  int t;
+
+  for (t = 0; t < writer->index_len; t++)
+  {
+    if (memcmp(writer->index[t].ckid, "00dc", 4) == 0) { count++; }
+  }
+
+  ix = begin_chunk(out, "ix00");
+  write_int16(out, 2);
+  putc(0, out);
+  putc(1, out);
+  write_int32(out, count);
+  write_fourcc(out, "00dc");
+  write_int64(out, writer->movi_ptr);
+  write_int32(out, 0);
+
+  for (t = 0; t < writer->index_len; t++)
+  {
+    if (memcmp(writer->index[t].ckid, "00dc", 4) != 0) { continue; }
+
+    write_int32(out, writer->index[t].offset - writer->movi_ptr);
+    write_int32(out, writer->index[t].length);
+  }
+
+  end_chunk(out, ix);
+
+  entry = writer->indx_ptr + 8 + 24 + (writer->segments * 16);
+
+  patch_int32(out, entry, ix & 0xffffffff);
+  patch_int32(out, entry + 4, ix >> 32);
+  patch_int32(out, entry + 8, ftello(out) - ix);
+  patch_int32(out, entry + 12, count);
+
+  writer->segments++;
+  patch_int32(out, writer->indx_ptr + 12, writer->segments);
+}
+
+// Legacy index of every chunk (audio too) relative to the movi fourcc.
+static void write_idx1(Writer *writer)
+{
+  FILE *out = writer->out;
+  int64_t chunk;
+  int t;
+
+  chunk = begin_chunk(out, "idx1");
+
+  for (t = 0; t < writer->idx1_len; t++)
+  {
+    write_fourcc(out, writer->index[t].ckid);
+    write_int32(out, AVIF_HASINDEX);
+    write_int32(out, writer->index[t].offset - 8 - writer->idx1_movi_ptr);
+    write_int32(out, writer->index[t].length);
+  }
+
+  end_chunk(out, chunk);
+}
+
+static void end_segment(Writer *writer)
+{
+  FILE *out = writer->out;
+
+  if (writer->opendml) { write_std_index(writer); }
+
+  end_chunk(out, writer->movi_ptr);
+
+  // Only the first RIFF gets an idx1 so old players can read part of
+  // an OpenDML file.
+  if (writer->riff_ptr == 0)
+  {
+    if (writer->idx1_len == 0) { writer->idx1_len = writer->index_len; }
+
+    write_idx1(writer);
+
+    patch_int32(out, writer->avih_ptr, writer->segment_frames);
+  }
+
+  end_chunk(out, writer->riff_ptr);
+
+  writer->index_len = 0;
+  writer->segment_frames = 0;
+}
+
+static void begin_segment(Writer *writer)
+{
+  writer->riff_ptr = begin_list(writer->out, "RIFF", "AVIX");
+  writer->movi_ptr = begin_list(writer->out, "LIST", "movi");
+}
+
+static int build_frame(
+  uint8_t *frame,
+  const uint8_t *jpeg,
+  int jpeg_len,
+  int frame_num,
+  int frame_size)
+{
+  int length, com_len, padding;
+
+  // SOI, a COM segment with the frame number, COM segments to pad the
+  // frame out to frame_size and then the rest of the JPEG.
+  frame[0] = 0xff;
+  frame[1] = 0xd8;
+
+  com_len = snprintf((char *)frame + 6, 32, "frame %d", frame_num);
+
+  frame[2] = 0xff;
+  frame[3] = 0xfe;
+  frame[4] = (com_len + 2) >> 8;
+  frame[5] = (com_len + 2) & 0xff;
+
+  length = com_len + 6;
+  padding = frame_size - jpeg_len - length + 2;
+
+  while (padding >= 5)
+  {
+    com_len = padding - 4;
+
+    if (com_len > 65533) { com_len = 65533; }
+
+    frame[length + 0] = 0xff;
+    frame[length + 1] = 0xfe;
+    frame[length + 2] = (com_len + 2) >> 8;
+    frame[length + 3] = (com_len + 2) & 0xff;
+    memset(frame + length + 4, ' ', com_len);
+
+    length += com_len + 4;
+    padding -= com_len + 4;
+  }
+
+  memcpy(frame + length, jpeg + 2, jpeg_len - 2);
+
+  return length + jpeg_len - 2;
+}
+
+static int64_t parse_size(const char *s)
+{
+  char *end;
+  int64_t n = strtoll(s, &end, 10);
+
+  switch (*end)
+  {
+    case 'k': case 'K': n = n * 1024; break;
+    case 'm': case 'M': n = n * 1024 * 1024; break;
+    case 'g': case 'G': n = n * 1024 * 1024 * 1024; break;
+  }
+
+  return n;
+}
+
+static uint8_t *load_file(const char *filename, int *length)
+{
+  FILE *in;
+  uint8_t *data;
+
+  in = fopen(filename, "rb");
+
+  if (in == NULL)
+  {
+    printf("Cannot open %s\n", filename);
+    return NULL;
+  }
+
+  fseek(in, 0, SEEK_END);
+  *length = ftell(in);
+  fseek(in, 0, SEEK_SET);
+
+  data = malloc(*length);
+
+  if (fread(data, 1, *length, in) != *length || *length < 4 ||
+      data[0] != 0xff || data[1] != 0xd8)
+  {
+    printf("%s is not a JPEG\n", filename);
+    free(data);
+    data = NULL;
+  }
+
+  fclose(in);
+
+  return data;
+}
+
+static void show_help()
+{
+  printf("Usage: avi_gen [options] <output.avi>\n"
+         "  -n <frames>       number of frames (default 300)\n"
+         "  -s <size>         write frames until the file is this big (10G)\n"
+         "  -b <bytes>        pad frames to this size (default 64k)\n"
+         "  -r <rate[/scale]> frame rate, for example 30 or 30000/1001\n"
+         "  -j <file.jpg>     use this JPEG for frames (can repeat)\n"
+         "  -a                add an audio stream\n"
+         "  -odml             OpenDML (AVI 2.0) with indx / ix## indexes\n"
+         "  -sparse           don't write frame data (index tests only)\n");
+}
+
+int main(int argc, char *argv[])
+{
+  Writer writer;
+  const char *filename = NULL;
+  uint8_t *jpegs[64];
+  int jpeg_lens[64];
+  int jpeg_count = 0;
+  uint8_t *frame, *audio = NULL;
+  int64_t max_size = 0;
+  int frames = 300;
+  int frame_size = 65536;
+  int length, audio_len = 0;
+  int r;
+
+  memset(&writer, 0, sizeof(writer));
+  writer.rate = 30;
+  writer.scale = 1;
+  writer.width = 64;
+  writer.height = 48;
+
+  for (r = 1; r < argc; r++)
+  {
+    if (strcmp(argv[r], "-n") == 0 && r + 1 < argc)
+    {
+      frames = atoi(argv[++r]);
+    }
+      else
+    if (strcmp(argv[r], "-s") == 0 && r + 1 < argc)
+    {
+      max_size = parse_size(argv[++r]);
+      frames = 0x7fffffff;
+    }
+      else
+    if (strcmp(argv[r], "-b") == 0 && r + 1 < argc)
+    {
+      frame_size = parse_size(argv[++r]);
+    }
+      else
+    if (strcmp(argv[r], "-r") == 0 && r + 1 < argc)
+    {
+      r++;
+      writer.rate = atoi(argv[r]);
+      if (strchr(argv[r], '/') != NULL) { writer.scale = atoi(strchr(argv[r], '/') + 1); }
+    }
+      else
+    if (strcmp(argv[r], "-j") == 0 && r + 1 < argc && jpeg_count < 64)
+    {
+      jpegs[jpeg_count] = load_file(argv[++r], &jpeg_lens[jpeg_count]);
+      if (jpegs[jpeg_count] == NULL) { exit(1); }
+      jpeg_count++;
+    }
+      else
+    if (strcmp(argv[r], "-a") == 0)
+    {
+      writer.audio = 1;
+    }
+      else
+    if (strcmp(argv[r], "-odml") == 0)
+    {
+      writer.opendml = 1;
+    }
+      else
+    if (strcmp(argv[r], "-sparse") == 0)
+    {
+      writer.sparse = 1;
+    }
+      else
+    if (argv[r][0] != '-' && filename == NULL)
+    {
+      filename = argv[r];
+    }
+      else
+    {
+      show_help();
+      exit(1);
+    }
+  }
+
+  if (filename == NULL || writer.rate == 0 || writer.scale == 0)
+  {
+    show_help();
+    exit(1);
+  }
+
+  if (writer.opendml == 0 && max_size >= 0xffff0000LL)
+  {
+    printf("Files over 4GB need -odml\n");
+    exit(1);
+  }
+
+  if (jpeg_count == 0)
+  {
+    jpegs[0] = test_jpeg;
+    jpeg_lens[0] = sizeof(test_jpeg);
+    jpeg_count = 1;
+  }
+
+  for (r = 0; r < jpeg_count; r++)
+  {
+    if (frame_size < jpeg_lens[r] + 48) { frame_size = jpeg_lens[r] + 48; }
+  }
+
+  frame = malloc(frame_size + 65540);
+
+  if (writer.audio)
+  {
+    audio_len = (8000 * writer.scale) / writer.rate;
+    audio = malloc(audio_len + 1);
+    memset(audio, 0x80, audio_len + 1);
+  }
+
+  writer.out = fopen(filename, "wb");
+
+  if (writer.out == NULL)
+  {
+    printf("Cannot open %s for writing\n", filename);
+    exit(1);
+  }
+
+  write_headers(&writer);
+
+  for (r = 0; r < frames; r++)
+  {
+    if (max_size != 0 && ftello(writer.out) + frame_size > max_size) { break; }
+
+    length = build_frame(frame, jpegs[r % jpeg_count], jpeg_lens[r % jpeg_count], r, frame_size);
+
+    if (writer.opendml &&
+        ftello(writer.out) + length - writer.riff_ptr > RIFF_SEGMENT_SIZE)
+    {
+      if (writer.segments == SUPER_INDEX_ENTRIES - 1)
+      {
+        printf("Too many RIFF segments, stopping at %d frames\n", r);
+        break;
+      }
+
+      end_segment(&writer);
+      begin_segment(&writer);
+    }
+
+    if (write_chunk(&writer, "00dc", writer.sparse ? NULL : frame, length) != 0)
+    {
+      break;
+    }
+
+    if (writer.audio)
+    {
+      write_chunk(&writer, "01wb", audio, audio_len);
+    }
+
+    if (length > writer.biggest_frame) { writer.biggest_frame = length; }
+
+    writer.segment_frames++;
+    writer.total_frames++;
+  }
+
+  end_segment(&writer);
+
+  patch_int32(writer.out, writer.strh_ptr, writer.total_frames);
+  patch_int32(writer.out, writer.strh_ptr + 4, writer.biggest_frame);
+
+  if (writer.opendml)
+  {
+    patch_int32(writer.out, writer.dmlh_ptr + 8, writer.total_frames);
+  }
+
+  printf("%s: %d frames, %lld bytes\n",
+    filename, writer.total_frames, (long long)ftello(writer.out));
+
+  fclose(writer.out);
+  free(writer.index);
+  free(frame);
+  free(audio);
+
+  return 0;
+}
+
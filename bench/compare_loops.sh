@@ -0,0 +1,67 @@
+#!/usr/bin/env bash
+
+# Runs the same streaming load against the select() and io_uring server
+# loops and prints what stream_bench measured for each. Pollers fetch
+# single frames from /bench.jpg while the streams run.
+#
+# Usage: compare_loops.sh <file.avi> [connections] [seconds] [pollers]
+#
+# A test file can be made with: ./avi_gen -n 300 -r 30 test.avi
+
+if [ -z "$1" ]
+then
+  echo "Usage: compare_loops.sh <file.avi> [connections] [seconds] [pollers]"
+  exit 1
+fi
+
+AVI=`realpath $1`
+CONNECTIONS=${2:-100}
+SECONDS_TO_RUN=${3:-10}
+POLLERS=${4:-0}
+PORT=8099
+BENCH_DIR=`dirname $0`
+SERVER=${BENCH_DIR}/../mjpeg_webserver
+TEMP_DIR=`mktemp -d`
+
+for loop in select io_uring
+do
+  cat > ${TEMP_DIR}/bench.conf <<EOC
+filename ${AVI}
+{
+  name bench
+}
+htdocs_dir ${TEMP_DIR}
+port ${PORT}
+minconn 10
+maxconn $((CONNECTIONS + POLLERS + 10))
+max_idle_time 60
+frame_rate 1000
+server_loop ${loop}
+alias /bench.mjpg
+{
+  source bench
+  type stream
+}
+alias /bench.jpg
+{
+  source bench
+  type single
+}
+EOC
+
+  ${SERVER} -f ${TEMP_DIR}/bench.conf -d > ${TEMP_DIR}/server.log 2>&1 &
+  pid=$!
+  sleep 1
+
+  echo "== server_loop ${loop}"
+  grep "io_uring" ${TEMP_DIR}/server.log | grep -v server_loop
+  ${BENCH_DIR}/stream_bench -port ${PORT} -c ${CONNECTIONS} -s ${POLLERS} -snap /bench.jpg \
+    -t ${SECONDS_TO_RUN} -p ${pid} /bench.mjpg
+  echo
+
+  kill ${pid}
+  wait ${pid} 2>/dev/null
+done
+
+rm -rf ${TEMP_DIR}
+
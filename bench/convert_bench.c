@@ -0,0 +1,458 @@
+/*
+
+  mjpeg_webserver - Web server optimized for JPEGs from a webcam or AVI file.
+
+  Copyright 2004-2024 - Michael Kohn (mike@mikekohn.net)
+  https://www.mikekohn.net/
+
+  This program falls under the GPLv3 license.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include <jpeglib.h>
+
+#include "capture.h"
+#include "general.h"
+#include "jpeg_compress.h"
+
+// Times the capture conversions in v4l2_capture.c and jpeg_compress()
+// at a range of frame sizes and JPEG qualities. The output of each
+// conversion is checked against the plain C versions below and every
+// JPEG is decoded and compared to its input, so a faster version of
+// any of these (SIMD, a different libjpeg) can be checked before using
+// it. Needs ./configure --enable-v4l2.
+
+typedef struct Size
+{
+  const char *name;
+  int width;
+  int height;
+} Size;
+
+static Size default_sizes[] =
+{
+  { "QVGA",   320,  240 },
+  { "VGA",    640,  480 },
+  { "720p",  1280,  720 },
+  { "1080p", 1920, 1080 },
+  { "4K",    3840, 2160 },
+};
+
+static int default_qualities[] = { 50, 75, 90 };
+
+#define KERNEL_BGR2RGB 0
+#define KERNEL_YUYV 1
+#define KERNEL_BAYER 2
+#define KERNEL_JPEG 3
+
+typedef struct Test
+{
+  CaptureInfo capture_info;
+  uint8_t *jpeg;
+  int jpeg_alloc;
+  int jpeg_len;
+  int quality;
+} Test;
+
+static int64_t min_time = 250000000;
+
+// Input that looks more like a picture than random bytes: bars, a
+// gradient and a little noise.
+static uint8_t test_value(int x, int y, int n)
+{
+  static uint32_t seed = 12345;
+  int value;
+
+  seed = seed * 1103515245 + 12345;
+
+  value = ((x / 64) * 37 + n * 71 + y / 4) & 0xff;
+  value += (int)((seed >> 16) & 7) - 4;
+
+  return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+static void fill_buffer(uint8_t *buffer, int width, int height, int bytes_per_pixel)
+{
+  int x, y, n;
+
+  for (y = 0; y < height; y++)
+  {
+    for (x = 0; x < width; x++)
+    {
+      for (n = 0; n < bytes_per_pixel; n++)
+      {
+        *buffer++ = test_value(x, y, n);
+      }
+    }
+  }
+}
+
+static uint8_t clamp(int value)
+{
+  if (value < 0) { return 0; }
+  if (value > 255) { return 255; }
+
+  return value;
+}
+
+static void reference_bgr2rgb(const uint8_t *in, uint8_t *out, int pixels)
+{
+  int n;
+
+  for (n = 0; n < pixels; n++)
+  {
+    out[n * 3 + 0] = in[n * 3 + 2];
+    out[n * 3 + 1] = in[n * 3 + 1];
+    out[n * 3 + 2] = in[n * 3 + 0];
+  }
+}
+
+static void reference_yuyv(const uint8_t *in, uint8_t *out, int pixels)
+{
+  int n, y, u, v;
+
+  for (n = 0; n < pixels; n++)
+  {
+    const uint8_t *pair = in + (n & ~1) * 2;
+
+    y = in[n * 2] << 12;
+    u = pair[1] - 128;
+    v = pair[3] - 128;
+
+    out[n * 3 + 0] = clamp((y + 5727 * v) >> 12);
+    out[n * 3 + 1] = clamp((y - 1617 * u - 2378 * v) >> 12);
+    out[n * 3 + 2] = clamp((y + 8324 * u) >> 12);
+  }
+}
+
+// BGGR: both rows of each 2x2 block become the same two pixels, with
+// red and blue shared and each pixel taking the green in its column.
+static void reference_bayer(const uint8_t *in, uint8_t *out, int width, int height)
+{
+  int x, y, x0, even, odd;
+
+  for (y = 0; y < height; y++)
+  {
+    even = (y & ~1) * width;
+    odd = even + width;
+
+    for (x = 0; x < width; x++)
+    {
+      x0 = x & ~1;
+
+      *out++ = in[odd + x0 + 1];
+      *out++ = (x & 1) == 0 ? in[odd + x0] : in[even + x0 + 1];
+      *out++ = in[even + x0];
+    }
+  }
+}
+
+static int compare(const uint8_t *a, const uint8_t *b, int length)
+{
+  int n;
+
+  for (n = 0; n < length; n++)
+  {
+    if (a[n] != b[n])
+    {
+      printf("  mismatch at byte %d: %d should be %d\n", n, a[n], b[n]);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// Decodes a JPEG from memory and returns the PSNR against the RGB
+// picture it was made from or -1 if it doesn't decode.
+static double jpeg_psnr(uint8_t *jpeg, int jpeg_len, const uint8_t *rgb, int width, int height)
+{
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  JSAMPROW row_pointer[1];
+  uint8_t *row;
+  double error = 0;
+  int n;
+
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, jpeg, jpeg_len);
+
+  if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK ||
+      cinfo.image_width != width ||
+      cinfo.image_height != height)
+  {
+    jpeg_destroy_decompress(&cinfo);
+    return -1;
+  }
+
+  cinfo.out_color_space = JCS_RGB;
+  jpeg_start_decompress(&cinfo);
+
+  row = (uint8_t *)malloc(width * 3);
+  row_pointer[0] = row;
+
+  while (cinfo.output_scanline < cinfo.output_height)
+  {
+    const uint8_t *expected = rgb + cinfo.output_scanline * width * 3;
+
+    jpeg_read_scanlines(&cinfo, row_pointer, 1);
+
+    for (n = 0; n < width * 3; n++)
+    {
+      int diff = row[n] - expected[n];
+      error += diff * diff;
+    }
+  }
+
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  free(row);
+
+  error = error / ((double)width * height * 3);
+
+  if (error == 0) { return 99; }
+
+  return 10 * log10(255.0 * 255.0 / error);
+}
+
+static void run_kernel(Test *test, int kernel)
+{
+  CaptureInfo *capture_info = &test->capture_info;
+
+  switch (kernel)
+  {
+    case KERNEL_BGR2RGB:
+      bgr2rgb(capture_info);
+      break;
+    case KERNEL_YUYV:
+      convert_yuyv(capture_info);
+      break;
+    case KERNEL_BAYER:
+      convert_bayer(capture_info);
+      break;
+    case KERNEL_JPEG:
+      test->jpeg_len = jpeg_compress(
+        capture_info->picture,
+        capture_info->width * capture_info->height * 3,
+        test->jpeg,
+        test->jpeg_alloc,
+        capture_info->width,
+        capture_info->height,
+        3,
+        test->quality);
+      break;
+  }
+}
+
+// Runs a kernel for at least min_time and prints the average.
+static void time_kernel(Test *test, int kernel, const char *name)
+{
+  int pixels = test->capture_info.width * test->capture_info.height;
+  int64_t start, elapsed;
+  int loops = 0;
+  double ns;
+
+  start = get_time_ns();
+
+  do
+  {
+    run_kernel(test, kernel);
+    loops++;
+    elapsed = get_time_ns() - start;
+  } while (elapsed < min_time || loops < 3);
+
+  ns = (double)elapsed / loops;
+
+  printf("  %-18s %8.3f %10.1f", name, ns / pixels, 1000000000.0 / ns);
+}
+
+static void bench_size(Size *size, int *qualities, int quality_count, const char *only)
+{
+  Test test;
+  CaptureInfo *capture_info = &test.capture_info;
+  uint8_t *expected;
+  int pixels = size->width * size->height;
+  char name[32];
+  int check, n;
+
+  memset(&test, 0, sizeof(test));
+  capture_info->width = size->width;
+  capture_info->height = size->height;
+  capture_info->buffer = (uint8_t *)malloc(pixels * 3);
+  capture_info->picture = (uint8_t *)malloc(pixels * 3);
+  test.jpeg_alloc = pixels * 3;
+  test.jpeg = (uint8_t *)malloc(test.jpeg_alloc);
+  expected = (uint8_t *)malloc(pixels * 3);
+
+  if (capture_info->buffer == NULL || capture_info->picture == NULL ||
+      test.jpeg == NULL || expected == NULL)
+  {
+    printf("Out of memory for %dx%d\n", size->width, size->height);
+    exit(1);
+  }
+
+  if (size->name != NULL) { printf("%s ", size->name); }
+  printf("%dx%d\n", size->width, size->height);
+
+  // bgr2rgb() swaps in place, so it's checked after one run and after
+  // that it just keeps swapping back and forth.
+  if (only == NULL || strcmp(only, "bgr2rgb") == 0)
+  {
+    fill_buffer(capture_info->buffer, size->width, size->height, 3);
+    capture_info->buffer_len = pixels * 3;
+    reference_bgr2rgb(capture_info->buffer, expected, pixels);
+
+    run_kernel(&test, KERNEL_BGR2RGB);
+    check = compare(capture_info->buffer, expected, pixels * 3);
+
+    time_kernel(&test, KERNEL_BGR2RGB, "bgr2rgb");
+    printf("  %s\n", check == 0 ? "ok" : "MISMATCH");
+  }
+
+  if (only == NULL || strcmp(only, "convert_yuyv") == 0)
+  {
+    fill_buffer(capture_info->buffer, size->width, size->height, 2);
+    capture_info->buffer_len = pixels * 2;
+    reference_yuyv(capture_info->buffer, expected, pixels);
+
+    run_kernel(&test, KERNEL_YUYV);
+    check = compare(capture_info->picture, expected, pixels * 3);
+
+    time_kernel(&test, KERNEL_YUYV, "convert_yuyv");
+    printf("  %s\n", check == 0 ? "ok" : "MISMATCH");
+  }
+
+  if (only == NULL || strcmp(only, "convert_bayer") == 0)
+  {
+    fill_buffer(capture_info->buffer, size->width, size->height, 1);
+    capture_info->buffer_len = pixels;
+    reference_bayer(capture_info->buffer, expected, size->width, size->height);
+
+    run_kernel(&test, KERNEL_BAYER);
+    check = compare(capture_info->picture, expected, pixels * 3);
+
+    time_kernel(&test, KERNEL_BAYER, "convert_bayer");
+    printf("  %s\n", check == 0 ? "ok" : "MISMATCH");
+  }
+
+  if (only == NULL || strcmp(only, "jpeg_compress") == 0)
+  {
+    // Compress what a YUYV webcam frame turns into.
+    fill_buffer(capture_info->buffer, size->width, size->height, 2);
+    capture_info->buffer_len = pixels * 2;
+    convert_yuyv(capture_info);
+
+    for (n = 0; n < quality_count; n++)
+    {
+      double psnr;
+
+      test.quality = qualities[n];
+
+      run_kernel(&test, KERNEL_JPEG);
+      psnr = jpeg_psnr(test.jpeg, test.jpeg_len, capture_info->picture,
+        size->width, size->height);
+
+      snprintf(name, sizeof(name), "jpeg_compress q%d", qualities[n]);
+      time_kernel(&test, KERNEL_JPEG, name);
+
+      if (psnr < 0)
+      {
+        printf("  BAD JPEG\n");
+      }
+        else
+      {
+        printf("  %d bytes, %.1f dB\n", test.jpeg_len, psnr);
+      }
+    }
+  }
+
+  free(capture_info->buffer);
+  free(capture_info->picture);
+  free(test.jpeg);
+  free(expected);
+}
+
+int main(int argc, char *argv[])
+{
+  Size sizes[16];
+  int qualities[16];
+  int size_count = 0;
+  int quality_count = 0;
+  const char *only = NULL;
+  int n;
+
+  for (n = 1; n < argc; n++)
+  {
+    if (strcmp(argv[n], "-s") == 0 && n + 1 < argc && size_count < 16)
+    {
+      Size *size = &sizes[size_count];
+
+      if (sscanf(argv[++n], "%dx%d", &size->width, &size->height) != 2 ||
+          size->width < 2 || size->height < 2)
+      {
+        printf("Bad size %s\n", argv[n]);
+        exit(1);
+      }
+
+      // The conversions work on pairs of pixels and rows.
+      size->width &= ~1;
+      size->height &= ~1;
+      size->name = NULL;
+      size_count++;
+    }
+      else
+    if (strcmp(argv[n], "-q") == 0 && n + 1 < argc && quality_count < 16)
+    {
+      qualities[quality_count++] = atoi(argv[++n]);
+    }
+      else
+    if (strcmp(argv[n], "-k") == 0 && n + 1 < argc)
+    {
+      only = argv[++n];
+    }
+      else
+    if (strcmp(argv[n], "-t") == 0 && n + 1 < argc)
+    {
+      min_time = (int64_t)atoi(argv[++n]) * 1000000;
+    }
+      else
+    {
+      printf("Usage: convert_bench [options]\n"
+             "  -s <WxH>     frame size, can be repeated (default QVGA to 4K)\n"
+             "  -q <quality> JPEG quality, can be repeated (default 50, 75, 90)\n"
+             "  -k <kernel>  only bgr2rgb, convert_yuyv, convert_bayer\n"
+             "               or jpeg_compress\n"
+             "  -t <ms>      minimum time for each test (default 250)\n");
+      exit(1);
+    }
+  }
+
+  if (size_count == 0)
+  {
+    size_count = sizeof(default_sizes) / sizeof(Size);
+    memcpy(sizes, default_sizes, sizeof(default_sizes));
+  }
+
+  if (quality_count == 0)
+  {
+    quality_count = sizeof(default_qualities) / sizeof(int);
+    memcpy(qualities, default_qualities, sizeof(default_qualities));
+  }
+
+  printf("  %-18s %8s %10s\n", "kernel", "ns/pixel", "frames/s");
+
+  for (n = 0; n < size_count; n++)
+  {
+    bench_size(&sizes[n], qualities, quality_count, only);
+  }
+
+  return 0;
+}
+
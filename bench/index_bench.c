@@ -0,0 +1,81 @@
+/*
+
+  mjpeg_webserver - Web server optimized for JPEGs from a webcam or AVI file.
+
+  Copyright 2004-2024 - Michael Kohn (mike@mikekohn.net)
+  https://www.mikekohn.net/
+
+  This program falls under the GPLv3 license.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "avi_play.h"
+#include "general.h"
+#include "video.h"
+
+// Times how long the server takes to open and index AVI files at
+// startup. Make a big test file with: avi_gen -odml -sparse -s 10G big.avi
+
+int main(int argc, char *argv[])
+{
+  Video *curr_video;
+  int64_t start, elapsed, best, total;
+  int loops = 5;
+  int frames = 0;
+  int n, r;
+
+  if (argc < 2)
+  {
+    printf("Usage: index_bench [-n loops] <file.avi> ...\n");
+    exit(1);
+  }
+
+  for (r = 1; r < argc; r++)
+  {
+    if (strcmp(argv[r], "-n") == 0 && r + 1 < argc)
+    {
+      loops = atoi(argv[++r]);
+      continue;
+    }
+
+    best = 0;
+    total = 0;
+
+    for (n = 0; n < loops; n++)
+    {
+      start = get_time_ns();
+
+      curr_video = avi_init(argv[r], NULL);
+
+      if (curr_video == NULL)
+      {
+        printf("%s: failed\n", argv[r]);
+        break;
+      }
+
+      elapsed = get_time_ns() - start;
+
+      frames = curr_video->total_frames;
+      video_free(curr_video);
+
+      if (n == 0 || elapsed < best) { best = elapsed; }
+      total += elapsed;
+    }
+
+    if (n != loops) { continue; }
+
+    printf("%s: %d frames, best %.3f ms, average %.3f ms\n",
+      argv[r],
+      frames,
+      (double)best / 1000000,
+      (double)total / loops / 1000000);
+  }
+
+  return 0;
+}
+
@@ -0,0 +1,886 @@
+/*
+
+  mjpeg_webserver - Web server optimized for JPEGs from a webcam or AVI file.
+
+  Copyright 2004-2024 - Michael Kohn (mike@mikekohn.net)
+  https://www.mikekohn.net/
+
+  This program falls under the GPLv3 license.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// Load generator for a running server. Opens a number of multipart
+// streams spread over a few threads, plus snapshot pollers that fetch a
+// single JPEG over and over, and reports the fps each stream got, the
+// jitter between frames, bandwidth, connect and request latency. With
+// -p the server's CPU time and context switches over the run are read
+// from /proc. Test files can be made with avi_gen so everything runs on
+// localhost (see compare_loops.sh).
+
+#define STATE_HTTP 0
+#define STATE_PART 1
+#define STATE_BODY 2
+
+#define MAX_THREADS 64
+#define HEADER_SIZE 1024
+
+typedef struct Samples
+{
+  int64_t *values;
+  int count;
+  int alloc;
+} Samples;
+
+typedef struct Stream
+{
+  int socketid;
+  int state;
+  int header_len;
+  int body_left;
+  int body_ptr;
+  uint8_t tail[2];
+  char header[HEADER_SIZE];
+  char boundary[80];
+  uint32_t frames;
+  uint32_t bad_frames;
+  uint64_t bytes;
+  int64_t connect_time;
+  int64_t first_frame_time;
+  int64_t last_frame_time;
+  Samples intervals;
+} Stream;
+
+typedef struct StreamThread
+{
+  pthread_t thread;
+  Stream *streams;
+  int count;
+  int failed;
+} StreamThread;
+
+typedef struct Poller
+{
+  pthread_t thread;
+  uint32_t requests;
+  uint32_t errors;
+  uint64_t bytes;
+  Samples connect_times;
+  Samples latencies;
+} Poller;
+
+typedef struct ProcStats
+{
+  uint64_t cpu_ticks;
+  uint64_t context_switches;
+} ProcStats;
+
+static struct sockaddr_in server_addr;
+static const char *stream_path = NULL;
+static const char *snapshot_path = NULL;
+static int connected_threads = 0;
+static int stop = 0;
+
+static int64_t get_time_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void samples_add(Samples *samples, int64_t value)
+{
+  if (samples->count == samples->alloc)
+  {
+    int alloc = samples->alloc == 0 ? 256 : samples->alloc * 2;
+    int64_t *values;
+
+    values = (int64_t *)realloc(samples->values, sizeof(int64_t) * alloc);
+    if (values == NULL) { return; }
+
+    samples->values = values;
+    samples->alloc = alloc;
+  }
+
+  samples->values[samples->count++] = value;
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+  int64_t x = *(const int64_t *)a;
+  int64_t y = *(const int64_t *)b;
+
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static double samples_percentile(Samples *samples, int percent)
+{
+  int n = (int)((int64_t)(samples->count - 1) * percent / 100);
+
+  return (double)samples->values[n] / 1000000;
+}
+
+static void samples_print(const char *name, Samples *samples)
+{
+  if (samples->count == 0) { return; }
+
+  qsort(samples->values, samples->count, sizeof(int64_t), compare_samples);
+
+  printf("%s: p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+    name,
+    samples_percentile(samples, 50),
+    samples_percentile(samples, 90),
+    samples_percentile(samples, 99),
+    samples_percentile(samples, 100));
+}
+
+static int read_proc_stats(int pid, ProcStats *stats)
+{
+  char filename[300];
+  char line[1024];
+  struct dirent *entry;
+  DIR *dir;
+  unsigned long utime, stime, value;
+  char *s;
+  FILE *in;
+
+  memset(stats, 0, sizeof(ProcStats));
+
+  snprintf(filename, sizeof(filename), "/proc/%d/stat", pid);
+  in = fopen(filename, "rb");
+  if (in == NULL) { return -1; }
+
+  if (fgets(line, sizeof(line), in) == NULL)
+  {
+    fclose(in);
+    return -1;
+  }
+
+  fclose(in);
+
+  // The command name can have spaces so start after the ')'.
+  s = strrchr(line, ')');
+
+  if (s == NULL ||
+      sscanf(s + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+        &utime, &stime) != 2)
+  {
+    return -1;
+  }
+
+  stats->cpu_ticks = utime + stime;
+
+  // Context switches are counted per thread.
+  snprintf(filename, sizeof(filename), "/proc/%d/task", pid);
+  dir = opendir(filename);
+  if (dir == NULL) { return -1; }
+
+  while ((entry = readdir(dir)) != NULL)
+  {
+    if (entry->d_name[0] == '.') { continue; }
+
+    snprintf(filename, sizeof(filename), "/proc/%d/task/%s/status",
+      pid, entry->d_name);
+    in = fopen(filename, "rb");
+    if (in == NULL) { continue; }
+
+    while (fgets(line, sizeof(line), in) != NULL)
+    {
+      if (sscanf(line, "voluntary_ctxt_switches: %lu", &value) == 1 ||
+          sscanf(line, "nonvoluntary_ctxt_switches: %lu", &value) == 1)
+      {
+        stats->context_switches += value;
+      }
+    }
+
+    fclose(in);
+  }
+
+  closedir(dir);
+
+  return 0;
+}
+
+// Connects and sends a GET, returning the socket or -1. How long the
+// connect() took is stored in connect_time.
+static int http_get(const char *path, int64_t *connect_time)
+{
+  char request[1024];
+  int64_t start;
+  int socketid, length;
+  int value = 1;
+
+  socketid = socket(AF_INET, SOCK_STREAM, 0);
+  if (socketid < 0) { return -1; }
+
+  setsockopt(socketid, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+
+  start = get_time_ns();
+
+  if (connect(socketid, (struct sockaddr *)&server_addr, sizeof(server_addr)) != 0)
+  {
+    close(socketid);
+    return -1;
+  }
+
+  *connect_time = get_time_ns() - start;
+
+  length = snprintf(request, sizeof(request),
+    "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n", path);
+
+  if (send(socketid, request, length, 0) != length)
+  {
+    close(socketid);
+    return -1;
+  }
+
+  return socketid;
+}
+
+// Returns the value of a header in a block of headers or NULL.
+static const char *find_header(const char *headers, const char *name)
+{
+  const char *s = headers;
+  int length = strlen(name);
+
+  while (*s != 0)
+  {
+    if (strncasecmp(s, name, length) == 0 && s[length] == ':')
+    {
+      s += length + 1;
+      while (*s == ' ') { s++; }
+      return s;
+    }
+
+    s = strstr(s, "\r\n");
+    if (s == NULL) { break; }
+    s += 2;
+  }
+
+  return NULL;
+}
+
+// Called with each block of headers, first the HTTP response and then
+// the headers in front of every part.
+static void stream_headers(Stream *stream)
+{
+  const char *value;
+  int n;
+
+  if (stream->state == STATE_HTTP)
+  {
+    value = find_header(stream->header, "Content-Type");
+
+    if (value == NULL || (value = strstr(value, "boundary=")) == NULL)
+    {
+      printf("Response isn't a multipart stream\n");
+      exit(1);
+    }
+
+    value += sizeof("boundary=") - 1;
+
+    // Parts start with "--" and the boundary, but this server's boundary
+    // already starts with "--" so match on what comes after the dashes.
+    while (*value == '-') { value++; }
+
+    for (n = 0; n < sizeof(stream->boundary) - 1; n++)
+    {
+      if (value[n] == '\r' || value[n] == ';' || value[n] == 0) { break; }
+      stream->boundary[n] = value[n];
+    }
+
+    stream->boundary[n] = 0;
+    stream->state = STATE_PART;
+
+    return;
+  }
+
+  value = find_header(stream->header, "Content-Length");
+
+  if (strstr(stream->header, "--") == NULL ||
+      strstr(stream->header, stream->boundary) == NULL ||
+      value == NULL || atoi(value) <= 0)
+  {
+    stream->bad_frames++;
+    return;
+  }
+
+  stream->body_left = atoi(value);
+  stream->body_ptr = 0;
+  stream->state = STATE_BODY;
+}
+
+static void stream_frame(Stream *stream)
+{
+  int64_t now = get_time_ns();
+
+  // A JPEG that doesn't end with EOI was cut off or mixed up.
+  if (stream->tail[0] != 0xff || stream->tail[1] != 0xd9)
+  {
+    stream->bad_frames++;
+  }
+
+  if (stream->last_frame_time != 0)
+  {
+    samples_add(&stream->intervals, now - stream->last_frame_time);
+  }
+    else
+  {
+    stream->first_frame_time = now;
+  }
+
+  stream->last_frame_time = now;
+  stream->frames++;
+}
+
+// Splits what was read into header blocks and JPEGs.
+static void stream_parse(Stream *stream, const uint8_t *buffer, int length)
+{
+  int n;
+
+  stream->bytes += length;
+
+  while (length > 0)
+  {
+    if (stream->state == STATE_BODY)
+    {
+      n = length < stream->body_left ? length : stream->body_left;
+
+      if (stream->body_ptr == 0 && buffer[0] != 0xff)
+      {
+        stream->bad_frames++;
+      }
+
+      if (n == 1)
+      {
+        stream->tail[0] = stream->tail[1];
+        stream->tail[1] = buffer[0];
+      }
+        else
+      {
+        stream->tail[0] = buffer[n - 2];
+        stream->tail[1] = buffer[n - 1];
+      }
+
+      stream->body_left -= n;
+      stream->body_ptr += n;
+      buffer += n;
+      length -= n;
+
+      if (stream->body_left == 0)
+      {
+        stream_frame(stream);
+        stream->state = STATE_PART;
+      }
+
+      continue;
+    }
+
+    // Skip the line break between a JPEG and the next boundary.
+    if (stream->header_len == 0 && (*buffer == '\r' || *buffer == '\n'))
+    {
+      buffer++;
+      length--;
+      continue;
+    }
+
+    stream->header[stream->header_len++] = *buffer++;
+    stream->header[stream->header_len] = 0;
+    length--;
+
+    if (stream->header_len >= 4 &&
+        memcmp(stream->header + stream->header_len - 4, "\r\n\r\n", 4) == 0)
+    {
+      stream_headers(stream);
+      stream->header_len = 0;
+    }
+      else
+    if (stream->header_len == HEADER_SIZE - 1)
+    {
+      stream->bad_frames++;
+      stream->header_len = 0;
+    }
+  }
+}
+
+static void *stream_thread(void *context)
+{
+  StreamThread *thread = (StreamThread *)context;
+  struct pollfd *fds;
+  uint8_t buffer[65536];
+  int n, r, length;
+
+  fds = (struct pollfd *)malloc(sizeof(struct pollfd) * thread->count);
+
+  for (n = 0; n < thread->count; n++)
+  {
+    Stream *stream = &thread->streams[n];
+
+    stream->socketid = http_get(stream_path, &stream->connect_time);
+
+    if (stream->socketid == -1) { thread->failed++; }
+
+    fds[n].fd = stream->socketid;
+    fds[n].events = POLLIN;
+  }
+
+  __atomic_add_fetch(&connected_threads, 1, __ATOMIC_RELEASE);
+
+  while (__atomic_load_n(&stop, __ATOMIC_ACQUIRE) == 0)
+  {
+    r = poll(fds, thread->count, 100);
+
+    if (r < 0)
+    {
+      if (errno == EINTR) { continue; }
+      break;
+    }
+
+    for (n = 0; n < thread->count && r > 0; n++)
+    {
+      if (fds[n].revents == 0) { continue; }
+
+      r--;
+
+      length = recv(fds[n].fd, buffer, sizeof(buffer), 0);
+
+      if (length <= 0)
+      {
+        close(fds[n].fd);
+        fds[n].fd = -1;
+        continue;
+      }
+
+      stream_parse(&thread->streams[n], buffer, length);
+    }
+  }
+
+  for (n = 0; n < thread->count; n++)
+  {
+    thread->streams[n].socketid = fds[n].fd;
+
+    if (fds[n].fd != -1) { close(fds[n].fd); }
+  }
+
+  free(fds);
+
+  return NULL;
+}
+
+// Fetches one JPEG and reads until Content-Length bytes of it arrived.
+static int poller_request(Poller *poller)
+{
+  char buffer[65536];
+  const char *value;
+  int64_t start, connect_time;
+  int socketid, length;
+  int total = 0, header_len = 0, content_length = -1;
+  char *s;
+
+  start = get_time_ns();
+
+  socketid = http_get(snapshot_path, &connect_time);
+  if (socketid == -1) { return -1; }
+
+  samples_add(&poller->connect_times, connect_time);
+
+  while (1)
+  {
+    if (header_len == 0)
+    {
+      length = recv(socketid, buffer + total, sizeof(buffer) - 1 - total, 0);
+    }
+      else
+    {
+      length = recv(socketid, buffer, sizeof(buffer), 0);
+    }
+
+    if (length <= 0) { break; }
+
+    poller->bytes += length;
+    total += length;
+
+    if (header_len == 0)
+    {
+      buffer[total] = 0;
+      s = strstr(buffer, "\r\n\r\n");
+
+      if (s == NULL)
+      {
+        if (total == sizeof(buffer) - 1) { break; }
+        continue;
+      }
+
+      header_len = s + 4 - buffer;
+      value = find_header(buffer, "Content-Length");
+
+      if (value == NULL || strncmp(buffer + 9, "200", 3) != 0) { break; }
+
+      content_length = atoi(value);
+    }
+
+    if (total - header_len >= content_length) { break; }
+  }
+
+  close(socketid);
+
+  if (content_length <= 0 || total - header_len < content_length) { return -1; }
+
+  samples_add(&poller->latencies, get_time_ns() - start);
+
+  return 0;
+}
+
+static void *poller_thread(void *context)
+{
+  Poller *poller = (Poller *)context;
+
+  while (__atomic_load_n(&stop, __ATOMIC_ACQUIRE) == 0)
+  {
+    if (poller_request(poller) != 0)
+    {
+      // Don't spin on a server that's refusing connections.
+      poller->errors++;
+      usleep(10000);
+      continue;
+    }
+
+    poller->requests++;
+  }
+
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  StreamThread threads[MAX_THREADS];
+  Stream *streams;
+  Poller *pollers;
+  ProcStats start_stats, end_stats;
+  Samples intervals, jitter, connect_times, latencies;
+  const char *host = "127.0.0.1";
+  int64_t start, elapsed;
+  uint64_t frames = 0, bad_frames = 0, bytes = 0;
+  uint64_t requests = 0, errors = 0;
+  double secs, fps, total_fps = 0, min_fps = 0, max_fps = 0;
+  int connections = 10;
+  int poller_count = 0;
+  int thread_count = 4;
+  int seconds = 10;
+  int port = 5555;
+  int verbose = 0;
+  int pid = 0;
+  int failed = 0, closed = 0;
+  int n, k;
+
+  for (n = 1; n < argc; n++)
+  {
+    if (strcmp(argv[n], "-c") == 0 && n + 1 < argc)
+    {
+      connections = atoi(argv[++n]);
+    }
+      else
+    if (strcmp(argv[n], "-s") == 0 && n + 1 < argc)
+    {
+      poller_count = atoi(argv[++n]);
+    }
+      else
+    if (strcmp(argv[n], "-snap") == 0 && n + 1 < argc)
+    {
+      snapshot_path = argv[++n];
+    }
+      else
+    if (strcmp(argv[n], "-j") == 0 && n + 1 < argc)
+    {
+      thread_count = atoi(argv[++n]);
+    }
+      else
+    if (strcmp(argv[n], "-t") == 0 && n + 1 < argc)
+    {
+      seconds = atoi(argv[++n]);
+    }
+      else
+    if (strcmp(argv[n], "-h") == 0 && n + 1 < argc)
+    {
+      host = argv[++n];
+    }
+      else
+    if (strcmp(argv[n], "-p") == 0 && n + 1 < argc)
+    {
+      pid = atoi(argv[++n]);
+    }
+      else
+    if (strcmp(argv[n], "-port") == 0 && n + 1 < argc)
+    {
+      port = atoi(argv[++n]);
+    }
+      else
+    if (strcmp(argv[n], "-v") == 0)
+    {
+      verbose = 1;
+    }
+      else
+    if (argv[n][0] == '/')
+    {
+      stream_path = argv[n];
+    }
+      else
+    {
+      stream_path = NULL;
+      break;
+    }
+  }
+
+  if (stream_path == NULL || connections < 0 || poller_count < 0 ||
+      (connections == 0 && poller_count == 0))
+  {
+    printf("Usage: stream_bench [options] <path>\n"
+           "  -c <count>   multipart streams (default 10)\n"
+           "  -j <count>   threads reading the streams (default 4)\n"
+           "  -s <count>   snapshot pollers, one thread each (default 0)\n"
+           "  -snap <path> what the pollers fetch (default <path>)\n"
+           "  -t <secs>    how long to run (default 10)\n"
+           "  -h <host>    server address (default 127.0.0.1)\n"
+           "  -port <port> server port (default 5555)\n"
+           "  -p <pid>     report CPU used by the server process\n"
+           "  -v           print the results for every stream\n");
+    exit(1);
+  }
+
+  if (snapshot_path == NULL) { snapshot_path = stream_path; }
+
+  if (thread_count > MAX_THREADS) { thread_count = MAX_THREADS; }
+  if (thread_count > connections) { thread_count = connections; }
+  if (thread_count < 1 && connections > 0) { thread_count = 1; }
+
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_port = htons(port);
+
+  if (inet_pton(AF_INET, host, &server_addr.sin_addr) != 1)
+  {
+    printf("Bad address %s\n", host);
+    exit(1);
+  }
+
+  streams = (Stream *)calloc(connections + 1, sizeof(Stream));
+  pollers = (Poller *)calloc(poller_count + 1, sizeof(Poller));
+
+  if (streams == NULL || pollers == NULL)
+  {
+    printf("Out of memory\n");
+    exit(1);
+  }
+
+  if (pid != 0 && read_proc_stats(pid, &start_stats) != 0)
+  {
+    printf("Can't read /proc stats for pid %d\n", pid);
+    pid = 0;
+  }
+
+  // Frames sent while the rest of the connections are being opened wait
+  // in the socket buffers, so the clock starts before the first one and
+  // the run lasts seconds after the last one.
+  start = get_time_ns();
+
+  for (n = 0, k = 0; n < thread_count; n++)
+  {
+    threads[n].streams = streams + k;
+    threads[n].count = connections / thread_count +
+      (n < connections % thread_count ? 1 : 0);
+    threads[n].failed = 0;
+    k += threads[n].count;
+
+    pthread_create(&threads[n].thread, NULL, stream_thread, &threads[n]);
+  }
+
+  while (__atomic_load_n(&connected_threads, __ATOMIC_ACQUIRE) < thread_count)
+  {
+    usleep(1000);
+  }
+
+  for (n = 0; n < poller_count; n++)
+  {
+    pthread_create(&pollers[n].thread, NULL, poller_thread, &pollers[n]);
+  }
+
+  sleep(seconds);
+
+  __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+
+  for (n = 0; n < thread_count; n++)
+  {
+    pthread_join(threads[n].thread, NULL);
+    failed += threads[n].failed;
+  }
+
+  for (n = 0; n < poller_count; n++)
+  {
+    pthread_join(pollers[n].thread, NULL);
+  }
+
+  elapsed = get_time_ns() - start;
+  secs = (double)elapsed / 1000000000;
+
+  if (pid != 0) { read_proc_stats(pid, &end_stats); }
+
+  memset(&intervals, 0, sizeof(intervals));
+  memset(&jitter, 0, sizeof(jitter));
+  memset(&connect_times, 0, sizeof(connect_times));
+  memset(&latencies, 0, sizeof(latencies));
+
+  for (n = 0; n < connections; n++)
+  {
+    Stream *stream = &streams[n];
+    int64_t mean = 0;
+
+    if (stream->socketid == -1) { closed++; }
+
+    frames += stream->frames;
+    bad_frames += stream->bad_frames;
+    bytes += stream->bytes;
+
+    // The rate a stream got is timed from its first frame to its last
+    // so connecting and shutting down don't count against it.
+    fps = 0;
+
+    if (stream->frames > 1)
+    {
+      fps = (double)(stream->frames - 1) * 1000000000 /
+        (stream->last_frame_time - stream->first_frame_time);
+    }
+
+    total_fps += fps;
+
+    if (n == 0 || fps < min_fps) { min_fps = fps; }
+    if (n == 0 || fps > max_fps) { max_fps = fps; }
+
+    if (stream->connect_time != 0)
+    {
+      samples_add(&connect_times, stream->connect_time);
+    }
+
+    // Jitter is how far each gap between frames is from the average gap
+    // of that stream, so streams at different rates can be mixed.
+    for (k = 0; k < stream->intervals.count; k++)
+    {
+      mean += stream->intervals.values[k];
+    }
+
+    if (stream->intervals.count != 0) { mean /= stream->intervals.count; }
+
+    for (k = 0; k < stream->intervals.count; k++)
+    {
+      int64_t value = stream->intervals.values[k];
+
+      samples_add(&intervals, value);
+      samples_add(&jitter, value > mean ? value - mean : mean - value);
+    }
+
+    if (verbose == 1)
+    {
+      printf("stream %d: %u frames (%.2f fps), %u bad, %.2f MB/s\n",
+        n,
+        stream->frames,
+        fps,
+        stream->bad_frames,
+        (double)stream->bytes / secs / 1000000);
+    }
+
+    free(stream->intervals.values);
+  }
+
+  for (n = 0; n < poller_count; n++)
+  {
+    Poller *poller = &pollers[n];
+
+    requests += poller->requests;
+    errors += poller->errors;
+    bytes += poller->bytes;
+
+    for (k = 0; k < poller->connect_times.count; k++)
+    {
+      samples_add(&connect_times, poller->connect_times.values[k]);
+    }
+
+    for (k = 0; k < poller->latencies.count; k++)
+    {
+      samples_add(&latencies, poller->latencies.values[k]);
+    }
+
+    free(poller->connect_times.values);
+    free(poller->latencies.values);
+  }
+
+  if (connections > 0)
+  {
+    // Streams that failed to connect are still in -1.
+    printf("    streams: %d on %d threads (%d failed, %d closed early)\n",
+      connections,
+      thread_count,
+      failed,
+      closed - failed);
+    printf("     frames: %llu (%llu bad)\n",
+      (unsigned long long)frames,
+      (unsigned long long)bad_frames);
+    printf("        fps: %.2f per stream (min %.2f, max %.2f)\n",
+      total_fps / connections,
+      min_fps,
+      max_fps);
+    samples_print("   interval", &intervals);
+    samples_print("     jitter", &jitter);
+  }
+
+  if (poller_count > 0)
+  {
+    printf("  snapshots: %llu (%.2f per second, %llu errors)\n",
+      (unsigned long long)requests,
+      (double)requests / secs,
+      (unsigned long long)errors);
+    samples_print("    latency", &latencies);
+  }
+
+  samples_print("    connect", &connect_times);
+
+  printf("  bandwidth: %.2f MB/s\n", (double)bytes / secs / 1000000);
+
+  if (pid != 0)
+  {
+    double cpu_secs = (double)(end_stats.cpu_ticks - start_stats.cpu_ticks) /
+      sysconf(_SC_CLK_TCK);
+
+    printf(" server cpu: %.2f%% (%.1f us per frame)\n",
+      cpu_secs * 100 / secs,
+      frames + requests == 0 ? 0 : cpu_secs * 1000000 / (frames + requests));
+    printf("   switches: %llu\n",
+      (unsigned long long)(end_stats.context_switches - start_stats.context_switches));
+  }
+
+  free(intervals.values);
+  free(jitter.values);
+  free(connect_times.values);
+  free(latencies.values);
+  free(streams);
+  free(pollers);
+
+  return 0;
+}
+
@@ -0,0 +1,11 @@
+# Generated include file
+
+PREFIX=/usr/local
+CC=gcc
+COMPILER_PREFIX=
+FLAGS=-D_FILE_OFFSET_BITS=64 -DENABLE_IO_URING
+LDFLAGS= -lpthread -lnsl
+CFLAGS=-Wall -O2 -s
+CONFIG_EXT=
+OBJS=adaptive.o avi_parse.o avi_play.o channel.o config.o file_io.o frame_ring.o general.o hls.o mime_types.o network_io.o http_headers.o reload.o server.o set_signals.o rate_limit.o stats.o upgrade.o url_utils.o user.o video.o websocket.o uring_server.o
+
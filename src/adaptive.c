@@ -0,0 +1,245 @@
+/*
+
+  mjpeg_webserver - Web server optimized for JPEGs from a webcam or AVI file.
+
+  Copyright 2004-2024 - Michael Kohn (mike@mikekohn.net)
+  https://www.mikekohn.net/
+
+  This program falls under the GPLv3 license.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#endif
+
+#include "adaptive.h"
+#include "general.h"
+#include "globals.h"
+#include "server.h"
+#include "user.h"
+
+// A viewer is congested if what's sitting in its socket would take more
+// than ADAPTIVE_MAX_BACKLOG_MS to drain at the rate the socket actually
+// drained over the last check, or if it fell more than a frame behind.
+// Small queues are ignored since a healthy socket can still be holding
+// part of the last frame.
+#define ADAPTIVE_MAX_BACKLOG_MS 500
+#define ADAPTIVE_MIN_QUEUED 16384
+#define ADAPTIVE_MAX_SKIPPED 2
+
+// Seconds to wait after a change before stepping down again (so the
+// smaller frames have a chance to drain the queue) and the range the
+// wait before stepping back up can be.
+#define ADAPTIVE_SETTLE 2
+#define ADAPTIVE_MIN_HOLD 5
+#define ADAPTIVE_MAX_HOLD 60
+
+void adaptive_init(User *user)
+{
+  AdaptiveState *state = &user->adaptive;
+
+  memset(state, 0, sizeof(AdaptiveState));
+
+  state->hold = ADAPTIVE_MIN_HOLD;
+  state->check_time = get_time_ns();
+}
+
+static void adaptive_set_level(Config *config, User *user, int level, int64_t now)
+{
+  AdaptiveState *state = &user->adaptive;
+
+#ifdef DEBUG
+  if (debug == 1)
+  {
+    printf("User %d: adaptive level %d -> %d\n", user->id, state->level, level);
+  }
+#endif
+
+  state->last_change = level > state->level ? -1 : 1;
+  state->level = level;
+  state->change_time = now;
+  state->good = 0;
+
+  if (level == 0)
+  {
+    state->quality = 0;
+    state->frame_rate = 0;
+  }
+    else
+  {
+    state->quality = config->adaptive[level - 1].quality;
+    state->frame_rate = config->adaptive[level - 1].frame_rate;
+  }
+}
+
+static int adaptive_congested(User *user, int queued, int64_t elapsed)
+{
+  AdaptiveState *state = &user->adaptive;
+  int64_t delivered, rate;
+  uint32_t skipped;
+
+  // Bytes that left the socket: what was written minus what the queue grew.
+  delivered = (int64_t)(user->bytes_sent - state->bytes_sent) -
+    (queued - state->queued);
+
+  if (delivered < 0) { delivered = 0; }
+
+  rate = delivered * 1000 / (elapsed / 1000000);
+
+  // frames_skipped starts over with each request.
+  skipped = user->frames_skipped >= state->frames_skipped ?
+    user->frames_skipped - state->frames_skipped : user->frames_skipped;
+
+  if (skipped >= ADAPTIVE_MAX_SKIPPED) { return 1; }
+
+  if (queued > ADAPTIVE_MIN_QUEUED &&
+      (int64_t)queued * 1000 > rate * ADAPTIVE_MAX_BACKLOG_MS)
+  {
+    return 1;
+  }
+
+  return 0;
+}
+
+// Called by each worker thread about once a second for its own
+// connections. Viewers that can't keep up move one step down the ladder
+// at a time; once they've kept up for hold seconds they move back up
+// one step.
+void adaptive_check(ThreadContext *thread_context)
+{
+  Config *config = thread_context->config;
+  int thread_num = thread_context->thread_num;
+  int64_t now, elapsed;
+  int r;
+
+  now = get_time_ns();
+
+  for (r = thread_num; r < config->maxconn; r = r + MAX_USER_THREADS)
+  {
+    User *user = users[r];
+    AdaptiveState *state = &user->adaptive;
+    int queued = 0;
+    int congested;
+
+    if (user->inuse != 1) { continue; }
+
+    // A reload may have taken steps off the ladder this viewer was on.
+    if (state->level > config->adaptive_steps)
+    {
+      adaptive_set_level(config, user, config->adaptive_steps, now);
+    }
+
+    if (config->adaptive_steps == 0) { continue; }
+
+    elapsed = now - state->check_time;
+
+    if (elapsed < 500000000) { continue; }
+
+#ifdef SIOCOUTQ
+    if (ioctl(user->socketid, SIOCOUTQ, &queued) != 0) { queued = 0; }
+#endif
+
+    congested = 0;
+
+    // Only streams adapt, everything else just keeps the counters
+    // current for when a stream starts.
+    if (user->video_num >= 0 &&
+        user->request_type != REQUEST_SINGLE &&
+        user->state == STATE_SEND_FILE)
+    {
+      congested = adaptive_congested(user, queued, elapsed);
+
+      if (congested == 1)
+      {
+        state->good = 0;
+
+        if (state->level < config->adaptive_steps &&
+            now - state->change_time >= (int64_t)ADAPTIVE_SETTLE * 1000000000)
+        {
+          // A step up that didn't last, wait longer before trying again.
+          if (state->last_change == 1 &&
+              now - state->change_time < (int64_t)state->hold * 2000000000)
+          {
+            state->hold *= 2;
+
+            if (state->hold > ADAPTIVE_MAX_HOLD) { state->hold = ADAPTIVE_MAX_HOLD; }
+          }
+
+          adaptive_set_level(config, user, state->level + 1, now);
+        }
+      }
+        else
+      {
+        state->good++;
+
+        if (state->level > 0 && state->good >= state->hold)
+        {
+          adaptive_set_level(config, user, state->level - 1, now);
+        }
+          else
+        if (state->level == 0 && state->good >= ADAPTIVE_MAX_HOLD)
+        {
+          state->hold = ADAPTIVE_MIN_HOLD;
+        }
+      }
+    }
+
+    state->check_time = now;
+    state->bytes_sent = user->bytes_sent;
+    state->frames_skipped = user->frames_skipped;
+    state->queued = queued;
+  }
+}
+
+// The frame rate the scheduler should use: what the viewer asked for or
+// the ladder's frame rate, whichever is lower.
+int adaptive_frame_rate(User *user)
+{
+  int frame_rate = user->adaptive.frame_rate;
+
+  if (frame_rate > 0 && (user->frame_rate <= 0 || frame_rate < user->frame_rate))
+  {
+    return frame_rate;
+  }
+
+  return user->frame_rate;
+}
+
+int adaptive_quality(User *user, int quality)
+{
+  if (user->adaptive.quality > 0 && user->adaptive.quality < quality)
+  {
+    return user->adaptive.quality;
+  }
+
+  return quality;
+}
+
+// Capture sources have no frame clock of their own to skip against, so
+// a viewer stepped down to a lower frame rate is paced here. Returns 1
+// if it isn't time for the next frame yet.
+int adaptive_capture_wait(User *user)
+{
+  AdaptiveState *state = &user->adaptive;
+  int64_t now, interval;
+
+  if (state->frame_rate <= 0) { return 0; }
+
+  now = get_time_ns();
+
+  if (now < state->next_frame) { return 1; }
+
+  interval = 1000000000 / state->frame_rate;
+  state->next_frame += interval;
+
+  if (state->next_frame < now) { state->next_frame = now + interval; }
+
+  return 0;
+}
+
@@ -0,0 +1,51 @@
+/*
+
+  mjpeg_webserver - Web server optimized for JPEGs from a webcam or AVI file.
+
+  Copyright 2004-2024 - Michael Kohn (mike@mikekohn.net)
+  https://www.mikekohn.net/
+
+  This program falls under the GPLv3 license.
+
+*/
+
+#ifndef ADAPTIVE_H
+#define ADAPTIVE_H
+
+#include <stdint.h>
+
+#include "config.h"
+
+struct User;
+struct ThreadContext;
+
+// Where a viewer is on the adaptive ladder and what was measured at the
+// last check. Only the thread that owns the connection touches this.
+typedef struct AdaptiveState
+{
+  // 0 is the quality and frame rate the viewer asked for, 1 is the
+  // first step in the conf file and so on.
+  int level;
+  int quality;
+  int frame_rate;
+  // Seconds in a row the viewer kept up and how many it needs before
+  // moving back up. hold doubles when a step up doesn't last.
+  int good;
+  int hold;
+  int last_change;
+  int64_t change_time;
+  int64_t check_time;
+  uint64_t bytes_sent;
+  uint32_t frames_skipped;
+  int queued;
+  int64_t next_frame;
+} AdaptiveState;
+
+void adaptive_init(struct User *user);
+void adaptive_check(struct ThreadContext *thread_context);
+int adaptive_frame_rate(struct User *user);
+int adaptive_quality(struct User *user, int quality);
+int adaptive_capture_wait(struct User *user);
+
+#endif
+
@@ -20,13 +20,12 @@ typedef struct Alias
   int type;
   int url_len;
   char *url;
+  char *source;
   char *port_param;
   char *size_param;
   char *comp_param;
   char *fps_param;
 } Alias;
 
-extern Alias *alias;
-
 #endif
 
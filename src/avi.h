@@ -12,6 +12,12 @@
 #ifndef AVI_H
 #define AVI_H
 
+#include <stdint.h>
+
+// bIndexType values for OpenDML indx / ix## chunks.
+#define AVI_INDEX_OF_INDEXES 0x00
+#define AVI_INDEX_OF_CHUNKS  0x01
+
 struct avi_header_t
 {
   int time_delay;
@@ -66,8 +72,21 @@ struct index_entry_t
 {
   char ckid[4];
   int flags;
-  int offset;
-  int length;
+  uint32_t offset;
+  uint32_t length;
+};
+
+// Where the indexes for the video stream are. Everything is found
+// while walking the file and the frame index is built at the end, so
+// an OpenDML indx can be used in place of idx1 when both exist.
+struct avi_index_t
+{
+  int stream;
+  int64_t movi_ptr;
+  int64_t idx1_offset;
+  uint32_t idx1_size;
+  int64_t indx_offset;
+  uint32_t indx_size;
 };
 
 #endif
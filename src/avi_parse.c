@@ -19,6 +19,20 @@
 #include "globals.h"
 #include "video.h"
 
+#ifndef WINDOWS
+#define avi_seek(in, offset) fseeko(in, offset, SEEK_SET)
+#define avi_tell(in) ftello(in)
+#else
+#define avi_seek(in, offset) _fseeki64(in, offset, SEEK_SET)
+#define avi_tell(in) _ftelli64(in)
+#endif
+
+// Index entries are read this many at a time.
+#define INDEX_BLOCK_ENTRIES 4096
+
+// Biggest indx or ix## chunk that will be loaded (2M frames).
+#define MAX_INDEX_CHUNK (16 * 1024 * 1024)
+
 int skip_chunk(FILE *in)
 {
   char chunk_id[4];
@@ -53,63 +67,259 @@ int skip_chunk(FILE *in)
   return 0;
 }
 
-int parse_idx1(FILE *in, int chunk_len, Video *video, int movi_ptr)
+static uint32_t get_int32(const uint8_t *data)
 {
-  struct index_entry_t index_entry;
-  int ptr;
-  int t, ptr_flag;
+  return data[0] | (data[1] << 8) | (data[2] << 16) |
+    ((uint32_t)data[3] << 24);
+}
 
-#ifdef DEBUG
-  printf("IDX1\n");
-  printf("-------------------------------\n");
-  printf("ckid   flags           offset               length\n");
-#endif
+static uint64_t get_int64(const uint8_t *data)
+{
+  return get_int32(data) | ((uint64_t)get_int32(data + 4) << 32);
+}
 
-  video->total_frames = chunk_len / 16;
-  video->index = malloc(sizeof(long) * (video->total_frames));
-  ptr_flag = 0;
-  ptr = 0;
+// Video frames are in chunks named ##dc (##db if uncompressed) where
+// ## is the stream number. Audio and text chunks are skipped.
+static int is_video_chunk(const uint8_t *ckid, int stream)
+{
+  if (ckid[0] != '0' + (stream / 10) || ckid[1] != '0' + (stream % 10))
+  {
+    return 0;
+  }
 
-  for (t = 0; t < chunk_len / 16; t++)
+  return ckid[2] == 'd' && (ckid[3] == 'c' || ckid[3] == 'b');
+}
+
+static int add_frame(
+  Video *video,
+  int *alloc_frames,
+  int64_t offset,
+  uint32_t length)
+{
+  FrameIndex *index;
+
+  // Zero length chunks are frames the capture program dropped.
+  if (length == 0) { return 0; }
+
+  if (video->total_frames == *alloc_frames)
   {
-    if (fread(index_entry.ckid, 1, 4, in) != 4)
+    *alloc_frames = (*alloc_frames == 0) ? 1024 : *alloc_frames * 2;
+
+    index = realloc(video->index, sizeof(FrameIndex) * (*alloc_frames));
+
+    if (index == NULL)
     {
-      printf("Error: fread() failed %s:%d\n", __FILE__, __LINE__);
+      printf("Error: Out of memory %s:%d\n", __FILE__, __LINE__);
       return -1;
     }
 
-    index_entry.flags  = read_int32(in);
-    index_entry.offset = read_int32(in);
-    index_entry.length = read_int32(in);
+    video->index = index;
+  }
+
+  video->index[video->total_frames].offset = offset;
+  video->index[video->total_frames].length = length;
+  video->total_frames++;
 
-    if (t == 0)
-    {
-      if (index_entry.offset < 16) { ptr_flag = 1; }
-    }
+  return 0;
+}
+
+// Loads a whole index chunk with one fread(). offset is where the
+// chunk's header starts.
+static uint8_t *read_index_chunk(FILE *in, int64_t offset, uint32_t *size)
+{
+  uint8_t header[8];
+  uint8_t *buffer;
+
+  if (avi_seek(in, offset) != 0 || fread(header, 1, 8, in) != 8)
+  {
+    printf("Error: Can't read index at %lld\n", (long long)offset);
+    return NULL;
+  }
+
+  *size = get_int32(header + 4);
+
+  if (*size < 24 || *size > MAX_INDEX_CHUNK)
+  {
+    printf("Error: Bad index size %u at %lld\n", *size, (long long)offset);
+    return NULL;
+  }
+
+  buffer = malloc(*size);
+
+  if (buffer == NULL) { return NULL; }
 
-    if (ptr_flag == 1)
+  if (fread(buffer, 1, *size, in) != *size)
+  {
+    printf("Error: fread() failed %s:%d\n", __FILE__, __LINE__);
+    free(buffer);
+    return NULL;
+  }
+
+  return buffer;
+}
+
+// AVISTDINDEX from an ix## chunk: a 64 bit base offset followed by
+// 32 bit offsets (pointing past the chunk header) and sizes.
+static int parse_std_index(
+  const uint8_t *buffer,
+  uint32_t size,
+  Video *video,
+  int stream,
+  int *alloc_frames)
+{
+  const uint8_t *entry;
+  uint32_t entries, entry_size, t;
+  int64_t base;
+
+  entry_size = (buffer[0] | (buffer[1] << 8)) * 4;
+  entries    = get_int32(buffer + 4);
+  base       = get_int64(buffer + 12);
+
+  if (buffer[3] != AVI_INDEX_OF_CHUNKS || entry_size < 8) { return -1; }
+  if (!is_video_chunk(buffer + 8, stream)) { return 0; }
+
+  if (entries > (size - 24) / entry_size)
+  {
+    entries = (size - 24) / entry_size;
+  }
+
+  for (t = 0; t < entries; t++)
+  {
+    entry = buffer + 24 + (t * entry_size);
+
+    // Bit 31 of the size is set for frames that aren't key frames.
+    if (add_frame(
+      video,
+      alloc_frames,
+      base + get_int32(entry),
+      get_int32(entry + 4) & 0x7fffffff) != 0)
     {
-      video->index[ptr++] = index_entry.offset + movi_ptr;
+      return -1;
     }
-      else
+  }
+
+  return 0;
+}
+
+// OpenDML (AVI 2.0) super index. Each entry points to an ix## chunk
+// indexing up to one RIFF AVIX segment, so files can be bigger than 4GB.
+int parse_indx(FILE *in, Video *video, struct avi_index_t *avi_index)
+{
+  const uint8_t *entry;
+  uint8_t *indx, *ix;
+  uint32_t entries, size, ix_size, t;
+  int alloc_frames = 0;
+  int n = 0;
+
+  indx = read_index_chunk(in, avi_index->indx_offset, &size);
+
+  if (indx == NULL) { return -1; }
+
+  if (indx[3] == AVI_INDEX_OF_CHUNKS)
+  {
+    n = parse_std_index(indx, size, video, avi_index->stream, &alloc_frames);
+  }
+    else
+  if (indx[3] == AVI_INDEX_OF_INDEXES && indx[0] == 4)
+  {
+    entries = get_int32(indx + 4);
+
+    if (entries > (size - 24) / 16) { entries = (size - 24) / 16; }
+
+    for (t = 0; t < entries; t++)
     {
-      video->index[ptr++] = index_entry.offset;
+      entry = indx + 24 + (t * 16);
+
+      ix = read_index_chunk(in, get_int64(entry), &ix_size);
+
+      if (ix == NULL) { n = -1; break; }
+
+      n = parse_std_index(ix, ix_size, video, avi_index->stream, &alloc_frames);
+
+      free(ix);
+
+      if (n != 0) { break; }
     }
+  }
+
+  free(indx);
 
-#if 0
 #ifdef DEBUG
-    printf("%.4s   0x%08x      0x%08x           0x%08x  0x%08x\n",
-             index_entry.ckid,
-             index_entry.flags,
-             index_entry.offset,
-             index_entry.length,
-             (int)video->index[ptr-1]);
-#endif
+  printf("INDX: %d frames\n\n", video->total_frames);
 #endif
+
+  return n;
+}
+
+// Legacy AVI 1.0 index. Entries are read in blocks of
+// INDEX_BLOCK_ENTRIES instead of a getc() per byte.
+int parse_idx1(FILE *in, Video *video, struct avi_index_t *avi_index)
+{
+  uint8_t header[8];
+  uint8_t *buffer;
+  const uint8_t *entry;
+  uint32_t entries, count, offset, t;
+  int64_t base = -1;
+  int alloc_frames = 0;
+
+  if (avi_seek(in, avi_index->idx1_offset) != 0 ||
+      fread(header, 1, 8, in) != 8)
+  {
+    printf("Error: fread() failed %s:%d\n", __FILE__, __LINE__);
+    return -1;
   }
 
+  entries = get_int32(header + 4) / 16;
+
+  buffer = malloc(INDEX_BLOCK_ENTRIES * 16);
+
+  if (buffer == NULL) { return -1; }
+
+  while (entries > 0)
+  {
+    count = entries;
+
+    if (count > INDEX_BLOCK_ENTRIES) { count = INDEX_BLOCK_ENTRIES; }
+
+    if (fread(buffer, 16, count, in) != count)
+    {
+      printf("Error: fread() failed %s:%d\n", __FILE__, __LINE__);
+      break;
+    }
+
+    for (t = 0; t < count; t++)
+    {
+      entry = buffer + (t * 16);
+      offset = get_int32(entry + 8);
+
+      // Offsets should be relative to the "movi" fourcc, but some
+      // programs write absolute file offsets. The first entry shows
+      // which one this file uses.
+      if (base == -1)
+      {
+        base = (offset < avi_index->movi_ptr) ? avi_index->movi_ptr : 0;
+      }
+
+      if (!is_video_chunk(entry, avi_index->stream)) { continue; }
+
+      if (add_frame(
+        video,
+        &alloc_frames,
+        base + offset + 8,
+        get_int32(entry + 12)) != 0)
+      {
+        free(buffer);
+        return -1;
+      }
+    }
+
+    entries -= count;
+  }
+
+  free(buffer);
+
 #ifdef DEBUG
-  printf("\n");
+  printf("IDX1: %d frames\n\n", video->total_frames);
 #endif
 
   return 0;
@@ -258,15 +468,15 @@ int read_stream_format(FILE *in, struct stream_format_t *stream_format)
 
 int parse_hdrl_list(
   FILE *in,
-  struct avi_header_t *avi_header,
   struct stream_header_t *stream_header,
-  struct stream_format_t *stream_format)
+  struct stream_format_t *stream_format,
+  int64_t *indx_offset)
 {
   char chunk_id[4];
-  int chunk_size;
+  uint32_t chunk_size;
   char chunk_type[4];
-  int end_of_chunk;
-  int next_chunk;
+  int64_t end_of_chunk;
+  int64_t next_chunk;
 
   if (fread(chunk_id, 1, 4, in) != 4)
   {
@@ -286,19 +496,14 @@ int parse_hdrl_list(
   printf("AVI Header Chunk LIST\n");
   printf("-------------------------------\n");
   printf("           chunk_id: %.4s\n", chunk_id);
-  printf("         chunk_size: %d\n", chunk_size);
+  printf("         chunk_size: %u\n", chunk_size);
   printf("         chunk_type: %.4s\n", chunk_type);
   printf("\n");
 #endif
 
-  end_of_chunk = ftell(in) + chunk_size - 4;
-
-  if ((end_of_chunk % 4) != 0)
-  {
-    end_of_chunk = end_of_chunk + (4 - (end_of_chunk % 4));
-  }
+  end_of_chunk = avi_tell(in) + chunk_size - 4;
 
-  while (ftell(in) < end_of_chunk)
+  while (avi_tell(in) + 8 <= end_of_chunk)
   {
     if (fread(chunk_type, 1, 4, in) != 4)
     {
@@ -307,12 +512,7 @@ int parse_hdrl_list(
     }
 
     chunk_size = read_int32(in);
-    next_chunk = ftell(in) + chunk_size;
-
-    if ((chunk_size % 4) != 0)
-    {
-      chunk_size = chunk_size + (4 - (chunk_size % 4));
-    }
+    next_chunk = avi_tell(in) + chunk_size + (chunk_size & 1);
 
     if (strncasecmp("strh", chunk_type, 4) == 0)
     {
@@ -321,7 +521,16 @@ int parse_hdrl_list(
       else
     if (strncasecmp("strf", chunk_type, 4) == 0)
     {
-      read_stream_format(in, stream_format);
+      // Only a video stream's strf is a BITMAPINFOHEADER.
+      if (memcmp("vids", stream_header->data_type, 4) == 0)
+      {
+        read_stream_format(in, stream_format);
+      }
+    }
+      else
+    if (strncasecmp("indx", chunk_type, 4) == 0)
+    {
+      *indx_offset = avi_tell(in) - 8;
     }
       else
     if (strncasecmp("strd", chunk_type, 4) == 0)
@@ -336,23 +545,32 @@ int parse_hdrl_list(
       /* skip_chunk(in); */
     }
 
-    fseek(in, next_chunk, SEEK_SET);
+    avi_seek(in, next_chunk);
   }
 
-  fseek(in, end_of_chunk, SEEK_SET);
+  avi_seek(in, end_of_chunk);
 
   return 0;
 }
 
 int parse_hdrl(
   FILE *in,
+  int64_t end_of_hdrl,
   struct avi_header_t *avi_header,
   struct stream_header_t *stream_header,
-  struct stream_format_t *stream_format)
+  struct stream_format_t *stream_format,
+  struct avi_index_t *avi_index)
 {
   char chunk_id[4];
-  int chunk_size;
-  int end_of_chunk;
+  uint32_t chunk_size;
+  char chunk_type[4];
+  int64_t end_of_chunk;
+  int64_t start_of_list, next_list;
+  struct stream_header_t list_stream_header;
+  struct stream_format_t list_stream_format;
+  int64_t indx_offset;
+  int stream = 0;
+  int found_video = 0;
 
   if (fread(chunk_id, 1, 4, in) != 4)
   {
@@ -366,19 +584,67 @@ int parse_hdrl(
   printf("AVI Header Chunk\n");
   printf("-------------------------------\n");
   printf("           chunk_id: %.4s\n", chunk_id);
-  printf("         chunk_size: %d\n", chunk_size);
+  printf("         chunk_size: %u\n", chunk_size);
   printf("\n");
 #endif
 
-  end_of_chunk = ftell(in) + chunk_size;
+  end_of_chunk = avi_tell(in) + chunk_size + (chunk_size & 1);
 
-  if ((end_of_chunk % 4) != 0)
+  read_avi_header(in, avi_header);
+  avi_seek(in, end_of_chunk);
+
+  // One LIST strl per stream. The video stream's headers and OpenDML
+  // indx are kept, audio streams are only counted so the video's ##dc
+  // chunk id is known.
+  while (avi_tell(in) + 12 <= end_of_hdrl)
   {
-    end_of_chunk = end_of_chunk + (4 - (end_of_chunk % 4));
-  }
+    start_of_list = avi_tell(in);
 
-  read_avi_header(in, avi_header);
-  parse_hdrl_list(in, avi_header, stream_header, stream_format);
+    if (fread(chunk_id, 1, 4, in) != 4)
+    {
+      printf("Error: fread() failed %s:%d\n", __FILE__, __LINE__);
+      return -1;
+    }
+
+    chunk_size = read_int32(in);
+    next_list = avi_tell(in) + chunk_size + (chunk_size & 1);
+
+    if (fread(chunk_type, 1, 4, in) != 4)
+    {
+      printf("Error: fread() failed %s:%d\n", __FILE__, __LINE__);
+      return -1;
+    }
+
+    if (memcmp("LIST", chunk_id, 4) == 0 &&
+        strncasecmp("strl", chunk_type, 4) == 0)
+    {
+      memset(&list_stream_header, 0, sizeof(list_stream_header));
+      memset(&list_stream_format, 0, sizeof(list_stream_format));
+      indx_offset = 0;
+
+      avi_seek(in, start_of_list);
+      parse_hdrl_list(in, &list_stream_header, &list_stream_format, &indx_offset);
+
+      if (found_video == 0 &&
+          memcmp("vids", list_stream_header.data_type, 4) == 0)
+      {
+        memcpy(stream_header, &list_stream_header, sizeof(list_stream_header));
+        memcpy(stream_format, &list_stream_format, sizeof(list_stream_format));
+        avi_index->stream = stream;
+        avi_index->indx_offset = indx_offset;
+        found_video = 1;
+      }
+        else
+      if (list_stream_format.palette != 0)
+      {
+        free(list_stream_format.palette);
+      }
+
+      stream++;
+    }
+
+    avi_seek(in, next_list);
+  }
 
   return 0;
 }
@@ -386,15 +652,20 @@ int parse_hdrl(
 int parse_riff(FILE *in, Video *video)
 {
   char chunk_id[4];
-  int chunk_size;
+  uint32_t chunk_size;
   char chunk_type[4];
-  long end_of_chunk, end_of_subchunk;
+  int64_t start_of_chunk, end_of_chunk, end_of_subchunk;
   struct avi_header_t avi_header;
   struct stream_header_t stream_header;
   struct stream_format_t stream_format;
-  long movi_ptr = 0;
+  struct avi_index_t avi_index;
   float float_fps;
 
+  memset(&avi_header, 0, sizeof(avi_header));
+  memset(&stream_header, 0, sizeof(stream_header));
+  memset(&stream_format, 0, sizeof(stream_format));
+  memset(&avi_index, 0, sizeof(avi_index));
+
   if (fread(chunk_id, 1, 4, in) != 4)
   {
     printf("Error: fread() failed %s:%d\n", __FILE__, __LINE__);
@@ -413,7 +684,7 @@ int parse_riff(FILE *in, Video *video)
   printf("RIFF Chunk\n");
   printf("-------------------------------\n");
   printf("           chunk_id: %.4s\n", chunk_id);
-  printf("         chunk_size: %d\n", chunk_size);
+  printf("         chunk_size: %u\n", chunk_size);
   printf("         chunk_type: %.4s\n", chunk_type);
   printf("\n");
 #endif
@@ -434,17 +705,12 @@ int parse_riff(FILE *in, Video *video)
     return -1;
   }
 
-  end_of_chunk = ftell(in) + chunk_size - 4;
+  end_of_chunk = avi_tell(in) + chunk_size - 4;
 
-#if 0
-  if ((end_of_chunk % 4) != 0)
+  while (avi_tell(in) + 8 <= end_of_chunk)
   {
-    end_of_chunk = end_of_chunk + (4 - (end_of_chunk % 4));
-  }
-#endif
+    start_of_chunk = avi_tell(in);
 
-  while (ftell(in) < end_of_chunk)
-  {
     if (fread(chunk_id, 1, 4, in) != 4)
     {
       printf("Error: fread() failed %s:%d\n", __FILE__, __LINE__);
@@ -452,14 +718,7 @@ int parse_riff(FILE *in, Video *video)
     }
 
     chunk_size = read_int32(in);
-    end_of_subchunk = ftell(in) + chunk_size;
-
-#if 0
-    if ((end_of_subchunk % 4) != 0)
-    {
-      end_of_subchunk = end_of_subchunk + (4 - (end_of_subchunk % 4));
-    }
-#endif
+    end_of_subchunk = avi_tell(in) + chunk_size + (chunk_size & 1);
 
     if (memcmp("JUNK", chunk_id, 4) == 0 || memcmp("PAD ", chunk_id, 4) == 0)
     {
@@ -478,7 +737,7 @@ int parse_riff(FILE *in, Video *video)
     printf("New Chunk\n");
     printf("-------------------------------\n");
     printf("           chunk_id: %.4s\n", chunk_id);
-    printf("         chunk_size: %d\n", chunk_size);
+    printf("         chunk_size: %u\n", chunk_size);
     printf("         chunk_type: %.4s\n", chunk_type);
     printf("\n");
     fflush(stdout);
@@ -486,50 +745,89 @@ int parse_riff(FILE *in, Video *video)
 
     if (memcmp("JUNK", chunk_id, 4) == 0 || memcmp("PAD ", chunk_id, 4) == 0)
     {
-      if ((chunk_size % 4) != 0)
-      {
-        chunk_size = chunk_size + (4 - (chunk_size % 4));
-      }
-
-      fseek(in, ftell(in) + chunk_size, SEEK_SET);
+      /* Skip */
     }
       else
     if (strncasecmp("hdrl", chunk_type, 4) == 0)
     {
-      parse_hdrl(in, &avi_header, &stream_header, &stream_format);
+      parse_hdrl(
+        in,
+        end_of_subchunk,
+        &avi_header,
+        &stream_header,
+        &stream_format,
+        &avi_index);
     }
       else
     if (strncasecmp("movi", chunk_type, 4) == 0)
     {
-      movi_ptr=ftell(in) - 4;
+      avi_index.movi_ptr = avi_tell(in) - 4;
     }
       else
     if (strncasecmp("idx1", chunk_id, 4) == 0)
     {
-      fseek(in, ftell(in) - 4, SEEK_SET);
-      parse_idx1(in, chunk_size, video, movi_ptr);
+      avi_index.idx1_offset = start_of_chunk;
     }
       else
     {
 #ifdef DEBUG
-      printf("Unknown chunk at %d (%4s)\n", (int)ftell(in) - 8, chunk_type);
+      printf("Unknown chunk at %lld (%.4s)\n",
+        (long long)start_of_chunk, chunk_type);
 #endif
       if (chunk_size == 0) { break; }
     }
 
-    fseek(in, end_of_subchunk, SEEK_SET);
+    avi_seek(in, end_of_subchunk);
+  }
+
+  // idx1 only covers the first RIFF chunk of an OpenDML file so the
+  // super index is used when there is one.
+  if (avi_index.indx_offset != 0)
+  {
+    parse_indx(in, video, &avi_index);
+  }
+
+  if (video->total_frames == 0 && avi_index.idx1_offset != 0)
+  {
+    parse_idx1(in, video, &avi_index);
+  }
+
+  // dwRate / dwScale is the exact frame rate (30000 / 1001 for 29.97),
+  // avih's microseconds per frame is only a fallback when it's missing.
+  if (stream_header.data_rate > 0 && stream_header.time_scale > 0)
+  {
+    video->rate  = stream_header.data_rate;
+    video->scale = stream_header.time_scale;
+  }
+    else
+  if (avi_header.time_delay > 0)
+  {
+    video->rate  = 1000000;
+    video->scale = avi_header.time_delay;
+  }
+    else
+  {
+    video->rate  = 30;
+    video->scale = 1;
   }
 
-  float_fps = (float)1000000 / (float)avi_header.time_delay;
+  float_fps = (float)video->rate / (float)video->scale;
   video->fps = (int)float_fps;
 
   if (float_fps - (float)(int)float_fps >= 0.5) { video->fps++; }
+  if (video->fps == 0) { video->fps = 1; }
 
   if (stream_format.palette != 0)
   {
     free(stream_format.palette);
   }
 
+  if (video->total_frames == 0)
+  {
+    printf("Error: No video frames found in %s\n", video->filename);
+    return -1;
+  }
+
   return 0;
 }
 
@@ -16,72 +16,91 @@
 #include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#ifdef WITH_MMAP
+#ifndef WINDOWS
+#include <sys/mman.h>
+#endif
+#endif
 
 #include "avi_play.h"
+#include "channel.h"
 #include "functions.h"
+#include "general.h"
 #include "globals.h"
 #include "http_headers.h"
 #include "mime_types.h"
 #include "avi_parse.h"
 #include "user.h"
 
-int avi_init(const char *filename)
+// Opens and indexes an AVI file as a source. The caller adds it with
+// video_add() once its options are set. Returns NULL on error.
+Video *avi_init(const char *filename, const char *name)
 {
+  Video *curr_video;
   FILE *in = fopen(filename, "rb");
 
   if (in == NULL)
   {
     printf("Cannot open AVI file: %s\n", filename);
-    return -1;
+    return NULL;
   }
 
   printf("Indexing AVI file %d: '%s'\n", video_count, filename);
 
-  memset(&video[video_count], 0, sizeof(Video));
+  curr_video = video_new();
 
-  video[video_count].filename = malloc(strlen(filename) + 1);
+  curr_video->filename = malloc(strlen(filename) + 1);
+  strcpy(curr_video->filename, filename);
 
-  strcpy(video[video_count].filename, filename);
-  parse_riff(in, &video[video_count]);
-
-  /* gettimeofday(&video[video_count].tv_start, DST_NONE); */
-  gettimeofday(&video[video_count].tv_start, 0);
+  if (name != NULL)
+  {
+    curr_video->name = malloc(strlen(name) + 1);
+    strcpy(curr_video->name, name);
+  }
 
-  video[video_count].tv_total.tv_sec =
-    video[video_count].total_frames / video[video_count].fps;
+  if (parse_riff(in, curr_video) != 0)
+  {
+    printf("Cannot index AVI file: %s\n", filename);
+    fclose(in);
+    video_free(curr_video);
+    return NULL;
+  }
 
-  video[video_count].tv_total.tv_usec =
-    (int)((((double)video[video_count].total_frames /
-            (double)video[video_count].fps) -
-            (double)video[video_count].tv_total.tv_sec) * (double)1000000);
+  __atomic_store_n(&curr_video->start_time, get_time_ns(), __ATOMIC_RELEASE);
 
 #ifdef DEBUG
   if (debug == 1)
   {
-    printf("fps=%d total_frames=%d sec=%d usec=%d\n",
-      video[video_count].fps,
-      video[video_count].total_frames,
-      (int)video[video_count].tv_total.tv_sec,
-      (int)video[video_count].tv_total.tv_usec);
+    printf("rate=%u scale=%u fps=%d total_frames=%d\n",
+      curr_video->rate,
+      curr_video->scale,
+      curr_video->fps,
+      curr_video->total_frames);
   }
 #endif
 
 #ifdef WITH_MMAP
-  fseek(in,0,SEEK_END);
-  video[video_count].file_len = ftell(in);
 #ifndef WINDOWS
-  video[video_count].fd = open(video[video_count].filename, O_RDONLY);
+  fseeko(in, 0, SEEK_END);
+  curr_video->file_len = ftello(in);
+#else
+  _fseeki64(in, 0, SEEK_END);
+  curr_video->file_len = _ftelli64(in);
+#endif
+#ifndef WINDOWS
+  curr_video->fd = open(curr_video->filename, O_RDONLY);
 
-  video[video_count].mem = (uint8_t *)mmap(
+  curr_video->mem = (uint8_t *)mmap(
     NULL,
-    video[video_count].file_len,
+    curr_video->file_len,
     PROT_READ,
     MAP_SHARED,
-    video[video_count].fd,
+    curr_video->fd,
     0);
 #else
-  video[video_count].fd = CreateFile(
-    video[video_count].filename,
+  curr_video->fd = CreateFile(
+    curr_video->filename,
     FILE_READ_DATA,
     FILE_SHARE_READ,
     NULL,
@@ -92,144 +111,153 @@ int avi_init(const char *filename)
   // Security.nLength=sizeof(Security);
   // Security.lpSecurityDescriptor = NULL;
 
-  video[video_count].mem_handle = CreateFileMapping(
-    video[video_count].fd,
+  curr_video->mem_handle = CreateFileMapping(
+    curr_video->fd,
     NULL,
     PAGE_READONLY,
     0,
-    video[video_count].file_len,
+    curr_video->file_len,
     NULL);
 
-  video[video_count].mem = (uint8_t *)MapViewOfFile(
-    video[video_count].mem_handle,
+  curr_video->mem = (uint8_t *)MapViewOfFile(
+    curr_video->mem_handle,
     FILE_MAP_READ,
     0,
     0,
-    video[video_count].file_len);
+    curr_video->file_len);
 #endif
 #endif
 
-  video_count++;
   fclose(in);
 
-  return 0;
+  curr_video->channel = channel_create(curr_video);
+
+  if (curr_video->channel == NULL)
+  {
+    printf("Cannot open AVI file: %s\n", filename);
+    video_free(curr_video);
+    return NULL;
+  }
+
+  return curr_video;
 }
 
-int avi_play_calc_frame(User *user)
+// Number of frames played in elapsed_ns. This is done in pieces so
+// nothing overflows 64 bits no matter how long the server runs.
+int64_t avi_play_frames_at(Video *video, int64_t elapsed_ns)
 {
-  uint8_t temp[8];
-  struct timeval tv_now;
-  int frame;
-  int t, r;
-#ifndef WITH_MMAP
-// int l;
-#endif
-
-  gettimeofday(&tv_now, 0);
+  int64_t ticks = (elapsed_ns / 1000000000) * video->rate;
+  int64_t nsec  = elapsed_ns % 1000000000;
 
-  t =
-    ((tv_now.tv_sec  - video[user->video_num].tv_start.tv_sec) * 1000) +
-    ((tv_now.tv_usec - video[user->video_num].tv_start.tv_usec) / 1000);
+  return (ticks / video->scale) +
+    (((ticks % video->scale) * 1000000000) + (nsec * video->rate)) /
+    ((int64_t)video->scale * 1000000000);
+}
 
-  r = (int)(((double)t / 1000) * (double)video[user->video_num].fps);
-  t = r / video[user->video_num].total_frames;
-  r = r % video[user->video_num].total_frames;
+// Time (in ns from the start of playback) when frames starts.
+int64_t avi_play_frame_time(Video *video, int64_t frames)
+{
+  int64_t ticks = frames * video->scale;
 
-  if (t > 1000 || r < 0)
-  {
-    if (r < 0) { r = 0; }
-    gettimeofday(&video[user->video_num].tv_start, 0);
-    t = r * (1000000 / video[user->video_num].fps);
-    video[user->video_num].tv_start.tv_sec += (t / 1000000);
-    video[user->video_num].tv_start.tv_usec = (t % 1000000);
+  return ((ticks / video->rate) * 1000000000) +
+    (((ticks % video->rate) * 1000000000) + video->rate - 1) / video->rate;
+}
 
-#ifdef DEBUG
-if (debug == 1)
+int avi_play_calc_frame(Video *video, int64_t *next_tick)
 {
-  printf("Video starts over.\n");
+  int64_t start, frames;
+
+  start = __atomic_load_n(&video->start_time, __ATOMIC_ACQUIRE);
+  frames = avi_play_frames_at(video, get_time_ns() - start);
+
+  *next_tick = start + avi_play_frame_time(video, frames + 1);
+
+  return frames % video->total_frames;
 }
-#endif
-  }
 
-  frame = r;
+// Frame a viewer playing the file from its own start (?start=) is on.
+// start_time is when frame 0 was due. Returns -1 once it's played to
+// the end.
+int avi_play_cursor_frame(Video *video, int64_t start_time, int64_t *next_tick)
+{
+  int64_t frames;
 
-#ifdef WITH_MMAP
-  user->offset = video[user->video_num].index[r] + 4;
+  frames = avi_play_frames_at(video, get_time_ns() - start_time);
 
-#if 0
-  if (l > video[user->video_num].index[r])
-  {
-    user->offset = video[user->video_num].index[r];
-  }
-    else
-  {
-    user->offset = video[user->video_num].index[r]-l;
-  }
-#endif
+  if (frames >= video->total_frames) { return -1; }
 
-  user->content_length =
-     video[user->video_num].mem[user->offset + 0] +
-    (video[user->video_num].mem[user->offset + 1] << 8) +
-    (video[user->video_num].mem[user->offset + 2] << 16) +
-    (video[user->video_num].mem[user->offset + 3] << 24);
+  *next_tick = start_time + avi_play_frame_time(video, frames + 1);
 
-  user->offset += 4;
+  return frames;
+}
 
-#else
-  // FIXME - Can it seek by offsets forward and does it give a speed increase?
-  // l = ftell(user->in);
+#ifndef WITH_MMAP
+static int read_at(int in, uint8_t *buffer, int length, int64_t offset)
+{
+  int n = 0, i;
 
-#if 0
-  if (l > video[user->video_num].index[r])
+#ifndef WINDOWS
+  while (n < length)
   {
-    fseek(user->in, video[user->video_num].index[r], SEEK_SET);
+    i = pread(in, buffer + n, length - n, offset + n);
+    if (i <= 0) { return -1; }
+    n = n + i;
   }
-    else
+#else
+  _lseeki64(in, offset, SEEK_SET);
+
+  while (n < length)
   {
-    fseek(user->in, video[user->video_num].index[r] - l, SEEK_CUR);
+    i = read(in, buffer + n, length - n);
+    if (i <= 0) { return -1; }
+    n = n + i;
   }
 #endif
 
-#if 0
-  if (l > video[user->video_num].index[r])
+  return n;
+}
+#endif
+
+Frame *avi_play_read_frame(Video *video, int in, int frame_num)
+{
+  Frame *frame;
+  int64_t offset = video->index[frame_num].offset;
+  uint32_t length = video->index[frame_num].length;
+
+  if (length > BIGGEST_SUPPORTED_FILE)
   {
-    lseek(user->in, video[user->video_num].index[r], SEEK_SET);
+    printf("Bad frame %d in %s (length=%u)\n", frame_num, video->filename, length);
+    return NULL;
   }
-    else
+
+#ifdef WITH_MMAP
+  if (offset + length > video->file_len)
   {
-    lseek(user->in, video[user->video_num].index[r] - l, SEEK_CUR);
+    printf("Bad frame %d in %s (offset=%lld)\n",
+      frame_num, video->filename, (long long)offset);
+    return NULL;
   }
-#endif
 
-  lseek(user->in, video[user->video_num].index[r], SEEK_SET);
+  // Frames point straight into the mapped file, no copy needed.
+  frame = frame_alloc(0);
 
-  // read_int32(user->in);
-  // user->content_length = read_int32(user->in);
-  int n = 0;
+  if (frame == NULL) { return NULL; }
 
-  while (n < 8)
-  {
-    int i = read(user->in, temp + n, 8 - n);
-    n = n + i;
-  }
+  frame->data = video->mem + offset;
+  frame->length = length;
+#else
+  frame = frame_alloc(length);
 
-  user->content_length =
-    temp[4] + (temp[5] << 8)+ (temp[6] << 16) + (temp[7] << 24);
-#endif
+  if (frame == NULL) { return NULL; }
 
-  if (user->content_length > BIGGEST_SUPPORTED_FILE ||
-      user->content_length == 0)
+  if (read_at(in, frame->data, length, offset) != length)
   {
-    int id = user->id;
-
-    send_video_error(id);
-    user_disconnect(user);
-    return -1;
+    frame_release(frame);
+    return NULL;
   }
+#endif
 
-  user->last_modified = time(NULL);
-  user->mime_type = MIME_TYPE_JPEG;
+  frame->frame_num = frame_num;
 
   return frame;
 }
-
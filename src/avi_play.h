@@ -12,10 +12,17 @@
 #ifndef AVI_PLAY_H
 #define AVI_PLAY_H
 
-#include "user.h"
+#include <stdint.h>
 
-int avi_init(const char *filename);
-int avi_play_calc_frame(User *user);
+#include "channel.h"
+#include "video.h"
+
+Video *avi_init(const char *filename, const char *name);
+int64_t avi_play_frames_at(Video *video, int64_t elapsed_ns);
+int64_t avi_play_frame_time(Video *video, int64_t frames);
+int avi_play_calc_frame(Video *video, int64_t *next_tick);
+int avi_play_cursor_frame(Video *video, int64_t start_time, int64_t *next_tick);
+Frame *avi_play_read_frame(Video *video, int in, int frame_num);
 
 #endif
 
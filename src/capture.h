@@ -12,7 +12,10 @@
 #ifndef CAPTURE_H
 #define CAPTURE_H
 
+#include <stdint.h>
+
 #ifdef V4L2
+#include <pthread.h>
 #include <asm/types.h>
 #include <linux/videodev2.h>
 #endif
@@ -30,6 +33,14 @@ typedef struct CaptureInfo
   int video_fd;
   uint8_t *mmap_buf;
   int mmap_buf_len;
+  // Every viewer captures from the same device so only one at a time.
+  pthread_mutex_t lock;
+  // Set for "synthetic:" sources which make test patterns instead of
+  // reading a device (see synthetic_capture.c).
+  int synthetic;
+  uint8_t *pattern;
+  uint32_t frame_count;
+  int64_t start_time;
 #endif
 #ifdef VFW
   BITMAPINFO bmp;
@@ -56,5 +67,16 @@ int open_capture(CaptureInfo *capture_info, char *dev_name);
 int capture_image(CaptureInfo *capture_info, int id);
 int close_capture(CaptureInfo *capture_info);
 
+#ifdef V4L2
+void bgr2rgb(CaptureInfo *capture_info);
+uint8_t *convert_yuyv(CaptureInfo *capture_info);
+uint8_t *convert_bayer(CaptureInfo *capture_info);
+int capture_jpeg(CaptureInfo *capture_info, uint8_t *jpeg, int jpeg_len, int quality);
+
+int synthetic_open(CaptureInfo *capture_info, const char *dev_name);
+int synthetic_read(CaptureInfo *capture_info, uint8_t *buffer, int len);
+void synthetic_close(CaptureInfo *capture_info);
+#endif
+
 #endif
 
@@ -0,0 +1,184 @@
+/*
+
+  mjpeg_webserver - Web server optimized for JPEGs from a webcam or AVI file.
+
+  Copyright 2004-2024 - Michael Kohn (mike@mikekohn.net)
+  https://www.mikekohn.net/
+
+  This program falls under the GPLv3 license.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#ifdef ENABLE_CAPTURE
+#include "capture.h"
+#endif
+
+#include "avi_play.h"
+#include "channel.h"
+#include "frame_ring.h"
+#include "general.h"
+#include "globals.h"
+#include "video.h"
+
+Channel *channel_create(Video *video)
+{
+  Channel *channel = (Channel *)calloc(1, sizeof(Channel));
+
+  if (channel == NULL) { return NULL; }
+
+  pthread_mutex_init(&channel->lock, NULL);
+  pthread_mutex_init(&channel->produce_lock, NULL);
+
+  channel->video = video;
+  channel->in = -1;
+
+  if (video->filename != NULL)
+  {
+#ifndef WINDOWS
+    channel->in = open(video->filename, O_RDONLY);
+#else
+    channel->in = open(video->filename, O_RDONLY | _O_BINARY);
+#endif
+
+    if (channel->in == -1)
+    {
+      channel_destroy(channel);
+      return NULL;
+    }
+  }
+
+  return channel;
+}
+
+void channel_destroy(Channel *channel)
+{
+  if (channel->frame != NULL) { frame_release(channel->frame); }
+  if (channel->in != -1) { close(channel->in); }
+
+  pthread_mutex_destroy(&channel->lock);
+  pthread_mutex_destroy(&channel->produce_lock);
+
+  free(channel);
+}
+
+// Only called while holding produce_lock so channel->frame can be
+// read here without taking channel->lock. next_tick is stored last so
+// a thread that sees the new tick also finds the new frame published.
+static void channel_produce(Channel *channel)
+{
+  Frame *frame, *old_frame;
+  int64_t next_tick;
+  int frame_num;
+
+  frame_num = avi_play_calc_frame(channel->video, &next_tick);
+
+  if (channel->frame == NULL || channel->frame->frame_num != frame_num)
+  {
+    frame = avi_play_read_frame(channel->video, channel->in, frame_num);
+
+    if (frame != NULL)
+    {
+      frame->sequence =
+        __atomic_add_fetch(&channel->sequence, 1, __ATOMIC_RELAXED);
+      frame_set_header(frame);
+      frame->ready_time = get_time_ns();
+
+      pthread_mutex_lock(&channel->lock);
+      old_frame = channel->frame;
+      channel->frame = frame;
+      pthread_mutex_unlock(&channel->lock);
+
+      if (channel->video->ring != NULL)
+      {
+        frame_ring_add(channel->video->ring, frame);
+      }
+
+      if (old_frame != NULL) { frame_release(old_frame); }
+    }
+  }
+
+  __atomic_store_n(&channel->next_tick, next_tick, __ATOMIC_RELEASE);
+}
+
+Frame *channel_get_frame(Channel *channel)
+{
+  Frame *frame;
+  int64_t now = get_time_ns();
+
+  // If another thread is already reading the next frame don't wait
+  // for it, the current frame is still good to send. Until there is a
+  // first frame there's nothing to send so wait for that one.
+  if (now >= __atomic_load_n(&channel->next_tick, __ATOMIC_ACQUIRE))
+  {
+    if (pthread_mutex_trylock(&channel->produce_lock) == 0 ||
+        (__atomic_load_n(&channel->frame, __ATOMIC_ACQUIRE) == NULL &&
+         pthread_mutex_lock(&channel->produce_lock) == 0))
+    {
+      if (now >= channel->next_tick) { channel_produce(channel); }
+
+      pthread_mutex_unlock(&channel->produce_lock);
+    }
+  }
+
+  pthread_mutex_lock(&channel->lock);
+  frame = channel->frame;
+
+  if (frame != NULL)
+  {
+    __atomic_add_fetch(&frame->ref_count, 1, __ATOMIC_RELAXED);
+  }
+
+  pthread_mutex_unlock(&channel->lock);
+
+  return frame;
+}
+
+void channel_subscribe(Channel *channel)
+{
+  __atomic_add_fetch(&channel->subscribers, 1, __ATOMIC_RELAXED);
+}
+
+void channel_unsubscribe(Channel *channel)
+{
+  __atomic_sub_fetch(&channel->subscribers, 1, __ATOMIC_RELAXED);
+}
+
+Frame *frame_alloc(int length)
+{
+  Frame *frame = (Frame *)malloc(sizeof(Frame) + length);
+
+  if (frame == NULL) { return NULL; }
+
+  memset(frame, 0, sizeof(Frame));
+  frame->ref_count = 1;
+  frame->length = length;
+  frame->data = (uint8_t *)(frame + 1);
+
+  return frame;
+}
+
+void frame_set_header(Frame *frame)
+{
+  frame->header_len = snprintf(frame->header, sizeof(frame->header),
+    "\r\n--myboundary"
+    "\r\nContent-Type: image/jpeg"
+    "\r\nContent-Length: %d\r\n\r\n",
+    frame->length);
+}
+
+void frame_release(Frame *frame)
+{
+  if (__atomic_sub_fetch(&frame->ref_count, 1, __ATOMIC_ACQ_REL) == 0)
+  {
+    free(frame);
+  }
+}
+
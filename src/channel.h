@@ -0,0 +1,64 @@
+/*
+
+  mjpeg_webserver - Web server optimized for JPEGs from a webcam or AVI file.
+
+  Copyright 2004-2024 - Michael Kohn (mike@mikekohn.net)
+  https://www.mikekohn.net/
+
+  This program falls under the GPLv3 license.
+
+*/
+
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define FRAME_HEADER_SIZE 96
+
+// A published JPEG with its multipart boundary header already built.
+// Frames are shared by every viewer of a source and freed when the
+// last reference is released.
+typedef struct Frame
+{
+  int ref_count;
+  uint32_t sequence;
+  int frame_num;
+  // JPEG quality of a captured frame, 0 for frames from a file.
+  int quality;
+  int header_len;
+  int length;
+  // get_time_ns() when the frame was published.
+  int64_t ready_time;
+  char header[FRAME_HEADER_SIZE];
+  uint8_t *data;
+} Frame;
+
+// One producer per source. The first worker thread to notice that the
+// source has moved to a new frame reads it once and publishes it; every
+// other viewer just takes a reference to the published frame.
+typedef struct Channel
+{
+  pthread_mutex_t lock;
+  pthread_mutex_t produce_lock;
+  struct Video *video;
+  Frame *frame;
+  uint32_t sequence;
+  int subscribers;
+  int64_t next_tick;
+  int in;
+} Channel;
+
+Channel *channel_create(struct Video *video);
+void channel_destroy(Channel *channel);
+Frame *channel_get_frame(Channel *channel);
+void channel_subscribe(Channel *channel);
+void channel_unsubscribe(Channel *channel);
+
+Frame *frame_alloc(int length);
+void frame_set_header(Frame *frame);
+void frame_release(Frame *frame);
+
+#endif
+
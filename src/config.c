@@ -40,10 +40,18 @@
 #include "avi_play.h"
 #include "cgi_handler.h"
 #include "config.h"
+#include "frame_ring.h"
 #include "general.h"
 #include "globals.h"
 #include "functions.h"
 #include "plugin.h"
+#include "rate_limit.h"
+#ifdef V4L2
+#include "recorder.h"
+#endif
+#include "reload.h"
+#include "stats.h"
+#include "upgrade.h"
 
 #ifndef ENABLE_ESP32
 #define TOKEN_LENGTH 1024
@@ -51,10 +59,8 @@
 #define TOKEN_LENGTH 128
 #endif
 
-void config_init(Config *config, int argc, char *argv[])
+static void config_defaults(Config *config)
 {
-  int r;
-
   memset(config, 0, sizeof(Config));
 
   config->port = DEFAULT_PORT;
@@ -62,10 +68,21 @@ void config_init(Config *config, int argc, char *argv[])
   config->minconn = 10;
   config->maxconn = 50;
   config->max_idle_time = 60;
+  config->drain_timeout = 10;
   config->frame_rate = 30;
+  config->stats_url = (char *)malloc(sizeof("/stats"));
+  strcpy(config->stats_url, "/stats");
+  config->hls_segment_time = 2;
+  config->hls_segments = 4;
+}
+
+void config_init(Config *config, int argc, char *argv[])
+{
+  int r;
+
+  config_defaults(config);
 
   debug = 0;
-  alias = NULL;
 #ifdef ENABLE_CGI
   cgi_handler = NULL;
 #endif
@@ -101,16 +118,50 @@ void config_init(Config *config, int argc, char *argv[])
   }
 }
 
+static void free_aliases(Alias *alias)
+{
+  Alias *next_alias;
+
+  while (alias != NULL)
+  {
+    next_alias = alias->next_alias;
+
+    free(alias->url);
+    free(alias->source);
+    free(alias->port_param);
+    free(alias->size_param);
+    free(alias->comp_param);
+    free(alias->fps_param);
+    free(alias);
+
+    alias = next_alias;
+  }
+}
+
 void config_destroy(Config *config)
 {
   free(config->htdocs_dir);
   free(config->index_file);
+  free(config->stats_url);
+  free(config->hls_url);
+  free(config->filename);
+  free_aliases(config->alias);
+  rate_limit_free_clients(config->client_limits);
+
+  config->htdocs_dir = NULL;
+  config->index_file = NULL;
+  config->stats_url = NULL;
+  config->hls_url = NULL;
+  config->filename = NULL;
+  config->alias = NULL;
+  config->client_limits = NULL;
 }
 
 void config_dump(Config *config)
 {
   const char *htdocs_dir = config->htdocs_dir;
   const char *index_file = config->index_file;
+  int r;
 
   if (htdocs_dir == NULL) { htdocs_dir = "<not set>"; }
   if (index_file == NULL) { index_file = "<not set>"; }
@@ -123,7 +174,22 @@ void config_dump(Config *config)
   printf("      minconn: %d\n", config->minconn);
   printf("      maxconn: %d\n", config->maxconn);
   printf("max_idle_time: %d\n", config->max_idle_time);
+  printf("drain_timeout: %d\n", config->drain_timeout);
   printf("   frame_rate: %d\n", config->frame_rate);
+  printf("     zerocopy: %d\n", config->zerocopy);
+  printf("  server_loop: %s\n",
+    config->server_loop == SERVER_LOOP_IO_URING ? "io_uring" : "select");
+  printf("    stats_url: %s\n",
+    config->stats_url == NULL ? "<none>" : config->stats_url);
+  printf("      hls_url: %s\n",
+    config->hls_url == NULL ? "<none>" : config->hls_url);
+
+  for (r = 0; r < config->adaptive_steps; r++)
+  {
+    printf("     adaptive: quality=%d frame_rate=%d\n",
+      config->adaptive[r].quality, config->adaptive[r].frame_rate);
+  }
+
   printf("    wifi_ssid: %s\n", config->wifi_ssid);
   printf("wifi_password: %s\n", config->wifi_password);
   printf("   wifi_is_ap: %d\n", config->wifi_is_ap);
@@ -356,7 +422,7 @@ static int parse_plugin(FILE *in)
 
 #endif
 
-static int parse_alias(FILE *in)
+static int parse_alias(FILE *in, Config *config)
 {
   Alias *curr_alias, *temp_alias;
   char token[TOKEN_LENGTH];
@@ -364,13 +430,13 @@ static int parse_alias(FILE *in)
 
   curr_alias = (Alias *)malloc(sizeof(Alias));
 
-  if (alias == NULL)
+  if (config->alias == NULL)
   {
-    alias = curr_alias;
+    config->alias = curr_alias;
   }
     else
   {
-    temp_alias = alias;
+    temp_alias = config->alias;
     while (temp_alias->next_alias != NULL)
     {
       temp_alias = temp_alias->next_alias;
@@ -420,6 +486,13 @@ static int parse_alias(FILE *in)
       }
     }
       else
+    if (strcasecmp(token, "source") == 0 && curr_alias->source == NULL)
+    {
+      gettoken(in, token, sizeof(token));
+      curr_alias->source = (char *)malloc(strlen(token) + 1);
+      strcpy(curr_alias->source, token);
+    }
+      else
     if (strcasecmp(token, "type") == 0)
     {
       gettoken(in,token,sizeof(token));
@@ -465,57 +538,400 @@ static int parse_alias(FILE *in)
   return 0;
 }
 
+// A filename or capture block from the conf file. They're all read
+// before any source is opened or taken out so a mistake in the file
+// leaves the running sources as they are.
+typedef struct SourceConf
+{
+  struct SourceConf *next;
+  char filename[TOKEN_LENGTH];
+  char name[TOKEN_LENGTH];
+  int limit_bytes;
+  int limit_frames;
+  int history_frames;
+  int history_seconds;
+#ifdef ENABLE_CAPTURE
+  // Set for a capture block, filename is then the device.
+  CaptureInfo *capture_info;
+  char record[TOKEN_LENGTH];
+  int record_seconds;
+  int record_size;
+#endif
+  // The running source it's the same as (or -1), and the file opened
+  // for it if it's a new one.
+  int video_num;
+  Video *video;
+  int failed;
+} SourceConf;
+
+static SourceConf *source_conf_new(SourceConf **sources)
+{
+  SourceConf *source = (SourceConf *)malloc(sizeof(SourceConf));
+
+  memset(source, 0, sizeof(SourceConf));
+
+  source->history_frames = 1;
+  source->video_num = -1;
+
+  while (*sources != NULL) { sources = &(*sources)->next; }
+
+  *sources = source;
+
+  return source;
+}
+
+static void free_source_confs(SourceConf *sources)
+{
+  SourceConf *next;
+
+  while (sources != NULL)
+  {
+    next = sources->next;
+
+    if (sources->video != NULL) { video_free(sources->video); }
+#ifdef ENABLE_CAPTURE
+    free(sources->capture_info);
+#endif
+    free(sources);
+
+    sources = next;
+  }
+}
+
+static int is_capture(SourceConf *source)
+{
+#ifdef ENABLE_CAPTURE
+  return source->capture_info != NULL;
+#else
+  return 0;
+#endif
+}
+
+// When the conf file is read again a source is the same one if it has
+// the same file (or capture device) and name. Returns the video_num of
+// the running source that matches and no earlier block has, or -1.
+static int find_source(SourceConf *sources, SourceConf *source)
+{
+  Video *curr_video;
+  SourceConf *other;
+  int n;
+
+  for (n = 0; n < video_count; n++)
+  {
+    curr_video = video[n];
+
+    if (curr_video->removed == 1) { continue; }
+
+    for (other = sources; other != source; other = other->next)
+    {
+      if (other->video_num == n) { break; }
+    }
+
+    if (other != source) { continue; }
+
+    if (strcmp(curr_video->name == NULL ? "" : curr_video->name,
+               source->name) != 0)
+    {
+      continue;
+    }
+
+    if (is_capture(source) == 0 && curr_video->filename != NULL &&
+        strcmp(curr_video->filename, source->filename) == 0)
+    {
+      return n;
+    }
+
+#ifdef ENABLE_CAPTURE
+    if (is_capture(source) == 1 && curr_video->device != NULL &&
+        strcmp(curr_video->device, source->filename) == 0)
+    {
+      return n;
+    }
+#endif
+  }
+
+  return -1;
+}
+
+// Checks names and opens the AVI files without touching the running
+// sources. Capture devices can't be opened until the source using them
+// is taken out so they're left for add_sources(). Returns -1 if a
+// source couldn't be set up, which is then marked failed.
+static int prepare_sources(Config *config, SourceConf *sources)
+{
+  SourceConf *source, *other;
+  Video *curr_video;
+  int error = 0;
+
+  for (source = sources; source != NULL; source = source->next)
+  {
+    if (source->failed == 1) { continue; }
+
+    if (source->name[0] != 0)
+    {
+      for (other = sources; other != source; other = other->next)
+      {
+        if (strcmp(other->name, source->name) == 0) { break; }
+      }
+
+      if (other != source || video_check_name(source->name) != 0)
+      {
+        printf("Invalid or duplicate source name '%s' for %s\n",
+          source->name, source->filename);
+        source->failed = 1;
+        error = -1;
+        continue;
+      }
+    }
+
+    if (config->generation != 0)
+    {
+      source->video_num = find_source(sources, source);
+
+      if (source->video_num != -1) { continue; }
+    }
+
+    if (is_capture(source) == 1) { continue; }
+
+    curr_video = avi_init(
+      source->filename,
+      source->name[0] == 0 ? NULL : source->name);
+
+    if (curr_video == NULL)
+    {
+      source->failed = 1;
+      error = -1;
+      continue;
+    }
+
+    curr_video->generation = config->generation;
+    curr_video->rate_limit =
+      rate_limit_create(source->limit_bytes, source->limit_frames);
+    curr_video->ring = frame_ring_create(
+      source->history_frames,
+      source->history_seconds,
+      curr_video->fps);
+
+    source->video = curr_video;
+  }
+
+  return error;
+}
+
 #ifdef ENABLE_CAPTURE
-static int parse_capture(FILE *in)
+static void add_capture(Config *config, SourceConf *source)
+{
+  CaptureInfo *capture_info = source->capture_info;
+  Video *curr_video;
+  int i;
+
+  // The server this one is taking over from lets go of it first.
+  upgrade_release(source->filename);
+
+  i = open_capture(capture_info, source->filename);
+
+  if (i != 0)
+  {
+    printf("Couldn't open capture for device %s (error %d)\n",
+      source->filename, i);
+    return;
+  }
+
+  source->capture_info = NULL;
+
+  curr_video = video_new();
+  curr_video->capture_info = capture_info;
+  curr_video->generation = config->generation;
+  curr_video->device = (char *)malloc(strlen(source->filename) + 1);
+  strcpy(curr_video->device, source->filename);
+  curr_video->rate_limit =
+    rate_limit_create(source->limit_bytes, source->limit_frames);
+  curr_video->ring = frame_ring_create(
+    source->history_frames,
+    source->history_seconds,
+    capture_info->max_fps);
+
+  if (source->record[0] != 0)
+  {
+#ifdef V4L2
+    // The recorder shares frames with viewers through the ring.
+    if (curr_video->ring == NULL)
+    {
+      curr_video->ring = frame_ring_create(1, 0, capture_info->max_fps);
+    }
+
+    curr_video->recorder = recorder_create(
+      curr_video,
+      source->record,
+      source->record_seconds,
+      source->record_size);
+#else
+    printf("Recording %s needs video4linux2 support.\n", source->filename);
+#endif
+  }
+
+  if (source->name[0] != 0)
+  {
+    curr_video->name = (char *)malloc(strlen(source->name) + 1);
+    strcpy(curr_video->name, source->name);
+  }
+
+  i = video_add(curr_video);
+
+#ifdef V4L2
+  // Recorders from the conf the server started with are started after
+  // it forks.
+  if (i >= 0 && config->generation != 0 && curr_video->recorder != NULL)
+  {
+    recorder_start(curr_video->recorder, config, i);
+  }
+#endif
+}
+#endif
+
+// Sources that are still in the file are kept as they are so their
+// viewers aren't interrupted, the rest are taken out first so their
+// names and devices are free and then the new ones are added in the
+// order they're in the file.
+static void add_sources(Config *config, SourceConf *sources)
+{
+  SourceConf *source;
+  int n;
+
+  if (config->generation != 0)
+  {
+    for (source = sources; source != NULL; source = source->next)
+    {
+      if (source->video_num != -1)
+      {
+        video[source->video_num]->generation = config->generation;
+      }
+    }
+
+    for (n = 0; n < video_count; n++)
+    {
+      if (video[n]->removed == 0 && video[n]->generation != config->generation)
+      {
+        reload_remove_source(n);
+      }
+    }
+  }
+
+  for (source = sources; source != NULL; source = source->next)
+  {
+    if (source->failed == 1 || source->video_num != -1) { continue; }
+
+#ifdef ENABLE_CAPTURE
+    if (is_capture(source) == 1)
+    {
+      add_capture(config, source);
+      continue;
+    }
+#endif
+
+    if (video_add(source->video) < 0) { continue; }
+
+    source->video = NULL;
+  }
+}
+
+#ifdef ENABLE_CAPTURE
+static int parse_capture(FILE *in, SourceConf **sources)
 {
   char token[TOKEN_LENGTH];
   char value[TOKEN_LENGTH];
-  char video_dev[TOKEN_LENGTH];
-  int i;
+  SourceConf *source;
+  CaptureInfo *capture_info;
+
+  source = source_conf_new(sources);
 
-  gettoken(in, video_dev, sizeof(video_dev));
+  gettoken(in, source->filename, sizeof(source->filename));
   gettoken(in, token, sizeof(token));
 
   if (strcmp(token, "{") != 0)
   {
     printf("Parse error in alias, expected '{' and got '%s'\n", token);
+    source->failed = 1;
     return -1;
   }
 
-  memset(&video[video_count], 0, sizeof(Video));
-  video[video_count].capture_info = (CaptureInfo *)malloc(sizeof(CaptureInfo));
+  capture_info = (CaptureInfo *)malloc(sizeof(CaptureInfo));
+  memset(capture_info, 0, sizeof(CaptureInfo));
 
-  video[video_count].capture_info->width   = 352;
-  video[video_count].capture_info->height  = 240;
-  video[video_count].capture_info->channel = -1;
+  capture_info->width   = 352;
+  capture_info->height  = 240;
+  capture_info->channel = -1;
 #ifdef V4L
-  video[video_count].capture_info->format  = V4L2_STD_NTSC_M;
+  capture_info->format  = V4L2_STD_NTSC_M;
 #endif
 
+  source->capture_info = capture_info;
+
   while (1)
   {
-    if (gettoken(in, token, sizeof(token)) == -1) { return -1; }
+    if (gettoken(in, token, sizeof(token)) == -1)
+    {
+      source->failed = 1;
+      return -1;
+    }
 
     if (strcmp(token, "}") ==0) { break; }
 
     gettoken(in, value, sizeof(value));
 
+    if (strcmp(token, "name") == 0)
+    {
+      snprintf(source->name, sizeof(source->name), "%s", value);
+    }
+      else
     if (strcmp(token, "size") == 0)
     {
-      parse_size(
-        value,
-        &video[video_count].capture_info->width,
-        &video[video_count].capture_info->height);
+      parse_size(value, &capture_info->width, &capture_info->height);
     }
       else
     if (strcmp(token, "max_fps") == 0)
     {
-      video[video_count].capture_info->max_fps = atoi(value);
+      capture_info->max_fps = atoi(value);
+    }
+      else
+    if (strcmp(token, "limit_bytes") == 0)
+    {
+      source->limit_bytes = atoi(value);
+    }
+      else
+    if (strcmp(token, "limit_frames") == 0)
+    {
+      source->limit_frames = atoi(value);
+    }
+      else
+    if (strcmp(token, "history_frames") == 0)
+    {
+      source->history_frames = atoi(value);
+    }
+      else
+    if (strcmp(token, "history_seconds") == 0)
+    {
+      source->history_seconds = atoi(value);
+    }
+      else
+    if (strcmp(token, "record") == 0)
+    {
+      snprintf(source->record, sizeof(source->record), "%s", value);
+    }
+      else
+    if (strcmp(token, "record_seconds") == 0)
+    {
+      source->record_seconds = atoi(value);
+    }
+      else
+    if (strcmp(token, "record_size") == 0)
+    {
+      source->record_size = atoi(value);
     }
       else
     if (strcmp(token, "channel") == 0)
     {
-      video[video_count].capture_info->channel = atoi(value);
+      capture_info->channel = atoi(value);
     }
       else
     if (strcmp(token, "format") == 0)
@@ -523,42 +939,203 @@ static int parse_capture(FILE *in)
 #ifdef V4L
       if (strcasecmp(value, "pal") == 0)
       {
-        video[video_count].capture_info->format = V4L2_STD_PAL_M;
+        capture_info->format = V4L2_STD_PAL_M;
       }
         else
       if (strcasecmp(value, "ntsc") == 0)
       {
-        video[video_count].capture_info->format = V4L2_STD_NTSC_M;
+        capture_info->format = V4L2_STD_NTSC_M;
       }
         else
       {
-        video[video_count].capture_info->format = atoi(value);
+        capture_info->format = atoi(value);
       }
 #endif
     }
   }
 
   printf("%s  %dx%d  max_fps=%d\n",
-    video_dev,
-    video[video_count].capture_info->width,
-    video[video_count].capture_info->height,
-    video[video_count].capture_info->max_fps);
+    source->filename,
+    capture_info->width,
+    capture_info->height,
+    capture_info->max_fps);
+
+  return 0;
+}
+#endif
+
+static int parse_filename(FILE *in, SourceConf **sources)
+{
+  char token[TOKEN_LENGTH];
+  SourceConf *source;
+  long marker;
+
+  source = source_conf_new(sources);
 
-  i = open_capture(video[video_count].capture_info, video_dev);
+  gettoken(in, source->filename, sizeof(source->filename));
 
-  if (i == 0)
+  // The { name ... } block is optional so if the next token isn't
+  // a '{' rewind and let config_read() see it.
+  marker = ftell(in);
+
+  if (gettoken(in, token, sizeof(token)) != 0 || strcmp(token, "{") != 0)
   {
-    video_count++;
+    fseek(in, marker, SEEK_SET);
+    return 0;
   }
-    else
+
+  while (1)
   {
-    printf("Couldn't open capture for device %s (error %d)\n", video_dev, i);
-    free(video[video_count].capture_info);
+    if (gettoken(in, token, sizeof(token)) != 0)
+    {
+      printf("Parse error in filename, expected '}'\n");
+      source->failed = 1;
+      return -1;
+    }
+
+    if (strcmp(token, "}") == 0) { break; }
+
+    if (strcasecmp(token, "name") == 0)
+    {
+      gettoken(in, source->name, sizeof(source->name));
+    }
+      else
+    if (strcasecmp(token, "limit_bytes") == 0)
+    {
+      gettoken(in, token, sizeof(token));
+      source->limit_bytes = atoi(token);
+    }
+      else
+    if (strcasecmp(token, "limit_frames") == 0)
+    {
+      gettoken(in, token, sizeof(token));
+      source->limit_frames = atoi(token);
+    }
+      else
+    if (strcasecmp(token, "history_frames") == 0)
+    {
+      gettoken(in, token, sizeof(token));
+      source->history_frames = atoi(token);
+    }
+      else
+    if (strcasecmp(token, "history_seconds") == 0)
+    {
+      gettoken(in, token, sizeof(token));
+      source->history_seconds = atoi(token);
+    }
+      else
+    {
+      printf("Error in conf '%s'\n", token);
+      source->failed = 1;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int parse_client_limit(FILE *in, Config *config)
+{
+  char token[TOKEN_LENGTH];
+  char network[TOKEN_LENGTH];
+  int limit_bytes = 0;
+  int limit_frames = 0;
+
+  gettoken(in, network, sizeof(network));
+  gettoken(in, token, sizeof(token));
+
+  if (strcmp(token, "{") != 0)
+  {
+    printf("Parse error in client_limit, expected '{' and got '%s'\n", token);
+    return -1;
+  }
+
+  while (1)
+  {
+    if (gettoken(in, token, sizeof(token)) != 0)
+    {
+      printf("Parse error in client_limit, expected '}'\n");
+      return -1;
+    }
+
+    if (strcmp(token, "}") == 0) { break; }
+
+    if (strcasecmp(token, "limit_bytes") == 0)
+    {
+      gettoken(in, token, sizeof(token));
+      limit_bytes = atoi(token);
+    }
+      else
+    if (strcasecmp(token, "limit_frames") == 0)
+    {
+      gettoken(in, token, sizeof(token));
+      limit_frames = atoi(token);
+    }
+      else
+    {
+      printf("Error in conf '%s'\n", token);
+      return -1;
+    }
+  }
+
+  return rate_limit_add_client(
+    &config->client_limits,
+    network,
+    limit_bytes,
+    limit_frames);
+}
+
+// adaptive { step <quality> <frame_rate> ... } lists the steps a viewer
+// that can't keep up is moved down through, in order.
+static int parse_adaptive(FILE *in, Config *config)
+{
+  char token[TOKEN_LENGTH];
+  AdaptiveStep *step;
+
+  gettoken(in, token, sizeof(token));
+
+  if (strcmp(token, "{") != 0)
+  {
+    printf("Parse error in adaptive, expected '{' and got '%s'\n", token);
+    return -1;
+  }
+
+  config->adaptive_steps = 0;
+
+  while (1)
+  {
+    if (gettoken(in, token, sizeof(token)) != 0)
+    {
+      printf("Parse error in adaptive, expected '}'\n");
+      return -1;
+    }
+
+    if (strcmp(token, "}") == 0) { break; }
+
+    if (strcasecmp(token, "step") == 0)
+    {
+      if (config->adaptive_steps == ADAPTIVE_MAX_STEPS)
+      {
+        printf("Too many steps in adaptive (max %d)\n", ADAPTIVE_MAX_STEPS);
+        return -1;
+      }
+
+      step = &config->adaptive[config->adaptive_steps++];
+
+      gettoken(in, token, sizeof(token));
+      step->quality = atoi(token);
+      gettoken(in, token, sizeof(token));
+      step->frame_rate = atoi(token);
+    }
+      else
+    {
+      printf("Error in conf '%s'\n", token);
+      return -1;
+    }
   }
 
   return 0;
 }
-#endif
 
 #if !defined(WINDOWS) && !defined(ENABLE_ESP32)
 void config_set_runas(Config *config)
@@ -606,7 +1183,6 @@ void config_set_runas(Config *config)
 }
 #endif
 
-#if !defined(ENABLE_CGI) || !defined(ENABLE_PLUGINS) || !defined(ENABLE_CAPTURE)
 static void skip_block(FILE *in)
 {
   char token[TOKEN_LENGTH];
@@ -631,13 +1207,18 @@ static void skip_block(FILE *in)
     }
   }
 }
-#endif
 
-void config_read(Config *config, const char *config_dir)
+// Returns -1 if the file couldn't be opened or has a mistake in it.
+// Sources are only opened or taken out once the whole file has been
+// read, except the server starting up still gets the ones before the
+// mistake.
+int config_read(Config *config, const char *config_dir)
 {
   char token[TOKEN_LENGTH];
   char username[128];
   char password[128];
+  SourceConf *sources = NULL;
+  int error = 0;
 #ifndef WINDOWS
   int ch;
 #endif
@@ -645,20 +1226,36 @@ void config_read(Config *config, const char *config_dir)
   username[0] = 0;
   password[0] = 0;
 
+  // Remembered so SIGHUP can read it again.
+  if (config->filename == NULL)
+  {
+    config->filename = (char *)malloc(strlen(config_dir) + 1);
+    strcpy(config->filename, config_dir);
+  }
+
   FILE *in = fopen(config_dir, "rb");
 
   if (in == NULL)
   {
     printf("No config file found \"%s\". Going with defaults.\n", config_dir);
-    return;
+    return -1;
   }
 
   while (gettoken(in, token, sizeof(token)) == 0)
   {
     if (strcasecmp(token, "filename") == 0)
     {
-      gettoken(in, token, sizeof(token));
-      avi_init(token);
+      error = parse_filename(in, &sources);
+    }
+      else
+    if (strcasecmp(token, "client_limit") == 0)
+    {
+      error = parse_client_limit(in, config);
+    }
+      else
+    if (strcasecmp(token, "adaptive") == 0)
+    {
+      error = parse_adaptive(in, config);
     }
       else
     if (strcasecmp(token, "port") == 0)
@@ -685,6 +1282,12 @@ void config_read(Config *config, const char *config_dir)
       config->max_idle_time = atoi(token);
     }
       else
+    if (strcasecmp(token, "drain_timeout") == 0)
+    {
+      gettoken(in, token, sizeof(token));
+      config->drain_timeout = atoi(token);
+    }
+      else
     if (strcasecmp(token, "htdocs_dir") == 0)
     {
       gettoken(in, token, sizeof(token));
@@ -731,7 +1334,8 @@ void config_read(Config *config, const char *config_dir)
         token[ch] = 0;
       }
 
-      if (runas_user == NULL)
+      // Only the user the server started as can change it.
+      if (runas_user == NULL && config->generation == 0)
       {
         runas_user = (char *)malloc(strlen(token) + 1);
         strcpy(runas_user, token);
@@ -740,7 +1344,7 @@ void config_read(Config *config, const char *config_dir)
       if (token[ch] != 0)
       {
         // gettoken(in,token,128);
-        if (runas_group == 0)
+        if (runas_group == 0 && config->generation == 0)
         {
           runas_group = (char *)malloc(strlen(token + ch) + 1);
           strcpy(runas_group, token + ch);
@@ -761,15 +1365,97 @@ void config_read(Config *config, const char *config_dir)
       config->frame_rate = atoi(token);
     }
       else
+    if (strcasecmp(token, "zerocopy") == 0)
+    {
+      gettoken(in, token, sizeof(token));
+      config->zerocopy = atoi(token);
+    }
+      else
+    if (strcasecmp(token, "server_loop") == 0)
+    {
+      gettoken(in, token, sizeof(token));
+
+      if (strcasecmp(token, "select") == 0)
+      {
+        config->server_loop = SERVER_LOOP_SELECT;
+      }
+        else
+      if (strcasecmp(token, "io_uring") == 0)
+      {
+        config->server_loop = SERVER_LOOP_IO_URING;
+      }
+        else
+      {
+        printf("Error in conf 'server_loop %s'\n", token);
+        error = -1;
+      }
+    }
+      else
+    if (strcasecmp(token, "stats_url") == 0)
+    {
+      gettoken(in, token, sizeof(token));
+      free(config->stats_url);
+      config->stats_url = NULL;
+
+      if (strcasecmp(token, "none") != 0)
+      {
+        int length = strlen(token) + 1;
+        config->stats_url = (char *)malloc(length);
+        snprintf(config->stats_url, length, "%s", token);
+      }
+    }
+      else
+    if (strcasecmp(token, "hls_url") == 0)
+    {
+      gettoken(in, token, sizeof(token));
+      free(config->hls_url);
+      config->hls_url = NULL;
+
+      if (strcasecmp(token, "none") != 0)
+      {
+        int length = strlen(token) + 1;
+        config->hls_url = (char *)malloc(length);
+        snprintf(config->hls_url, length, "%s", token);
+      }
+    }
+      else
+    if (strcasecmp(token, "hls_segment_time") == 0)
+    {
+      gettoken(in, token, sizeof(token));
+      config->hls_segment_time = atoi(token);
+
+      if (config->hls_segment_time < 1) { config->hls_segment_time = 1; }
+    }
+      else
+    if (strcasecmp(token, "hls_segments") == 0)
+    {
+      gettoken(in, token, sizeof(token));
+      config->hls_segments = atoi(token);
+
+      if (config->hls_segments < 2) { config->hls_segments = 2; }
+      if (config->hls_segments > HLS_MAX_SEGMENTS)
+      {
+        config->hls_segments = HLS_MAX_SEGMENTS;
+      }
+    }
+      else
     if (strcasecmp(token, "alias") == 0)
     {
-      parse_alias(in);
+      error = parse_alias(in, config);
     }
       else
     if (strcasecmp(token, "cgi_handler") == 0)
     {
 #ifdef ENABLE_CGI
-      parse_handler(in);
+      // Handlers and plugins are only set up when the server starts.
+      if (config->generation == 0)
+      {
+        parse_handler(in);
+      }
+        else
+      {
+        skip_block(in);
+      }
 #else
       printf("CGI support was not compiled in.\n");
       skip_block(in);
@@ -779,7 +1465,14 @@ void config_read(Config *config, const char *config_dir)
     if (strcasecmp(token, "plugin") == 0)
     {
 #ifdef ENABLE_PLUGINS
-      parse_plugin(in);
+      if (config->generation == 0)
+      {
+        parse_plugin(in);
+      }
+        else
+      {
+        skip_block(in);
+      }
 #else
       printf("Plugin support was not compiled in.\n");
       skip_block(in);
@@ -789,7 +1482,7 @@ void config_read(Config *config, const char *config_dir)
     if (strcasecmp(token, "capture") == 0)
     {
 #ifdef ENABLE_CAPTURE
-      parse_capture(in);
+      error = parse_capture(in, &sources);
 #else
       printf("Capture support was not compiled in.\n");
       skip_block(in);
@@ -816,12 +1509,23 @@ void config_read(Config *config, const char *config_dir)
       else
     {
       printf("Config file syntax error: %s\n", token);
-      break;
+      error = -1;
     }
+
+    if (error != 0) { break; }
   }
 
   fclose(in);
 
+  if (prepare_sources(config, sources) != 0) { error = -1; }
+
+  if (error == 0 || config->generation == 0)
+  {
+    add_sources(config, sources);
+  }
+
+  free_source_confs(sources);
+
   if (username[0] != 0 || password[0] != 0)
   {
     strcat(username, ":");
@@ -829,5 +1533,39 @@ void config_read(Config *config, const char *config_dir)
 
     base64_encode_(config->user_pass_64, username);
   }
+
+  return error;
+}
+
+// Reads the conf file again into a new Config for the running server.
+// Sources still in it with the same file (or device) and name are kept
+// as they are so their viewers aren't interrupted, new ones are opened
+// and the rest are taken out. port, maxconn, minconn and server_loop
+// stay what the server started with. Returns NULL if the file couldn't
+// be read or has a mistake in it, in which case nothing has changed.
+Config *config_reload(Config *current)
+{
+  Config *config = (Config *)malloc(sizeof(Config));
+
+  if (config == NULL) { return NULL; }
+
+  config_defaults(config);
+  config->generation = current->generation + 1;
+
+  if (config_read(config, current->filename) != 0)
+  {
+    config_destroy(config);
+    free(config);
+    return NULL;
+  }
+
+  config->port = current->port;
+  config->maxconn = current->maxconn;
+  config->minconn = current->minconn;
+  config->server_loop = current->server_loop;
+
+  stats_sources(video_count);
+
+  return config;
 }
 
@@ -16,6 +16,20 @@
 #define DEFAULT_JPEG_QUALITY 80
 #define DEFAULT_PORT 5555
 
+#define SERVER_LOOP_SELECT 0
+#define SERVER_LOOP_IO_URING 1
+
+#define ADAPTIVE_MAX_STEPS 8
+#define HLS_MAX_SEGMENTS 16
+
+// One step down the ladder a congested viewer is moved along. 0 leaves
+// that setting alone.
+typedef struct AdaptiveStep
+{
+  int quality;
+  int frame_rate;
+} AdaptiveStep;
+
 typedef struct Config
 {
   int port;
@@ -24,18 +38,34 @@ typedef struct Config
   int maxconn;
   int minconn;
   int max_idle_time;
+  int drain_timeout;
   char user_pass_64[PASS64_LEN];
   char wifi_ssid[64];
   char wifi_password[64];
   int wifi_is_ap;
   int jpeg_quality;
   int frame_rate;
+  int zerocopy;
+  int server_loop;
+  char *stats_url;
+  char *hls_url;
+  int hls_segment_time;
+  int hls_segments;
+  AdaptiveStep adaptive[ADAPTIVE_MAX_STEPS];
+  int adaptive_steps;
+  struct Alias *alias;
+  struct ClientLimit *client_limits;
+  // The conf file this was read from and how many times it's been read
+  // again since the server started (0 for the first time).
+  char *filename;
+  int generation;
 } Config;
 
 void config_init(Config *config, int argc, char *argv[]);
 void config_destroy(Config *config);
 void config_dump(Config *config);
-void config_read(Config *config, const char *config_dir);
+int config_read(Config *config, const char *config_dir);
+Config *config_reload(Config *current);
 void config_set_runas(Config *config);
 
 #endif
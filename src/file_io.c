@@ -52,13 +52,20 @@ if (debug == 1)
 }
 #endif
 
-  curr_alias = alias;
+  curr_alias = config->alias;
 
   while (curr_alias != NULL)
   {
     if (strncmp(filename, curr_alias->url, curr_alias->url_len) == 0)
     {
-      user->video_num = 0;
+      if (curr_alias->source != NULL)
+      {
+        user->video_num = video_find(curr_alias->source);
+      }
+        else
+      {
+        user->video_num = curr_alias->port;
+      }
 
       if (curr_alias->type != 0)
       {
@@ -67,6 +74,8 @@ if (debug == 1)
 
       parse_querystring(user, filename, curr_alias);
 
+      if (user->video_num < 0) { user->video_num = VIDEO_NUM_404; }
+
       return user->video_num;
     }
 
@@ -0,0 +1,188 @@
+/*
+
+  mjpeg_webserver - Web server optimized for JPEGs from a webcam or AVI file.
+
+  Copyright 2004-2024 - Michael Kohn (mike@mikekohn.net)
+  https://www.mikekohn.net/
+
+  This program falls under the GPLv3 license.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "channel.h"
+#include "frame_ring.h"
+#include "general.h"
+
+// Keeps whichever is more of frames or seconds worth of frames at fps.
+// Returns NULL if neither is set.
+FrameRing *frame_ring_create(int frames, int seconds, int fps)
+{
+  FrameRing *ring;
+  int size = frames;
+
+  if (fps <= 0) { fps = 30; }
+  if (seconds > 0 && seconds * fps > size) { size = seconds * fps; }
+  if (size > HISTORY_MAX_FRAMES) { size = HISTORY_MAX_FRAMES; }
+  if (size <= 0) { return NULL; }
+
+  ring = (FrameRing *)calloc(1, sizeof(FrameRing));
+
+  if (ring == NULL) { return NULL; }
+
+  ring->frames = (Frame **)calloc(size, sizeof(Frame *));
+
+  if (ring->frames == NULL)
+  {
+    free(ring);
+    return NULL;
+  }
+
+  pthread_mutex_init(&ring->lock, NULL);
+  pthread_mutex_init(&ring->capture_lock, NULL);
+  ring->size = size;
+  ring->max_age = (int64_t)seconds * 1000000000;
+
+  return ring;
+}
+
+void frame_ring_destroy(FrameRing *ring)
+{
+  int n;
+
+  if (ring == NULL) { return; }
+
+  for (n = 0; n < ring->size; n++)
+  {
+    if (ring->frames[n] != NULL) { frame_release(ring->frames[n]); }
+  }
+
+  pthread_mutex_destroy(&ring->lock);
+  pthread_mutex_destroy(&ring->capture_lock);
+  free(ring->frames);
+  free(ring);
+}
+
+// Index of the i'th oldest frame.
+static int ring_slot(FrameRing *ring, int i)
+{
+  return (ring->next - ring->count + i + ring->size) % ring->size;
+}
+
+void frame_ring_add(FrameRing *ring, Frame *frame)
+{
+  Frame *old_frame, *oldest;
+
+  __atomic_add_fetch(&frame->ref_count, 1, __ATOMIC_RELAXED);
+
+  pthread_mutex_lock(&ring->lock);
+
+  old_frame = ring->frames[ring->next];
+  ring->frames[ring->next] = frame;
+  ring->next = (ring->next + 1) % ring->size;
+
+  if (ring->count < ring->size) { ring->count++; }
+
+  // Frames past max_age are only let go here so a source nobody is
+  // watching keeps its last frames.
+  while (ring->max_age != 0 && ring->count > 1)
+  {
+    oldest = ring->frames[ring_slot(ring, 0)];
+
+    if (frame->ready_time - oldest->ready_time <= ring->max_age) { break; }
+
+    ring->frames[ring_slot(ring, 0)] = NULL;
+    ring->count--;
+    frame_release(oldest);
+  }
+
+  pthread_mutex_unlock(&ring->lock);
+
+  if (old_frame != NULL) { frame_release(old_frame); }
+}
+
+// Copies a JPEG that wasn't read through a channel (a capture) into a
+// new frame and adds it. Returns the frame with a reference for the
+// caller.
+Frame *frame_ring_publish(FrameRing *ring, const uint8_t *data, int length, int quality)
+{
+  Frame *frame = frame_alloc(length);
+
+  if (frame == NULL) { return NULL; }
+
+  memcpy(frame->data, data, length);
+  frame->sequence = __atomic_add_fetch(&ring->sequence, 1, __ATOMIC_RELAXED);
+  frame->frame_num = frame->sequence;
+  frame->quality = quality;
+  frame_set_header(frame);
+  frame->ready_time = get_time_ns();
+
+  frame_ring_add(ring, frame);
+
+  return frame;
+}
+
+Frame *frame_ring_latest(FrameRing *ring)
+{
+  Frame *frame = NULL;
+
+  if (ring == NULL) { return NULL; }
+
+  pthread_mutex_lock(&ring->lock);
+
+  if (ring->count != 0)
+  {
+    frame = ring->frames[ring_slot(ring, ring->count - 1)];
+    __atomic_add_fetch(&frame->ref_count, 1, __ATOMIC_RELAXED);
+  }
+
+  pthread_mutex_unlock(&ring->lock);
+
+  return frame;
+}
+
+// Finds the newest frame that was ready by time (get_time_ns()).
+// Returns NULL if the ring doesn't go back that far.
+Frame *frame_ring_find(FrameRing *ring, int64_t time)
+{
+  Frame *frame = NULL;
+  int first, last, middle;
+
+  if (ring == NULL) { return NULL; }
+
+  pthread_mutex_lock(&ring->lock);
+
+  // Frames are added in the order they were ready.
+  first = 0;
+  last = ring->count - 1;
+
+  while (first <= last)
+  {
+    middle = (first + last) / 2;
+
+    if (ring->frames[ring_slot(ring, middle)]->ready_time <= time)
+    {
+      frame = ring->frames[ring_slot(ring, middle)];
+      first = middle + 1;
+    }
+      else
+    {
+      last = middle - 1;
+    }
+  }
+
+  if (frame != NULL)
+  {
+    __atomic_add_fetch(&frame->ref_count, 1, __ATOMIC_RELAXED);
+  }
+
+  pthread_mutex_unlock(&ring->lock);
+
+  return frame;
+}
+
@@ -0,0 +1,50 @@
+/*
+
+  mjpeg_webserver - Web server optimized for JPEGs from a webcam or AVI file.
+
+  Copyright 2004-2024 - Michael Kohn (mike@mikekohn.net)
+  https://www.mikekohn.net/
+
+  This program falls under the GPLv3 license.
+
+*/
+
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "channel.h"
+
+#define HISTORY_MAX_FRAMES 1800
+
+// The last frames published by a source, newest last. Snapshots are
+// served from here and ?t= looks back through it. The ring holds a
+// reference to every frame in it.
+typedef struct FrameRing
+{
+  pthread_mutex_t lock;
+  // Held by the viewer capturing a source's next frame so the others
+  // can wait for it instead of reading the device again.
+  pthread_mutex_t capture_lock;
+  Frame **frames;
+  int size;
+  int count;
+  // Slot the next frame goes in.
+  int next;
+  // Frames older than this (in ns) are dropped, 0 to keep size frames.
+  int64_t max_age;
+  // Sequence numbers for frames that don't come from a channel.
+  uint32_t sequence;
+} FrameRing;
+
+FrameRing *frame_ring_create(int frames, int seconds, int fps);
+void frame_ring_destroy(FrameRing *ring);
+void frame_ring_add(FrameRing *ring, Frame *frame);
+Frame *frame_ring_publish(FrameRing *ring, const uint8_t *data, int length, int quality);
+Frame *frame_ring_latest(FrameRing *ring);
+Frame *frame_ring_find(FrameRing *ring, int64_t time);
+
+#endif
+
@@ -44,6 +44,10 @@
 #include "functions.h"
 #include "network_io.h"
 #include "plugin.h"
+#ifdef V4L2
+#include "recorder.h"
+#endif
+#include "stats.h"
 #include "user.h"
 
 #ifdef WINDOWS
@@ -66,6 +70,41 @@ int gettimeofday(struct timeval *tv, int tz)
 }
 #endif
 
+// Monotonic time in nanoseconds. Unlike gettimeofday() this doesn't
+// jump when the wall clock is stepped.
+int64_t get_time_ns()
+{
+#ifndef WINDOWS
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ((int64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+#else
+  LARGE_INTEGER counter, frequency;
+
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+
+  return ((counter.QuadPart / frequency.QuadPart) * 1000000000) +
+    ((counter.QuadPart % frequency.QuadPart) * 1000000000) / frequency.QuadPart;
+#endif
+}
+
+// Microseconds since 1970 for timestamps sent to clients.
+int64_t get_wall_time_us()
+{
+#ifndef WINDOWS
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+
+  return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#else
+  return (int64_t)time(NULL) * 1000000;
+#endif
+}
+
 int socketdie(int socketid)
 {
 #ifdef WINDOWS
@@ -77,75 +116,22 @@ int socketdie(int socketid)
   return 0;
 }
 
+// Workers can still be serving when the server stops or hands over so
+// nothing they use is freed here, exiting takes care of it. Recordings
+// are finished so their files are complete.
 void destroy()
 {
-#ifdef ENABLE_CGI
-  CgiHandler *next_handler;
-#endif
-#ifdef ENABLE_PLUGIN
-  Plugin *next_plugin;
-#endif
-  Alias *next_alias;
-  int r;
+#ifdef V4L2
+  int n;
 
-  for (r = 0; r < video_count; r++)
+  for (n = 0; n < video_count; n++)
   {
-#ifdef ENABLE_CAPTURE
-    if (video[r].capture_info != 0) { free(video[r].capture_info); }
-#endif
-#ifdef WITH_MMAP
-#ifndef WINDOWS
-    munmap(video[r].mem, (size_t)video[r].file_len);
-    close(video[r].fd);
-#else
-    UnmapViewOfFile(video[r].mem);
-    CloseHandle(video[r].mem_handle);
-    CloseHandle(video[r].fd);
-#endif
-#endif
-    free(video[r].filename);
-  }
-
-  while(alias != 0)
-  {
-    next_alias = alias->next_alias;
-
-    if (alias->url != NULL)        { free(alias->url); }
-    if (alias->port_param != NULL) { free(alias->port_param); }
-    if (alias->size_param != NULL) { free(alias->size_param); }
-    if (alias->comp_param != NULL) { free(alias->comp_param); }
-    if (alias->fps_param != NULL)  { free(alias->fps_param); }
-    free(alias);
-
-    alias = next_alias;
-  }
-
-#ifdef ENABLE_CGI
-  while (cgi_handler != 0)
-  {
-    next_handler = cgi_handler->next_handler;
-
-    if (cgi_handler->extension != NULL)   { free(cgi_handler->extension); }
-    if (cgi_handler->application != NULL) { free(cgi_handler->application); }
-    free(cgi_handler);
-
-    cgi_handler = next_handler;
+    recorder_destroy(video[n]->recorder);
+    video[n]->recorder = NULL;
   }
 #endif
 
-#ifdef ENABLE_PLUGIN
-  while (plugin != NULL)
-  {
-    next_plugin = plugin->next_plugin;
-
-    if (plugin->alias != NULL) { free(plugin->alias);}
-
-    dlclose(dlhandle);
-    free(plugin);
-
-    plugin = next_plugin;
-  }
-#endif
+  stats_log();
 
 #ifdef DEBUG
   if (debug == 1)
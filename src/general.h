@@ -12,12 +12,16 @@
 #ifndef GENERAL_H
 #define GENERAL_H
 
+#include <stdint.h>
+
 int socketdie(int socketid);
 void destroy();
 void broken_pipe();
 void set_signals();
 void message(int id, char *daMessage);
 int conv_num(const char *s);
+int64_t get_time_ns();
+int64_t get_wall_time_us();
 int base64_encode_(char *user_pass_64, const char *text_in);
 //int base64_compare(char *text_in);
 
@@ -22,8 +22,10 @@
 #include "user.h"
 #include "video.h"
 
-#define VIDEO_NUM_404 404
-#define VIDEO_NUM_400 400
+#define VIDEO_NUM_404 -404
+#define VIDEO_NUM_400 -400
+#define VIDEO_NUM_STATS -5
+#define VIDEO_NUM_HLS -6
 #define BIGGEST_SUPPORTED_FILE 400000
 #define BIGGEST_FILE_CHUNK 1024
 #define CHUNKS_PER_SEND 8
@@ -32,6 +34,8 @@
 #define REQUEST_SINGLE 0
 #define REQUEST_MULTIPART 1
 #define REQUEST_MULTIPART2 2
+#define REQUEST_WEBSOCKET 3
+#define REQUEST_EVENTS 4
 
 #define METHOD_GET 0
 #define METHOD_POST 1
@@ -0,0 +1,917 @@
+/*
+
+  mjpeg_webserver - Web server optimized for JPEGs from a webcam or AVI file.
+
+  Copyright 2004-2024 - Michael Kohn (mike@mikekohn.net)
+  https://www.mikekohn.net/
+
+  This program falls under the GPLv3 license.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef ENABLE_CAPTURE
+#include "capture.h"
+#endif
+
+#include "channel.h"
+#include "frame_ring.h"
+#include "general.h"
+#include "globals.h"
+#include "hls.h"
+#include "mime_types.h"
+#include "network_io.h"
+#include "url_utils.h"
+#include "user.h"
+#include "version.h"
+#include "video.h"
+
+// Media timescale (90kHz like MPEG-TS so players don't rescale).
+#define HLS_TIMESCALE 90000
+
+// Stop packaging a source after this many seconds without a request.
+#define HLS_IDLE_TIME 30
+
+// A segment is cut early if it gets this many frames.
+#define HLS_MAX_SAMPLES 1024
+
+#define HLS_PLAYLIST_SIZE (512 + HLS_MAX_SEGMENTS * 64)
+
+static pthread_mutex_t hls_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The segment being put together. Only the packager thread uses this.
+typedef struct HlsBuild
+{
+  uint8_t *payload;
+  int payload_len;
+  int payload_alloc;
+  int count;
+  int sizes[HLS_MAX_SAMPLES];
+  int64_t times[HLS_MAX_SAMPLES];
+  int64_t start_time;
+} HlsBuild;
+
+typedef struct Mp4Buffer
+{
+  uint8_t *data;
+  int length;
+} Mp4Buffer;
+
+static void put_8(Mp4Buffer *buffer, int value)
+{
+  buffer->data[buffer->length++] = value;
+}
+
+static void put_16(Mp4Buffer *buffer, int value)
+{
+  put_8(buffer, value >> 8);
+  put_8(buffer, value);
+}
+
+static void put_32(Mp4Buffer *buffer, uint32_t value)
+{
+  put_16(buffer, value >> 16);
+  put_16(buffer, value);
+}
+
+static void put_64(Mp4Buffer *buffer, uint64_t value)
+{
+  put_32(buffer, value >> 32);
+  put_32(buffer, value);
+}
+
+static void put_zero(Mp4Buffer *buffer, int count)
+{
+  memset(buffer->data + buffer->length, 0, count);
+  buffer->length += count;
+}
+
+// Boxes are written with a zero size that box_end() fills in.
+static int box_start(Mp4Buffer *buffer, const char *type)
+{
+  int start = buffer->length;
+
+  put_32(buffer, 0);
+  memcpy(buffer->data + buffer->length, type, 4);
+  buffer->length += 4;
+
+  return start;
+}
+
+static int full_box_start(Mp4Buffer *buffer, const char *type, int version, int flags)
+{
+  int start = box_start(buffer, type);
+
+  put_32(buffer, (version << 24) | flags);
+
+  return start;
+}
+
+static void box_end(Mp4Buffer *buffer, int start)
+{
+  int length = buffer->length;
+
+  buffer->length = start;
+  put_32(buffer, length - start);
+  buffer->length = length;
+}
+
+static void put_matrix(Mp4Buffer *buffer)
+{
+  put_32(buffer, 0x00010000);
+  put_zero(buffer, 12);
+  put_32(buffer, 0x00010000);
+  put_zero(buffer, 12);
+  put_32(buffer, 0x40000000);
+}
+
+// Finds the picture size in a JPEG's start of frame marker.
+static int jpeg_size(const uint8_t *data, int length, int *width, int *height)
+{
+  int n = 2;
+  int marker;
+
+  if (length < 4 || data[0] != 0xff || data[1] != 0xd8) { return -1; }
+
+  while (n + 9 < length)
+  {
+    if (data[n] != 0xff) { return -1; }
+
+    marker = data[n + 1];
+
+    if (marker == 0xff) { n++; continue; }
+
+    if (marker >= 0xc0 && marker <= 0xcf &&
+        marker != 0xc4 && marker != 0xc8 && marker != 0xcc)
+    {
+      *height = (data[n + 5] << 8) | data[n + 6];
+      *width = (data[n + 7] << 8) | data[n + 8];
+      return 0;
+    }
+
+    n += 2 + ((data[n + 2] << 8) | data[n + 3]);
+  }
+
+  return -1;
+}
+
+// ftyp and moov with one 'jpeg' video track and no samples.
+static Frame *build_init(int width, int height)
+{
+  uint8_t data[1024];
+  Mp4Buffer buffer = { data, 0 };
+  int moov, trak, mdia, minf, dinf, dref, stbl, stsd, jpeg, mvex, box;
+  Frame *frame;
+
+  box = box_start(&buffer, "ftyp");
+  memcpy(buffer.data + buffer.length, "iso6", 4); buffer.length += 4;
+  put_32(&buffer, 0);
+  memcpy(buffer.data + buffer.length, "iso6mp41", 8); buffer.length += 8;
+  box_end(&buffer, box);
+
+  moov = box_start(&buffer, "moov");
+
+  box = full_box_start(&buffer, "mvhd", 0, 0);
+  put_zero(&buffer, 8);
+  put_32(&buffer, 1000);
+  put_32(&buffer, 0);
+  put_32(&buffer, 0x00010000);
+  put_16(&buffer, 0x0100);
+  put_zero(&buffer, 10);
+  put_matrix(&buffer);
+  put_zero(&buffer, 24);
+  put_32(&buffer, 2);
+  box_end(&buffer, box);
+
+  trak = box_start(&buffer, "trak");
+
+  box = full_box_start(&buffer, "tkhd", 0, 3);
+  put_zero(&buffer, 8);
+  put_32(&buffer, 1);
+  put_zero(&buffer, 4 + 4 + 8 + 2 + 2 + 2 + 2);
+  put_matrix(&buffer);
+  put_32(&buffer, width << 16);
+  put_32(&buffer, height << 16);
+  box_end(&buffer, box);
+
+  mdia = box_start(&buffer, "mdia");
+
+  box = full_box_start(&buffer, "mdhd", 0, 0);
+  put_zero(&buffer, 8);
+  put_32(&buffer, HLS_TIMESCALE);
+  put_32(&buffer, 0);
+  put_16(&buffer, 0x55c4);
+  put_16(&buffer, 0);
+  box_end(&buffer, box);
+
+  box = full_box_start(&buffer, "hdlr", 0, 0);
+  put_32(&buffer, 0);
+  memcpy(buffer.data + buffer.length, "vide", 4); buffer.length += 4;
+  put_zero(&buffer, 12);
+  memcpy(buffer.data + buffer.length, "VideoHandler", 13); buffer.length += 13;
+  box_end(&buffer, box);
+
+  minf = box_start(&buffer, "minf");
+
+  box = full_box_start(&buffer, "vmhd", 0, 1);
+  put_zero(&buffer, 8);
+  box_end(&buffer, box);
+
+  dinf = box_start(&buffer, "dinf");
+  dref = full_box_start(&buffer, "dref", 0, 0);
+  put_32(&buffer, 1);
+  box = full_box_start(&buffer, "url ", 0, 1);
+  box_end(&buffer, box);
+  box_end(&buffer, dref);
+  box_end(&buffer, dinf);
+
+  stbl = box_start(&buffer, "stbl");
+
+  stsd = full_box_start(&buffer, "stsd", 0, 0);
+  put_32(&buffer, 1);
+  jpeg = box_start(&buffer, "jpeg");
+  put_zero(&buffer, 6);
+  put_16(&buffer, 1);
+  put_zero(&buffer, 16);
+  put_16(&buffer, width);
+  put_16(&buffer, height);
+  put_32(&buffer, 0x00480000);
+  put_32(&buffer, 0x00480000);
+  put_32(&buffer, 0);
+  put_16(&buffer, 1);
+  put_8(&buffer, 12);
+  memcpy(buffer.data + buffer.length, "Photo - JPEG", 12); buffer.length += 12;
+  put_zero(&buffer, 31 - 12);
+  put_16(&buffer, 0x0018);
+  put_16(&buffer, 0xffff);
+  box_end(&buffer, jpeg);
+  box_end(&buffer, stsd);
+
+  box = full_box_start(&buffer, "stts", 0, 0);
+  put_32(&buffer, 0);
+  box_end(&buffer, box);
+  box = full_box_start(&buffer, "stsc", 0, 0);
+  put_32(&buffer, 0);
+  box_end(&buffer, box);
+  box = full_box_start(&buffer, "stsz", 0, 0);
+  put_32(&buffer, 0);
+  put_32(&buffer, 0);
+  box_end(&buffer, box);
+  box = full_box_start(&buffer, "stco", 0, 0);
+  put_32(&buffer, 0);
+  box_end(&buffer, box);
+
+  box_end(&buffer, stbl);
+  box_end(&buffer, minf);
+  box_end(&buffer, mdia);
+  box_end(&buffer, trak);
+
+  // Every sample is a sync sample that doesn't depend on any other.
+  mvex = box_start(&buffer, "mvex");
+  box = full_box_start(&buffer, "trex", 0, 0);
+  put_32(&buffer, 1);
+  put_32(&buffer, 1);
+  put_32(&buffer, 0);
+  put_32(&buffer, 0);
+  put_32(&buffer, 0x02000000);
+  box_end(&buffer, box);
+  box_end(&buffer, mvex);
+
+  box_end(&buffer, moov);
+
+  frame = frame_alloc(buffer.length);
+
+  if (frame == NULL) { return NULL; }
+
+  memcpy(frame->data, buffer.data, buffer.length);
+  frame->ready_time = get_time_ns();
+
+  return frame;
+}
+
+static int64_t hls_ticks(HlsBuild *build, int64_t time)
+{
+  return (time - build->start_time) * HLS_TIMESCALE / 1000000000;
+}
+
+// moof and mdat for the frames collected so far. end_time is when the
+// frame after the last one arrived, so the last frame's duration is
+// known.
+static Frame *build_segment(HlsBuild *build, uint32_t sequence, int64_t end_time)
+{
+  uint8_t *data;
+  Mp4Buffer buffer;
+  int moof, traf, trun, box, data_offset, n;
+  int64_t tick, next_tick;
+  Frame *frame;
+
+  data = (uint8_t *)malloc(128 + build->count * 8);
+
+  if (data == NULL) { return NULL; }
+
+  buffer.data = data;
+  buffer.length = 0;
+
+  moof = box_start(&buffer, "moof");
+
+  box = full_box_start(&buffer, "mfhd", 0, 0);
+  put_32(&buffer, sequence + 1);
+  box_end(&buffer, box);
+
+  traf = box_start(&buffer, "traf");
+
+  // default-base-is-moof
+  box = full_box_start(&buffer, "tfhd", 0, 0x020000);
+  put_32(&buffer, 1);
+  box_end(&buffer, box);
+
+  box = full_box_start(&buffer, "tfdt", 1, 0);
+  put_64(&buffer, hls_ticks(build, build->times[0]));
+  box_end(&buffer, box);
+
+  // data-offset, sample-duration and sample-size present.
+  trun = full_box_start(&buffer, "trun", 0, 0x000301);
+  put_32(&buffer, build->count);
+  data_offset = buffer.length;
+  put_32(&buffer, 0);
+
+  for (n = 0; n < build->count; n++)
+  {
+    tick = hls_ticks(build, build->times[n]);
+    next_tick = hls_ticks(build,
+      n + 1 < build->count ? build->times[n + 1] : end_time);
+
+    put_32(&buffer, next_tick - tick);
+    put_32(&buffer, build->sizes[n]);
+  }
+
+  box_end(&buffer, trun);
+  box_end(&buffer, traf);
+  box_end(&buffer, moof);
+
+  // The samples start right after the mdat header.
+  n = buffer.length;
+  buffer.length = data_offset;
+  put_32(&buffer, n + 8);
+  buffer.length = n;
+
+  frame = frame_alloc(buffer.length + 8 + build->payload_len);
+
+  if (frame != NULL)
+  {
+    memcpy(frame->data, buffer.data, buffer.length);
+
+    buffer.data = frame->data;
+    box = box_start(&buffer, "mdat");
+    memcpy(buffer.data + buffer.length, build->payload, build->payload_len);
+    buffer.length += build->payload_len;
+    box_end(&buffer, box);
+
+    frame->ready_time = get_time_ns();
+  }
+
+  free(data);
+
+  return frame;
+}
+
+// Called with hls->lock held.
+static void build_playlist(Hls *hls)
+{
+  char text[HLS_PLAYLIST_SIZE];
+  int target = hls->segment_time;
+  int length, n;
+  Frame *frame;
+
+  for (n = 0; n < hls->segment_count; n++)
+  {
+    int seconds = (hls->segments[n].duration + 500000000) / 1000000000;
+
+    if (seconds > target) { target = seconds; }
+  }
+
+  length = snprintf(text, sizeof(text),
+    "#EXTM3U\n"
+    "#EXT-X-VERSION:7\n"
+    "#EXT-X-TARGETDURATION:%d\n"
+    "#EXT-X-MEDIA-SEQUENCE:%u\n"
+    "#EXT-X-INDEPENDENT-SEGMENTS\n"
+    "#EXT-X-MAP:URI=\"init.mp4\"\n",
+    target,
+    hls->segment_count == 0 ? hls->sequence : hls->segments[0].sequence);
+
+  for (n = 0; n < hls->segment_count; n++)
+  {
+    length += snprintf(text + length, sizeof(text) - length,
+      "#EXTINF:%.3f,\n%u.m4s\n",
+      (double)hls->segments[n].duration / 1000000000,
+      hls->segments[n].sequence);
+  }
+
+  frame = frame_alloc(length);
+
+  if (frame == NULL) { return; }
+
+  memcpy(frame->data, text, length);
+  frame->ready_time = get_time_ns();
+
+  if (hls->playlist != NULL) { frame_release(hls->playlist); }
+  hls->playlist = frame;
+}
+
+static void hls_finish_segment(Hls *hls, HlsBuild *build, int64_t end_time)
+{
+  HlsSegment *segment;
+  Frame *frame;
+
+  frame = build_segment(build, hls->sequence, end_time);
+
+  build->count = 0;
+  build->payload_len = 0;
+
+  if (frame == NULL) { return; }
+
+  pthread_mutex_lock(&hls->lock);
+
+  if (hls->segment_count == hls->max_segments)
+  {
+    frame_release(hls->segments[0].frame);
+    memmove(hls->segments, hls->segments + 1,
+      sizeof(HlsSegment) * (hls->segment_count - 1));
+    hls->segment_count--;
+  }
+
+  segment = &hls->segments[hls->segment_count++];
+  segment->frame = frame;
+  segment->sequence = hls->sequence++;
+  segment->duration = end_time - build->times[0];
+
+  build_playlist(hls);
+
+  pthread_mutex_unlock(&hls->lock);
+}
+
+static void hls_add_frame(Hls *hls, HlsBuild *build, uint8_t *data, int length, int64_t time)
+{
+  int64_t segment_time = (int64_t)hls->segment_time * 1000000000;
+
+  if (hls->init == NULL)
+  {
+    Frame *init;
+
+    if (hls->width == 0 && jpeg_size(data, length, &hls->width, &hls->height) != 0)
+    {
+      return;
+    }
+
+    init = build_init(hls->width, hls->height);
+
+    if (init == NULL) { return; }
+
+    pthread_mutex_lock(&hls->lock);
+    hls->init = init;
+    pthread_mutex_unlock(&hls->lock);
+
+    build->start_time = time;
+  }
+
+  if (build->count != 0 &&
+      (time - build->times[0] >= segment_time || build->count == HLS_MAX_SAMPLES))
+  {
+    hls_finish_segment(hls, build, time);
+  }
+
+  if (build->payload_len + length > build->payload_alloc)
+  {
+    int alloc = (build->payload_len + length) * 2;
+    uint8_t *payload = (uint8_t *)realloc(build->payload, alloc);
+
+    if (payload == NULL) { return; }
+
+    build->payload = payload;
+    build->payload_alloc = alloc;
+  }
+
+  memcpy(build->payload + build->payload_len, data, length);
+  build->payload_len += length;
+  build->sizes[build->count] = length;
+  build->times[build->count] = time;
+  build->count++;
+}
+
+// Sleeps until wake_time, at most 100ms so a stop is noticed quickly.
+static void hls_sleep(int64_t wake_time)
+{
+  int64_t wait = wake_time - get_time_ns();
+
+  if (wait <= 0) { return; }
+  if (wait > 100000000) { wait = 100000000; }
+
+  usleep(wait / 1000);
+}
+
+// Called with hls->lock held.
+static void hls_clear(Hls *hls)
+{
+  int n;
+
+  for (n = 0; n < hls->segment_count; n++)
+  {
+    frame_release(hls->segments[n].frame);
+  }
+
+  hls->segment_count = 0;
+
+  if (hls->init != NULL) { frame_release(hls->init); }
+  hls->init = NULL;
+
+  build_playlist(hls);
+}
+
+#ifdef V4L2
+// A frame a viewer or the recorder of the source captured this frame
+// time.
+static Frame *hls_ring_frame(
+  Hls *hls,
+  FrameRing *ring,
+  uint32_t last_sequence,
+  int max_fps)
+{
+  Frame *frame = frame_ring_latest(ring);
+
+  if (frame == NULL) { return NULL; }
+
+  if (frame->quality == hls->jpeg_quality &&
+      frame->sequence != last_sequence &&
+      get_time_ns() - frame->ready_time < 1000000000 / max_fps)
+  {
+    return frame;
+  }
+
+  frame_release(frame);
+
+  return NULL;
+}
+
+// Capture sources are read once per frame time for everyone through
+// the ring, so the packager takes what's there or captures and
+// publishes it itself.
+static Frame *hls_next_frame(
+  Hls *hls,
+  Video *source,
+  uint8_t *jpeg,
+  int jpeg_len,
+  uint32_t last_sequence,
+  int max_fps)
+{
+  FrameRing *ring = source->ring;
+  Frame *frame = hls_ring_frame(hls, ring, last_sequence, max_fps);
+  int length;
+
+  if (frame != NULL) { return frame; }
+
+  pthread_mutex_lock(&ring->capture_lock);
+
+  frame = hls_ring_frame(hls, ring, last_sequence, max_fps);
+
+  if (frame == NULL)
+  {
+    length = capture_jpeg(source->capture_info, jpeg, jpeg_len,
+      hls->jpeg_quality);
+
+    if (length > 0)
+    {
+      frame = frame_ring_publish(ring, jpeg, length, hls->jpeg_quality);
+    }
+  }
+
+  pthread_mutex_unlock(&ring->capture_lock);
+
+  return frame;
+}
+#endif
+
+static void *hls_thread(void *context)
+{
+  Hls *hls = (Hls *)context;
+  Video *source = video[hls->video_num];
+  HlsBuild *build;
+  uint8_t *jpeg = NULL;
+  uint32_t last_sequence = 0;
+  int64_t now;
+  int done = 0;
+#ifdef V4L2
+  int jpeg_len = 0;
+  int64_t next_time = get_time_ns();
+#endif
+
+  build = (HlsBuild *)calloc(1, sizeof(HlsBuild));
+
+#ifdef V4L2
+  if (source->capture_info != NULL)
+  {
+    CaptureInfo *capture_info = source->capture_info;
+
+    hls->width = capture_info->width;
+    hls->height = capture_info->height;
+
+    jpeg_len = 128000;
+
+    if (jpeg_len < capture_info->width * capture_info->height)
+    {
+      jpeg_len = capture_info->width * capture_info->height;
+    }
+
+    jpeg = (uint8_t *)malloc(jpeg_len);
+  }
+#endif
+
+  while (done == 0)
+  {
+    now = get_time_ns();
+
+    pthread_mutex_lock(&hls->lock);
+
+    if (hls->stop == 1 ||
+        now - hls->last_request > (int64_t)HLS_IDLE_TIME * 1000000000 ||
+        build == NULL)
+    {
+      hls_clear(hls);
+      hls->running = 0;
+
+      if (hls->stop == 0) { pthread_detach(pthread_self()); }
+
+      done = 1;
+    }
+
+    pthread_mutex_unlock(&hls->lock);
+
+    if (done == 1) { break; }
+
+    if (source->channel != NULL)
+    {
+      Frame *frame = channel_get_frame(source->channel);
+
+      if (frame != NULL)
+      {
+        if (frame->sequence != last_sequence)
+        {
+          last_sequence = frame->sequence;
+          hls_add_frame(hls, build, frame->data, frame->length, frame->ready_time);
+        }
+
+        frame_release(frame);
+      }
+
+      hls_sleep(__atomic_load_n(&source->channel->next_tick, __ATOMIC_ACQUIRE));
+    }
+#ifdef V4L2
+      else
+    if (jpeg != NULL)
+    {
+      int max_fps = source->capture_info->max_fps;
+      int length;
+
+      if (max_fps <= 0) { max_fps = hls->frame_rate; }
+      if (max_fps <= 0) { max_fps = 30; }
+
+      if (now >= next_time)
+      {
+        if (source->ring != NULL)
+        {
+          Frame *frame = hls_next_frame(hls, source, jpeg, jpeg_len,
+            last_sequence, max_fps);
+
+          if (frame != NULL)
+          {
+            last_sequence = frame->sequence;
+            hls_add_frame(hls, build, frame->data, frame->length, frame->ready_time);
+            frame_release(frame);
+          }
+        }
+          else
+        {
+          length = capture_jpeg(source->capture_info, jpeg, jpeg_len,
+            hls->jpeg_quality);
+
+          if (length > 0) { hls_add_frame(hls, build, jpeg, length, get_time_ns()); }
+        }
+
+        next_time += 1000000000 / max_fps;
+
+        if (next_time < now) { next_time = now; }
+      }
+
+      hls_sleep(next_time);
+    }
+#endif
+      else
+    {
+      hls_sleep(now + 100000000);
+    }
+  }
+
+  if (build != NULL) { free(build->payload); }
+  free(build);
+  free(jpeg);
+
+  return NULL;
+}
+
+// Finds (or makes) the packager for a source and starts its thread if
+// it isn't running. Returns NULL if the source can't be packaged.
+static Hls *hls_get(Config *config, int video_num)
+{
+  Video *source = video[video_num];
+  Hls *hls;
+  int ok = source->channel != NULL;
+
+#ifdef V4L2
+  if (source->capture_info != NULL) { ok = 1; }
+#endif
+
+  if (ok == 0) { return NULL; }
+
+  pthread_mutex_lock(&hls_lock);
+
+  hls = source->hls;
+
+  if (hls == NULL)
+  {
+    hls = (Hls *)calloc(1, sizeof(Hls));
+
+    if (hls != NULL)
+    {
+      pthread_mutex_init(&hls->lock, NULL);
+      hls->video_num = video_num;
+      hls->segment_time = config->hls_segment_time;
+      hls->max_segments = config->hls_segments;
+      hls->frame_rate = config->frame_rate;
+      hls->jpeg_quality = config->jpeg_quality;
+      build_playlist(hls);
+      source->hls = hls;
+    }
+  }
+
+  pthread_mutex_unlock(&hls_lock);
+
+  return hls;
+}
+
+// path is <hls_url>/<source>/index.m3u8, init.mp4 or <sequence>.m4s.
+// Returns -1 if the path isn't under hls_url. Otherwise the connection's
+// frame is set to what was asked for and VIDEO_NUM_HLS is returned, or
+// VIDEO_NUM_404 if there's no such thing.
+int hls_request(Config *config, User *user, const char *path)
+{
+  char name[128];
+  const char *object;
+  Frame *frame = NULL;
+  Hls *hls;
+  int length, video_num, n;
+  int mime_type = MIME_TYPE_MP4;
+
+  if (config->hls_url == NULL) { return -1; }
+
+  length = strlen(config->hls_url);
+
+  if (strncmp(path, config->hls_url, length) != 0 || path[length] != '/')
+  {
+    return -1;
+  }
+
+  path += length + 1;
+
+  for (n = 0; path[n] != '/' && path[n] != 0 && n < (int)sizeof(name) - 1; n++)
+  {
+    name[n] = path[n];
+  }
+
+  name[n] = 0;
+
+  if (path[n] != '/') { return VIDEO_NUM_404; }
+
+  object = path + n + 1;
+  video_num = get_video_num(name);
+
+  if (video_num < 0 || video_num >= video_count) { return VIDEO_NUM_404; }
+  if (video[video_num]->removed == 1 || video[video_num]->handed_over != 0)
+  {
+    return VIDEO_NUM_404;
+  }
+
+  hls = hls_get(config, video_num);
+
+  if (hls == NULL) { return VIDEO_NUM_404; }
+
+  pthread_mutex_lock(&hls->lock);
+
+  hls->last_request = get_time_ns();
+
+  if (hls->running == 0)
+  {
+    hls->stop = 0;
+
+    if (pthread_create(&hls->thread, NULL, hls_thread, hls) == 0)
+    {
+      hls->running = 1;
+    }
+  }
+
+  if (strncmp(object, "index.m3u8", 10) == 0)
+  {
+    frame = hls->playlist;
+    mime_type = MIME_TYPE_M3U8;
+  }
+    else
+  if (strncmp(object, "init.mp4", 8) == 0)
+  {
+    frame = hls->init;
+  }
+    else
+  {
+    length = conv_num(object);
+
+    for (n = 0; n < hls->segment_count && length >= 0; n++)
+    {
+      if (hls->segments[n].sequence == (uint32_t)length)
+      {
+        frame = hls->segments[n].frame;
+        break;
+      }
+    }
+  }
+
+  if (frame != NULL)
+  {
+    __atomic_add_fetch(&frame->ref_count, 1, __ATOMIC_RELAXED);
+  }
+
+  pthread_mutex_unlock(&hls->lock);
+
+  if (frame == NULL) { return VIDEO_NUM_404; }
+
+  user->frame = frame;
+  user->mime_type = mime_type;
+
+  return VIDEO_NUM_HLS;
+}
+
+// Sends the frame hls_request() picked like a snapshot, but with its
+// own headers. Segments never change so they can be cached.
+int send_hls(int id)
+{
+  User *user = users[id];
+
+  if (user->need_header == NEED_HEADER_YES)
+  {
+    user->header_len = snprintf(user->header_buffer, sizeof(user->header_buffer),
+      "HTTP/1.1 200 OK\r\n"
+      "Server: " VERSION "\r\n"
+      "Cache-Control: %s\r\n"
+      "Access-Control-Allow-Origin: *\r\n"
+      "Connection: Keep-Alive\r\n"
+      "Content-Length: %d\r\nContent-Type: %s\r\n\r\n",
+      user->mime_type == MIME_TYPE_M3U8 ? "no-cache" : "max-age=60",
+      user->frame->length,
+      mime_types[user->mime_type]);
+
+    user->header = user->header_buffer;
+    user->header_ptr = 0;
+    user->frame_ptr = 0;
+    user->content_length = user->frame->length;
+    user->need_header = NEED_HEADER_NO;
+  }
+
+  return send_frame(id);
+}
+
+void hls_destroy(Hls *hls)
+{
+  int running;
+
+  if (hls == NULL) { return; }
+
+  pthread_mutex_lock(&hls->lock);
+  hls->stop = 1;
+  running = hls->running;
+  pthread_mutex_unlock(&hls->lock);
+
+  if (running == 1) { pthread_join(hls->thread, NULL); }
+
+  pthread_mutex_lock(&hls->lock);
+  hls_clear(hls);
+  pthread_mutex_unlock(&hls->lock);
+
+  if (hls->playlist != NULL) { frame_release(hls->playlist); }
+
+  pthread_mutex_destroy(&hls->lock);
+  free(hls);
+}
+
@@ -0,0 +1,63 @@
+/*
+
+  mjpeg_webserver - Web server optimized for JPEGs from a webcam or AVI file.
+
+  Copyright 2004-2024 - Michael Kohn (mike@mikekohn.net)
+  https://www.mikekohn.net/
+
+  This program falls under the GPLv3 license.
+
+*/
+
+#ifndef HLS_H
+#define HLS_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "channel.h"
+#include "config.h"
+
+struct User;
+
+typedef struct HlsSegment
+{
+  Frame *frame;
+  uint32_t sequence;
+  int64_t duration;
+} HlsSegment;
+
+// Packages one source as Motion JPEG in fragmented MP4 for HLS. A
+// thread per source collects the frames into segments while anyone is
+// asking for them. The playlist, init segment and media segments are
+// all kept as Frames so every viewer is sent the same copy.
+typedef struct Hls
+{
+  pthread_mutex_t lock;
+  pthread_t thread;
+  int video_num;
+  // From the Config the source was first asked for with, a reload
+  // doesn't change a packager that's already been made.
+  int segment_time;
+  int max_segments;
+  int frame_rate;
+  int jpeg_quality;
+  int running;
+  int stop;
+  int64_t last_request;
+  int width;
+  int height;
+  Frame *init;
+  Frame *playlist;
+  // Finished segments, oldest first.
+  HlsSegment segments[HLS_MAX_SEGMENTS];
+  int segment_count;
+  uint32_t sequence;
+} Hls;
+
+int hls_request(Config *config, struct User *user, const char *path);
+int send_hls(int id);
+void hls_destroy(Hls *hls);
+
+#endif
+
@@ -25,6 +25,7 @@
 #include "network_io.h"
 #include "user.h"
 #include "version.h"
+#include "websocket.h"
 
 #if 0
 HTTP/1.1 200 OK
@@ -148,6 +149,81 @@ int send_header_multipart(int id)
   return 0;
 }
 
+// Builds the response headers for a frame into the connection's header
+// buffer so they go out in the same writev() as the JPEG.
+int build_header_frame(int id, Frame *frame)
+{
+  User *user = users[id];
+  int length = 0;
+
+  switch (user->request_type)
+  {
+    case REQUEST_SINGLE:
+      length = snprintf(user->header_buffer, sizeof(user->header_buffer),
+        "HTTP/1.1 200 OK\r\n"
+        "Server: " VERSION "\r\n"
+        "Cache-Control: no-cache\r\n"
+        "Pragma: no-cache\r\n"
+        "Last-Modified: Wed, 29 May 1974 07:00:00 GMT\r\n"
+        "Connection: Keep-Alive\r\n"
+        "Content-Length: %d\r\nContent-Type: %s\r\n\r\n",
+        frame->length,
+        mime_types[MIME_TYPE_JPEG]);
+      break;
+    case REQUEST_MULTIPART:
+      length = snprintf(user->header_buffer, sizeof(user->header_buffer),
+        "HTTP/1.0 200 OK\r\n"
+        "Cache-Control: no-cache\r\n"
+        "Pragma: no-cache\r\n"
+        "Expires: Thu, 01 Dec 1994 16:00:00 GMT\r\n"
+        "Connection: Close\r\n"
+        "Content-Type: multipart/x-mixed-replace; boundary=--myboundary\r\n\r\n"
+        "--myboundary\r\n"
+        "Content-Type: image/jpeg\r\n"
+        "Content-Length: %d\r\n\r\n",
+        frame->length);
+
+      user->request_type = REQUEST_MULTIPART2;
+      break;
+    case REQUEST_EVENTS:
+      // The first event carries the response headers.
+      if (user->frames_sent == 0)
+      {
+        length = snprintf(user->header_buffer, sizeof(user->header_buffer),
+          "HTTP/1.1 200 OK\r\n"
+          "Server: " VERSION "\r\n"
+          "Cache-Control: no-cache\r\n"
+          "Access-Control-Allow-Origin: *\r\n"
+          "Connection: Close\r\n"
+          "Content-Type: text/event-stream\r\n\r\n");
+      }
+
+      length += snprintf(user->header_buffer + length,
+        sizeof(user->header_buffer) - length,
+        "id: %u\n"
+        "data: {\"source\": %d, \"sequence\": %u, \"frame\": %d, "
+        "\"time\": %lld, \"size\": %d, \"skipped\": %u}\n\n",
+        frame->sequence,
+        user->video_num,
+        frame->sequence,
+        frame->frame_num,
+        (long long)(get_wall_time_us() -
+          (get_time_ns() - frame->ready_time) / 1000),
+        frame->length,
+        user->frames_skipped);
+      break;
+    case REQUEST_WEBSOCKET:
+      length = websocket_frame_header(user, user->header_buffer,
+        user->video_num, frame->sequence, frame->ready_time, frame->length);
+      break;
+  }
+
+  user->header = user->header_buffer;
+  user->header_len = length;
+
+  return 0;
+}
+
 int send_error(int id, const char *short_error, const char *error, int len)
 {
   char temp[1024];
@@ -12,6 +12,7 @@
 #ifndef HTTP_HEADERS_H
 #define HTTP_HEADERS_H
 
+#include "channel.h"
 #include "globals.h"
 
 int send_header(int id);
@@ -22,6 +23,7 @@ int send_header_cgi(int id);
 int send_header_plugin(int id);
 #endif
 int send_header_multipart(int id);
+int build_header_frame(int id, Frame *frame);
 int send_error(int id, const char *short_error, const char *error, int len);
 int send_401(int id);
 int send_video_error(int id);
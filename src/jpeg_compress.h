@@ -12,6 +12,8 @@
 #ifndef JPEG_COMPRESS
 #define JPEG_COMPRESS
 
+#include <stdint.h>
+
 int jpeg_decompress(
   uint8_t *jpeg_buffer,
   int jpeg_buffer_len,
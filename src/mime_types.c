@@ -29,6 +29,9 @@ const char *mime_types[] =
   "image/png",
   "application/x-javascript",
   "text/vnd.wap.wml",
+  "application/json",
+  "application/vnd.apple.mpegurl",
+  "video/mp4",
   NULL
 };
 
@@ -44,6 +47,9 @@ static const char *extensions[] =
   "js",
   "wml",
   "shtml",
+  "json",
+  "m3u8",
+  "mp4", "m4s",
   NULL
 };
 
@@ -58,6 +64,9 @@ static const int mime_type_code[] =
   MIME_TYPE_JS,
   MIME_TYPE_WAP,
   MIME_TYPE_HTML,
+  MIME_TYPE_JSON,
+  MIME_TYPE_M3U8,
+  MIME_TYPE_MP4, MIME_TYPE_MP4,
   0
 };
 
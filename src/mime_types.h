@@ -29,7 +29,10 @@ enum
   MIME_TYPE_GIF,
   MIME_TYPE_PNG,
   MIME_TYPE_JS,
-  MIME_TYPE_WAP
+  MIME_TYPE_WAP,
+  MIME_TYPE_JSON,
+  MIME_TYPE_M3U8,
+  MIME_TYPE_MP4
 };
 
 extern const char *mime_types[];
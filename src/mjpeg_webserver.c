@@ -31,6 +31,7 @@
 #include "globals.h"
 #include "server.h"
 #include "set_signals.h"
+#include "upgrade.h"
 
 #if 0
 #include "avi_play.h"
@@ -62,12 +63,16 @@ int main(int argc, char *argv[])
 #endif
 
   Config config;
+  int upgrading;
+
+  upgrading = upgrade_init(argc, argv);
 
   config_init(&config, argc, argv);
   config_dump(&config);
 
 #ifndef WINDOWS
-  if (debug == 0)
+  // A server started by an upgrade is already in the background.
+  if (debug == 0 && upgrading == 0)
   {
     int r = fork();
 
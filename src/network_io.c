@@ -22,6 +22,10 @@
 #include <signal.h>
 #include <netdb.h>
 #include <pthread.h>
+#include <sys/uio.h>
+#endif
+#ifdef __linux__
+#include <linux/errqueue.h>
 #endif
 #include <errno.h>
 #include <time.h>
@@ -31,14 +35,22 @@
 #include <winsock.h>
 #endif
 
+#include "channel.h"
 #include "file_io.h"
+#include "frame_ring.h"
 #include "general.h"
 #include "globals.h"
 #include "http_headers.h"
 #include "functions.h"
 #include "mime_types.h"
 #include "network_io.h"
+#include "rate_limit.h"
+#include "stats.h"
 #include "user.h"
+#include "websocket.h"
+#ifdef ENABLE_IO_URING
+#include "uring_server.h"
+#endif
 
 int send_data(int socketid, const char *message, int message_len)
 {
@@ -72,6 +84,29 @@ int send_data(int socketid, const char *message, int message_len)
   }
 }
 
+// Same as send_data() but never waits for the socket to be writable.
+// Returns 0 if the socket's send buffer is full.
+int send_data_nowait(int socketid, const char *message, int message_len)
+{
+  int t;
+
+  t = send(socketid, message, message_len, 0);
+
+  if (t == -1)
+  {
+#ifndef WINDOWS
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+#else
+    if (WSAGetLastError() == WSAEWOULDBLOCK)
+#endif
+    {
+      return 0;
+    }
+  }
+
+  return t;
+}
+
 int send_file(int id)
 {
   char temp_string[BIGGEST_FILE_CHUNK];
@@ -97,6 +132,9 @@ int send_file(int id)
       {
         send_header(id);
       }
+
+      histogram_add(&stats_user(users[id])->request_static,
+        get_time_ns() - users[id]->request_time);
     }
       else
     if (users[id]->request_type == REQUEST_MULTIPART)
@@ -134,20 +172,6 @@ if (debug==1)
     if (users[id]->content_length == 0) { break; }
 
     // This 1024 thing needs work.
-#ifdef WITH_MMAP
-    if (users[id]->video_num >= 0)
-    {
-      if (users[id]->content_length > BIGGEST_FILE_CHUNK)
-      {
-        r = BIGGEST_FILE_CHUNK;
-      }
-        else
-      {
-        r = users[id]->content_length;
-      }
-    }
-      else
-#endif
     {
 /*
       if (users[id]->content_length > BIGGEST_FILE_CHUNK)
@@ -185,16 +209,7 @@ if (debug==1)
     t = 0;
     while (t < r)
     {
-#ifdef WITH_MMAP
-      if (users[id]->video_num >= 0)
-      {
-        k = send_data(users[id]->socketid, video[users[id]->video_num].mem + users[id]->offset + t, r - t);
-      }
-        else
-#endif
-      {
-        k = send_data(users[id]->socketid, temp_string + t, r - t);
-      }
+      k = send_data(users[id]->socketid, temp_string + t, r - t);
 
       if (k == -1)
       {
@@ -205,14 +220,14 @@ if (debug==1)
       t = t + k;
     }
 
-#ifdef WITH_MMAP
-  users[id]->offset += r;
-#endif
-
+    STATS_ADD(stats_user(users[id]), bytes_sent, r);
+    users[id]->bytes_sent += r;
   }
 
   if (users[id]->content_length == 0)
   {
+    STATS_ADD(stats_user(users[id]), files_sent, 1);
+
     if (users[id]->video_num == -2)
     {
       if (users[id]->in != -1)
@@ -236,141 +251,497 @@ if (debug==1)
   return 0;
 }
 
-#ifdef ENABLE_CAPTURE
-int send_capture_frame(int id)
+#ifdef ZEROCOPY
+static void zerocopy_hold(User *user, Frame *frame)
 {
-  if (users[id]->need_header == NEED_HEADER_YES)
-  {
-    users[id]->jpeg_ptr = 0;
-    users[id]->mime_type = 4;
+  ZerocopyPending *pending;
 
-    users[id]->content_length =
-      capture_image(video[users[id]->video_num].capture_info, id);
+  pending = &user->zerocopy_pending[
+    (user->zerocopy_head + user->zerocopy_count) % ZEROCOPY_MAX_PENDING];
 
-#ifdef DEBUG
-if (debug == 1) { printf("content-length: %d\n", users[id]->content_length); }
-#endif
+  // Every successful MSG_ZEROCOPY send gets the next id from the kernel.
+  pending->id = user->zerocopy_next++;
+  pending->frame = frame;
+  __atomic_add_fetch(&frame->ref_count, 1, __ATOMIC_RELAXED);
 
-    if (users[id]->content_length < 0) { users[id]->content_length = 0; }
+  user->zerocopy_count++;
+}
 
-#if 0
-    if (users[id]->jpeg_len == 0)
-    {
-// FIXME this should be dynamic instead of wasting memory.. easy to fix
-//       also need a way to deallocate this crap
+// Reads MSG_ZEROCOPY completions from the socket's error queue and
+// drops the references to frames the kernel is done with.
+void zerocopy_reap(User *user)
+{
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct sock_extended_err *err;
+  ZerocopyPending *pending;
+  char control[128];
 
-      // users[id]->jpeg_len = 20480;
-      users[id]->jpeg_len = 128000;
-      users[id]->jpeg = (uint8_t *)malloc(users[id]->jpeg_len);
-    }
-#endif
+  while (user->zerocopy_count > 0)
+  {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
 
-#if 0
-    users[id]->content_length = jpeg_compress(
-      cap_buffer,
-      video[users[id]->video_num].capture_info->buffer_len,
-      users[id]->jpeg,
-      users[id]->jpeg_len,
-      video[users[id]->video_num].capture_info->width,
-      video[users[id]->video_num].capture_info->height,
-      3,
-      users[id]->jpeg_quality);
-#endif
+    if (recvmsg(user->socketid, &msg, MSG_ERRQUEUE) == -1) { break; }
 
-    switch (users[id]->request_type)
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
     {
-      case REQUEST_SINGLE:
+      if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+          !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
       {
-        send_header(id);
-        break;
+        continue;
+      }
+
+      err = (struct sock_extended_err *)CMSG_DATA(cmsg);
+
+      if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+      {
+        continue;
       }
-      case REQUEST_MULTIPART:
+
+      // The kernel had to copy the data anyway (loopback does this) so
+      // stop paying for completions on this connection.
+      if ((err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0)
       {
-        send_header_multipart(id);
-        break;
+        user->zerocopy = 0;
       }
-      case REQUEST_MULTIPART2:
+
+      // Completions for TCP come back in order as a range of ids.
+      while (user->zerocopy_count > 0)
       {
-        char temp_string[96];
+        pending = &user->zerocopy_pending[user->zerocopy_head];
+
+        if (pending->id - err->ee_info > err->ee_data - err->ee_info)
+        {
+          break;
+        }
 
-        sprintf(temp_string,
-          "\r\n--myboundary"
-          "\r\nContent-Type: image/jpeg"
-          "\r\nContent-Length: %d\r\n\r\n",
-          users[id]->content_length);
+        frame_release(pending->frame);
 
-        message(id, temp_string);
-        break;
+        user->zerocopy_head = (user->zerocopy_head + 1) % ZEROCOPY_MAX_PENDING;
+        user->zerocopy_count--;
       }
     }
+  }
+}
 
-    users[id]->need_header = NEED_HEADER_NO;
+// Once the socket is closed no more completions will come.
+void zerocopy_release(User *user)
+{
+  while (user->zerocopy_count > 0)
+  {
+    frame_release(user->zerocopy_pending[user->zerocopy_head].frame);
+
+    user->zerocopy_head = (user->zerocopy_head + 1) % ZEROCOPY_MAX_PENDING;
+    user->zerocopy_count--;
   }
 
-//FIXME: REMOVE
-//printf("send_capture_frame() %d/%d %d chunks=%d\n",
-//  users[id]->jpeg_ptr,
-//  users[id]->content_length, id,
-//  CHUNKS_PER_SEND);
+  user->zerocopy_next = 0;
+}
+#endif
 
-#ifdef NO_INTERLACED_FILE
-  while (users[id]->jpeg_ptr < users[id]->content_length)
-#else
-  int c;
+// Sends what's left of the part header and JPEG with one writev().
+// Returns the number of bytes sent, 0 if the socket buffer is full.
+static int send_frame_data(User *user)
+{
+  Frame *frame = user->frame;
+  int header_left = user->header_len - user->header_ptr;
+#ifndef WINDOWS
+  struct iovec iov[2];
+  int count = 0;
+  int k;
 
-  for (c = 0; c < CHUNKS_PER_SEND; c++)
+  if (header_left > 0)
+  {
+    iov[count].iov_base = (void *)(user->header + user->header_ptr);
+    iov[count].iov_len = header_left;
+    count++;
+  }
+
+  iov[count].iov_base = frame->data + user->frame_ptr;
+  iov[count].iov_len = frame->length - user->frame_ptr;
+  count++;
+
+#ifdef ENABLE_IO_URING
+  if (user->io_uring == 1) { return uring_server_send(user, iov, count); }
 #endif
+
+#ifdef ZEROCOPY
+  // The kernel sends straight from the frame's pages, so everything in
+  // the iovec has to stay untouched until the completion comes back.
+  // The connection's own header buffer doesn't, so the first header is
+  // always copied.
+  if (user->zerocopy != 0 &&
+      frame->length >= user->zerocopy &&
+      user->zerocopy_count < ZEROCOPY_MAX_PENDING &&
+      (header_left == 0 || user->header == frame->header))
   {
-    // This BIGGEST_FILE_CHUNK thing needs work.
-    int chunk_length = users[id]->content_length - users[id]->jpeg_ptr;
+    struct msghdr msg;
 
-#if 0
-    if (chunk_length > BIGGEST_FILE_CHUNK)
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+
+    k = sendmsg(user->socketid, &msg, MSG_ZEROCOPY);
+
+    if (k > 0)
     {
-      chunk_length = users[id]->jpeg_ptr + BIGGEST_FILE_CHUNK;
+      zerocopy_hold(user, frame);
+      return k;
     }
+
+    // Out of optmem for pinned pages, just copy this one.
+    if (k == -1 && errno != ENOBUFS)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      {
+        return 0;
+      }
+
+      return -1;
+    }
+  }
 #endif
 
-    const int socketid = users[id]->socketid;
+  k = writev(user->socketid, iov, count);
+
+  if (k == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+  {
+    return 0;
+  }
+
+  return k;
+#else
+  if (header_left > 0)
+  {
+    return send_data_nowait(
+      user->socketid,
+      user->header + user->header_ptr,
+      header_left);
+  }
+
+  return send_data_nowait(
+    user->socketid,
+    (char *)frame->data + user->frame_ptr,
+    frame->length - user->frame_ptr);
+#endif
+}
+
+// Accounts for k more bytes of the current frame having been sent.
+// Returns 1 if there is still more of the frame to send.
+int send_frame_advance(User *user, int k)
+{
+  Frame *frame = user->frame;
+  Channel *channel = user->channel;
+  ThreadStats *stats = stats_user(user);
+  SourceStats *source = stats_source(user);
+  uint32_t behind;
+  int skipped = 0;
+  int bytes;
+  int64_t now = 0;
+
+  STATS_ADD(stats, bytes_sent, k);
+  user->bytes_sent += k;
+
+  if (k > 0 && user->header_ptr == 0 && user->frame_ptr == 0)
+  {
+    now = get_time_ns();
+    user->send_start = now;
+
+    if (source != NULL)
+    {
+      histogram_add(&source->first_byte, now - frame->ready_time);
+    }
+
+    // HLS playlists and segments are served from memory like files.
+    if (user->video_num == VIDEO_NUM_HLS)
+    {
+      histogram_add(&stats->request_static, now - user->request_time);
+    }
+      else
+    if (user->request_type == REQUEST_SINGLE)
+    {
+      histogram_add(&stats->request_snapshot, now - user->request_time);
+    }
+  }
+
+  if (k < user->header_len - user->header_ptr)
+  {
+    user->header_ptr += k;
+  }
+    else
+  {
+    user->frame_ptr += k - (user->header_len - user->header_ptr);
+    user->header_ptr = user->header_len;
+  }
+
+  if (user->header_ptr < user->header_len || user->frame_ptr < frame->length)
+  {
+    return 1;
+  }
+
+  if (channel != NULL)
+  {
+    behind = __atomic_load_n(&channel->sequence, __ATOMIC_RELAXED) -
+      frame->sequence;
+
+    if (behind > 1 && user->request_type != REQUEST_SINGLE)
+    {
+      skipped = behind - 1;
+    }
+  }
+
+  if (user->request_type == REQUEST_EVENTS)
+  {
+    bytes = user->header_len;
+  }
+    else
+  {
+    bytes = frame->length + user->header_len;
+
+    if (source != NULL)
+    {
+      if (now == 0) { now = get_time_ns(); }
+
+      histogram_add(&source->frame_send, now - user->send_start);
+    }
+  }
+
+  user->frames_sent++;
+  user->frames_skipped += skipped;
+
+  STATS_ADD(stats, frames_sent, 1);
+  STATS_ADD(stats, frames_skipped, skipped);
+  stats_source_add(user, 1, skipped, bytes);
+
+  frame_release(frame);
+  user->frame = NULL;
 
-    while (users[id]->jpeg_ptr < chunk_length)
+  if (user->request_type == REQUEST_SINGLE)
+  {
+    user_leave_channel(user);
+    user->state = STATE_IDLE;
+  }
+    else
+  {
+    user->need_header = NEED_HEADER_YES;
+  }
+
+  return 0;
+}
+
+// Frames are sent without blocking the worker thread. If the viewer's
+// socket fills up the rest of the frame is sent when select() says it's
+// writable again. By then the channel may have published several newer
+// frames, only the latest one is sent next and the ones in between are
+// counted as skipped.
+int send_frame(int id)
+{
+  User *user = users[id];
+  Frame *frame = user->frame;
+  int k;
+
+  if (user->need_header == NEED_HEADER_YES)
+  {
+    user->content_length = frame->length;
+    user->mime_type = MIME_TYPE_JPEG;
+    user->frame_ptr = 0;
+    user->header_ptr = 0;
+
+    // Later parts of a multipart stream use the boundary header that
+    // was built once when the frame was published.
+    if (user->request_type == REQUEST_MULTIPART2)
     {
-//printf("Preparing to send %d bytes\n", chunk_length - users[id]->jpeg_ptr);
-      int length = chunk_length - users[id]->jpeg_ptr;
-      if (length > 4096) { length = 4096; }
-
-      int last_length = send_data(
-        socketid,
-        (char *)(users[id]->jpeg + users[id]->jpeg_ptr),
-        //chunk_length - users[id]->jpeg_ptr);
-        length);
-
-//printf("%d %d %d\n", users[id]->jpeg_ptr, chunk_length, last_length);
-      if (last_length == -1)
+      user->header = frame->header;
+      user->header_len = frame->header_len;
+    }
+      else
+    {
+      build_header_frame(id, frame);
+
+      // Events are only the text built in the header, none of the JPEG.
+      if (user->request_type == REQUEST_EVENTS)
       {
-        user_disconnect(users[id]);
-        return -1;
+        user->frame_ptr = frame->length;
       }
+    }
+
+    user->need_header = NEED_HEADER_NO;
+  }
+
+  k = send_frame_data(user);
+
+  if (k == -1)
+  {
+    user_disconnect(user);
+    return -1;
+  }
+
+  // A short write means the socket buffer is full (or with io_uring
+  // that the send was queued and finishes later).
+  if (send_frame_advance(user, k) != 0)
+  {
+    user->send_blocked = 1;
+
+    if (user->io_uring == 0) { STATS_ADD(stats_user(user), send_stalls, 1); }
+  }
+
+  return 0;
+}
+
+#ifdef ENABLE_CAPTURE
+// Returns the newest frame in a capture source's ring if it's from the
+// last frame time and this viewer hasn't had it yet, otherwise NULL.
+static Frame *capture_ring_frame(User *user, FrameRing *ring, int quality, int max_fps)
+{
+  Frame *frame = frame_ring_latest(ring);
+
+  if (frame == NULL) { return NULL; }
+
+  if (frame->quality == quality &&
+      frame->sequence != (uint32_t)user->last_frame &&
+      get_time_ns() - frame->ready_time < 1000000000 / max_fps)
+  {
+    return frame;
+  }
+
+  frame_release(frame);
 
-      users[id]->jpeg_ptr += last_length;
+  return NULL;
+}
+
+// Gets the next JPEG for a capture viewer. A frame another viewer of
+// the source just captured is sent again instead of reading the device.
+// Anything captured at the viewer's normal quality goes in the source's
+// ring. Leaves the frame in user->frame when there is one, otherwise
+// the JPEG is in user->jpeg.
+static int capture_next_frame(int id, int64_t *ready_time)
+{
+  User *user = users[id];
+  Video *curr_video = video[user->video_num];
+  FrameRing *ring = curr_video->ring;
+  int quality = adaptive_quality(user, user->jpeg_quality);
+  int max_fps = curr_video->capture_info->max_fps;
+  int length = 0;
+
+  // Viewers that were stepped down to a lower quality don't share.
+  if (ring == NULL || quality != user->jpeg_quality)
+  {
+    length = capture_image(curr_video->capture_info, id);
+    *ready_time = get_time_ns();
+
+    return length;
+  }
+
+  if (max_fps <= 0) { max_fps = 30; }
+
+  user->frame = capture_ring_frame(user, ring, quality, max_fps);
+
+  if (user->frame == NULL)
+  {
+    pthread_mutex_lock(&ring->capture_lock);
+
+    // Another viewer may have captured one while this one waited.
+    user->frame = capture_ring_frame(user, ring, quality, max_fps);
+
+    if (user->frame == NULL)
+    {
+      length = capture_image(curr_video->capture_info, id);
+
+      if (length > 0)
+      {
+        user->frame = frame_ring_publish(ring, user->jpeg, length, quality);
+      }
     }
 
-    if (users[id]->jpeg_ptr == users[id]->content_length) { break; }
+    pthread_mutex_unlock(&ring->capture_lock);
   }
 
-  if (users[id]->jpeg_ptr == users[id]->content_length)
+  if (user->frame == NULL)
   {
-    if (users[id]->request_type == REQUEST_SINGLE)
+    *ready_time = get_time_ns();
+
+    return length;
+  }
+
+  user->last_frame = user->frame->sequence;
+  *ready_time = user->frame->ready_time;
+
+  return user->frame->length;
+}
+
+// A JPEG captured for just this viewer (no ring, or a lower quality)
+// is copied into a Frame of its own so it's sent the same way.
+static Frame *capture_own_frame(User *user, int length, int64_t ready_time)
+{
+  Frame *frame = frame_alloc(length);
+
+  if (frame == NULL) { return NULL; }
+
+  memcpy(frame->data, user->jpeg, length);
+  frame->sequence = user->frames_sent + 1;
+  frame->frame_num = frame->sequence;
+  frame->quality = adaptive_quality(user, user->jpeg_quality);
+  frame->ready_time = ready_time;
+  frame_set_header(frame);
+
+  return frame;
+}
+
+// Capture frames go out through send_frame() like channel frames so a
+// slow viewer never holds up the worker thread.
+int send_capture_frame(int id)
+{
+  User *user = users[id];
+  int64_t ready_time;
+  int length;
+
+  if (user->need_header == NEED_HEADER_YES && user->frame == NULL)
+  {
+    if (user->history_time != 0 && user->request_type == REQUEST_SINGLE)
     {
-      users[id]->state = STATE_IDLE;
+      user->frame = frame_ring_find(
+        video[user->video_num]->ring,
+        user->history_time);
+
+      if (user->frame == NULL)
+      {
+        STATS_ADD(stats_user(user), not_found, 1);
+        send_error(id, "404 Not Found", FOUR_OH_FOUR, sizeof(FOUR_OH_FOUR));
+        return 0;
+      }
     }
       else
     {
-      users[id]->need_header = NEED_HEADER_YES;
+      length = capture_next_frame(id, &ready_time);
+
+      // Nothing from the device this time, try again on the next pass.
+      if (length <= 0) { return 0; }
+
+      if (user->frame == NULL)
+      {
+        user->frame = capture_own_frame(user, length, ready_time);
+
+        if (user->frame == NULL)
+        {
+          user_disconnect(user);
+          return -1;
+        }
+      }
+    }
+
+#ifdef DEBUG
+if (debug == 1) { printf("content-length: %d\n", user->frame->length); }
+#endif
+
+    if (user->request_type != REQUEST_EVENTS)
+    {
+      rate_limit_user_take(user, user->frame->length);
     }
   }
 
-  return 0;
+  return send_frame(id);
 }
 #endif
 
@@ -384,12 +755,27 @@ int buffered_read(int id)
 
     if (users[id]->in_ptr >= users[id]->in_len)
     {
+#ifdef ENABLE_IO_URING
+      // The io_uring loop fills in_buffer when a recv completes.
+      if (users[id]->io_uring == 1) { return 0; }
+#endif
+
       users[id]->in_len = recv(users[id]->socketid, (char *)users[id]->in_buffer, BUFFER_SIZE - 2, 0);
       users[id]->in_ptr = 0;
 
       if (users[id]->in_len == 0) { return -1; }
       if (users[id]->in_len < 0)
       {
+#ifndef WINDOWS
+        // Woken up for something other than data (a MSG_ZEROCOPY
+        // completion or a partial line), try again later.
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+          users[id]->in_len = 0;
+          return 0;
+        }
+#endif
+
 #ifdef DEBUG
         if (debug == 1)
         {
@@ -12,12 +12,22 @@
 #ifndef NETWORK_IO
 #define NETWORK_IO
 
+#include "user.h"
+
 int send_data(int socketid, const char *message, int message_len);
+int send_data_nowait(int socketid, const char *message, int message_len);
 int buffered_read(int id);
 int send_file(int id);
+int send_frame(int id);
+int send_frame_advance(User *user, int k);
 int send_capture_frame(int id);
 int set_socket_options(int sockfd);
 int set_nonblocking(int socketid);
 
+#ifdef ZEROCOPY
+void zerocopy_reap(User *user);
+void zerocopy_release(User *user);
+#endif
+
 #endif
 
@@ -0,0 +1,273 @@
+/*
+
+  mjpeg_webserver - Web server optimized for JPEGs from a webcam or AVI file.
+
+  Copyright 2004-2024 - Michael Kohn (mike@mikekohn.net)
+  https://www.mikekohn.net/
+
+  This program falls under the GPLv3 license.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "general.h"
+#include "rate_limit.h"
+#include "user.h"
+#include "video.h"
+
+// Client buckets are found by address in a small chained hash table.
+#define CLIENT_CHAINS 256
+
+static RateLimit *clients[CLIENT_CHAINS];
+static pthread_mutex_t client_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int client_chain(uint32_t address)
+{
+  return (address ^ (address >> 8) ^ (address >> 16)) % CLIENT_CHAINS;
+}
+
+// A quarter of a second of tokens (and at least one frame) can be used
+// at once.
+static void bucket_init(TokenBucket *bucket, int rate, int min_burst)
+{
+  bucket->rate = rate;
+  bucket->burst = (double)rate / 4;
+
+  if (bucket->burst < min_burst) { bucket->burst = min_burst; }
+
+  bucket->tokens = bucket->burst;
+  bucket->last_time = get_time_ns();
+}
+
+static void bucket_refill(TokenBucket *bucket, int64_t now)
+{
+  if (bucket->rate <= 0) { return; }
+
+  bucket->tokens += bucket->rate * (now - bucket->last_time) / 1000000000;
+
+  if (bucket->tokens > bucket->burst) { bucket->tokens = bucket->burst; }
+
+  bucket->last_time = now;
+}
+
+RateLimit *rate_limit_create(int limit_bytes, int limit_frames)
+{
+  RateLimit *limit;
+
+  if (limit_bytes <= 0 && limit_frames <= 0) { return NULL; }
+
+  limit = (RateLimit *)calloc(1, sizeof(RateLimit));
+
+  if (limit == NULL) { return NULL; }
+
+  pthread_mutex_init(&limit->lock, NULL);
+  bucket_init(&limit->bytes, limit_bytes, 1);
+  bucket_init(&limit->frames, limit_frames, 1);
+
+  return limit;
+}
+
+void rate_limit_destroy(RateLimit *limit)
+{
+  if (limit == NULL) { return; }
+
+  pthread_mutex_destroy(&limit->lock);
+  free(limit);
+}
+
+// Returns 0 if there are tokens for another frame.
+int rate_limit_check(RateLimit *limit)
+{
+  int64_t now = get_time_ns();
+  int ok;
+
+  pthread_mutex_lock(&limit->lock);
+
+  bucket_refill(&limit->bytes, now);
+  bucket_refill(&limit->frames, now);
+
+  ok = (limit->bytes.rate <= 0 || limit->bytes.tokens > 0) &&
+       (limit->frames.rate <= 0 || limit->frames.tokens >= 1);
+
+  pthread_mutex_unlock(&limit->lock);
+
+  return ok ? 0 : -1;
+}
+
+void rate_limit_take(RateLimit *limit, int bytes)
+{
+  pthread_mutex_lock(&limit->lock);
+
+  if (limit->bytes.rate > 0) { limit->bytes.tokens -= bytes; }
+  if (limit->frames.rate > 0) { limit->frames.tokens -= 1; }
+
+  pthread_mutex_unlock(&limit->lock);
+}
+
+// network is an IPv4 address optionally followed by /bits. Rules are
+// checked in the order they're added and the first match is used.
+int rate_limit_add_client(
+  ClientLimit **client_limits,
+  const char *network,
+  int limit_bytes,
+  int limit_frames)
+{
+  ClientLimit *client_limit;
+  ClientLimit *last;
+  unsigned int a, b, c, d;
+  int bits = 32;
+
+  if (sscanf(network, "%u.%u.%u.%u/%d", &a, &b, &c, &d, &bits) < 4 ||
+      a > 255 || b > 255 || c > 255 || d > 255 || bits < 0 || bits > 32)
+  {
+    printf("Bad address '%s' in client_limit\n", network);
+    return -1;
+  }
+
+  client_limit = (ClientLimit *)calloc(1, sizeof(ClientLimit));
+
+  if (client_limit == NULL) { return -1; }
+
+  client_limit->mask = bits == 0 ? 0 : 0xffffffff << (32 - bits);
+  client_limit->network = ((a << 24) | (b << 16) | (c << 8) | d) & client_limit->mask;
+  client_limit->limit_bytes = limit_bytes;
+  client_limit->limit_frames = limit_frames;
+
+  if (*client_limits == NULL)
+  {
+    *client_limits = client_limit;
+  }
+    else
+  {
+    for (last = *client_limits; last->next != NULL; last = last->next) { }
+    last->next = client_limit;
+  }
+
+  return 0;
+}
+
+// Finds (or makes) the buckets for a client address in host byte order.
+// Returns NULL if no client_limit covers the address. Buckets already
+// made for an address keep their rates until its last connection goes.
+RateLimit *rate_limit_client_get(ClientLimit *client_limits, uint32_t address)
+{
+  ClientLimit *client_limit;
+  RateLimit *limit;
+  int chain = client_chain(address);
+
+  for (client_limit = client_limits; client_limit != NULL; client_limit = client_limit->next)
+  {
+    if ((address & client_limit->mask) == client_limit->network) { break; }
+  }
+
+  if (client_limit == NULL) { return NULL; }
+
+  pthread_mutex_lock(&client_lock);
+
+  for (limit = clients[chain]; limit != NULL; limit = limit->next)
+  {
+    if (limit->address == address) { break; }
+  }
+
+  if (limit == NULL)
+  {
+    limit = rate_limit_create(client_limit->limit_bytes, client_limit->limit_frames);
+
+    if (limit != NULL)
+    {
+      limit->address = address;
+      limit->next = clients[chain];
+      clients[chain] = limit;
+    }
+  }
+
+  if (limit != NULL) { limit->ref_count++; }
+
+  pthread_mutex_unlock(&client_lock);
+
+  return limit;
+}
+
+// Drops a connection's reference and frees the buckets with the last one.
+void rate_limit_client_put(RateLimit *limit)
+{
+  RateLimit **prev;
+  int chain;
+
+  if (limit == NULL) { return; }
+
+  chain = client_chain(limit->address);
+
+  pthread_mutex_lock(&client_lock);
+
+  limit->ref_count--;
+
+  if (limit->ref_count == 0)
+  {
+    for (prev = &clients[chain]; *prev != NULL; prev = &(*prev)->next)
+    {
+      if (*prev == limit)
+      {
+        *prev = limit->next;
+        break;
+      }
+    }
+
+    rate_limit_destroy(limit);
+  }
+
+  pthread_mutex_unlock(&client_lock);
+}
+
+// Returns 0 if the user's source and client buckets both have room for
+// another frame.
+int rate_limit_user_check(User *user)
+{
+  RateLimit *source = NULL;
+
+  if (user->video_num >= 0 && user->video_num < video_count)
+  {
+    source = video[user->video_num]->rate_limit;
+  }
+
+  if (source != NULL && rate_limit_check(source) != 0) { return -1; }
+
+  if (user->client_limit != NULL && rate_limit_check(user->client_limit) != 0)
+  {
+    return -1;
+  }
+
+  return 0;
+}
+
+void rate_limit_user_take(User *user, int bytes)
+{
+  if (user->video_num >= 0 && user->video_num < video_count &&
+      video[user->video_num]->rate_limit != NULL)
+  {
+    rate_limit_take(video[user->video_num]->rate_limit, bytes);
+  }
+
+  if (user->client_limit != NULL)
+  {
+    rate_limit_take(user->client_limit, bytes);
+  }
+}
+
+void rate_limit_free_clients(ClientLimit *client_limits)
+{
+  ClientLimit *next;
+
+  while (client_limits != NULL)
+  {
+    next = client_limits->next;
+    free(client_limits);
+    client_limits = next;
+  }
+}
+
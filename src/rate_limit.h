@@ -0,0 +1,72 @@
+/*
+
+  mjpeg_webserver - Web server optimized for JPEGs from a webcam or AVI file.
+
+  Copyright 2004-2024 - Michael Kohn (mike@mikekohn.net)
+  https://www.mikekohn.net/
+
+  This program falls under the GPLv3 license.
+
+*/
+
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+struct User;
+
+// Tokens are bytes or frames. They come back at rate per second up to
+// burst, and a frame is let through while there are any tokens left so
+// a frame bigger than the bucket still goes out (the bucket just goes
+// negative and has to refill first).
+typedef struct TokenBucket
+{
+  double rate;
+  double burst;
+  double tokens;
+  int64_t last_time;
+} TokenBucket;
+
+// A byte and a frame bucket shared by every viewer of a source, or by
+// every connection from one client address.
+typedef struct RateLimit
+{
+  pthread_mutex_t lock;
+  TokenBucket bytes;
+  TokenBucket frames;
+  // Client limits are kept in a list by address.
+  struct RateLimit *next;
+  uint32_t address;
+  int ref_count;
+} RateLimit;
+
+// From a client_limit block in the conf file: connections from
+// address/mask each get their own buckets with these rates.
+typedef struct ClientLimit
+{
+  struct ClientLimit *next;
+  uint32_t network;
+  uint32_t mask;
+  int limit_bytes;
+  int limit_frames;
+} ClientLimit;
+
+RateLimit *rate_limit_create(int limit_bytes, int limit_frames);
+void rate_limit_destroy(RateLimit *limit);
+int rate_limit_check(RateLimit *limit);
+void rate_limit_take(RateLimit *limit, int bytes);
+int rate_limit_add_client(
+  ClientLimit **client_limits,
+  const char *network,
+  int limit_bytes,
+  int limit_frames);
+RateLimit *rate_limit_client_get(ClientLimit *client_limits, uint32_t address);
+void rate_limit_client_put(RateLimit *limit);
+int rate_limit_user_check(struct User *user);
+void rate_limit_user_take(struct User *user, int bytes);
+void rate_limit_free_clients(ClientLimit *client_limits);
+
+#endif
+
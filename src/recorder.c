@@ -0,0 +1,698 @@
+/*
+
+  mjpeg_webserver - Web server optimized for JPEGs from a webcam or AVI file.
+
+  Copyright 2004-2024 - Michael Kohn (mike@mikekohn.net)
+  https://www.mikekohn.net/
+
+  This program falls under the GPLv3 license.
+
+*/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "capture.h"
+#include "channel.h"
+#include "frame_ring.h"
+#include "general.h"
+#include "recorder.h"
+#include "video.h"
+
+#define AVIF_HASINDEX 0x10
+#define AVIIF_KEYFRAME 0x10
+
+// Room in the super index for an ix00 chunk every RECORDER_INDEX_TIME
+// seconds (just over an hour), a file is finished early if it fills up.
+#define RECORDER_SUPER_ENTRIES 4096
+#define RECORDER_INDEX_TIME 1
+#define RECORDER_BUFFER_SIZE (1024 * 1024)
+#define RECORDER_RETRY_TIME 10
+
+static void put_int16(uint8_t *buffer, int n)
+{
+  buffer[0] = n & 0xff;
+  buffer[1] = (n >> 8) & 0xff;
+}
+
+static void put_int32(uint8_t *buffer, uint32_t n)
+{
+  buffer[0] = n & 0xff;
+  buffer[1] = (n >> 8) & 0xff;
+  buffer[2] = (n >> 16) & 0xff;
+  buffer[3] = (n >> 24) & 0xff;
+}
+
+// Makes room for length more bytes at the end of the buffer and
+// returns where they go.
+static uint8_t *recorder_reserve(Recorder *recorder, int length)
+{
+  uint8_t *buffer;
+  int alloc = recorder->buffer_alloc;
+
+  while (recorder->buffer_len + length > alloc)
+  {
+    alloc = alloc == 0 ? RECORDER_BUFFER_SIZE : alloc * 2;
+  }
+
+  if (alloc != recorder->buffer_alloc)
+  {
+    buffer = (uint8_t *)realloc(recorder->buffer, alloc);
+
+    if (buffer == NULL) { return NULL; }
+
+    recorder->buffer = buffer;
+    recorder->buffer_alloc = alloc;
+  }
+
+  buffer = recorder->buffer + recorder->buffer_len;
+  recorder->buffer_len += length;
+
+  return buffer;
+}
+
+// Where the next byte appended to the buffer will be in the file.
+static int64_t recorder_tell(Recorder *recorder)
+{
+  return recorder->file_len + recorder->buffer_len;
+}
+
+static void append_int16(Recorder *recorder, int n)
+{
+  uint8_t *buffer = recorder_reserve(recorder, 2);
+
+  if (buffer != NULL) { put_int16(buffer, n); }
+}
+
+static void append_int32(Recorder *recorder, uint32_t n)
+{
+  uint8_t *buffer = recorder_reserve(recorder, 4);
+
+  if (buffer != NULL) { put_int32(buffer, n); }
+}
+
+static void append_data(Recorder *recorder, const void *data, int length)
+{
+  uint8_t *buffer = recorder_reserve(recorder, length);
+
+  if (buffer == NULL) { return; }
+
+  if (data == NULL)
+  {
+    memset(buffer, 0, length);
+  }
+    else
+  {
+    memcpy(buffer, data, length);
+  }
+}
+
+// Chunk header with the size filled in by end_chunk(). Returns where
+// the header is.
+static int64_t begin_chunk(Recorder *recorder, const char *fourcc)
+{
+  int64_t ptr = recorder_tell(recorder);
+
+  append_data(recorder, fourcc, 4);
+  append_int32(recorder, 0);
+
+  return ptr;
+}
+
+static int64_t begin_list(Recorder *recorder, const char *list, const char *type)
+{
+  int64_t ptr = begin_chunk(recorder, list);
+
+  append_data(recorder, type, 4);
+
+  return ptr;
+}
+
+// Only for chunks that are still in the buffer.
+static void end_chunk(Recorder *recorder, int64_t ptr)
+{
+  int64_t length = recorder_tell(recorder) - ptr - 8;
+
+  put_int32(recorder->buffer + (ptr - recorder->file_len) + 4, length);
+
+  if ((length & 1) != 0) { append_data(recorder, NULL, 1); }
+}
+
+static int patch_int32(Recorder *recorder, int64_t offset, uint32_t n)
+{
+  uint8_t buffer[4];
+
+  put_int32(buffer, n);
+
+  if (pwrite(recorder->fd, buffer, 4, offset) != 4) { return -1; }
+
+  return 0;
+}
+
+static int recorder_flush(Recorder *recorder)
+{
+  int offset = 0;
+  int n;
+
+  while (offset < recorder->buffer_len)
+  {
+    n = write(recorder->fd, recorder->buffer + offset, recorder->buffer_len - offset);
+
+    if (n <= 0) { return -1; }
+
+    offset += n;
+  }
+
+  recorder->file_len += recorder->buffer_len;
+  recorder->buffer_len = 0;
+
+  return 0;
+}
+
+static void write_headers(Recorder *recorder)
+{
+  CaptureInfo *capture_info = recorder->video->capture_info;
+  int64_t hdrl, strl, chunk, odml;
+
+  begin_list(recorder, "RIFF", "AVI ");
+
+  hdrl = begin_list(recorder, "LIST", "hdrl");
+
+  chunk = begin_chunk(recorder, "avih");
+  append_int32(recorder, 1000000 / recorder->rate);
+  append_int32(recorder, 0);
+  append_int32(recorder, 0);
+  append_int32(recorder, AVIF_HASINDEX);
+  recorder->avih_ptr = recorder_tell(recorder);
+  append_int32(recorder, 0);
+  append_int32(recorder, 0);
+  append_int32(recorder, 1);
+  append_int32(recorder, 0);
+  append_int32(recorder, capture_info->width);
+  append_int32(recorder, capture_info->height);
+  append_data(recorder, NULL, 16);
+  end_chunk(recorder, chunk);
+
+  strl = begin_list(recorder, "LIST", "strl");
+
+  chunk = begin_chunk(recorder, "strh");
+  append_data(recorder, "vids", 4);
+  append_data(recorder, "MJPG", 4);
+  append_int32(recorder, 0);
+  append_int32(recorder, 0);
+  append_int32(recorder, 0);
+  append_int32(recorder, 1);
+  append_int32(recorder, recorder->rate);
+  append_int32(recorder, 0);
+  recorder->strh_ptr = recorder_tell(recorder);
+  append_int32(recorder, 0);
+  append_int32(recorder, 0);
+  append_int32(recorder, 0xffffffff);
+  append_int32(recorder, 0);
+  append_int16(recorder, 0);
+  append_int16(recorder, 0);
+  append_int16(recorder, capture_info->width);
+  append_int16(recorder, capture_info->height);
+  end_chunk(recorder, chunk);
+
+  chunk = begin_chunk(recorder, "strf");
+  append_int32(recorder, 40);
+  append_int32(recorder, capture_info->width);
+  append_int32(recorder, capture_info->height);
+  append_int16(recorder, 1);
+  append_int16(recorder, 24);
+  append_data(recorder, "MJPG", 4);
+  append_int32(recorder, capture_info->width * capture_info->height * 3);
+  append_data(recorder, NULL, 16);
+  end_chunk(recorder, chunk);
+
+  // The super index gets an entry for each ix00 written into movi.
+  recorder->indx_ptr = begin_chunk(recorder, "indx");
+  append_int16(recorder, 4);
+  append_data(recorder, NULL, 2);
+  append_int32(recorder, 0);
+  append_data(recorder, "00dc", 4);
+  append_data(recorder, NULL, 12 + RECORDER_SUPER_ENTRIES * 16);
+  end_chunk(recorder, recorder->indx_ptr);
+
+  end_chunk(recorder, strl);
+
+  odml = begin_list(recorder, "LIST", "odml");
+  recorder->dmlh_ptr = begin_chunk(recorder, "dmlh");
+  append_data(recorder, NULL, 248);
+  end_chunk(recorder, recorder->dmlh_ptr);
+  end_chunk(recorder, odml);
+
+  end_chunk(recorder, hdrl);
+
+  recorder->movi_ptr = begin_list(recorder, "LIST", "movi");
+
+  // Sizes for a file with no frames yet, write_index() moves them up.
+  put_int32(recorder->buffer + 4, recorder_tell(recorder) - 8);
+  put_int32(recorder->buffer + recorder->movi_ptr + 4, 4);
+}
+
+// Writes an ix00 chunk for the frames since the last one and brings
+// the super index, frame counts and RIFF sizes up to date, so a file
+// that's cut off is readable up to here.
+static int write_index(Recorder *recorder)
+{
+  int64_t ix, entry;
+  int count = recorder->index_len - recorder->index_written;
+  int t;
+
+  recorder->index_time = get_time_ns();
+
+  if (count == 0) { return recorder_flush(recorder); }
+
+  ix = begin_chunk(recorder, "ix00");
+  append_int16(recorder, 2);
+  append_data(recorder, "\x00\x01", 2);
+  append_int32(recorder, count);
+  append_data(recorder, "00dc", 4);
+  append_int32(recorder, recorder->movi_ptr & 0xffffffff);
+  append_int32(recorder, recorder->movi_ptr >> 32);
+  append_int32(recorder, 0);
+
+  for (t = recorder->index_written; t < recorder->index_len; t++)
+  {
+    append_int32(recorder, recorder->index[t].offset - recorder->movi_ptr);
+    append_int32(recorder, recorder->index[t].length);
+  }
+
+  end_chunk(recorder, ix);
+
+  if (recorder_flush(recorder) != 0) { return -1; }
+
+  entry = recorder->indx_ptr + 8 + 24 + (recorder->super_len * 16);
+
+  if (patch_int32(recorder, entry, ix & 0xffffffff) != 0 ||
+      patch_int32(recorder, entry + 4, ix >> 32) != 0 ||
+      patch_int32(recorder, entry + 8, 8 + 24 + count * 8) != 0 ||
+      patch_int32(recorder, entry + 12, count) != 0)
+  {
+    return -1;
+  }
+
+  recorder->super_len++;
+  recorder->index_written = recorder->index_len;
+
+  if (patch_int32(recorder, recorder->indx_ptr + 12, recorder->super_len) != 0 ||
+      patch_int32(recorder, recorder->avih_ptr, recorder->index_len) != 0 ||
+      patch_int32(recorder, recorder->strh_ptr, recorder->index_len) != 0 ||
+      patch_int32(recorder, recorder->dmlh_ptr + 8, recorder->index_len) != 0 ||
+      patch_int32(recorder, recorder->movi_ptr + 4,
+        recorder->file_len - recorder->movi_ptr - 8) != 0 ||
+      patch_int32(recorder, 4, recorder->file_len - 8) != 0)
+  {
+    return -1;
+  }
+
+  return 0;
+}
+
+static void recorder_close(Recorder *recorder)
+{
+  int64_t chunk, movi;
+  int t;
+
+  if (recorder->fd == -1) { return; }
+
+  if (write_index(recorder) == 0)
+  {
+    // Legacy index of every frame relative to the movi fourcc.
+    movi = recorder->movi_ptr + 8;
+    chunk = begin_chunk(recorder, "idx1");
+
+    for (t = 0; t < recorder->index_len; t++)
+    {
+      append_data(recorder, "00dc", 4);
+      append_int32(recorder, AVIIF_KEYFRAME);
+      append_int32(recorder, recorder->index[t].offset - 8 - movi);
+      append_int32(recorder, recorder->index[t].length);
+    }
+
+    end_chunk(recorder, chunk);
+
+    if (recorder_flush(recorder) == 0)
+    {
+      patch_int32(recorder, 4, recorder->file_len - 8);
+    }
+  }
+
+  // Gives back what fallocate() reserved past the end.
+  if (ftruncate(recorder->fd, recorder->file_len) != 0) { }
+
+  close(recorder->fd);
+
+  recorder->fd = -1;
+  recorder->buffer_len = 0;
+  recorder->index_len = 0;
+  recorder->index_written = 0;
+  recorder->super_len = 0;
+}
+
+static int recorder_open(Recorder *recorder, Frame *frame)
+{
+  char filename[1024];
+  char date[32];
+  struct tm tm;
+  time_t now;
+  int64_t size;
+
+  // Named for when the first frame was ready, in UTC.
+  now = (get_wall_time_us() - (get_time_ns() - frame->ready_time) / 1000) / 1000000;
+  gmtime_r(&now, &tm);
+  strftime(date, sizeof(date), "%Y%m%d-%H%M%S", &tm);
+
+  snprintf(filename, sizeof(filename), "%s/%s-%s.avi",
+    recorder->directory, recorder->source, date);
+
+  recorder->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+  if (recorder->fd == -1)
+  {
+    printf("Couldn't open %s for recording\n", filename);
+    recorder->retry_time = frame->ready_time + (int64_t)RECORDER_RETRY_TIME * 1000000000;
+    return -1;
+  }
+
+  // Reserves the blocks the file will need up front so they aren't
+  // allocated a write at a time. The size stays where it is.
+  size = (recorder->max_time / 1000000000) * recorder->rate * ((int64_t)frame->length + 8);
+  size += size / 4;
+
+  if (size > recorder->max_size) { size = recorder->max_size; }
+
+#ifdef FALLOC_FL_KEEP_SIZE
+  if (fallocate(recorder->fd, FALLOC_FL_KEEP_SIZE, 0, size) != 0) { }
+#endif
+
+  recorder->file_len = 0;
+  recorder->buffer_len = 0;
+  recorder->start_time = frame->ready_time;
+
+  write_headers(recorder);
+
+  if (recorder_flush(recorder) != 0)
+  {
+    printf("Couldn't write %s\n", filename);
+    close(recorder->fd);
+    recorder->fd = -1;
+    recorder->retry_time = frame->ready_time + (int64_t)RECORDER_RETRY_TIME * 1000000000;
+    return -1;
+  }
+
+  recorder->index_time = get_time_ns();
+
+  return 0;
+}
+
+static int add_index(Recorder *recorder, int64_t offset, uint32_t length)
+{
+  FrameIndex *index;
+
+  if (recorder->index_len == recorder->index_alloc)
+  {
+    int alloc = recorder->index_alloc == 0 ? 4096 : recorder->index_alloc * 2;
+
+    index = (FrameIndex *)realloc(recorder->index, sizeof(FrameIndex) * alloc);
+
+    if (index == NULL) { return -1; }
+
+    recorder->index = index;
+    recorder->index_alloc = alloc;
+  }
+
+  recorder->index[recorder->index_len].offset = offset;
+  recorder->index[recorder->index_len].length = length;
+  recorder->index_len++;
+
+  return 0;
+}
+
+static void recorder_add_frame(Recorder *recorder, Frame *frame)
+{
+  int64_t slot, offset;
+  // What's written after the frame: an ix00 and idx1 entry for it.
+  int64_t trailer = (int64_t)(recorder->index_len + 1) * 24 + 64;
+
+  if (recorder->fd != -1)
+  {
+    if (frame->ready_time - recorder->start_time >= recorder->max_time ||
+        recorder_tell(recorder) + frame->length + 8 + trailer > recorder->max_size ||
+        recorder->super_len >= RECORDER_SUPER_ENTRIES - 1)
+    {
+      recorder_close(recorder);
+    }
+  }
+
+  if (recorder->fd == -1)
+  {
+    if (frame->ready_time < recorder->retry_time) { return; }
+    if (recorder_open(recorder, frame) != 0) { return; }
+  }
+
+  // Frame times nothing new was captured for repeat the last frame.
+  slot = (frame->ready_time - recorder->start_time) * recorder->rate / 1000000000;
+
+  while (recorder->index_len != 0 && recorder->index_len < slot)
+  {
+    FrameIndex *last = &recorder->index[recorder->index_len - 1];
+
+    if (add_index(recorder, last->offset, last->length) != 0) { return; }
+  }
+
+  append_data(recorder, "00dc", 4);
+  append_int32(recorder, frame->length);
+  offset = recorder_tell(recorder);
+  append_data(recorder, frame->data, frame->length);
+
+  if ((frame->length & 1) != 0) { append_data(recorder, NULL, 1); }
+
+  add_index(recorder, offset, frame->length);
+}
+
+// A frame another user of the source captured this frame time.
+static Frame *recorder_ring_frame(Recorder *recorder, FrameRing *ring)
+{
+  Frame *frame = frame_ring_latest(ring);
+
+  if (frame == NULL) { return NULL; }
+
+  if (frame->quality == recorder->quality &&
+      frame->sequence != recorder->sequence &&
+      get_time_ns() - frame->ready_time < 1000000000 / recorder->rate)
+  {
+    return frame;
+  }
+
+  frame_release(frame);
+
+  return NULL;
+}
+
+static Frame *recorder_next_frame(Recorder *recorder)
+{
+  FrameRing *ring = recorder->video->ring;
+  Frame *frame = recorder_ring_frame(recorder, ring);
+
+  if (frame == NULL && recorder->jpeg != NULL)
+  {
+    int length;
+
+    pthread_mutex_lock(&ring->capture_lock);
+
+    frame = recorder_ring_frame(recorder, ring);
+
+    if (frame == NULL)
+    {
+      length = capture_jpeg(
+        recorder->video->capture_info,
+        recorder->jpeg,
+        recorder->jpeg_len,
+        recorder->quality);
+
+      if (length > 0)
+      {
+        frame = frame_ring_publish(ring, recorder->jpeg, length, recorder->quality);
+      }
+    }
+
+    pthread_mutex_unlock(&ring->capture_lock);
+  }
+
+  return frame;
+}
+
+static void recorder_sleep(int64_t wake_time)
+{
+  int64_t wait = wake_time - get_time_ns();
+
+  if (wait <= 0) { return; }
+  if (wait > 100000000) { wait = 100000000; }
+
+  usleep(wait / 1000);
+}
+
+static void *recorder_thread(void *context)
+{
+  Recorder *recorder = (Recorder *)context;
+  int64_t interval = 1000000000 / recorder->rate;
+  int64_t next_time = get_time_ns();
+  int64_t now;
+  Frame *frame;
+
+  while (__atomic_load_n(&recorder->stop, __ATOMIC_ACQUIRE) == 0)
+  {
+    now = get_time_ns();
+
+    if (now < next_time)
+    {
+      recorder_sleep(next_time);
+      continue;
+    }
+
+    next_time += interval;
+
+    if (next_time < now) { next_time = now; }
+
+    frame = recorder_next_frame(recorder);
+
+    if (frame != NULL)
+    {
+      recorder->sequence = frame->sequence;
+      recorder_add_frame(recorder, frame);
+      frame_release(frame);
+    }
+
+    if (recorder->fd == -1) { continue; }
+
+    now = get_time_ns();
+
+    if (now - recorder->index_time >= (int64_t)RECORDER_INDEX_TIME * 1000000000)
+    {
+      if (write_index(recorder) != 0)
+      {
+        printf("Recording %s failed.\n", recorder->source);
+        recorder_close(recorder);
+        recorder->retry_time = now + (int64_t)RECORDER_RETRY_TIME * 1000000000;
+      }
+    }
+      else
+    if (recorder->buffer_len >= RECORDER_BUFFER_SIZE)
+    {
+      if (recorder_flush(recorder) != 0)
+      {
+        printf("Recording %s failed.\n", recorder->source);
+        recorder_close(recorder);
+        recorder->retry_time = now + (int64_t)RECORDER_RETRY_TIME * 1000000000;
+      }
+    }
+  }
+
+  recorder_close(recorder);
+
+  return NULL;
+}
+
+Recorder *recorder_create(Video *video, const char *directory, int seconds, int megabytes)
+{
+  Recorder *recorder = (Recorder *)calloc(1, sizeof(Recorder));
+
+  if (recorder == NULL) { return NULL; }
+
+  recorder->directory = (char *)malloc(strlen(directory) + 1);
+
+  if (recorder->directory == NULL)
+  {
+    free(recorder);
+    return NULL;
+  }
+
+  strcpy(recorder->directory, directory);
+
+  if (seconds <= 0) { seconds = RECORDER_DEFAULT_SECONDS; }
+
+  recorder->video = video;
+  recorder->max_time = (int64_t)seconds * 1000000000;
+  recorder->max_size = (int64_t)megabytes * 1024 * 1024;
+  recorder->fd = -1;
+
+  if (megabytes <= 0 || recorder->max_size > RECORDER_MAX_SIZE)
+  {
+    recorder->max_size = RECORDER_MAX_SIZE;
+  }
+
+  return recorder;
+}
+
+// Started once the server has forked and changed user so the thread
+// survives and the files belong to the runas user.
+int recorder_start(Recorder *recorder, Config *config, int video_num)
+{
+  Video *source = recorder->video;
+
+  if (source->name != NULL)
+  {
+    snprintf(recorder->source, sizeof(recorder->source), "%s", source->name);
+  }
+    else
+  {
+    snprintf(recorder->source, sizeof(recorder->source), "%d", video_num);
+  }
+
+  recorder->quality = config->jpeg_quality;
+  recorder->rate = source->capture_info->max_fps;
+
+  if (recorder->rate <= 0) { recorder->rate = config->frame_rate; }
+  if (recorder->rate <= 0) { recorder->rate = 30; }
+
+  recorder->jpeg_len = 128000;
+
+  if (recorder->jpeg_len < source->capture_info->width * source->capture_info->height)
+  {
+    recorder->jpeg_len = source->capture_info->width * source->capture_info->height;
+  }
+
+  recorder->jpeg = (uint8_t *)malloc(recorder->jpeg_len);
+
+  if (pthread_create(&recorder->thread, NULL, recorder_thread, recorder) != 0)
+  {
+    printf("Couldn't start recording %s\n", recorder->source);
+    return -1;
+  }
+
+  recorder->running = 1;
+
+  return 0;
+}
+
+// Finishes the file being written so it has both indexes.
+void recorder_destroy(Recorder *recorder)
+{
+  if (recorder == NULL) { return; }
+
+  if (recorder->running == 1)
+  {
+    __atomic_store_n(&recorder->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(recorder->thread, NULL);
+  }
+
+  free(recorder->directory);
+  free(recorder->jpeg);
+  free(recorder->index);
+  free(recorder->buffer);
+  free(recorder);
+}
+
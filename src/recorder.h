@@ -0,0 +1,76 @@
+/*
+
+  mjpeg_webserver - Web server optimized for JPEGs from a webcam or AVI file.
+
+  Copyright 2004-2024 - Michael Kohn (mike@mikekohn.net)
+  https://www.mikekohn.net/
+
+  This program falls under the GPLv3 license.
+
+*/
+
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "video.h"
+
+// Files are kept to one RIFF chunk (no AVIX segments) so idx1 covers
+// every frame and old players can read them.
+#define RECORDER_MAX_SIZE (1024 * 1024 * 1024)
+#define RECORDER_DEFAULT_SECONDS 600
+
+// Writes everything a capture source publishes to AVI files in a
+// directory, starting a new file every max_time or max_size. A thread
+// per source takes the frame viewers just captured when there is one
+// so recording doesn't read the device again.
+typedef struct Recorder
+{
+  pthread_t thread;
+  int running;
+  int stop;
+  Video *video;
+  char *directory;
+  char source[64];
+  int64_t max_time;
+  int64_t max_size;
+  int quality;
+  int rate;
+  // Last frame written so the same frame isn't picked up twice.
+  uint32_t sequence;
+  uint8_t *jpeg;
+  int jpeg_len;
+  // The file being written, fd is -1 between files. file_len is what's
+  // been written, buffer holds what comes after it.
+  int fd;
+  int64_t file_len;
+  int64_t start_time;
+  int64_t index_time;
+  int64_t retry_time;
+  int64_t avih_ptr;
+  int64_t strh_ptr;
+  int64_t indx_ptr;
+  int64_t dmlh_ptr;
+  int64_t movi_ptr;
+  // One entry per frame time. A frame time nothing was captured for
+  // points at the frame before it so playback keeps real time.
+  FrameIndex *index;
+  int index_len;
+  int index_alloc;
+  // Entries already covered by an ix00 chunk and super index entries.
+  int index_written;
+  int super_len;
+  uint8_t *buffer;
+  int buffer_len;
+  int buffer_alloc;
+} Recorder;
+
+Recorder *recorder_create(Video *video, const char *directory, int seconds, int megabytes);
+int recorder_start(Recorder *recorder, Config *config, int video_num);
+void recorder_destroy(Recorder *recorder);
+
+#endif
+
@@ -0,0 +1,307 @@
+/*
+
+  mjpeg_webserver - Web server optimized for JPEGs from a webcam or AVI file.
+
+  Copyright 2004-2024 - Michael Kohn (mike@mikekohn.net)
+  https://www.mikekohn.net/
+
+  This program falls under the GPLv3 license.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#if !defined(WINDOWS) && !defined(ENABLE_ESP32)
+#include <fcntl.h>
+#include <pthread.h>
+#endif
+
+#include "config.h"
+#include "reload.h"
+#include "upgrade.h"
+#include "video.h"
+
+typedef struct Retired
+{
+  struct Retired *next;
+  void *ptr;
+} Retired;
+
+// The Config requests are handled with. A new one is swapped in by the
+// reload thread and the old one is freed once nothing can be using it:
+// a slot's epoch is odd while it holds a Config and goes up every time
+// it lets go of one, so once every odd epoch seen at the swap has moved
+// on (a grace period) the old Config is unused. The first Config isn't
+// freed since it belongs to main().
+static Config *current = NULL;
+static Config *first = NULL;
+static uint32_t epochs[RELOAD_SLOTS];
+
+// Tables replaced while workers may still be reading them. Only the
+// reload thread (or main() before the workers start) adds to this.
+static Retired *retired = NULL;
+
+// While a source is being taken out workers count the viewers still on
+// one each time they go through their connections.
+static int draining = 0;
+static int drain_counts[RELOAD_SLOTS];
+
+#if !defined(WINDOWS) && !defined(ENABLE_ESP32)
+static int reload_pipe[2] = { -1, -1 };
+#endif
+
+Config *reload_enter(int slot)
+{
+  __atomic_add_fetch(&epochs[slot], 1, __ATOMIC_SEQ_CST);
+
+  return __atomic_load_n(&current, __ATOMIC_SEQ_CST);
+}
+
+void reload_exit(int slot)
+{
+  __atomic_add_fetch(&epochs[slot], 1, __ATOMIC_RELEASE);
+}
+
+// Same as reload_exit() then reload_enter() for workers, which always
+// hold a Config and let go of it between passes through their
+// connections.
+Config *reload_quiescent(int slot)
+{
+  __atomic_add_fetch(&epochs[slot], 2, __ATOMIC_SEQ_CST);
+
+  return __atomic_load_n(&current, __ATOMIC_SEQ_CST);
+}
+
+// Waits until everything that held a Config when this was called has
+// let go of it. Workers wake at least once a second so this is quick.
+void reload_synchronize()
+{
+  uint32_t seen[RELOAD_SLOTS];
+  int n;
+
+  for (n = 0; n < RELOAD_SLOTS; n++)
+  {
+    seen[n] = __atomic_load_n(&epochs[n], __ATOMIC_SEQ_CST);
+  }
+
+  for (n = 0; n < RELOAD_SLOTS; n++)
+  {
+    if ((seen[n] & 1) == 0) { continue; }
+
+    while (__atomic_load_n(&epochs[n], __ATOMIC_ACQUIRE) == seen[n])
+    {
+      usleep(1000);
+    }
+  }
+}
+
+void reload_retire(void *ptr)
+{
+  Retired *entry = (Retired *)malloc(sizeof(Retired));
+
+  // Better to leak it than free it under a reader.
+  if (entry == NULL) { return; }
+
+  entry->ptr = ptr;
+  entry->next = retired;
+  retired = entry;
+}
+
+static void reload_free_retired()
+{
+  Retired *next;
+
+  while (retired != NULL)
+  {
+    next = retired->next;
+    free(retired->ptr);
+    free(retired);
+    retired = next;
+  }
+}
+
+int reload_draining()
+{
+  return __atomic_load_n(&draining, __ATOMIC_ACQUIRE);
+}
+
+void reload_drain_count(int slot, int count)
+{
+  __atomic_store_n(&drain_counts[slot], count, __ATOMIC_RELEASE);
+}
+
+// Takes a source out while the server is running. Requests for it get a
+// 404 from now on and its viewers are let go after the frame they're
+// being sent. Once they're gone the source is closed.
+void reload_remove_source(int video_num)
+{
+  time_t start = time(NULL);
+  int count = 0;
+  int n;
+
+  printf("Removing source %d\n", video_num);
+
+  video_remove(video_num);
+
+  __atomic_store_n(&draining, RELOAD_DRAIN_WAIT, __ATOMIC_SEQ_CST);
+
+  // After this every worker has seen draining set, so the counts they
+  // give after the next grace period are current.
+  reload_synchronize();
+
+  while (1)
+  {
+    reload_synchronize();
+
+    count = 0;
+
+    for (n = 0; n < RELOAD_SLOTS; n++)
+    {
+      count += __atomic_load_n(&drain_counts[n], __ATOMIC_ACQUIRE);
+    }
+
+    if (count == 0) { break; }
+    if (time(NULL) - start >= RELOAD_DRAIN_SECONDS * 2) { break; }
+
+    if (time(NULL) - start >= RELOAD_DRAIN_SECONDS)
+    {
+      __atomic_store_n(&draining, RELOAD_DRAIN_FORCE, __ATOMIC_RELEASE);
+    }
+
+    usleep(100000);
+  }
+
+  __atomic_store_n(&draining, 0, __ATOMIC_RELEASE);
+
+  if (count != 0)
+  {
+    printf("Source %d still has %d viewers, leaving it open.\n", video_num, count);
+    return;
+  }
+
+  video_close(video[video_num]);
+}
+
+#if !defined(WINDOWS) && !defined(ENABLE_ESP32)
+static void reload_config()
+{
+  Config *config, *old_config;
+
+  old_config = current;
+  config = config_reload(old_config);
+
+  if (config == NULL)
+  {
+    printf("Couldn't reload %s, keeping the config it had.\n",
+      old_config->filename);
+    return;
+  }
+
+  __atomic_store_n(&current, config, __ATOMIC_SEQ_CST);
+
+  reload_synchronize();
+
+  config_destroy(old_config);
+
+  if (old_config != first) { free(old_config); }
+
+  reload_free_retired();
+
+  printf("Reloaded %s\n", config->filename);
+  fflush(stdout);
+}
+
+static void *reload_thread(void *context)
+{
+  char buffer[64];
+  int length;
+
+  while (1)
+  {
+    // SIGHUPs that come in together are one reload.
+    length = read(reload_pipe[0], buffer, sizeof(buffer));
+
+    if (length <= 0) { continue; }
+
+    // Doesn't come back.
+    if (memchr(buffer, 'q', length) != NULL) { server_stop(current); }
+
+    if (memchr(buffer, 'r', length) != NULL) { reload_config(); }
+
+    // Only comes back if the new server couldn't start.
+    if (memchr(buffer, 'u', length) != NULL) { upgrade_start(current); }
+  }
+
+  return NULL;
+}
+
+// Signal handlers pass command ('r' reload, 'u' upgrade, 'q' shut down)
+// to the reload thread since almost nothing is safe to do in a signal
+// handler. Returns -1 if the thread isn't running.
+int reload_wake(char command)
+{
+  int saved_errno = errno;
+
+  if (reload_pipe[1] == -1) { return -1; }
+
+  if (write(reload_pipe[1], &command, 1) != 1) { }
+
+  errno = saved_errno;
+
+  return 0;
+}
+#else
+int reload_wake(char command)
+{
+  return -1;
+}
+#endif
+
+// SIGHUP handler.
+void reload_signal()
+{
+  reload_wake('r');
+}
+
+// config is what the server was started with. Returns -1 if reloading
+// isn't possible (the server still runs).
+int reload_init(Config *config)
+{
+#if !defined(WINDOWS) && !defined(ENABLE_ESP32)
+  pthread_t thread;
+#endif
+
+  current = config;
+  first = config;
+
+#if !defined(WINDOWS) && !defined(ENABLE_ESP32)
+  if (pipe(reload_pipe) != 0) { return -1; }
+
+  fcntl(reload_pipe[0], F_SETFD, FD_CLOEXEC);
+  fcntl(reload_pipe[1], F_SETFD, FD_CLOEXEC);
+
+  // The handler mustn't block if reloads are piling up.
+  fcntl(reload_pipe[1], F_SETFL, O_NONBLOCK);
+
+  if (pthread_create(&thread, NULL, reload_thread, NULL) != 0)
+  {
+    close(reload_pipe[0]);
+    close(reload_pipe[1]);
+    reload_pipe[0] = -1;
+    reload_pipe[1] = -1;
+    return -1;
+  }
+
+  pthread_detach(thread);
+
+  return 0;
+#else
+  return -1;
+#endif
+}
+
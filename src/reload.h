@@ -0,0 +1,43 @@
+/*
+
+  mjpeg_webserver - Web server optimized for JPEGs from a webcam or AVI file.
+
+  Copyright 2004-2024 - Michael Kohn (mike@mikekohn.net)
+  https://www.mikekohn.net/
+
+  This program falls under the GPLv3 license.
+
+*/
+
+#ifndef RELOAD_H
+#define RELOAD_H
+
+#include "config.h"
+#include "server.h"
+
+// A slot per worker thread (by thread_num) and one for the accept loop.
+#define RELOAD_SLOTS (MAX_USER_THREADS + 1)
+#define RELOAD_ACCEPT_SLOT MAX_USER_THREADS
+
+// Viewers of a source taken out by a reload get this long to finish the
+// frame they're being sent before their sockets are shut down, and as
+// long again after that before the source is left open.
+#define RELOAD_DRAIN_SECONDS 10
+
+#define RELOAD_DRAIN_WAIT 1
+#define RELOAD_DRAIN_FORCE 2
+
+int reload_init(Config *config);
+Config *reload_enter(int slot);
+void reload_exit(int slot);
+Config *reload_quiescent(int slot);
+void reload_synchronize();
+void reload_retire(void *ptr);
+int reload_draining();
+void reload_drain_count(int slot, int count);
+void reload_remove_source(int video_num);
+int reload_wake(char command);
+void reload_signal();
+
+#endif
+
@@ -41,31 +41,44 @@
 #include "capture.h"
 #endif
 
+#include "adaptive.h"
 #include "alias.h"
 #include "avi_play.h"
 #include "cgi_handler.h"
+#include "channel.h"
 #include "config.h"
 #include "file_io.h"
+#include "frame_ring.h"
 #include "general.h"
+#include "hls.h"
 #include "http_headers.h"
 #include "mime_types.h"
 #include "network_io.h"
 #include "plugin.h"
+#include "rate_limit.h"
+#ifdef V4L2
+#include "recorder.h"
+#endif
+#include "reload.h"
 #include "server.h"
+#include "stats.h"
+#include "upgrade.h"
+#ifdef ENABLE_IO_URING
+#include "uring_server.h"
+#endif
+#include "url_utils.h"
 #include "user.h"
 #include "version.h"
 #include "video.h"
+#include "websocket.h"
 
 int sockfd;
 char *runas_user = NULL;
 char *runas_group = NULL;
 User nulluser;
-int video_count = 0;
-Video video[MAX_VIDEO_COUNT];
 int debug;
 uint32_t uptime;
 uint32_t server_flags;
-Alias *alias;
 #ifdef ENABLE_CGI
 CgiHandler *cgi_handler;
 #endif
@@ -73,400 +86,842 @@ CgiHandler *cgi_handler;
 Plugin *plugin;
 #endif
 
-typedef struct ThreadContext
-{
-  Config *config;
-  int thread_num;
-} ThreadContext;
+// Set once SIGINT or SIGTERM has come in and once the server has
+// stopped accepting connections.
+static int stop_requested = 0;
+static int stopping = 0;
 
-void server_thread(ThreadContext *thread_context)
+// Does whatever is next for one connection: reads a line of the
+// request or sends the next part of a file or frame. readable and
+// writable say what the event loop saw on the socket.
+void server_handle_user(ThreadContext *thread_context, int id, int readable, int writable)
 {
-  int t = 0, r, trim;
-  int id = 0;
-  int msock = 0;
-  fd_set readset;
-  struct timeval tv;
+  Config *config = thread_context->config;
+  int r, trim;
   char *out_buffer;
-  int gc_time, thread_num;
-  int dirty_buffer;
   char *command, *param;
+  Frame *frame;
+  int64_t offset, start;
+  int has_start;
 
-  Config *config = thread_context->config;
-  thread_num     = thread_context->thread_num;
-  gc_time = time(NULL);
+  errno = 0;
 
-  while (1)
+  if (users[id] == 0) { return; }
+  if (users[id]->inuse != 1) { return; }
+
+#if 0
+printf("Checking line %d     %d\n", id, users[id]->in_ptr);
+printf("state=%d  need_header=%d (%d)\n",
+  users[id]->state,
+  users[id]->need_header,id);
+#endif
+
+#ifdef ZEROCOPY
+  // Finished MSG_ZEROCOPY sends are queued on the socket's error
+  // queue which also makes select() say it's readable.
+  if (users[id]->zerocopy_count > 0 && readable != 0)
   {
-    if (time(NULL) - gc_time > GC_TIME)
-    {
-      for (r = config->minconn + thread_num; r < config->maxconn; r = r + MAX_USER_THREADS)
-      {
-        if (users[r]->inuse == 0 && users[r]->idletime != -1)
-        {
-#ifdef DEBUG
-          if (debug == 1) { printf("Deallocating line %d\n",r); }
+    zerocopy_reap(users[id]);
+  }
 #endif
-          if (time(NULL) - users[r]->idletime>GC_TIME)
-          {
-            free(users[r]);
-            users[r] = &nulluser;
-          }
-        }
-      }
 
-      if (config->max_idle_time > 0)
+  if (users[id]->send_blocked == 1)
+  {
+    if (writable == 0) { return; }
+    users[id]->send_blocked = 0;
+  }
+
+  if (users[id]->state == STATE_SEND_FILE)
+  {
+    // WebSocket clients can send pings or a close while frames go out.
+    if (users[id]->request_type == REQUEST_WEBSOCKET &&
+        (users[id]->in_ptr < users[id]->in_len || readable != 0))
+    {
+      if (websocket_read(id) != 0)
       {
-        for (r = thread_num; r < config->maxconn; r = r + MAX_USER_THREADS)
-        {
-          if (users[r]->inuse != 0 &&
-              time(NULL) - users[r]->idletime > config->max_idle_time)
-          {
-            user_disconnect(users[r]);
-          }
-        }
+        user_disconnect(users[id]);
+        return;
       }
-
-      gc_time = time(NULL);
     }
+  }
+    else
+  if (users[id]->in_ptr < users[id]->in_len || readable != 0)
+  {
+    r = buffered_read(id);
+    if (r < 0) { user_disconnect(users[id]); return; }
+    if (r == 0) { return; }
+    users[id]->buffer_ptr = 0;
 
-    FD_ZERO(&readset);
-    msock = 0;
-    dirty_buffer = 0;
-
-    for (r = thread_num; r < config->maxconn; r = r + MAX_USER_THREADS)
+    if (config->user_pass_64[0] != 0)
     {
-      if (users[r]->inuse == 1)
+      if (strncmp(users[id]->out_buffer, "Authorization: Basic ", sizeof("Authorization: Basic ") - 1) == 0)
       {
-        FD_SET(users[r]->socketid, &readset);
-
-        if (msock < users[r]->socketid) { msock = users[r]->socketid; }
-        if (users[r]->in_ptr < users[r]->in_len ||
-            users[r]->state == STATE_SEND_FILE)
+        if ((users[id]->flags & 2) == 0 &&
+            strcmp(config->user_pass_64, users[id]->out_buffer + sizeof("Authorization: Basic ") - 1) == 0)
         {
-          dirty_buffer = 1;
+          users[id]->flags |= 1;
         }
+        users[id]->flags |= 2;
       }
     }
 
-    if (dirty_buffer == 0)
+    if (r == 1 && users[id]->state == STATE_HEADERS)
     {
-      tv.tv_sec = 1;
-      tv.tv_usec = 0;
+      websocket_header_line(users[id], users[id]->out_buffer);
+
+      // EventSource asks for text/event-stream. Sources send an event
+      // per frame instead of the frame.
+      if (strncasecmp(users[id]->out_buffer, "Accept:", 7) == 0 &&
+          strstr(users[id]->out_buffer, "text/event-stream") != NULL &&
+          users[id]->video_num >= 0 &&
+          users[id]->video_num < video_count)
+      {
+        users[id]->request_type = REQUEST_EVENTS;
+      }
     }
-      else
+
+    if (r == 2) { users[id]->state=STATE_SEND_FILE; }
+  }
+    else
+  {
+    return;
+  }
+
+  if (users[id]->state == STATE_SEND_FILE)
+  {
+    if (config->user_pass_64[0] != 0)
     {
-      tv.tv_sec = 0;
-      tv.tv_usec = 1;
+      if ((users[id]->flags & 1) != 1)
+      {
+        send_401(id);
+        return;
+      }
     }
 
-#ifdef WINDOWS
-    if (msock == 0)
+    if (users[id]->websocket.upgrade == 1 && websocket_accept(id) != 0)
     {
-      _sleep(1000);
-      continue;
+      return;
     }
-#endif
 
-    if ((t = select(msock + 1, &readset, NULL, NULL, &tv)) == -1)
+    // A reload took this source out. Anyone who hasn't been sent a frame
+    // gets a 404 and viewers are let go between frames.
+    if (users[id]->video_num >= 0 &&
+        users[id]->video_num < video_count &&
+        video[users[id]->video_num]->removed == 1 &&
+        users[id]->need_header == NEED_HEADER_YES)
     {
-#ifdef WINDOWS
-      if (WSAGetLastError() != WSANOTINITIALISED) { printf("yes %d\n",errno); }
-      if (WSAGetLastError() != WSAEINTR)
-#else
-      if (errno!=EINTR)
-#endif
+      if (users[id]->frames_sent == 0)
       {
-#ifdef DEBUG
-        if (debug == 1) { printf("not EINTR %d\n",thread_num); }
-#endif
+        STATS_ADD(stats_user(users[id]), not_found, 1);
+        send_error(id, "404 Not Found", FOUR_OH_FOUR, sizeof(FOUR_OH_FOUR));
       }
-         else
+        else
       {
-#ifdef DEBUG
-        if (debug == 1) { printf("Problem with select\n"); }
-#endif
-        continue;
+        user_disconnect(users[id]);
       }
+
+      return;
     }
 
-    for (id = thread_num; id < config->maxconn; id = id + MAX_USER_THREADS)
+#ifdef ENABLE_PLUGINS
+    if (users[id]->video_num == -3)  // PLUGIN
     {
-      errno = 0;
-
-      if (users[id] == 0) { continue; }
-      if (users[id]->inuse != 1) { continue; }
-
-#if 0
-printf("Checking line %d     %d\n", id, users[id]->in_ptr);
-printf("state=%d  need_header=%d (%d)\n",
-  users[id]->state,
-  users[id]->need_header,id);
+       if (users[id]->method == METHOD_GET)
+       {
+         send_header_plugin(id);
+         if (users[id]->plugin->get(users[id]->socketid, users[id]->querystring) != 0)
+         {
+           user_disconnct(users[id]);
+           return;
+         }
+       }
+         else
+       if (users[id]->method == METHOD_POST)
+       {
+         // This is totally fuckered.. need to give content length.
+         send_header_plugin(id);
+         if (users[id]->plugin->post(users[id]->socketid, users[id]->querystring, 0) != 0)
+         {
+           user_disconnct(user[id]);
+           return;
+         }
+       }
+
+       users[id]->state = STATE_IDLE;
+       users[id]->plugin = 0;
+
+       return;
+    }
+      else
 #endif
-
-      if (users[id]->state == STATE_SEND_FILE)
+    if (users[id]->video_num == -2)  // FILE OR CGI
+    {
+      send_file(id);
+      return;
+    }
+      else
+    if (users[id]->video_num == VIDEO_NUM_STATS)
+    {
+      send_stats(id, config);
+      return;
+    }
+      else
+    if (users[id]->video_num == VIDEO_NUM_HLS)
+    {
+      send_hls(id);
+      return;
+    }
+      else
+    if (users[id]->video_num >= video_count ||
+        users[id]->video_num == VIDEO_NUM_404 ||
+        users[id]->video_num == VIDEO_NUM_400)
+    {
+      STATS_ADD(stats_user(users[id]), not_found, 1);
+      send_error(id,"404 Not Found", FOUR_OH_FOUR, sizeof(FOUR_OH_FOUR));
+      return;
+    }
+      else
+    if (users[id]->video_num >= 0)
+    {
+      // An upgrade gave the device to the new server. Viewers wait here
+      // between frames to be handed over too.
+      if (video[users[id]->video_num]->handed_over != 0 &&
+          users[id]->need_header == NEED_HEADER_YES)
       {
-        /* Do nothing */
+        return;
       }
-        else
-      if (users[id]->in_ptr < users[id]->in_len ||
-          FD_ISSET(users[id]->socketid, &readset))
-      {
-        r = buffered_read(id);
-        if (r < 0) { user_disconnect(users[id]); continue; }
-        if (r == 0) { continue; }
-        users[id]->buffer_ptr = 0;
 
-        if (config->user_pass_64[0] != 0)
+#ifdef ENABLE_CAPTURE
+      if (video[users[id]->video_num]->capture_info != 0)
+      {
+        if (users[id]->need_header == NEED_HEADER_YES &&
+            (adaptive_capture_wait(users[id]) != 0 ||
+             rate_limit_user_check(users[id]) != 0))
         {
-          if (strncmp(users[id]->out_buffer, "Authorization: Basic ", sizeof("Authorization: Basic ") - 1) == 0)
-          {
-            if ((users[id]->flags & 2) == 0 &&
-                strcmp(config->user_pass_64, users[id]->out_buffer + sizeof("Authorization: Basic ") - 1) == 0)
-            {
-              users[id]->flags |= 1;
-            }
-            users[id]->flags |= 2;
-          }
+          return;
         }
 
-        if (r == 2) { users[id]->state=STATE_SEND_FILE; }
+        send_capture_frame(id);
+        return;
       }
-        else
+#endif
+
+      Channel *channel = video[users[id]->video_num]->channel;
+
+      if (users[id]->play_start == 0 && users[id]->channel != channel)
       {
-        continue;
+        user_leave_channel(users[id]);
+        users[id]->channel = channel;
+        channel_subscribe(channel);
       }
 
-      if (users[id]->state == STATE_SEND_FILE)
+      if (users[id]->need_header != NEED_HEADER_NO)
       {
-        if (config->user_pass_64[0] != 0)
+        users[id]->idletime = time(NULL);
+
+        if (users[id]->history_time != 0 &&
+            users[id]->request_type == REQUEST_SINGLE)
         {
-          if ((users[id]->flags & 1) != 1)
+          frame = frame_ring_find(
+            video[users[id]->video_num]->ring,
+            users[id]->history_time);
+
+          if (frame == NULL)
           {
-            send_401(id);
-            continue;
+            STATS_ADD(stats_user(users[id]), not_found, 1);
+            send_error(id, "404 Not Found", FOUR_OH_FOUR, sizeof(FOUR_OH_FOUR));
+            return;
           }
         }
-
-#ifdef ENABLE_PLUGINS
-        if (users[id]->video_num == -3)  // PLUGIN
-        {
-           if (users[id]->method == METHOD_GET)
-           {
-             send_header_plugin(id);
-             if (users[id]->plugin->get(users[id]->socketid, users[id]->querystring) != 0)
-             {
-               user_disconnct(users[id]);
-               continue;
-             }
-           }
-             else
-           if (users[id]->method == METHOD_POST)
-           {
-             // This is totally fuckered.. need to give content length.
-             send_header_plugin(id);
-             if (users[id]->plugin->post(users[id]->socketid, users[id]->querystring, 0) != 0)
-             {
-               user_disconnct(user[id]);
-               continue;
-             }
-           }
-
-           users[id]->state = STATE_IDLE;
-           users[id]->plugin = 0;
-
-           continue;
-        }
           else
-#endif
-        if (users[id]->video_num == -2)  // FILE OR CGI
+        if (users[id]->play_start != 0)
         {
-          send_file(id);
-          continue;
+          // Viewers with their own place in the file read it straight
+          // from the channel's mapping or fd instead of sharing frames.
+          r = avi_play_cursor_frame(
+            video[users[id]->video_num],
+            users[id]->play_start,
+            &users[id]->play_tick);
+
+          if (r < 0)
+          {
+            if (users[id]->last_frame == -1)
+            {
+              STATS_ADD(stats_user(users[id]), not_found, 1);
+              send_error(id, "404 Not Found", FOUR_OH_FOUR, sizeof(FOUR_OH_FOUR));
+            }
+              else
+            {
+              user_disconnect(users[id]);
+            }
+
+            return;
+          }
+
+          if (r == users[id]->last_frame) { return; }
+
+          frame = avi_play_read_frame(video[users[id]->video_num], channel->in, r);
+
+          if (frame != NULL)
+          {
+            frame->sequence = r + 1;
+            frame_set_header(frame);
+            frame->ready_time = get_time_ns();
+          }
         }
           else
-        if (users[id]->video_num >= video_count)
         {
-          send_error(id,"404 Not Found", FOUR_OH_FOUR, sizeof(FOUR_OH_FOUR));
-          continue;
+          frame = channel_get_frame(channel);
         }
-          else
-        if (users[id]->video_num >= 0)
-        {
 
-#ifdef ENABLE_CAPTURE
-          if (video[users[id]->video_num].capture_info != 0)
-          {
-            send_capture_frame(id);
-            continue;
-          }
-#endif
+        if (frame == NULL)
+        {
+          send_video_error(id);
+          user_disconnect(users[id]);
+          return;
+        }
 
-          if (users[id]->in == -1)
-          {
-#ifndef WINDOWS
-            users[id]->in = open(video[users[id]->video_num].filename, O_RDONLY);
-#else
-            users[id]->in = open(video[users[id]->video_num].filename, O_RDONLY|_O_BINARY);
-#endif
+        r = frame->frame_num;
 
-            if (users[id]->in == -1)
-            {
-              const int length = sizeof(FOUR_OH_FOUR);
-#ifdef ENABLE_CGI
-              if ((users[id]->mime_type & MIME_IS_CGI) == 0)
-              {
-                send_error(id, "404 Not Found", FOUR_OH_FOUR, length);
-              }
-                else
-              {
-                send_error(id, "400 Bad Request", FOUR_OH_OH, length);
-              }
-#else
-              send_error(id, "404 Not Found", FOUR_OH_FOUR, length);
-#endif
-              continue;
-            }
-          }
+        // Skip frames when the viewer asked for a lower frame rate
+        // than the file: send only if frames * scale / rate (seconds
+        // since the last frame sent) >= 1 / frame_rate.
+        if (r == users[id]->last_frame ||
+            (int64_t)abs(r - users[id]->last_frame) *
+              video[users[id]->video_num]->scale * adaptive_frame_rate(users[id]) <
+              video[users[id]->video_num]->rate)
+        {
+          frame_release(frame);
+          return;
+        }
 
-          if (users[id]->need_header != NEED_HEADER_NO)
+        // When the source's or the client's bucket is empty this frame
+        // is dropped and the viewer gets whatever is current once the
+        // bucket refills. Events don't carry the JPEG so they aren't
+        // limited.
+        if (users[id]->request_type != REQUEST_EVENTS &&
+            rate_limit_user_check(users[id]) != 0)
+        {
+          if (frame->sequence != users[id]->limited_sequence)
           {
-            users[id]->idletime = time(NULL);
-            r = avi_play_calc_frame(users[id]);
+            users[id]->limited_sequence = frame->sequence;
+            STATS_ADD(stats_user(users[id]), frames_limited, 1);
+          }
 
-            if (r == users[id]->last_frame) { continue; }
+          frame_release(frame);
+          return;
+        }
 
-            if (abs(r-users[id]->last_frame) <
-                (video[users[id]->video_num].fps / users[id]->frame_rate))
-            {
-              continue;
-            }
+        if (users[id]->request_type != REQUEST_EVENTS)
+        {
+          rate_limit_user_take(users[id], frame->length);
+        }
 
 #ifdef DEBUG
 if (debug == 1)
 {
   printf("Frame %d/%d  camera=%d\n",
-    r, video[users[id]->video_num].total_frames, users[id]->video_num);
+r, video[users[id]->video_num]->total_frames, users[id]->video_num);
 }
 #endif
-            users[id]->last_frame = r;
-          }
+        users[id]->last_frame = r;
+        users[id]->frame = frame;
+      }
 
-          send_file(id);
+      send_frame(id);
 
-          continue;
-        }
-          else
-        {
-          //FIXME - why?
-          continue;
-        }
-      }
+      return;
+    }
+      else
+    {
+      //FIXME - why?
+      return;
+    }
+  }
 
-      // if (users[id]->video_num >= 0) continue;
-      // if (users[id]->video_num != -1) continue;
-      if (users[id]->state != STATE_IDLE) continue;
+  // if (users[id]->video_num >= 0) return;
+  // if (users[id]->video_num != -1) return;
+  if (users[id]->state != STATE_IDLE) return;
 
-      out_buffer = users[id]->out_buffer;
+  out_buffer = users[id]->out_buffer;
 
-      trim = 0;
+  trim = 0;
 
-      while (out_buffer[trim] == ' ') { trim++; }
+  while (out_buffer[trim] == ' ') { trim++; }
 
-      users[id]->idletime = time(NULL);
+  users[id]->idletime = time(NULL);
 
 #ifdef DEBUG
-      if (debug == 1)
+  if (debug == 1)
+  {
+    printf("Read in: %d bytes on thread %d.\n",
+      (int)strlen(out_buffer), thread_context->thread_num);
+    printf("%d typed: %s\n", id, out_buffer);
+    fflush(stdout);
+  }
+#endif
+
+  r = 0;
+  while (out_buffer[r] == ' ' && out_buffer[r] != 0) { r++; }
+
+  command = out_buffer + r;
+
+  r = 0;
+  while (command[r] != ' '  && command[r] != '\r' &&
+         command[r] != '\n' && command[r] != 0)
+  {
+    r++;
+  }
+
+  command[r++] = 0;
+
+#ifdef DEBUG
+  if (debug == 1)
+  {
+    printf("command=%s\n", command);
+  }
+#endif
+
+  param = command + r;
+  r = strlen(param) - 1;
+
+  while (param[r] == ' ' || param[r] == '\r' || param[r] == '\n')
+  {
+    param[r--] = 0;
+  }
+
+  if (strcasecmp(command, "get") == 0)
+  {
+    users[id]->state = STATE_HEADERS;
+    users[id]->method = METHOD_GET;
+
+    STATS_ADD(stats_user(users[id]), requests, 1);
+    users[id]->request_time = get_time_ns();
+
+    r = get_video_num(param + 1);
+
+    if (r != users[id]->video_num && users[id]->in != -1)
+    {
+      file_close(users[id]);
+    }
+
+    user_leave_channel(users[id]);
+
+    users[id]->frames_sent    = 0;
+    users[id]->frames_skipped = 0;
+
+    users[id]->video_num    = r;
+    users[id]->need_header  = NEED_HEADER_YES;
+    users[id]->request_type = REQUEST_SINGLE;
+    users[id]->last_frame   = -1;
+    users[id]->flags        = 0;
+    users[id]->history_time = 0;
+    users[id]->play_start   = 0;
+    users[id]->frame_rate   = config->frame_rate;
+    websocket_init(users[id]);
+#ifdef ENABLE_CAPTURE
+    users[id]->jpeg_quality = config->jpeg_quality;
+#endif
+
+    // ?t=-5s asks for the frame from 5 seconds ago.
+    if (get_time_param(param + 1, "t", &offset) == 0 && offset < 0)
+    {
+      users[id]->history_time = users[id]->request_time + offset;
+    }
+
+    // Aliases take the query string apart so this is looked for first.
+    has_start = get_time_param(param + 1, "start", &start) == 0;
+
+    if (users[id]->video_num == -1)
+    {
+      r = 1;
+
+      while (param[r] != ' ' && param[r] != 0) { r++; }
+
+      param[r] = 0;
+
+      r = stats_match(config, param);
+
+      if (r != -1)
       {
-        printf("Read in: %d bytes on thread %d.\n",
-          (int)strlen(out_buffer), thread_num);
-        printf("%d typed: %s\n", id, out_buffer);
-        fflush(stdout);
+        users[id]->video_num = VIDEO_NUM_STATS;
+        users[id]->stats_flags = r;
       }
+        else
+      {
+        r = hls_request(config, users[id], param);
+
+        if (r == -1) { r = file_open(users[id], config, param); }
+
+        users[id]->video_num = r;
+      }
+
+#ifdef DEBUG
+if (debug == 1)
+{
+  printf("video_num=%d\n", users[id]->video_num);
+}
 #endif
 
-      r = 0;
-      while (out_buffer[r] == ' ' && out_buffer[r] != 0) { r++; }
+    }
 
-      command = out_buffer + r;
+    // ?start=90s plays a file from 90 seconds in (start=-30s from 30
+    // seconds before the end) for this viewer instead of where the
+    // source is.
+    if (users[id]->video_num >= 0 &&
+        users[id]->video_num < video_count &&
+        video[users[id]->video_num]->channel != NULL &&
+        has_start == 1)
+    {
+      Video *curr_video = video[users[id]->video_num];
 
-      r = 0;
-      while (command[r] != ' '  && command[r] != '\r' &&
-             command[r] != '\n' && command[r] != 0)
+      if (start < 0)
       {
-        r++;
+        start += avi_play_frame_time(curr_video, curr_video->total_frames);
       }
 
-      command[r++] = 0;
+      if (start < 0) { start = 0; }
+
+      users[id]->play_start = users[id]->request_time - start;
+      users[id]->play_tick = 0;
+    }
+  }
+#ifdef ENABLE_CGI
+    else
+  if (strcasecmp(command, "post") == 0)
+  {
+     // complete me
+     // this maybe should go above in the GET section
+  }
+#endif
+    else
+  {
+    // Unknown command.
+    user_disconnect(users[id]);
+  }
+}
 
+// Frees User structures that have been unused for a while and, when
+// check_idle is set, drops connections idle longer than max_idle_time.
+void server_gc(ThreadContext *thread_context, int check_idle)
+{
+  Config *config = thread_context->config;
+  int thread_num = thread_context->thread_num;
+  int r;
+
+  for (r = config->minconn + thread_num; r < config->maxconn; r = r + MAX_USER_THREADS)
+  {
+    if (users[r]->inuse == 0 && users[r]->idletime != -1)
+    {
 #ifdef DEBUG
-      if (debug == 1)
+      if (debug == 1) { printf("Deallocating line %d\n",r); }
+#endif
+      if (time(NULL) - users[r]->idletime>GC_TIME)
+      {
+#ifdef ENABLE_CAPTURE
+        free(users[r]->jpeg);
+#endif
+        free(users[r]);
+        users[r] = &nulluser;
+      }
+    }
+  }
+
+  if (check_idle == 1 && config->max_idle_time > 0)
+  {
+    for (r = thread_num; r < config->maxconn; r = r + MAX_USER_THREADS)
+    {
+      if (users[r]->inuse != 0 &&
+          time(NULL) - users[r]->idletime > config->max_idle_time)
       {
-        printf("command=%s\n", command);
+        user_disconnect(users[r]);
       }
+    }
+  }
+}
+
+// While shutting down: closes a connection that's between frames or
+// requests so nobody is cut off in the middle of one. Returns -1 if it
+// isn't yet.
+static int server_close_user(User *user)
+{
+#ifndef WINDOWS
+  char buffer[256];
 #endif
 
-      param = command + r;
-      r = strlen(param) - 1;
+  if (user->send_blocked != 0 ||
+      user->frame != NULL ||
+      user->in_ptr < user->in_len)
+  {
+    return -1;
+  }
+
+  if (user->state != STATE_IDLE &&
+      (user->state != STATE_SEND_FILE ||
+       user->video_num < 0 ||
+       user->need_header != NEED_HEADER_YES))
+  {
+    return -1;
+  }
+
+  // The FIN goes out now. Anything the client sent that's still unread
+  // would make close() reset the connection instead.
+  shutdown(user->socketid, SHUT_WR);
 
-      while (param[r] == ' ' || param[r] == '\r' || param[r] == '\n')
+#ifndef WINDOWS
+  while (recv(user->socketid, buffer, sizeof(buffer), MSG_DONTWAIT) > 0) { }
+#endif
+
+  user_disconnect(user);
+
+  return 0;
+}
+
+// Workers call this between passes through their connections, which is
+// where they pick up a reloaded config. While a reload is taking out a
+// source it also counts the viewers still being sent one of its frames.
+void server_checkpoint(ThreadContext *thread_context)
+{
+  Config *config = thread_context->config;
+  int thread_num = thread_context->thread_num;
+  int draining = reload_draining();
+  int count = 0;
+  User *user;
+  int r;
+
+  if (draining != 0)
+  {
+    for (r = thread_num; r < config->maxconn; r = r + MAX_USER_THREADS)
+    {
+      user = users[r];
+
+      if (user->inuse != 1 ||
+          user->video_num < 0 ||
+          user->video_num >= video_count ||
+          video[user->video_num]->removed == 0)
       {
-        param[r--] = 0;
+        continue;
       }
 
-      if (strcasecmp(command, "get") == 0)
+      // Connections that finished with the source and are waiting for
+      // another request only need to let go of its channel.
+      if (user->state != STATE_SEND_FILE && user->frame == NULL)
       {
-        users[id]->state = STATE_HEADERS;
-        users[id]->method = METHOD_GET;
+        user_leave_channel(user);
+        continue;
+      }
 
-        r = conv_num(param + 1);
+      if (draining == RELOAD_DRAIN_FORCE)
+      {
+        shutdown(user->socketid, SHUT_RDWR);
+      }
 
-        if (r != users[id]->video_num && users[id]->in != -1)
-        {
-          file_close(users[id]);
-        }
+      count++;
+    }
 
-        users[id]->video_num    = r;
-        users[id]->need_header  = NEED_HEADER_YES;
-        users[id]->request_type = REQUEST_SINGLE;
-        users[id]->last_frame   = -1;
-        users[id]->flags        = 0;
-        users[id]->frame_rate   = config->frame_rate;
-#ifdef ENABLE_CAPTURE
-        users[id]->jpeg_quality = config->jpeg_quality;
-#endif
+    reload_drain_count(thread_num, count);
+  }
 
-        if (users[id]->video_num == -1)
-        {
-          r = 1;
+  // Once an upgrade has started connections go to the new server as
+  // soon as they're between frames or requests.
+  if (upgrade_handing_off() != 0)
+  {
+    for (r = thread_num; r < config->maxconn; r = r + MAX_USER_THREADS)
+    {
+      if (users[r]->inuse == 1) { upgrade_hand_off(users[r]); }
+    }
+  }
 
-          while (param[r] != ' ' && param[r] != 0) { r++; }
+  if (server_stopping() != 0)
+  {
+    for (r = thread_num; r < config->maxconn; r = r + MAX_USER_THREADS)
+    {
+      if (users[r]->inuse == 1) { server_close_user(users[r]); }
+    }
+  }
 
-          param[r] = 0;
-          users[id]->video_num = file_open(users[id], config, param);
+  thread_context->config = reload_quiescent(thread_num);
+}
 
-#ifdef DEBUG
-if (debug == 1)
+int server_stopping()
 {
-  printf("video_num=%d\n", users[id]->video_num);
+  return __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
 }
-#endif
 
+// SIGINT and SIGTERM handler. The reload thread shuts the server down
+// since almost nothing is safe to do here. If it isn't running yet the
+// server exits right away as does a second signal.
+void server_stop_signal()
+{
+  if (__atomic_exchange_n(&stop_requested, 1, __ATOMIC_SEQ_CST) != 0)
+  {
+    _exit(1);
+  }
+
+  if (reload_wake('q') != 0) { destroy(); }
+}
+
+// Runs on the reload thread. New connections are refused from here on
+// and each worker closes its connections as they finish the frame or
+// request they're on. Whatever is left after drain_timeout seconds is
+// closed when the process exits.
+void server_stop(Config *config)
+{
+  time_t start = time(NULL);
+  int count, n;
+
+  printf("Shutting down.\n");
+  fflush(stdout);
+
+  // Also resets connections still waiting in the backlog.
+  shutdown(sockfd, SHUT_RDWR);
+
+  __atomic_store_n(&stopping, 1, __ATOMIC_SEQ_CST);
+
+  while (1)
+  {
+    count = 0;
+
+    for (n = 0; n < config->maxconn; n++)
+    {
+      if (users[n]->inuse == 1) { count++; }
+    }
+
+    if (count == 0 || time(NULL) - start >= config->drain_timeout) { break; }
+
+    usleep(100000);
+  }
+
+  if (count != 0)
+  {
+    printf("Closing %d connections that didn't finish in %d seconds.\n",
+      count, config->drain_timeout);
+  }
+
+  destroy();
+}
+
+void server_thread(ThreadContext *thread_context)
+{
+  int t = 0, r;
+  int id = 0;
+  int msock = 0;
+  fd_set readset;
+  fd_set writeset;
+  struct timeval tv;
+  int gc_time, snapshot_time, thread_num;
+  int dirty_buffer;
+
+  Config *config;
+  thread_num     = thread_context->thread_num;
+  gc_time = time(NULL);
+  snapshot_time = 0;
+
+  thread_context->config = reload_enter(thread_num);
+
+  while (1)
+  {
+    server_checkpoint(thread_context);
+    config = thread_context->config;
+
+    if (time(NULL) - gc_time > GC_TIME)
+    {
+      server_gc(thread_context, 1);
+      gc_time = time(NULL);
+    }
+
+    if (time(NULL) != snapshot_time)
+    {
+      stats_snapshot(thread_context);
+      adaptive_check(thread_context);
+      snapshot_time = time(NULL);
+    }
+
+    FD_ZERO(&readset);
+    FD_ZERO(&writeset);
+    msock = 0;
+    dirty_buffer = 0;
+
+    for (r = thread_num; r < config->maxconn; r = r + MAX_USER_THREADS)
+    {
+      if (users[r]->inuse == 1)
+      {
+        FD_SET(users[r]->socketid, &readset);
+
+        if (msock < users[r]->socketid) { msock = users[r]->socketid; }
+
+        if (users[r]->send_blocked == 1)
+        {
+          FD_SET(users[r]->socketid, &writeset);
+        }
+          else
+        if (users[r]->in_ptr < users[r]->in_len ||
+            users[r]->state == STATE_SEND_FILE)
+        {
+          dirty_buffer = 1;
         }
       }
-#ifdef ENABLE_CGI
-        else
-      if (strcasecmp(command, "post") == 0)
+    }
+
+    if (dirty_buffer == 0)
+    {
+      tv.tv_sec = 1;
+      tv.tv_usec = 0;
+    }
+      else
+    {
+      tv.tv_sec = 0;
+      tv.tv_usec = 1;
+    }
+
+    // Connections an old server hands over don't wake select() so look
+    // for them often while that's going on.
+    if (dirty_buffer == 0 && upgrade_adopting() != 0)
+    {
+      tv.tv_usec = 10000;
+      tv.tv_sec = 0;
+    }
+
+#ifdef WINDOWS
+    if (msock == 0)
+    {
+      _sleep(1000);
+      continue;
+    }
+#endif
+
+    if ((t = select(msock + 1, &readset, &writeset, NULL, &tv)) == -1)
+    {
+#ifdef WINDOWS
+      if (WSAGetLastError() != WSANOTINITIALISED) { printf("yes %d\n",errno); }
+      if (WSAGetLastError() != WSAEINTR)
+#else
+      if (errno!=EINTR)
+#endif
       {
-         // complete me
-         // this maybe should go above in the GET section
-      }
+#ifdef DEBUG
+        if (debug == 1) { printf("not EINTR %d\n",thread_num); }
 #endif
-        else
+      }
+         else
       {
-        // Unknown command.
-        user_disconnect(users[id]);
+#ifdef DEBUG
+        if (debug == 1) { printf("Problem with select\n"); }
+#endif
+        continue;
       }
     }
+
+    for (id = thread_num; id < config->maxconn; id = id + MAX_USER_THREADS)
+    {
+      if (users[id]->inuse != 1) { continue; }
+
+      server_handle_user(
+        thread_context,
+        id,
+        FD_ISSET(users[id]->socketid, &readset),
+        FD_ISSET(users[id]->socketid, &writeset));
+    }
   }
 }
 
@@ -478,32 +933,57 @@ int server_run(Config *config)
   socklen_t clilen;
   struct sockaddr_in cli_addr;
   ThreadContext thread_context[MAX_USER_THREADS];
+  void (*thread_func)(ThreadContext *) = server_thread;
 #ifndef WINDOWS
   pthread_t pid;
 #endif
 
   uptime = time(NULL);
 
-  if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+  // After a binary upgrade the old server's listening socket is used.
+  sockfd = upgrade_listen();
+
+  if (sockfd == -1)
   {
-    printf("Can't open socket.\n");
-    return -1;
-  }
+    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    {
+      printf("Can't open socket.\n");
+      return -1;
+    }
 
-  memset((char *)&serv_addr, 0, sizeof(serv_addr));
-  serv_addr.sin_family = AF_INET;
-  serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-  serv_addr.sin_port = htons(config->port);
+    memset((char *)&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    serv_addr.sin_port = htons(config->port);
 
-  set_socket_options(sockfd);
+    set_socket_options(sockfd);
 
-  if (bind(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
-  {
-    printf("server can't bind.\n");
-    return -1;
+    if (bind(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+    {
+      printf("server can't bind.\n");
+      return -1;
+    }
+
+    listen(sockfd, LISTEN_BACKLOG);
   }
 
-  listen(sockfd, 5);
+  if (config->server_loop == SERVER_LOOP_IO_URING)
+  {
+#ifdef ENABLE_IO_URING
+    if (uring_server_init(config) == 0)
+    {
+      thread_func = uring_server_thread;
+    }
+      else
+    {
+      printf("io_uring isn't available, using select().\n");
+      config->server_loop = SERVER_LOOP_SELECT;
+    }
+#else
+    printf("io_uring support was not compiled in.\n");
+    config->server_loop = SERVER_LOOP_SELECT;
+#endif
+  }
 
   printf("\n" VERSION "\n" COPYRIGHT "\n\n");
 
@@ -524,22 +1004,53 @@ int server_run(Config *config)
 
   for (r = 0; r < config->minconn; r++)
   {
-    users[r] = malloc(sizeof(User));
+    users[r] = calloc(1, sizeof(User));
     users[r]->inuse = 0;
   }
 
+  if (stats_init(video_count) != 0)
+  {
+    printf("Couldn't allocate stats.\n");
+    return -1;
+  }
+
+#ifdef V4L2
+  for (r = 0; r < video_count; r++)
+  {
+    if (video[r]->recorder != NULL)
+    {
+      recorder_start(video[r]->recorder, config, r);
+    }
+  }
+#endif
+
+  if (reload_init(config) != 0)
+  {
+    printf("Couldn't start the reload thread, SIGHUP won't reload.\n");
+  }
+
   for (r = 0; r < MAX_USER_THREADS; r++)
   {
     thread_context[r].config = config;
     thread_context[r].thread_num = r;
 
 #ifndef WINDOWS
-    pthread_create(&pid, NULL, (void *)server_thread, &thread_context[r]);
+    pthread_create(&pid, NULL, (void *)thread_func, &thread_context[r]);
 #else
-    _beginthread((void *)server_thread, 0, &thread_context[r]);
+    _beginthread((void *)thread_func, 0, &thread_context[r]);
 #endif
   }
 
+#ifdef ENABLE_IO_URING
+  if (config->server_loop == SERVER_LOOP_IO_URING)
+  {
+    upgrade_adopt(uring_server_add);
+    return uring_server_accept(config, sockfd);
+  }
+#endif
+
+  upgrade_adopt(NULL);
+
   clilen = sizeof(cli_addr);
 
   while (1)
@@ -551,6 +1062,9 @@ int server_run(Config *config)
 #ifdef DEBUG
       if (debug == 1) { printf("server accept error.\n"); }
 #endif
+
+      // The socket was shut down, the reload thread exits when it's done.
+      if (server_stopping() != 0) { sleep(1); }
     }
       else
     {
@@ -562,7 +1076,12 @@ int server_run(Config *config)
       }
 #endif
 
+      // During an upgrade the new server gets it.
+      if (upgrade_forward(newsockfd) == 0) { continue; }
+
+      config = reload_enter(RELOAD_ACCEPT_SLOT);
       user_connect(config, newsockfd, &cli_addr);
+      reload_exit(RELOAD_ACCEPT_SLOT);
     }
   }
 }
@@ -16,8 +16,21 @@
 
 #define MAX_USER_THREADS 4
 #define GC_TIME 30
+#define LISTEN_BACKLOG 128
+
+typedef struct ThreadContext
+{
+  Config *config;
+  int thread_num;
+} ThreadContext;
 
 int server_run(Config *config);
+void server_handle_user(ThreadContext *thread_context, int id, int readable, int writable);
+void server_gc(ThreadContext *thread_context, int check_idle);
+void server_checkpoint(ThreadContext *thread_context);
+int server_stopping();
+void server_stop_signal();
+void server_stop(Config *config);
 
 #endif
 
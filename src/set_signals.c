@@ -18,6 +18,9 @@
 
 #include "general.h"
 #include "globals.h"
+#include "reload.h"
+#include "server.h"
+#include "upgrade.h"
 #include "set_signals.h"
 
 #ifndef WINDOWS
@@ -44,10 +47,11 @@ void set_signals()
   signal(SIGPIPE, broken_pipe);
   signal(SIGURG,  other_signal);
   signal(SIGIO,   other_signal);
-  signal(SIGHUP,  other_signal);
+  signal(SIGHUP,  reload_signal);
+  signal(SIGUSR2, upgrade_signal);
 
-  signal(SIGINT,  destroy);
-  signal(SIGTERM, destroy);
+  signal(SIGINT,  server_stop_signal);
+  signal(SIGTERM, server_stop_signal);
 }
 #endif
 
@@ -0,0 +1,1030 @@
+/*
+
+  mjpeg_webserver - Web server optimized for JPEGs from a webcam or AVI file.
+
+  Copyright 2004-2024 - Michael Kohn (mike@mikekohn.net)
+  https://www.mikekohn.net/
+
+  This program falls under the GPLv3 license.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#endif
+
+#include "general.h"
+#include "globals.h"
+#include "http_headers.h"
+#include "mime_types.h"
+#include "network_io.h"
+#include "stats.h"
+#include "user.h"
+#include "video.h"
+
+typedef struct StatsBuffer
+{
+  char *data;
+  int length;
+  int alloc;
+} StatsBuffer;
+
+static ThreadStats thread_stats[STATS_SLOTS];
+static uint8_t *sources_mem = NULL;
+static int source_count = 0;
+static int source_alloc = 0;
+
+// The writers never clear their own histograms, so a reset saves what
+// they add up to here and the page shows the difference.
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static ThreadStats baseline;
+static SourceStats *baseline_sources = NULL;
+
+typedef struct ConnectionSnapshot
+{
+  ConnectionInfo *connections;
+  int count;
+  int alloc;
+} ConnectionSnapshot;
+
+// Each worker only replaces its own snapshot and only about once a
+// second, so one lock for all of them is plenty.
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static ConnectionSnapshot snapshots[MAX_USER_THREADS];
+
+// The sources arrays for all slots come from one block, each padded out
+// to whole cache lines.
+int stats_init(int count)
+{
+  int alloc = count + STATS_SPARE_SOURCES;
+  int stride;
+  int n;
+
+  stats_free();
+
+  stride = (alloc * sizeof(SourceStats) + STATS_CACHE_LINE - 1) &
+    ~(STATS_CACHE_LINE - 1);
+
+  sources_mem = (uint8_t *)calloc(1, stride * STATS_SLOTS + STATS_CACHE_LINE);
+  baseline_sources = (SourceStats *)calloc(alloc + 1, sizeof(SourceStats));
+
+  if (sources_mem == NULL || baseline_sources == NULL)
+  {
+    stats_free();
+    return -1;
+  }
+
+  for (n = 0; n < STATS_SLOTS; n++)
+  {
+    uintptr_t address = (uintptr_t)sources_mem + stride * n;
+
+    address = (address + STATS_CACHE_LINE - 1) & ~(uintptr_t)(STATS_CACHE_LINE - 1);
+
+    thread_stats[n].sources = (SourceStats *)address;
+  }
+
+  source_count = count;
+  source_alloc = alloc;
+
+  return 0;
+}
+
+// The arrays never move so pages being built while this changes only
+// see the new sources with nothing counted yet.
+void stats_sources(int count)
+{
+  if (count > source_alloc) { count = source_alloc; }
+
+  __atomic_store_n(&source_count, count, __ATOMIC_RELEASE);
+}
+
+void stats_free()
+{
+  int n;
+
+  for (n = 0; n < STATS_SLOTS; n++)
+  {
+    memset(&thread_stats[n], 0, sizeof(ThreadStats));
+  }
+
+  memset(&baseline, 0, sizeof(baseline));
+
+  pthread_mutex_lock(&snapshot_lock);
+
+  for (n = 0; n < MAX_USER_THREADS; n++)
+  {
+    free(snapshots[n].connections);
+    memset(&snapshots[n], 0, sizeof(ConnectionSnapshot));
+  }
+
+  pthread_mutex_unlock(&snapshot_lock);
+
+  free(sources_mem);
+  free(baseline_sources);
+  sources_mem = NULL;
+  baseline_sources = NULL;
+  source_count = 0;
+  source_alloc = 0;
+}
+
+ThreadStats *stats_thread(int slot)
+{
+  return &thread_stats[slot];
+}
+
+// Connections are always handled by the same worker thread.
+ThreadStats *stats_user(User *user)
+{
+  return &thread_stats[user->id % MAX_USER_THREADS];
+}
+
+SourceStats *stats_source(User *user)
+{
+  if (user->video_num < 0 || user->video_num >= source_count) { return NULL; }
+
+  return &stats_user(user)->sources[user->video_num];
+}
+
+void stats_source_add(User *user, int frames, int skipped, int bytes)
+{
+  SourceStats *source = stats_source(user);
+
+  if (source == NULL) { return; }
+
+  STATS_ADD(source, frames_sent, frames);
+  STATS_ADD(source, frames_skipped, skipped);
+  STATS_ADD(source, bytes_sent, bytes);
+}
+
+static int histogram_bucket(uint64_t value)
+{
+  int e;
+
+  if (value < HISTOGRAM_SUB) { return value; }
+
+  e = 63 - __builtin_clzll(value);
+
+  if (e > HISTOGRAM_MAX_EXP) { return HISTOGRAM_BUCKETS - 1; }
+
+  return (e - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB +
+    ((value >> (e - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB - 1));
+}
+
+// The highest value that lands in bucket.
+static uint64_t histogram_bucket_high(int bucket)
+{
+  int e, shift;
+
+  if (bucket < HISTOGRAM_SUB) { return bucket; }
+
+  e = bucket / HISTOGRAM_SUB + HISTOGRAM_SUB_BITS - 1;
+  shift = e - HISTOGRAM_SUB_BITS;
+
+  return (((uint64_t)(HISTOGRAM_SUB + bucket % HISTOGRAM_SUB) + 1) << shift) - 1;
+}
+
+void histogram_add(Histogram *histogram, int64_t ns)
+{
+  uint64_t us = ns < 0 ? 0 : ns / 1000;
+  int bucket = histogram_bucket(us);
+
+  STATS_ADD(histogram, count, 1);
+  STATS_ADD(histogram, sum, us);
+  STATS_ADD(histogram, buckets[bucket], 1);
+}
+
+static void histogram_sum(Histogram *total, Histogram *histogram)
+{
+  int n;
+
+  total->count += __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+  total->sum += __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED);
+
+  for (n = 0; n < HISTOGRAM_BUCKETS; n++)
+  {
+    total->buckets[n] +=
+      __atomic_load_n(&histogram->buckets[n], __ATOMIC_RELAXED);
+  }
+}
+
+static void histogram_sub(Histogram *histogram, Histogram *base)
+{
+  int n;
+
+  histogram->count -= base->count;
+  histogram->sum -= base->sum;
+
+  for (n = 0; n < HISTOGRAM_BUCKETS; n++)
+  {
+    histogram->buckets[n] -= base->buckets[n];
+  }
+}
+
+// Like HdrHistogram this reports the highest value in the bucket the
+// percentile falls in.
+static uint64_t histogram_percentile(Histogram *histogram, double percentile)
+{
+  uint64_t want = (uint64_t)(histogram->count * percentile / 100 + 0.5);
+  uint64_t count = 0;
+  int n;
+
+  if (want == 0) { want = 1; }
+
+  for (n = 0; n < HISTOGRAM_BUCKETS; n++)
+  {
+    count += histogram->buckets[n];
+
+    if (count >= want) { return histogram_bucket_high(n); }
+  }
+
+  return 0;
+}
+
+// Called by each worker thread about once a second to copy what the
+// connections page shows about its users.
+void stats_snapshot(ThreadContext *thread_context)
+{
+  Config *config = thread_context->config;
+  int thread_num = thread_context->thread_num;
+  ConnectionSnapshot *snapshot = &snapshots[thread_num];
+  int alloc = config->maxconn / MAX_USER_THREADS + 1;
+  int64_t now = get_time_ns();
+  int r;
+
+  pthread_mutex_lock(&snapshot_lock);
+
+  if (snapshot->alloc < alloc)
+  {
+    ConnectionInfo *connections = (ConnectionInfo *)realloc(
+      snapshot->connections,
+      sizeof(ConnectionInfo) * alloc);
+
+    if (connections == NULL)
+    {
+      pthread_mutex_unlock(&snapshot_lock);
+      return;
+    }
+
+    snapshot->connections = connections;
+    snapshot->alloc = alloc;
+  }
+
+  snapshot->count = 0;
+
+  for (r = thread_num; r < config->maxconn; r = r + MAX_USER_THREADS)
+  {
+    User *user = users[r];
+    ConnectionInfo *info;
+    uint32_t frames;
+    int64_t elapsed;
+
+    if (user->inuse != 1) { continue; }
+
+    info = &snapshot->connections[snapshot->count++];
+
+    memcpy(info->location, user->location, sizeof(info->location));
+    info->id = user->id;
+    info->video_num = user->video_num;
+    info->request_type = user->request_type;
+    info->state = user->state;
+    info->frames_sent = user->frames_sent;
+    info->frames_skipped = user->frames_skipped;
+    info->bytes_sent = user->bytes_sent;
+    info->logontime = user->logontime;
+    info->queued = 0;
+    info->pending = 0;
+    info->adaptive_level = user->adaptive.level;
+
+#ifdef SIOCOUTQ
+    if (ioctl(user->socketid, SIOCOUTQ, &info->queued) != 0)
+    {
+      info->queued = 0;
+    }
+#endif
+
+    if (user->frame != NULL)
+    {
+      info->pending = (user->header_len - user->header_ptr) +
+        (user->frame->length - user->frame_ptr);
+    }
+      else
+    if (user->video_num == -2 && user->state == STATE_SEND_FILE)
+    {
+      info->pending = user->content_length;
+    }
+
+    // frames_sent starts over with each request.
+    frames = user->frames_sent >= user->snapshot_frames ?
+      user->frames_sent - user->snapshot_frames : user->frames_sent;
+
+    elapsed = now - user->snapshot_time;
+
+    if (elapsed > 0)
+    {
+      info->fps = (double)frames * 1000000000 / elapsed;
+      info->bytes_per_second =
+        (double)(user->bytes_sent - user->snapshot_bytes) * 1000000000 / elapsed;
+    }
+      else
+    {
+      info->fps = 0;
+      info->bytes_per_second = 0;
+    }
+
+    user->snapshot_frames = user->frames_sent;
+    user->snapshot_bytes = user->bytes_sent;
+    user->snapshot_time = now;
+  }
+
+  pthread_mutex_unlock(&snapshot_lock);
+}
+
+// Copies every worker's snapshot into one array. Returns the count.
+static int stats_connections(ConnectionInfo **connections)
+{
+  int count = 0;
+  int n;
+
+  pthread_mutex_lock(&snapshot_lock);
+
+  for (n = 0; n < MAX_USER_THREADS; n++)
+  {
+    count += snapshots[n].count;
+  }
+
+  *connections = (ConnectionInfo *)malloc(sizeof(ConnectionInfo) * (count + 1));
+
+  if (*connections != NULL)
+  {
+    count = 0;
+
+    for (n = 0; n < MAX_USER_THREADS; n++)
+    {
+      memcpy(*connections + count,
+        snapshots[n].connections,
+        sizeof(ConnectionInfo) * snapshots[n].count);
+
+      count += snapshots[n].count;
+    }
+  }
+
+  pthread_mutex_unlock(&snapshot_lock);
+
+  return count;
+}
+
+// Returns what the path and query string ask for (STATS_CONNECTIONS,
+// STATS_PROMETHEUS and STATS_RESET bits) if path is a stats page or -1.
+int stats_match(Config *config, const char *path)
+{
+  int length;
+  int flags = 0;
+
+  if (config->stats_url == NULL) { return -1; }
+
+  length = strlen(config->stats_url);
+
+  if (strncmp(path, config->stats_url, length) != 0) { return -1; }
+
+  if (strncmp(path + length, "/connections", 12) == 0)
+  {
+    flags |= STATS_CONNECTIONS;
+    length += 12;
+  }
+
+  if (path[length] != 0 && path[length] != '?') { return -1; }
+
+  if (path[length] == '?')
+  {
+    if (strstr(path + length, "format=prometheus") != NULL)
+    {
+      flags |= STATS_PROMETHEUS;
+    }
+
+    if (strstr(path + length, "reset=1") != NULL)
+    {
+      flags |= STATS_RESET;
+    }
+  }
+
+  return flags;
+}
+
+static void buffer_printf(StatsBuffer *buffer, const char *format, ...)
+{
+  va_list args;
+  int length;
+
+  while (1)
+  {
+    va_start(args, format);
+    length = vsnprintf(
+      buffer->data + buffer->length,
+      buffer->alloc - buffer->length,
+      format,
+      args);
+    va_end(args);
+
+    if (length < 0) { return; }
+
+    if (buffer->length + length < buffer->alloc)
+    {
+      buffer->length += length;
+      return;
+    }
+
+    char *data = (char *)realloc(buffer->data, buffer->alloc * 2 + length);
+    if (data == NULL) { return; }
+
+    buffer->data = data;
+    buffer->alloc = buffer->alloc * 2 + length;
+  }
+}
+
+// Source names can have anything but '/', '?' and '&' in them.
+static void source_name(char *name, int length, int video_num)
+{
+  const char *s = video[video_num]->name;
+  int n = 0;
+
+  if (s == NULL)
+  {
+    snprintf(name, length, "%d", video_num);
+    return;
+  }
+
+  while (*s != 0 && n < length - 2)
+  {
+    if (*s == '"' || *s == '\\') { name[n++] = '\\'; }
+    name[n++] = *s++;
+  }
+
+  name[n] = 0;
+}
+
+static void stats_sum(ThreadStats *total, SourceStats *sources)
+{
+  ThreadStats *stats;
+  int n, k;
+
+  memset(total, 0, sizeof(ThreadStats));
+  memset(sources, 0, sizeof(SourceStats) * source_count);
+
+  for (n = 0; n < STATS_SLOTS; n++)
+  {
+    stats = &thread_stats[n];
+
+#define STATS_SUM(field) \
+    total->field += __atomic_load_n(&stats->field, __ATOMIC_RELAXED)
+
+    STATS_SUM(connections);
+    STATS_SUM(connections_refused);
+    STATS_SUM(disconnects);
+    STATS_SUM(requests);
+    STATS_SUM(not_found);
+    STATS_SUM(frames_sent);
+    STATS_SUM(frames_skipped);
+    STATS_SUM(bytes_sent);
+    STATS_SUM(send_stalls);
+    STATS_SUM(files_sent);
+    STATS_SUM(captures);
+    STATS_SUM(encode_ns);
+    STATS_SUM(frames_limited);
+
+    histogram_sum(&total->request_static, &stats->request_static);
+    histogram_sum(&total->request_snapshot, &stats->request_snapshot);
+
+    for (k = 0; k < source_count; k++)
+    {
+      SourceStats *source = &stats->sources[k];
+
+      sources[k].frames_sent +=
+        __atomic_load_n(&source->frames_sent, __ATOMIC_RELAXED);
+      sources[k].frames_skipped +=
+        __atomic_load_n(&source->frames_skipped, __ATOMIC_RELAXED);
+      sources[k].bytes_sent +=
+        __atomic_load_n(&source->bytes_sent, __ATOMIC_RELAXED);
+
+      histogram_sum(&sources[k].capture, &source->capture);
+      histogram_sum(&sources[k].first_byte, &source->first_byte);
+      histogram_sum(&sources[k].frame_send, &source->frame_send);
+    }
+  }
+}
+
+// The totals since the server started, printed as it exits.
+void stats_log()
+{
+  ThreadStats total;
+  SourceStats *sources;
+
+  sources = (SourceStats *)calloc(source_count + 1, sizeof(SourceStats));
+
+  if (sources == NULL) { return; }
+
+  stats_sum(&total, sources);
+  free(sources);
+
+  printf("Served %llu connections, %llu requests, %llu frames (%llu skipped), "
+    "%llu bytes.\n",
+    (unsigned long long)total.connections,
+    (unsigned long long)total.requests,
+    (unsigned long long)total.frames_sent,
+    (unsigned long long)total.frames_skipped,
+    (unsigned long long)total.bytes_sent);
+  fflush(stdout);
+}
+
+// Takes out what the histograms held at the last reset. With reset set
+// the page still shows the counts since the last reset and the next one
+// starts from here.
+static void histogram_rebase(Histogram *histogram, Histogram *base, int reset)
+{
+  Histogram raw = *histogram;
+
+  histogram_sub(histogram, base);
+
+  if (reset == 1) { *base = raw; }
+}
+
+static void stats_baseline(ThreadStats *total, SourceStats *sources, int reset)
+{
+  int k;
+
+  pthread_mutex_lock(&stats_lock);
+
+  histogram_rebase(&total->request_static, &baseline.request_static, reset);
+  histogram_rebase(&total->request_snapshot, &baseline.request_snapshot, reset);
+
+  for (k = 0; k < source_count; k++)
+  {
+    SourceStats *base = &baseline_sources[k];
+
+    histogram_rebase(&sources[k].capture, &base->capture, reset);
+    histogram_rebase(&sources[k].first_byte, &base->first_byte, reset);
+    histogram_rebase(&sources[k].frame_send, &base->frame_send, reset);
+  }
+
+  pthread_mutex_unlock(&stats_lock);
+}
+
+static const char *counter_names[] =
+{
+  "connections", "Connections accepted",
+  "connections_refused", "Connections turned away because the server was full",
+  "disconnects", "Connections closed",
+  "requests", "Requests received",
+  "not_found", "Requests answered with 404",
+  "frames_sent", "Frames sent to viewers",
+  "frames_skipped", "Frames viewers missed because they fell behind",
+  "bytes_sent", "Bytes of files and frames sent",
+  "send_stalls", "Times a socket was full in the middle of a frame",
+  "files_sent", "Files sent from htdocs_dir",
+  "captures", "Frames read from capture devices",
+  "encode_ns", "Time spent converting and compressing captured frames",
+  "frames_limited", "Frames dropped by limit_bytes or limit_frames",
+  NULL
+};
+
+static void json_histogram(
+  StatsBuffer *buffer,
+  const char *name,
+  Histogram *histogram,
+  const char *end)
+{
+  buffer_printf(buffer,
+    "\"%s\": { \"count\": %llu, \"mean_us\": %llu, \"p50_us\": %llu, "
+    "\"p90_us\": %llu, \"p99_us\": %llu, \"p999_us\": %llu, "
+    "\"max_us\": %llu }%s",
+    name,
+    (unsigned long long)histogram->count,
+    (unsigned long long)(histogram->count == 0 ? 0 :
+      histogram->sum / histogram->count),
+    (unsigned long long)histogram_percentile(histogram, 50),
+    (unsigned long long)histogram_percentile(histogram, 90),
+    (unsigned long long)histogram_percentile(histogram, 99),
+    (unsigned long long)histogram_percentile(histogram, 99.9),
+    (unsigned long long)histogram_percentile(histogram, 100),
+    end);
+}
+
+static void format_json(
+  StatsBuffer *buffer,
+  Config *config,
+  int active,
+  ThreadStats *total,
+  SourceStats *sources)
+{
+  uint64_t *values = &total->connections;
+  char name[256];
+  int listed = 0;
+  int n, k;
+
+  buffer_printf(buffer,
+    "{\n"
+    "  \"uptime\": %d,\n"
+    "  \"server_loop\": \"%s\",\n"
+    "  \"connections_active\": %d,\n",
+    (int)(time(NULL) - uptime),
+    config->server_loop == SERVER_LOOP_IO_URING ? "io_uring" : "select",
+    active);
+
+  for (n = 0; counter_names[n] != NULL; n = n + 2)
+  {
+    buffer_printf(buffer, "  \"%s\": %llu,\n",
+      counter_names[n],
+      (unsigned long long)values[n / 2]);
+  }
+
+  buffer_printf(buffer, "  ");
+  json_histogram(buffer, "request_static", &total->request_static, ",\n  ");
+  json_histogram(buffer, "request_snapshot", &total->request_snapshot, ",\n");
+
+  buffer_printf(buffer, "  \"threads\": [\n");
+
+  for (n = 0; n < STATS_SLOTS; n++)
+  {
+    ThreadStats *stats = &thread_stats[n];
+
+    if (n == STATS_ACCEPT_SLOT)
+    {
+      strcpy(name, "accept");
+    }
+      else
+    {
+      sprintf(name, "%d", n);
+    }
+
+    buffer_printf(buffer,
+      "    { \"thread\": \"%s\", \"requests\": %llu, \"frames_sent\": %llu, "
+      "\"bytes_sent\": %llu, \"send_stalls\": %llu }%s\n",
+      name,
+      (unsigned long long)__atomic_load_n(&stats->requests, __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->frames_sent, __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->bytes_sent, __ATOMIC_RELAXED),
+      (unsigned long long)__atomic_load_n(&stats->send_stalls, __ATOMIC_RELAXED),
+      n == STATS_SLOTS - 1 ? "" : ",");
+  }
+
+  buffer_printf(buffer, "  ],\n  \"sources\": [\n");
+
+  for (k = 0; k < source_count; k++)
+  {
+    Channel *channel = video[k]->channel;
+
+    // Sources a reload took out aren't listed so a new one can have
+    // the same name.
+    if (video[k]->removed == 1) { continue; }
+
+    source_name(name, sizeof(name), k);
+
+    buffer_printf(buffer,
+      "%s    {\n"
+      "      \"name\": \"%s\", \"viewers\": %d, \"frames_sent\": %llu, "
+      "\"frames_skipped\": %llu, \"bytes_sent\": %llu,\n      ",
+      listed == 0 ? "" : ",\n",
+      name,
+      channel == NULL ? 0 : __atomic_load_n(&channel->subscribers, __ATOMIC_RELAXED),
+      (unsigned long long)sources[k].frames_sent,
+      (unsigned long long)sources[k].frames_skipped,
+      (unsigned long long)sources[k].bytes_sent);
+
+    json_histogram(buffer, "capture", &sources[k].capture, ",\n      ");
+    json_histogram(buffer, "first_byte", &sources[k].first_byte, ",\n      ");
+    json_histogram(buffer, "frame_send", &sources[k].frame_send, "\n");
+
+    buffer_printf(buffer, "    }");
+    listed++;
+  }
+
+  buffer_printf(buffer, "%s  ]\n}\n", listed == 0 ? "" : "\n");
+}
+
+// Prometheus histograms are cumulative so only the power of two bucket
+// edges are given, not every bucket.
+static void prometheus_histogram(
+  StatsBuffer *buffer,
+  const char *name,
+  const char *label,
+  Histogram *histogram)
+{
+  uint64_t count = 0;
+  int bucket = 0;
+  int e;
+
+  for (e = HISTOGRAM_SUB_BITS; e <= HISTOGRAM_MAX_EXP + 1; e++)
+  {
+    while (bucket < HISTOGRAM_BUCKETS - 1 &&
+           histogram_bucket_high(bucket) < (1ULL << e))
+    {
+      count += histogram->buckets[bucket++];
+    }
+
+    buffer_printf(buffer, "%s_bucket{%s,le=\"%g\"} %llu\n",
+      name, label, (double)(1ULL << e) / 1000000, (unsigned long long)count);
+  }
+
+  buffer_printf(buffer,
+    "%s_bucket{%s,le=\"+Inf\"} %llu\n"
+    "%s_sum{%s} %g\n"
+    "%s_count{%s} %llu\n",
+    name, label, (unsigned long long)histogram->count,
+    name, label, (double)histogram->sum / 1000000,
+    name, label, (unsigned long long)histogram->count);
+}
+
+static void format_prometheus(
+  StatsBuffer *buffer,
+  Config *config,
+  int active,
+  ThreadStats *total,
+  SourceStats *sources)
+{
+  uint64_t *values = &total->connections;
+  char name[256];
+  char label[300];
+  int n, k;
+
+  buffer_printf(buffer,
+    "# HELP mjpeg_uptime_seconds Seconds since the server started.\n"
+    "# TYPE mjpeg_uptime_seconds gauge\n"
+    "mjpeg_uptime_seconds %d\n"
+    "# HELP mjpeg_connections_active Connections open, updated about once a second.\n"
+    "# TYPE mjpeg_connections_active gauge\n"
+    "mjpeg_connections_active %d\n",
+    (int)(time(NULL) - uptime),
+    active);
+
+  for (n = 0; counter_names[n] != NULL; n = n + 2)
+  {
+    buffer_printf(buffer,
+      "# HELP mjpeg_%s_total %s.\n"
+      "# TYPE mjpeg_%s_total counter\n"
+      "mjpeg_%s_total %llu\n",
+      counter_names[n],
+      counter_names[n + 1],
+      counter_names[n],
+      counter_names[n],
+      (unsigned long long)values[n / 2]);
+  }
+
+  buffer_printf(buffer,
+    "# HELP mjpeg_source_frames_sent_total Frames sent per source.\n"
+    "# TYPE mjpeg_source_frames_sent_total counter\n");
+
+  for (k = 0; k < source_count; k++)
+  {
+    if (video[k]->removed == 1) { continue; }
+
+    source_name(name, sizeof(name), k);
+    buffer_printf(buffer, "mjpeg_source_frames_sent_total{source=\"%s\"} %llu\n",
+      name, (unsigned long long)sources[k].frames_sent);
+  }
+
+  buffer_printf(buffer,
+    "# HELP mjpeg_source_frames_skipped_total Frames skipped per source.\n"
+    "# TYPE mjpeg_source_frames_skipped_total counter\n");
+
+  for (k = 0; k < source_count; k++)
+  {
+    if (video[k]->removed == 1) { continue; }
+
+    source_name(name, sizeof(name), k);
+    buffer_printf(buffer, "mjpeg_source_frames_skipped_total{source=\"%s\"} %llu\n",
+      name, (unsigned long long)sources[k].frames_skipped);
+  }
+
+  buffer_printf(buffer,
+    "# HELP mjpeg_source_bytes_sent_total Bytes sent per source.\n"
+    "# TYPE mjpeg_source_bytes_sent_total counter\n");
+
+  for (k = 0; k < source_count; k++)
+  {
+    if (video[k]->removed == 1) { continue; }
+
+    source_name(name, sizeof(name), k);
+    buffer_printf(buffer, "mjpeg_source_bytes_sent_total{source=\"%s\"} %llu\n",
+      name, (unsigned long long)sources[k].bytes_sent);
+  }
+
+  buffer_printf(buffer,
+    "# HELP mjpeg_request_first_byte_seconds Time from a request to the "
+    "first byte of the response.\n"
+    "# TYPE mjpeg_request_first_byte_seconds histogram\n");
+
+  prometheus_histogram(buffer, "mjpeg_request_first_byte_seconds",
+    "type=\"static\"", &total->request_static);
+  prometheus_histogram(buffer, "mjpeg_request_first_byte_seconds",
+    "type=\"snapshot\"", &total->request_snapshot);
+
+  buffer_printf(buffer,
+    "# HELP mjpeg_capture_seconds Time from a capture device handing over "
+    "a frame to the JPEG being ready.\n"
+    "# TYPE mjpeg_capture_seconds histogram\n");
+
+  for (k = 0; k < source_count; k++)
+  {
+    if (video[k]->removed == 1) { continue; }
+
+    source_name(name, sizeof(name), k);
+    snprintf(label, sizeof(label), "source=\"%s\"", name);
+    prometheus_histogram(buffer, "mjpeg_capture_seconds", label,
+      &sources[k].capture);
+  }
+
+  buffer_printf(buffer,
+    "# HELP mjpeg_frame_first_byte_seconds Time from a frame being ready "
+    "to its first byte being sent.\n"
+    "# TYPE mjpeg_frame_first_byte_seconds histogram\n");
+
+  for (k = 0; k < source_count; k++)
+  {
+    if (video[k]->removed == 1) { continue; }
+
+    source_name(name, sizeof(name), k);
+    snprintf(label, sizeof(label), "source=\"%s\"", name);
+    prometheus_histogram(buffer, "mjpeg_frame_first_byte_seconds", label,
+      &sources[k].first_byte);
+  }
+
+  buffer_printf(buffer,
+    "# HELP mjpeg_frame_send_seconds Time from the first to the last byte "
+    "of a frame.\n"
+    "# TYPE mjpeg_frame_send_seconds histogram\n");
+
+  for (k = 0; k < source_count; k++)
+  {
+    if (video[k]->removed == 1) { continue; }
+
+    source_name(name, sizeof(name), k);
+    snprintf(label, sizeof(label), "source=\"%s\"", name);
+    prometheus_histogram(buffer, "mjpeg_frame_send_seconds", label,
+      &sources[k].frame_send);
+  }
+}
+
+static int compare_bandwidth(const void *a, const void *b)
+{
+  const ConnectionInfo *info_a = (const ConnectionInfo *)a;
+  const ConnectionInfo *info_b = (const ConnectionInfo *)b;
+
+  if (info_a->bytes_per_second < info_b->bytes_per_second) { return 1; }
+  if (info_a->bytes_per_second > info_b->bytes_per_second) { return -1; }
+
+  return info_a->id - info_b->id;
+}
+
+static const char *connection_type(ConnectionInfo *info)
+{
+  if (info->state == STATE_IDLE) { return "idle"; }
+  if (info->state == STATE_HEADERS) { return "request"; }
+  if (info->video_num == -2) { return "file"; }
+  if (info->video_num == -3) { return "plugin"; }
+  if (info->video_num == VIDEO_NUM_STATS) { return "stats"; }
+  if (info->video_num == VIDEO_NUM_HLS) { return "hls"; }
+  if (info->video_num < 0) { return "error"; }
+  if (info->request_type == REQUEST_SINGLE) { return "snapshot"; }
+  if (info->request_type == REQUEST_WEBSOCKET) { return "websocket"; }
+  if (info->request_type == REQUEST_EVENTS) { return "events"; }
+
+  return "stream";
+}
+
+// The busiest connections come first.
+static void format_connections(
+  StatsBuffer *buffer,
+  ConnectionInfo *connections,
+  int count)
+{
+  time_t now = time(NULL);
+  char name[256];
+  int n;
+
+  qsort(connections, count, sizeof(ConnectionInfo), compare_bandwidth);
+
+  buffer_printf(buffer, "{\n  \"connections\": [\n");
+
+  for (n = 0; n < count; n++)
+  {
+    ConnectionInfo *info = &connections[n];
+
+    if (info->video_num >= 0 && info->video_num < source_count)
+    {
+      source_name(name, sizeof(name), info->video_num);
+    }
+      else
+    {
+      name[0] = 0;
+    }
+
+    info->location[sizeof(info->location) - 1] = 0;
+
+    buffer_printf(buffer,
+      "    { \"id\": %d, \"address\": \"%s\", \"source\": \"%s\", "
+      "\"type\": \"%s\", \"age\": %d, \"fps\": %.1f, "
+      "\"bytes_per_second\": %.0f, \"bytes_sent\": %llu, "
+      "\"frames_sent\": %u, \"frames_skipped\": %u, "
+      "\"queued\": %d, \"pending\": %d, \"adaptive_level\": %d }%s\n",
+      info->id,
+      info->location,
+      name,
+      connection_type(info),
+      (int)(now - info->logontime),
+      info->fps,
+      info->bytes_per_second,
+      (unsigned long long)info->bytes_sent,
+      info->frames_sent,
+      info->frames_skipped,
+      info->queued,
+      info->pending,
+      info->adaptive_level,
+      n == count - 1 ? "" : ",");
+  }
+
+  buffer_printf(buffer, "  ]\n}\n");
+}
+
+// Builds the page and sends it the same way error pages are sent. What
+// the query string asked for was left in stats_flags when the request
+// came in.
+int send_stats(int id, Config *config)
+{
+  StatsBuffer buffer;
+  ThreadStats total;
+  SourceStats *sources;
+  ConnectionInfo *connections;
+  int flags = users[id]->stats_flags;
+  int active;
+  int n, k;
+
+  active = stats_connections(&connections);
+
+  buffer.alloc = 4096;
+  buffer.length = 0;
+  buffer.data = (char *)malloc(buffer.alloc);
+
+  sources = (SourceStats *)calloc(source_alloc + 1, sizeof(SourceStats));
+
+  if (buffer.data == NULL || sources == NULL || connections == NULL)
+  {
+    free(buffer.data);
+    free(sources);
+    free(connections);
+    user_disconnect(users[id]);
+    return -1;
+  }
+
+  stats_sum(&total, sources);
+  stats_baseline(&total, sources, (flags & STATS_RESET) != 0);
+
+  if ((flags & STATS_CONNECTIONS) != 0)
+  {
+    users[id]->mime_type = MIME_TYPE_JSON;
+    format_connections(&buffer, connections, active);
+  }
+    else
+  if ((flags & STATS_PROMETHEUS) != 0)
+  {
+    users[id]->mime_type = MIME_TYPE_TEXT;
+    format_prometheus(&buffer, config, active, &total, sources);
+  }
+    else
+  {
+    users[id]->mime_type = MIME_TYPE_JSON;
+    format_json(&buffer, config, active, &total, sources);
+  }
+
+  free(sources);
+  free(connections);
+
+  users[id]->content_length = buffer.length;
+
+  send_header(id);
+
+  for (n = 0; n < buffer.length && users[id]->inuse == 1; n = n + k)
+  {
+    k = send_data(users[id]->socketid, buffer.data + n, buffer.length - n);
+
+    if (k <= 0)
+    {
+      user_disconnect(users[id]);
+      break;
+    }
+  }
+
+  free(buffer.data);
+
+  users[id]->video_num = -1;
+  users[id]->state = STATE_IDLE;
+
+  return 0;
+}
+
@@ -0,0 +1,133 @@
+/*
+
+  mjpeg_webserver - Web server optimized for JPEGs from a webcam or AVI file.
+
+  Copyright 2004-2024 - Michael Kohn (mike@mikekohn.net)
+  https://www.mikekohn.net/
+
+  This program falls under the GPLv3 license.
+
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "config.h"
+#include "server.h"
+#include "user.h"
+
+#define STATS_CACHE_LINE 64
+
+// One slot per worker thread plus one for the thread that accepts
+// connections.
+#define STATS_SLOTS (MAX_USER_THREADS + 1)
+#define STATS_ACCEPT_SLOT MAX_USER_THREADS
+
+// Sources added by reloading the conf file are counted in these. Any
+// past that aren't counted per source.
+#define STATS_SPARE_SOURCES 16
+
+// Bits returned by stats_match() for what the query string asked for.
+#define STATS_PROMETHEUS 1
+#define STATS_RESET 2
+#define STATS_CONNECTIONS 4
+
+// Log-linear buckets in microseconds: values below HISTOGRAM_SUB get a
+// bucket each, above that every power of two is split into HISTOGRAM_SUB
+// buckets so a value is never off by more than 1/HISTOGRAM_SUB. Anything
+// over 2^(HISTOGRAM_MAX_EXP + 1) us (about 67 seconds) goes in the last
+// bucket.
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_EXP 25
+#define HISTOGRAM_BUCKETS \
+  ((HISTOGRAM_MAX_EXP - HISTOGRAM_SUB_BITS + 2) * HISTOGRAM_SUB)
+
+typedef struct Histogram
+{
+  uint64_t count;
+  uint64_t sum;
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+} Histogram;
+
+typedef struct SourceStats
+{
+  uint64_t frames_sent;
+  uint64_t frames_skipped;
+  uint64_t bytes_sent;
+  // Capture device handing over a frame (DQBUF) to the JPEG being ready.
+  Histogram capture;
+  // JPEG ready (or an AVI frame published) to its first byte being sent.
+  Histogram first_byte;
+  // First byte to last byte of a frame.
+  Histogram frame_send;
+} SourceStats;
+
+// Only the thread that owns a slot writes to it so there are no locks
+// or atomic read-modify-writes, and each slot (and its sources array)
+// starts on its own cache line so the workers never write to a line
+// another thread writes to. The /stats page adds the slots up.
+typedef struct ThreadStats
+{
+  uint64_t connections;
+  uint64_t connections_refused;
+  uint64_t disconnects;
+  uint64_t requests;
+  uint64_t not_found;
+  uint64_t frames_sent;
+  uint64_t frames_skipped;
+  uint64_t bytes_sent;
+  uint64_t send_stalls;
+  uint64_t files_sent;
+  uint64_t captures;
+  uint64_t encode_ns;
+  uint64_t frames_limited;
+  // Request line read to first byte of the response.
+  Histogram request_static;
+  Histogram request_snapshot;
+  SourceStats *sources;
+} __attribute__((aligned(STATS_CACHE_LINE))) ThreadStats;
+
+// What <stats_url>/connections lists for each connection. Every worker
+// thread fills these in for its own connections about once a second so
+// the page never reads a User another thread is changing.
+typedef struct ConnectionInfo
+{
+  char location[64];
+  int id;
+  int video_num;
+  int request_type;
+  int state;
+  int queued;
+  int pending;
+  int adaptive_level;
+  uint32_t frames_sent;
+  uint32_t frames_skipped;
+  uint64_t bytes_sent;
+  time_t logontime;
+  float fps;
+  float bytes_per_second;
+} ConnectionInfo;
+
+// Relaxed stores so a reader on another thread never sees a torn value.
+#define STATS_ADD(stats, field, value) \
+  __atomic_store_n(&(stats)->field, (stats)->field + (value), __ATOMIC_RELAXED)
+
+int stats_init(int source_count);
+void stats_sources(int source_count);
+void stats_free();
+void stats_log();
+ThreadStats *stats_thread(int slot);
+ThreadStats *stats_user(User *user);
+void stats_source_add(User *user, int frames, int skipped, int bytes);
+SourceStats *stats_source(User *user);
+void histogram_add(Histogram *histogram, int64_t ns);
+void stats_snapshot(ThreadContext *thread_context);
+int stats_match(Config *config, const char *path);
+int send_stats(int id, Config *config);
+
+#endif
+
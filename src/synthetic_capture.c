@@ -0,0 +1,314 @@
+/*
+
+  mjpeg_webserver - Web server optimized for JPEGs from a webcam or AVI file.
+
+  Copyright 2004-2024 - Michael Kohn (mike@mikekohn.net)
+  https://www.mikekohn.net/
+
+  This program falls under the GPLv3 license.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "capture.h"
+#include "general.h"
+#include "jpeg_compress.h"
+
+// A capture device that makes its own frames so the convert, encode and
+// send path can be load tested without a camera:
+//
+//   capture synthetic:yuyv
+//   {
+//     size 640x480
+//     max_fps 30
+//   }
+//
+// The format after "synthetic:" is yuyv, bgr24, bayer or mjpeg. Frames
+// come out in the same pixel format a webcam would give so they go
+// through the same conversions. Like a real device, reading blocks until
+// the next frame is due (max_fps 0 means as fast as possible).
+
+// Color bars with diagonal stripes and some noise so the JPEGs aren't
+// unrealistically small. The picture scrolls sideways one step per
+// frame and repeats every PATTERN_ROWS rows.
+#define PATTERN_ROWS 64
+#define SCROLL_STEP 4
+
+typedef struct SyntheticFormat
+{
+  const char *name;
+  uint32_t pixelformat;
+  int bytes_per_pixel;
+} SyntheticFormat;
+
+static SyntheticFormat formats[] =
+{
+  { "yuyv",  V4L2_PIX_FMT_YUYV,   2 },
+  { "bgr24", V4L2_PIX_FMT_BGR24,  3 },
+  { "bayer", V4L2_PIX_FMT_SBGGR8, 1 },
+  { "mjpeg", V4L2_PIX_FMT_MJPEG,  3 },
+  { NULL, 0, 0 }
+};
+
+static const uint8_t bars[8][3] =
+{
+  { 192, 192, 192 },
+  { 192, 192,   0 },
+  {   0, 192, 192 },
+  {   0, 192,   0 },
+  { 192,   0, 192 },
+  { 192,   0,   0 },
+  {   0,   0, 192 },
+  {  16,  16,  16 },
+};
+
+static void pattern_pixel(int x, int y, int width, uint8_t *rgb)
+{
+  const uint8_t *bar = bars[((x % width) * 8 / width) & 7];
+  uint32_t noise = (uint32_t)(x * 73856093) ^ (uint32_t)(y * 19349663);
+  int n, value;
+
+  noise = (noise ^ (noise >> 13)) * 0x5bd1e995;
+  value = (((x + y) >> 2) & 7) * 6 + ((noise >> 24) & 15) - 8;
+
+  for (n = 0; n < 3; n++)
+  {
+    int c = bar[n] + value;
+
+    rgb[n] = c < 0 ? 0 : (c > 255 ? 255 : c);
+  }
+}
+
+static int format_bytes_per_pixel(CaptureInfo *capture_info)
+{
+  int n;
+
+  for (n = 0; formats[n].name != NULL; n++)
+  {
+    if (formats[n].pixelformat == capture_info->vid_fmt.fmt.pix.pixelformat)
+    {
+      return formats[n].bytes_per_pixel;
+    }
+  }
+
+  return 0;
+}
+
+// Each pattern row is two frames wide so a scrolled row is one memcpy().
+static void build_pattern(CaptureInfo *capture_info)
+{
+  uint32_t pixelformat = capture_info->vid_fmt.fmt.pix.pixelformat;
+  int width = capture_info->width;
+  int row_len = width * 2 * format_bytes_per_pixel(capture_info);
+  uint8_t rgb[6];
+  uint8_t *row;
+  int x, y;
+
+  for (y = 0; y < PATTERN_ROWS; y++)
+  {
+    row = capture_info->pattern + y * row_len;
+
+    for (x = 0; x < width * 2; x = x + 2)
+    {
+      pattern_pixel(x, y, width, rgb);
+      pattern_pixel(x + 1, y, width, rgb + 3);
+
+      if (pixelformat == V4L2_PIX_FMT_YUYV)
+      {
+        int r = (rgb[0] + rgb[3]) >> 1;
+        int g = (rgb[1] + rgb[4]) >> 1;
+        int b = (rgb[2] + rgb[5]) >> 1;
+
+        row[x * 2 + 0] = ((66 * rgb[0] + 129 * rgb[1] + 25 * rgb[2] + 128) >> 8) + 16;
+        row[x * 2 + 1] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+        row[x * 2 + 2] = ((66 * rgb[3] + 129 * rgb[4] + 25 * rgb[5] + 128) >> 8) + 16;
+        row[x * 2 + 3] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+      }
+        else
+      if (pixelformat == V4L2_PIX_FMT_SBGGR8)
+      {
+        // BGBG... on even rows and GRGR... on odd rows.
+        if ((y & 1) == 0)
+        {
+          row[x + 0] = rgb[2];
+          row[x + 1] = rgb[4];
+        }
+          else
+        {
+          row[x + 0] = rgb[1];
+          row[x + 1] = rgb[3];
+        }
+      }
+        else
+      if (pixelformat == V4L2_PIX_FMT_BGR24)
+      {
+        row[x * 3 + 0] = rgb[2];
+        row[x * 3 + 1] = rgb[1];
+        row[x * 3 + 2] = rgb[0];
+        row[x * 3 + 3] = rgb[5];
+        row[x * 3 + 4] = rgb[4];
+        row[x * 3 + 5] = rgb[3];
+      }
+        else
+      {
+        memcpy(row + x * 3, rgb, 6);
+      }
+    }
+  }
+}
+
+int synthetic_open(CaptureInfo *capture_info, const char *dev_name)
+{
+  const char *name = strchr(dev_name, ':') + 1;
+  int bytes_per_pixel;
+  int n;
+
+  if (*name == 0) { name = "yuyv"; }
+
+  for (n = 0; formats[n].name != NULL; n++)
+  {
+    if (strcasecmp(formats[n].name, name) == 0) { break; }
+  }
+
+  if (formats[n].name == NULL)
+  {
+    printf("Unknown synthetic format '%s' (yuyv, bgr24, bayer or mjpeg)\n", name);
+    return -1;
+  }
+
+  // YUYV and Bayer work on pairs of pixels and pairs of rows.
+  capture_info->width &= ~1;
+  capture_info->height &= ~1;
+
+  if (capture_info->width <= 0 || capture_info->height <= 0)
+  {
+    printf("Bad size for %s\n", dev_name);
+    return -1;
+  }
+
+  memset(&capture_info->vid_fmt, 0, sizeof(capture_info->vid_fmt));
+  capture_info->vid_fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  capture_info->vid_fmt.fmt.pix.width = capture_info->width;
+  capture_info->vid_fmt.fmt.pix.height = capture_info->height;
+  capture_info->vid_fmt.fmt.pix.pixelformat = formats[n].pixelformat;
+
+  bytes_per_pixel = formats[n].bytes_per_pixel;
+
+  capture_info->synthetic = 1;
+  capture_info->video_fd = -1;
+  capture_info->frame_count = 0;
+  capture_info->start_time = get_time_ns();
+  capture_info->buffer_len = capture_info->width * capture_info->height * bytes_per_pixel;
+  capture_info->buffer = (uint8_t *)malloc(capture_info->buffer_len);
+  capture_info->picture =
+    (uint8_t *)malloc(capture_info->width * capture_info->height * 3);
+  capture_info->pattern =
+    (uint8_t *)malloc(capture_info->width * 2 * bytes_per_pixel * PATTERN_ROWS);
+
+  if (capture_info->buffer == NULL ||
+      capture_info->picture == NULL ||
+      capture_info->pattern == NULL)
+  {
+    synthetic_close(capture_info);
+    printf("Out of memory for %s\n", dev_name);
+    return -1;
+  }
+
+  build_pattern(capture_info);
+
+  printf("Synthetic %s source %dx%d\n",
+    formats[n].name,
+    capture_info->width,
+    capture_info->height);
+
+  return 0;
+}
+
+// Waits for the next frame like VIDIOC_DQBUF would. When the readers
+// fall more than a frame behind the frames they missed are skipped.
+static void synthetic_wait(CaptureInfo *capture_info)
+{
+  struct timespec ts;
+  int64_t now, due, elapsed;
+
+  if (capture_info->max_fps <= 0) { return; }
+
+  now = get_time_ns();
+  elapsed = now - capture_info->start_time;
+
+  due = (int64_t)capture_info->frame_count * 1000000000 / capture_info->max_fps;
+
+  if (elapsed > due + 1000000000 / capture_info->max_fps)
+  {
+    capture_info->frame_count = elapsed * capture_info->max_fps / 1000000000;
+    return;
+  }
+
+  if (elapsed >= due) { return; }
+
+  ts.tv_sec = (due - elapsed) / 1000000000;
+  ts.tv_nsec = (due - elapsed) % 1000000000;
+
+  nanosleep(&ts, NULL);
+}
+
+int synthetic_read(CaptureInfo *capture_info, uint8_t *buffer, int len)
+{
+  uint32_t pixelformat = capture_info->vid_fmt.fmt.pix.pixelformat;
+  int width = capture_info->width;
+  int height = capture_info->height;
+  int bytes_per_pixel = format_bytes_per_pixel(capture_info);
+  int row_len = width * bytes_per_pixel;
+  int shift, y;
+  uint8_t *dest;
+
+  synthetic_wait(capture_info);
+
+  shift = (capture_info->frame_count * SCROLL_STEP) % width;
+  capture_info->frame_count++;
+
+  // MJPEG cameras do the compression, so that happens here.
+  dest = pixelformat == V4L2_PIX_FMT_MJPEG ? capture_info->picture : buffer;
+
+  if (dest == buffer && len < row_len * height) { return -1; }
+
+  for (y = 0; y < height; y++)
+  {
+    memcpy(dest + y * row_len,
+      capture_info->pattern + (y % PATTERN_ROWS) * row_len * 2 + shift * bytes_per_pixel,
+      row_len);
+  }
+
+  if (pixelformat == V4L2_PIX_FMT_MJPEG)
+  {
+    return jpeg_compress(
+      capture_info->picture,
+      row_len * height,
+      buffer,
+      len,
+      width,
+      height,
+      3,
+      80);
+  }
+
+  return row_len * height;
+}
+
+void synthetic_close(CaptureInfo *capture_info)
+{
+  free(capture_info->buffer);
+  free(capture_info->picture);
+  free(capture_info->pattern);
+
+  capture_info->buffer = NULL;
+  capture_info->picture = NULL;
+  capture_info->pattern = NULL;
+}
+
@@ -0,0 +1,754 @@
+/*
+
+  mjpeg_webserver - Web server optimized for JPEGs from a webcam or AVI file.
+
+  Copyright 2004-2024 - Michael Kohn (mike@mikekohn.net)
+  https://www.mikekohn.net/
+
+  This program falls under the GPLv3 license.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#if !defined(WINDOWS) && !defined(ENABLE_ESP32)
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#endif
+
+#ifdef ENABLE_CAPTURE
+#include "capture.h"
+#endif
+
+#include "config.h"
+#include "general.h"
+#include "globals.h"
+#include "hls.h"
+#ifdef V4L2
+#include "recorder.h"
+#endif
+#include "reload.h"
+#include "upgrade.h"
+#ifdef ENABLE_IO_URING
+#include "uring_server.h"
+#endif
+#include "user.h"
+#include "video.h"
+
+/*
+
+Binary upgrade, started with SIGUSR2.
+
+The old server runs its binary again (with the arguments it was started
+with) and UPGRADE_ENV set to its end of a SOCK_SEQPACKET socket pair.
+The new server reads the conf like any other start except that it asks
+the old one to let go of each capture device before opening it. Viewers
+of that source wait between frames from then on. Once it has read the
+conf the new server says it's ready and the old one sends where every
+file source is playing and the listening socket. From then on the old
+server's workers send over each connection as soon as it's between
+frames or requests and its accept loop forwards whatever it accepts.
+It exits once it has nothing left or after drain_timeout seconds. If
+the new server doesn't get that far the old one opens its devices again
+and carries on.
+
+*/
+
+static char **upgrade_argv = NULL;
+
+// The other server's end of the socket pair. In the new server starting
+// is set until it has read its conf and adopting until the old server
+// has exited.
+static int upgrade_fd = -1;
+static int starting = 0;
+static int adopting = 0;
+static int handing_off = 0;
+
+#if !defined(WINDOWS) && !defined(ENABLE_ESP32)
+// Sends message with socketid (if it isn't -1). Returns -1 on error.
+static int upgrade_send(UpgradeMessage *message, int socketid)
+{
+  char control[CMSG_SPACE(sizeof(int))];
+  struct cmsghdr *cmsg;
+  struct msghdr msg;
+  struct iovec iov;
+  int r;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = message;
+  iov.iov_len = sizeof(UpgradeMessage);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  if (socketid != -1)
+  {
+    memset(control, 0, sizeof(control));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &socketid, sizeof(int));
+  }
+
+  do
+  {
+    r = sendmsg(upgrade_fd, &msg, MSG_NOSIGNAL);
+  } while (r == -1 && errno == EINTR);
+
+  return r == sizeof(UpgradeMessage) ? 0 : -1;
+}
+
+// Waits for the next message. socketid is set to the socket that came
+// with it or -1. Returns 0 or less once the other server has gone.
+static int upgrade_recv(UpgradeMessage *message, int *socketid)
+{
+  char control[CMSG_SPACE(sizeof(int))];
+  struct cmsghdr *cmsg;
+  struct msghdr msg;
+  struct iovec iov;
+  int r;
+
+  *socketid = -1;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = message;
+  iov.iov_len = sizeof(UpgradeMessage);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  do
+  {
+    r = recvmsg(upgrade_fd, &msg, 0);
+  } while (r == -1 && errno == EINTR);
+
+  if (r <= 0) { return r; }
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+  {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+      memcpy(socketid, CMSG_DATA(cmsg), sizeof(int));
+    }
+  }
+
+  if (r != sizeof(UpgradeMessage))
+  {
+    if (*socketid != -1) { close(*socketid); }
+    *socketid = -1;
+    message->type = 0;
+    return r;
+  }
+
+  message->name[sizeof(message->name) - 1] = 0;
+  message->path[sizeof(message->path) - 1] = 0;
+
+  return r;
+}
+
+static void upgrade_describe(UpgradeMessage *message, Video *curr_video)
+{
+  const char *path = curr_video->filename;
+
+#ifdef ENABLE_CAPTURE
+  if (path == NULL) { path = curr_video->device; }
+#endif
+
+  if (curr_video->name != NULL)
+  {
+    snprintf(message->name, sizeof(message->name), "%s", curr_video->name);
+  }
+
+  if (path != NULL)
+  {
+    snprintf(message->path, sizeof(message->path), "%s", path);
+  }
+}
+
+// This server's number for the source the other one described, matched
+// the same way a reload matches them. Returns -1 if there isn't one.
+static int upgrade_find_source(UpgradeMessage *message)
+{
+  Video *curr_video;
+  const char *path;
+  int n;
+
+  for (n = 0; n < video_count; n++)
+  {
+    curr_video = video[n];
+    path = curr_video->filename;
+
+#ifdef ENABLE_CAPTURE
+    if (path == NULL) { path = curr_video->device; }
+#endif
+
+    if (curr_video->removed != 0 || path == NULL) { continue; }
+
+    if (strcmp(path, message->path) == 0 &&
+        strcmp(curr_video->name != NULL ? curr_video->name : "", message->name) == 0)
+    {
+      return n;
+    }
+  }
+
+  return -1;
+}
+
+#ifdef ENABLE_CAPTURE
+// The new server wants the device at path. Viewers of the source wait
+// between frames from now on and its recording is finished.
+static void upgrade_release_device(const char *path)
+{
+  Video *curr_video;
+  int n;
+
+  for (n = 0; n < video_count; n++)
+  {
+    curr_video = video[n];
+
+    if (curr_video->removed != 0 ||
+        curr_video->handed_over != 0 ||
+        curr_video->capture_info == NULL ||
+        strcmp(curr_video->device, path) != 0)
+    {
+      continue;
+    }
+
+    __atomic_store_n(&curr_video->handed_over, 1, __ATOMIC_SEQ_CST);
+
+    // Once every worker has seen that none of them can be capturing.
+    reload_synchronize();
+
+#ifdef V4L2
+    recorder_destroy(curr_video->recorder);
+    curr_video->recorder = NULL;
+#endif
+    hls_destroy(curr_video->hls);
+    curr_video->hls = NULL;
+
+    close_capture(curr_video->capture_info);
+  }
+}
+
+// The new server didn't start. Recordings aren't started again.
+static void upgrade_reopen_devices()
+{
+  Video *curr_video;
+  int n;
+
+  for (n = 0; n < video_count; n++)
+  {
+    curr_video = video[n];
+
+    if (curr_video->handed_over == 0) { continue; }
+
+    if (open_capture(curr_video->capture_info, curr_video->device) != 0)
+    {
+      printf("Couldn't open capture for device %s again\n", curr_video->device);
+
+      // Stays handed over so the device isn't closed twice.
+      reload_remove_source(n);
+      continue;
+    }
+
+    __atomic_store_n(&curr_video->handed_over, 0, __ATOMIC_SEQ_CST);
+  }
+}
+#endif
+
+// In the forked child: runs the binary again with only stdin, stdout,
+// stderr and its end of the socket pair open so connections closed by
+// the old server aren't held open by the new one.
+static void upgrade_exec(int fd)
+{
+  int max = sysconf(_SC_OPEN_MAX);
+  int null, n;
+
+  if (fd != UPGRADE_CHILD_FD)
+  {
+    dup2(fd, UPGRADE_CHILD_FD);
+    close(fd);
+  }
+
+  // A server that isn't in debug mode has closed these.
+  null = open("/dev/null", O_RDWR);
+
+  for (n = 0; n < 3; n++)
+  {
+    if (fcntl(n, F_GETFD) == -1) { dup2(null, n); }
+  }
+
+  if (null > UPGRADE_CHILD_FD) { close(null); }
+
+  for (n = UPGRADE_CHILD_FD + 1; n < max; n++) { close(n); }
+
+  execvp(upgrade_argv[0], upgrade_argv);
+}
+
+// Lets go of capture devices as the new server asks for them until it
+// says it's ready. Returns -1 if it went away or took too long.
+static int upgrade_wait_ready()
+{
+  UpgradeMessage message;
+  struct pollfd pfd;
+  time_t start = time(NULL);
+  int socketid, r;
+
+  while (time(NULL) - start < UPGRADE_WAIT_SECONDS)
+  {
+    pfd.fd = upgrade_fd;
+    pfd.events = POLLIN;
+
+    r = poll(&pfd, 1, 1000);
+
+    if (r == -1 && errno != EINTR) { return -1; }
+    if (r <= 0) { continue; }
+
+    if (upgrade_recv(&message, &socketid) <= 0) { return -1; }
+    if (socketid != -1) { close(socketid); }
+
+    if (message.type == UPGRADE_READY) { return 0; }
+
+    if (message.type == UPGRADE_RELEASE)
+    {
+#ifdef ENABLE_CAPTURE
+      upgrade_release_device(message.path);
+#endif
+      message.type = UPGRADE_RELEASED;
+
+      if (upgrade_send(&message, -1) != 0) { return -1; }
+    }
+  }
+
+  return -1;
+}
+
+int upgrade_init(int argc, char *argv[])
+{
+  const char *value = getenv(UPGRADE_ENV);
+
+  upgrade_argv = argv;
+
+  if (value == NULL) { return 0; }
+
+  upgrade_fd = atoi(value);
+  starting = 1;
+  adopting = 1;
+  unsetenv(UPGRADE_ENV);
+
+  // CGI programs and the next upgrade don't get it.
+  fcntl(upgrade_fd, F_SETFD, FD_CLOEXEC);
+
+  return 1;
+}
+
+// SIGUSR2 handler.
+void upgrade_signal()
+{
+  reload_wake('u');
+}
+
+// Starts the new server and hands everything over to it. This only
+// returns if the new server couldn't start, otherwise this one exits.
+void upgrade_start(Config *config)
+{
+  UpgradeMessage message;
+  char value[16];
+  time_t start;
+  int pair[2];
+  int count, n;
+  pid_t pid;
+
+  if (upgrade_fd != -1)
+  {
+    printf("Still taking over from the old server, not upgrading.\n");
+    return;
+  }
+
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pair) != 0)
+  {
+    printf("Couldn't make a socket for the upgrade.\n");
+    return;
+  }
+
+  snprintf(value, sizeof(value), "%d", UPGRADE_CHILD_FD);
+  setenv(UPGRADE_ENV, value, 1);
+
+  pid = fork();
+
+  if (pid == 0)
+  {
+    upgrade_exec(pair[1]);
+    _exit(1);
+  }
+
+  unsetenv(UPGRADE_ENV);
+  close(pair[1]);
+
+  if (pid == -1)
+  {
+    printf("Couldn't fork for the upgrade.\n");
+    close(pair[0]);
+    return;
+  }
+
+  printf("Upgrading to %s (pid %d)\n", upgrade_argv[0], (int)pid);
+  fflush(stdout);
+
+  fcntl(pair[0], F_SETFD, FD_CLOEXEC);
+  upgrade_fd = pair[0];
+
+  if (upgrade_wait_ready() != 0)
+  {
+    printf("The new server didn't start, keeping this one.\n");
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(upgrade_fd);
+    upgrade_fd = -1;
+#ifdef ENABLE_CAPTURE
+    upgrade_reopen_devices();
+#endif
+    fflush(stdout);
+    return;
+  }
+
+  // Viewers of a file carry on from the frame they were on.
+  for (n = 0; n < video_count; n++)
+  {
+    if (video[n]->removed != 0 || video[n]->channel == NULL) { continue; }
+
+    memset(&message, 0, sizeof(message));
+    message.type = UPGRADE_CLOCK;
+    message.start_time = __atomic_load_n(&video[n]->start_time, __ATOMIC_ACQUIRE);
+    upgrade_describe(&message, video[n]);
+    upgrade_send(&message, -1);
+  }
+
+  memset(&message, 0, sizeof(message));
+  message.type = UPGRADE_LISTEN;
+  upgrade_send(&message, sockfd);
+
+  __atomic_store_n(&handing_off, 1, __ATOMIC_SEQ_CST);
+
+  start = time(NULL);
+
+  while (1)
+  {
+    count = 0;
+
+    for (n = 0; n < config->maxconn; n++)
+    {
+      if (users[n]->inuse == 1) { count++; }
+    }
+
+    if (count == 0 || time(NULL) - start >= config->drain_timeout) { break; }
+
+    usleep(100000);
+  }
+
+  printf("Handed over to pid %d, closing %d connections and exiting.\n",
+    (int)pid, count);
+  fflush(stdout);
+
+  destroy();
+}
+
+// Called by the new server before it opens a capture device. Returns
+// once the old server isn't using it.
+int upgrade_release(const char *device)
+{
+  UpgradeMessage message;
+  int socketid;
+
+  if (starting == 0) { return 0; }
+
+  memset(&message, 0, sizeof(message));
+  message.type = UPGRADE_RELEASE;
+  snprintf(message.path, sizeof(message.path), "%s", device);
+
+  if (upgrade_send(&message, -1) != 0) { return -1; }
+
+  while (upgrade_recv(&message, &socketid) > 0)
+  {
+    if (socketid != -1) { close(socketid); }
+    if (message.type == UPGRADE_RELEASED) { return 0; }
+  }
+
+  return -1;
+}
+
+// Tells the old server this one has read its conf. Returns the
+// listening socket it sends back, or -1 if this isn't an upgrade.
+int upgrade_listen()
+{
+  UpgradeMessage message;
+  int socketid, n;
+
+  if (starting == 0) { return -1; }
+
+  starting = 0;
+
+  memset(&message, 0, sizeof(message));
+  message.type = UPGRADE_READY;
+
+  if (upgrade_send(&message, -1) != 0) { return -1; }
+
+  while (upgrade_recv(&message, &socketid) > 0)
+  {
+    if (message.type == UPGRADE_LISTEN) { return socketid; }
+
+    if (message.type == UPGRADE_CLOCK)
+    {
+      n = upgrade_find_source(&message);
+
+      if (n != -1 && video[n]->channel != NULL)
+      {
+        __atomic_store_n(&video[n]->start_time, message.start_time, __ATOMIC_RELEASE);
+      }
+    }
+
+    if (socketid != -1) { close(socketid); }
+  }
+
+  return -1;
+}
+
+// Picks a stream up where the old server left it, after the frame it
+// had just sent.
+static void upgrade_resume(User *user, UpgradeMessage *message, int video_num)
+{
+  user->video_num = video_num;
+  user->method = METHOD_GET;
+  user->request_time = get_time_ns();
+  user->request_type = message->request_type;
+  user->need_header = NEED_HEADER_YES;
+  user->frame_rate = message->frame_rate;
+#ifdef ENABLE_CAPTURE
+  user->jpeg_quality = message->jpeg_quality;
+#endif
+  user->last_frame = message->last_frame;
+  user->flags = message->flags;
+  user->frames_sent = message->frames_sent;
+  user->frames_skipped = message->frames_skipped;
+  user->history_time = message->history_time;
+  user->play_start = message->play_start;
+  user->play_tick = message->play_tick;
+
+  // Last so a worker doesn't see it half done.
+  __atomic_store_n(&user->state, STATE_SEND_FILE, __ATOMIC_RELEASE);
+}
+
+// Runs on the new server's accept thread while the old server is still
+// there, taking whatever it hands over. The old server accepts (and
+// forwards) new connections until it exits. added is called with each
+// connection once it's set up.
+void upgrade_adopt(void (*added)(int id))
+{
+  UpgradeMessage message;
+  struct sockaddr_in cli_addr;
+  socklen_t clilen;
+  Config *config;
+  int socketid, video_num, id;
+
+  if (upgrade_fd == -1) { return; }
+
+  while (upgrade_recv(&message, &socketid) > 0)
+  {
+    if (socketid == -1) { continue; }
+
+    video_num = -1;
+
+    if (message.type == UPGRADE_STREAM)
+    {
+      video_num = upgrade_find_source(&message);
+
+      // The new conf doesn't have it.
+      if (video_num == -1)
+      {
+        close(socketid);
+        continue;
+      }
+    }
+
+    clilen = sizeof(cli_addr);
+    memset(&cli_addr, 0, sizeof(cli_addr));
+    getpeername(socketid, (struct sockaddr *)&cli_addr, &clilen);
+
+    config = reload_enter(RELOAD_ACCEPT_SLOT);
+    id = user_connect(config, socketid, &cli_addr);
+
+    if (id >= 0 && video_num != -1)
+    {
+      upgrade_resume(users[id], &message, video_num);
+    }
+
+    reload_exit(RELOAD_ACCEPT_SLOT);
+
+    if (id >= 0 && added != NULL) { added(id); }
+  }
+
+  close(upgrade_fd);
+  upgrade_fd = -1;
+
+  __atomic_store_n(&adopting, 0, __ATOMIC_RELEASE);
+
+  printf("Took over from the old server.\n");
+  fflush(stdout);
+}
+
+// Sends a connection to the new server if it's between frames or
+// requests. Returns 0 if it went.
+int upgrade_hand_off(User *user)
+{
+  UpgradeMessage message;
+  int socketid = user->socketid;
+
+  if (user->inuse != 1 ||
+      user->send_blocked != 0 ||
+      user->frame != NULL ||
+      user->in_ptr < user->in_len)
+  {
+    return -1;
+  }
+
+#ifdef ZEROCOPY
+  // The kernel is still reading the frames out of this process.
+  if (user->zerocopy_count != 0) { return -1; }
+#endif
+
+  memset(&message, 0, sizeof(message));
+
+  if (user->state == STATE_IDLE)
+  {
+    message.type = UPGRADE_ACCEPT;
+  }
+    else
+  if (user->state == STATE_SEND_FILE &&
+      user->video_num >= 0 &&
+      user->video_num < video_count &&
+      video[user->video_num]->removed == 0 &&
+      user->need_header == NEED_HEADER_YES &&
+      user->websocket.upgrade == 0 &&
+      user->websocket.pong_len < 0 &&
+      user->websocket.partial_len == 0 &&
+      user->websocket.skip == 0)
+  {
+    message.type = UPGRADE_STREAM;
+    message.request_type = user->request_type;
+    message.frame_rate = user->frame_rate;
+#ifdef ENABLE_CAPTURE
+    message.jpeg_quality = user->jpeg_quality;
+#endif
+    message.last_frame = user->last_frame;
+    message.flags = user->flags;
+    message.frames_sent = user->frames_sent;
+    message.frames_skipped = user->frames_skipped;
+    message.history_time = user->history_time;
+    message.play_start = user->play_start;
+    message.play_tick = user->play_tick;
+    upgrade_describe(&message, video[user->video_num]);
+  }
+    else
+  {
+    return -1;
+  }
+
+#ifdef ENABLE_IO_URING
+  // With io_uring there's always a recv waiting on the socket that
+  // could take what the client sends next.
+  if (user->io_uring != 0 && uring_server_release(user) != 0) { return -1; }
+#endif
+
+  if (upgrade_send(&message, socketid) != 0) { return -1; }
+
+  // The new server has the socket so it's closed here without ending
+  // the connection.
+  user->inuse = 4;
+  user_disconnect(user);
+  close(socketid);
+
+  return 0;
+}
+
+// The old server's accept loops give each new connection to this once
+// the new server has the listening socket. Returns 0 if it went.
+int upgrade_forward(int socketid)
+{
+  UpgradeMessage message;
+
+  if (upgrade_handing_off() == 0) { return -1; }
+
+  memset(&message, 0, sizeof(message));
+  message.type = UPGRADE_ACCEPT;
+
+  if (upgrade_send(&message, socketid) != 0) { return -1; }
+
+  close(socketid);
+
+  return 0;
+}
+#else
+int upgrade_init(int argc, char *argv[])
+{
+  upgrade_argv = argv;
+
+  return 0;
+}
+
+void upgrade_signal()
+{
+}
+
+void upgrade_start(Config *config)
+{
+}
+
+int upgrade_release(const char *device)
+{
+  return 0;
+}
+
+int upgrade_listen()
+{
+  return -1;
+}
+
+void upgrade_adopt(void (*added)(int id))
+{
+}
+
+int upgrade_hand_off(User *user)
+{
+  return -1;
+}
+
+int upgrade_forward(int socketid)
+{
+  return -1;
+}
+#endif
+
+int upgrade_adopting()
+{
+  return __atomic_load_n(&adopting, __ATOMIC_ACQUIRE);
+}
+
+int upgrade_handing_off()
+{
+  return __atomic_load_n(&handing_off, __ATOMIC_ACQUIRE);
+}
+
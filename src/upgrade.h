@@ -0,0 +1,71 @@
+/*
+
+  mjpeg_webserver - Web server optimized for JPEGs from a webcam or AVI file.
+
+  Copyright 2004-2024 - Michael Kohn (mike@mikekohn.net)
+  https://www.mikekohn.net/
+
+  This program falls under the GPLv3 license.
+
+*/
+
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <stdint.h>
+
+#include "config.h"
+#include "user.h"
+
+// The new server finds its end of the socket to the old one here.
+#define UPGRADE_ENV "MJPEG_UPGRADE_FD"
+#define UPGRADE_CHILD_FD 3
+
+// How long the new server gets to read its conf and say it's ready. The
+// old one waits drain_timeout seconds for connections it can't hand
+// over (a file being sent, a request half read) before it exits anyway.
+#define UPGRADE_WAIT_SECONDS 30
+
+// Messages between the servers. The ones marked with a socket carry it
+// with SCM_RIGHTS.
+#define UPGRADE_RELEASE 1   // new: let go of capture device path
+#define UPGRADE_RELEASED 2  // old: done
+#define UPGRADE_READY 3     // new: conf read, send everything over
+#define UPGRADE_CLOCK 4     // old: where file source name/path is playing
+#define UPGRADE_LISTEN 5    // old: the listening socket
+#define UPGRADE_ACCEPT 6    // old: a connection between requests
+#define UPGRADE_STREAM 7    // old: a connection between frames of a source
+
+typedef struct UpgradeMessage
+{
+  int type;
+  // The source by name, or by filename / device if it has none.
+  char name[64];
+  char path[256];
+  int64_t start_time;
+  // What the connection asked for, the rest is as it was.
+  int request_type;
+  int frame_rate;
+  int jpeg_quality;
+  int last_frame;
+  uint32_t flags;
+  uint32_t frames_sent;
+  uint32_t frames_skipped;
+  int64_t history_time;
+  int64_t play_start;
+  int64_t play_tick;
+} UpgradeMessage;
+
+int upgrade_init(int argc, char *argv[]);
+void upgrade_signal();
+void upgrade_start(Config *config);
+int upgrade_release(const char *device);
+int upgrade_listen();
+void upgrade_adopt(void (*added)(int id));
+int upgrade_adopting();
+int upgrade_handing_off();
+int upgrade_hand_off(User *user);
+int upgrade_forward(int socketid);
+
+#endif
+
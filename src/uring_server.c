@@ -0,0 +1,1075 @@
+/*
+
+  mjpeg_webserver - Web server optimized for JPEGs from a webcam or AVI file.
+
+  Copyright 2004-2024 - Michael Kohn (mike@mikekohn.net)
+  https://www.mikekohn.net/
+
+  This program falls under the GPLv3 license.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+
+#ifdef ENABLE_CAPTURE
+#include "capture.h"
+#endif
+
+#include "adaptive.h"
+#include "channel.h"
+#include "config.h"
+#include "general.h"
+#include "globals.h"
+#include "network_io.h"
+#include "reload.h"
+#include "server.h"
+#include "stats.h"
+#include "upgrade.h"
+#include "uring_server.h"
+#include "user.h"
+#include "video.h"
+
+/*
+
+io_uring event loop, selected with "server_loop io_uring".
+
+The main thread keeps a multishot accept armed on the listening socket
+and hands each new connection to its worker's ring with IORING_OP_MSG_RING.
+Each worker thread has its own ring. Requests are read with a recv that
+picks one of the worker's provided buffers, linked to a timeout of
+max_idle_time. Frames are sent with IORING_OP_SENDMSG and every send
+queued while fanning out a frame goes to the kernel with the same
+io_uring_enter() that waits for the next completions.
+
+*/
+
+#define URING_ENTRIES 256
+#define URING_BUFFER_GROUP 1
+#define URING_BUFFER_SIZE (BUFFER_SIZE - 2)
+#define URING_MAX_WAIT_NS 1000000000LL
+
+// What a completion is for is kept in the top byte of user_data, then
+// the user id and the connection serial so completions for a closed
+// connection can be told apart from ones for whoever got the slot next.
+#define URING_OP_NEW 1
+#define URING_OP_RECV 2
+#define URING_OP_SEND 3
+#define URING_OP_TIMEOUT 4
+#define URING_OP_CANCEL 5
+#define URING_OP_BUFFERS 6
+#define URING_OP_ACCEPT 7
+#define URING_OP_MSG_RING 8
+
+#define URING_DATA(op, id, serial) \
+  (((uint64_t)(op) << 56) | ((uint64_t)((id) & 0xffffff) << 32) | (uint32_t)(serial))
+#define URING_DATA_OP(data) ((int)((data) >> 56))
+#define URING_DATA_ID(data) ((int)(((data) >> 32) & 0xffffff))
+#define URING_DATA_SERIAL(data) ((uint32_t)(data))
+
+typedef struct Uring
+{
+  int fd;
+  uint32_t *sq_head;
+  uint32_t *sq_tail;
+  uint32_t sq_mask;
+  uint32_t sq_entries;
+  uint32_t *cq_head;
+  uint32_t *cq_tail;
+  uint32_t cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring;
+  void *cq_ring;
+  size_t sq_ring_size;
+  size_t cq_ring_size;
+  size_t sqes_size;
+  uint32_t tail;
+} Uring;
+
+// Per connection state of a worker. A new connection can't use the
+// slot until the recv and send of the last one have completed.
+typedef struct UringSlot
+{
+  uint32_t serial;
+  uint32_t next_serial;
+  uint32_t sequence;
+  // A capture viewer that had nothing to send isn't looked at again
+  // until this time.
+  int64_t next_tick;
+  char active;
+  char recv_armed;
+  char send_armed;
+  // Set while the connection is being given to a new server, its recv
+  // isn't armed again.
+  char releasing;
+  Frame *send_frame;
+  struct msghdr msg;
+  struct iovec iov[2];
+  char header[HEADER_BUFFER_SIZE];
+} UringSlot;
+
+typedef struct UringWorker
+{
+  Uring ring;
+  ThreadContext *thread_context;
+  UringSlot *slots;
+  int slot_count;
+  uint8_t *buffers;
+  int buffer_count;
+  struct __kernel_timespec idle_timeout;
+} UringWorker;
+
+static UringWorker workers[MAX_USER_THREADS];
+static Uring accept_ring;
+
+static void uring_pump(UringWorker *worker, int id);
+static void uring_after(UringWorker *worker, int id);
+
+static void uring_close(Uring *ring)
+{
+  if (ring->sqes != NULL) { munmap(ring->sqes, ring->sqes_size); }
+  if (ring->cq_ring != NULL) { munmap(ring->cq_ring, ring->cq_ring_size); }
+  if (ring->sq_ring != NULL) { munmap(ring->sq_ring, ring->sq_ring_size); }
+  if (ring->fd != -1) { close(ring->fd); }
+
+  memset(ring, 0, sizeof(Uring));
+  ring->fd = -1;
+}
+
+static int uring_setup(Uring *ring, int entries)
+{
+  struct io_uring_params params;
+  uint32_t *array;
+  uint32_t n;
+  uint8_t *sq_ring, *cq_ring;
+
+  memset(ring, 0, sizeof(Uring));
+  memset(&params, 0, sizeof(params));
+
+  // Room for a recv, its timeout, a send and a cancel per connection.
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = entries * 4;
+
+  ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+
+  if (ring->fd < 0)
+  {
+    ring->fd = -1;
+    return -1;
+  }
+
+  // Waiting with a timeout needs IORING_ENTER_EXT_ARG (Linux 5.11).
+  if ((params.features & IORING_FEAT_EXT_ARG) == 0)
+  {
+    uring_close(ring);
+    return -1;
+  }
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  ring->cq_ring_size =
+    params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+  if (ring->sq_ring == MAP_FAILED) { ring->sq_ring = NULL; }
+  if (ring->cq_ring == MAP_FAILED) { ring->cq_ring = NULL; }
+  if (ring->sqes == MAP_FAILED) { ring->sqes = NULL; }
+
+  if (ring->sq_ring == NULL || ring->cq_ring == NULL || ring->sqes == NULL)
+  {
+    uring_close(ring);
+    return -1;
+  }
+
+  sq_ring = (uint8_t *)ring->sq_ring;
+  cq_ring = (uint8_t *)ring->cq_ring;
+
+  ring->sq_head = (uint32_t *)(sq_ring + params.sq_off.head);
+  ring->sq_tail = (uint32_t *)(sq_ring + params.sq_off.tail);
+  ring->sq_mask = *(uint32_t *)(sq_ring + params.sq_off.ring_mask);
+  ring->sq_entries = params.sq_entries;
+  ring->cq_head = (uint32_t *)(cq_ring + params.cq_off.head);
+  ring->cq_tail = (uint32_t *)(cq_ring + params.cq_off.tail);
+  ring->cq_mask = *(uint32_t *)(cq_ring + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq_ring + params.cq_off.cqes);
+
+  // SQEs are always used in order so the index array never changes.
+  array = (uint32_t *)(sq_ring + params.sq_off.array);
+
+  for (n = 0; n < params.sq_entries; n++) { array[n] = n; }
+
+  ring->tail = *ring->sq_tail;
+
+  return 0;
+}
+
+// Checks that the kernel knows every opcode the loop uses.
+static int uring_probe(Uring *ring)
+{
+  const int ops[] =
+  {
+    IORING_OP_ACCEPT,
+    IORING_OP_RECV,
+    IORING_OP_SENDMSG,
+    IORING_OP_LINK_TIMEOUT,
+    IORING_OP_ASYNC_CANCEL,
+    IORING_OP_PROVIDE_BUFFERS,
+    IORING_OP_MSG_RING,
+  };
+  struct io_uring_probe *probe;
+  int n, r = 0;
+
+  probe = (struct io_uring_probe *)calloc(1,
+    sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+
+  if (probe == NULL) { return -1; }
+
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+  {
+    free(probe);
+    return -1;
+  }
+
+  for (n = 0; n < sizeof(ops) / sizeof(int); n++)
+  {
+    if (ops[n] > probe->last_op ||
+        (probe->ops[ops[n]].flags & IO_URING_OP_SUPPORTED) == 0)
+    {
+      r = -1;
+    }
+  }
+
+  free(probe);
+
+  return r;
+}
+
+// Hands everything queued so far to the kernel. With wait set this also
+// waits up to timeout for at least one completion.
+static int uring_submit(Uring *ring, int wait, struct __kernel_timespec *timeout)
+{
+  struct io_uring_getevents_arg arg;
+  uint32_t queued;
+  int r;
+
+  __atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+
+  queued = ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+  if (wait == 0)
+  {
+    if (queued == 0) { return 0; }
+
+    return syscall(__NR_io_uring_enter, ring->fd, queued, 0, 0, NULL, 0);
+  }
+
+  memset(&arg, 0, sizeof(arg));
+  arg.ts = (uint64_t)(uintptr_t)timeout;
+
+  r = syscall(__NR_io_uring_enter, ring->fd, queued, 1,
+    IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+
+  if (r < 0 && errno != ETIME && errno != EINTR)
+  {
+#ifdef DEBUG
+    if (debug == 1) { printf("io_uring_enter() failed %d\n", errno); }
+#endif
+    return -1;
+  }
+
+  return 0;
+}
+
+// Makes sure count more SQEs can be queued so linked requests don't
+// get split across two submits.
+static void uring_make_room(Uring *ring, int count)
+{
+  if (ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) + count >
+      ring->sq_entries)
+  {
+    uring_submit(ring, 0, NULL);
+  }
+}
+
+static struct io_uring_sqe *uring_get_sqe(Uring *ring)
+{
+  struct io_uring_sqe *sqe;
+
+  uring_make_room(ring, 1);
+
+  sqe = &ring->sqes[ring->tail & ring->sq_mask];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  ring->tail++;
+
+  return sqe;
+}
+
+static UringSlot *uring_slot(UringWorker *worker, int id)
+{
+  return &worker->slots[id / MAX_USER_THREADS];
+}
+
+static int uring_slot_live(UringSlot *slot, int id)
+{
+  return slot->active == 1 &&
+         users[id]->inuse == 1 &&
+         users[id]->connection == slot->serial;
+}
+
+static void uring_provide(UringWorker *worker, int bid, int count)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(&worker->ring);
+
+  sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+  sqe->fd = count;
+  sqe->addr = (uint64_t)(uintptr_t)(worker->buffers + bid * URING_BUFFER_SIZE);
+  sqe->len = URING_BUFFER_SIZE;
+  sqe->off = bid;
+  sqe->buf_group = URING_BUFFER_GROUP;
+  sqe->user_data = URING_DATA(URING_OP_BUFFERS, 0, 0);
+}
+
+static void uring_cancel(UringWorker *worker, uint64_t data)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(&worker->ring);
+
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = data;
+  sqe->user_data = URING_DATA(URING_OP_CANCEL, 0, 0);
+}
+
+static void uring_arm_recv(UringWorker *worker, int id)
+{
+  UringSlot *slot = uring_slot(worker, id);
+  Config *config = worker->thread_context->config;
+  struct io_uring_sqe *sqe;
+
+  uring_make_room(&worker->ring, 2);
+
+  sqe = uring_get_sqe(&worker->ring);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = users[id]->socketid;
+  sqe->len = URING_BUFFER_SIZE;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+  sqe->user_data = URING_DATA(URING_OP_RECV, id, slot->serial);
+
+  if (config->max_idle_time > 0)
+  {
+    sqe->flags |= IOSQE_IO_LINK;
+
+    sqe = uring_get_sqe(&worker->ring);
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&worker->idle_timeout;
+    sqe->len = 1;
+    sqe->user_data = URING_DATA(URING_OP_TIMEOUT, id, slot->serial);
+  }
+
+  slot->recv_armed = 1;
+}
+
+// Notices a connection closed by server_handle_user() and cancels
+// whatever the kernel is still doing for it.
+static void uring_check(UringWorker *worker, int id)
+{
+  UringSlot *slot = uring_slot(worker, id);
+
+  if (slot->active == 0 || uring_slot_live(slot, id)) { return; }
+
+  slot->active = 0;
+
+  if (slot->recv_armed == 1)
+  {
+    uring_cancel(worker, URING_DATA(URING_OP_RECV, id, slot->serial));
+  }
+
+  if (slot->send_armed == 1)
+  {
+    uring_cancel(worker, URING_DATA(URING_OP_SEND, id, slot->serial));
+  }
+}
+
+static void uring_adopt(UringWorker *worker, int id, uint32_t serial)
+{
+  UringSlot *slot = uring_slot(worker, id);
+  User *user = users[id];
+  int flags;
+
+  uring_check(worker, id);
+
+  if (user->inuse != 1 || user->connection != serial)
+  {
+    slot->next_serial = 0;
+    return;
+  }
+
+  if (slot->recv_armed == 1 || slot->send_armed == 1)
+  {
+    slot->next_serial = serial;
+    return;
+  }
+
+  slot->serial = serial;
+  slot->next_serial = 0;
+  slot->active = 1;
+  slot->releasing = 0;
+
+  user->io_uring = 1;
+#ifdef ZEROCOPY
+  user->zerocopy = 0;
+#endif
+
+  // The ring waits for the socket to be ready instead of the worker.
+  flags = fcntl(user->socketid, F_GETFL);
+  fcntl(user->socketid, F_SETFL, flags & ~O_NONBLOCK);
+
+#ifdef DEBUG
+  if (debug == 1)
+  {
+    printf("id=%d on io_uring thread %d\n", id, worker->thread_context->thread_num);
+  }
+#endif
+
+  uring_arm_recv(worker, id);
+}
+
+static void uring_recv_done(UringWorker *worker, int id, int res, uint32_t flags)
+{
+  UringSlot *slot = uring_slot(worker, id);
+  Config *config = worker->thread_context->config;
+  User *user = users[id];
+  int bid = -1;
+
+  slot->recv_armed = 0;
+
+  if ((flags & IORING_CQE_F_BUFFER) != 0)
+  {
+    bid = flags >> IORING_CQE_BUFFER_SHIFT;
+  }
+
+  if (uring_slot_live(slot, id) == 0)
+  {
+    if (bid != -1) { uring_provide(worker, bid, 1); }
+    uring_after(worker, id);
+    return;
+  }
+
+  if (res > 0 && bid != -1)
+  {
+    memcpy(user->in_buffer, worker->buffers + bid * URING_BUFFER_SIZE, res);
+    user->in_len = res;
+    user->in_ptr = 0;
+
+    // The request came in before the cancel so it stays here.
+    slot->releasing = 0;
+
+    uring_provide(worker, bid, 1);
+    uring_pump(worker, id);
+  }
+    else
+  if (res == -ECANCELED)
+  {
+    // The linked timeout went off (or uring_server_release() cancelled
+    // it). Streaming viewers update idletime with every frame so only
+    // stalled ones are dropped.
+    if (slot->releasing == 0 &&
+        time(NULL) - user->idletime >= config->max_idle_time)
+    {
+      user_disconnect(user);
+    }
+  }
+    else
+  if (res != -ENOBUFS && res != -EINTR)
+  {
+    if (bid != -1) { uring_provide(worker, bid, 1); }
+    user_disconnect(user);
+  }
+
+  uring_after(worker, id);
+}
+
+static void uring_send_done(UringWorker *worker, int id, int res)
+{
+  UringSlot *slot = uring_slot(worker, id);
+  User *user = users[id];
+
+  slot->send_armed = 0;
+
+  if (slot->send_frame != NULL)
+  {
+    frame_release(slot->send_frame);
+    slot->send_frame = NULL;
+  }
+
+  if (uring_slot_live(slot, id) == 1)
+  {
+    if (res <= 0)
+    {
+      user_disconnect(user);
+    }
+      else
+    {
+      user->send_blocked = 0;
+
+      if (send_frame_advance(user, res) != 0)
+      {
+        STATS_ADD(stats_user(user), send_stalls, 1);
+      }
+
+      uring_pump(worker, id);
+    }
+  }
+
+  uring_after(worker, id);
+}
+
+// Runs the request handler while it can make progress without waiting
+// on the socket: lines left in in_buffer or the rest of a frame.
+static void uring_pump(UringWorker *worker, int id)
+{
+  UringSlot *slot = uring_slot(worker, id);
+  User *user = users[id];
+
+  do
+  {
+    server_handle_user(worker->thread_context, id, 0, 0);
+  } while (uring_slot_live(slot, id) &&
+           user->send_blocked == 0 &&
+           user->state != STATE_SEND_FILE &&
+           user->in_ptr < user->in_len);
+}
+
+static void uring_after(UringWorker *worker, int id)
+{
+  UringSlot *slot = uring_slot(worker, id);
+
+  uring_check(worker, id);
+
+  if (slot->active == 1)
+  {
+    if (slot->recv_armed == 0 &&
+        slot->releasing == 0 &&
+        users[id]->in_ptr >= users[id]->in_len)
+    {
+      uring_arm_recv(worker, id);
+    }
+  }
+    else
+  if (slot->next_serial != 0 &&
+      slot->recv_armed == 0 &&
+      slot->send_armed == 0)
+  {
+    uring_adopt(worker, id, slot->next_serial);
+  }
+}
+
+// Capture viewers have no channel to wait on. Returns their source's
+// frame time or 0 for everyone else.
+static int64_t uring_capture_interval(User *user)
+{
+#ifdef ENABLE_CAPTURE
+  int max_fps;
+
+  if (user->channel != NULL ||
+      user->play_start != 0 ||
+      user->video_num < 0 ||
+      user->video_num >= video_count ||
+      video[user->video_num]->capture_info == NULL)
+  {
+    return 0;
+  }
+
+  max_fps = video[user->video_num]->capture_info->max_fps;
+
+  if (max_fps <= 0) { max_fps = 30; }
+
+  return 1000000000LL / max_fps;
+#else
+  return 0;
+#endif
+}
+
+// Sends the next frame to every streaming viewer whose source has moved
+// on and returns how long to wait until the next one is due.
+static int64_t uring_stream(UringWorker *worker)
+{
+  Config *config = worker->thread_context->config;
+  int thread_num = worker->thread_context->thread_num;
+  int64_t now, next_tick, interval, timeout = URING_MAX_WAIT_NS;
+  Channel *channel;
+  UringSlot *slot;
+  User *user;
+  uint32_t frames_sent;
+  int n, id;
+
+  now = get_time_ns();
+
+  for (n = 0; n < worker->slot_count; n++)
+  {
+    id = n * MAX_USER_THREADS + thread_num;
+    slot = &worker->slots[n];
+
+    if (id >= config->maxconn) { break; }
+
+    // Connections closed outside a completion (by a reload or an
+    // upgrade) still have a recv waiting.
+    if (uring_slot_live(slot, id) == 0)
+    {
+      uring_check(worker, id);
+      continue;
+    }
+
+    user = users[id];
+
+    if (user->state != STATE_SEND_FILE || user->send_blocked == 1) { continue; }
+
+    // Viewers playing a file from their own ?start= wait for their own
+    // next frame.
+    if (user->play_start != 0 && user->frame == NULL && now < user->play_tick)
+    {
+      continue;
+    }
+
+    interval = uring_capture_interval(user);
+
+    if (interval != 0)
+    {
+      if (now < slot->next_tick) { continue; }
+
+      frames_sent = user->frames_sent;
+
+      uring_pump(worker, id);
+
+      // Nothing went out (a lower frame rate, an empty bucket or no
+      // frame from the device) so try again a frame time from now
+      // instead of right away.
+      if (uring_slot_live(slot, id) &&
+          user->send_blocked == 0 &&
+          user->frames_sent == frames_sent)
+      {
+        slot->next_tick = now + interval;
+      }
+
+      uring_after(worker, id);
+      continue;
+    }
+
+    channel = user->channel;
+
+    // Another worker may have published the frame for this tick while
+    // this one was looking, so a change of sequence counts too.
+    if (channel == NULL ||
+        now >= __atomic_load_n(&channel->next_tick, __ATOMIC_ACQUIRE) ||
+        __atomic_load_n(&channel->sequence, __ATOMIC_ACQUIRE) != slot->sequence)
+    {
+      if (channel != NULL)
+      {
+        slot->sequence = __atomic_load_n(&channel->sequence, __ATOMIC_ACQUIRE);
+      }
+
+      uring_pump(worker, id);
+      uring_after(worker, id);
+    }
+  }
+
+  now = get_time_ns();
+
+  for (n = 0; n < worker->slot_count; n++)
+  {
+    id = n * MAX_USER_THREADS + thread_num;
+    slot = &worker->slots[n];
+
+    if (id >= config->maxconn) { break; }
+
+    // Connections closed outside a completion (by a reload or an
+    // upgrade) still have a recv waiting.
+    if (uring_slot_live(slot, id) == 0)
+    {
+      uring_check(worker, id);
+      continue;
+    }
+
+    user = users[id];
+
+    if (user->state != STATE_SEND_FILE || user->send_blocked == 1) { continue; }
+
+    if (user->play_start != 0 && user->frame == NULL)
+    {
+      if (user->play_tick - now < timeout)
+      {
+        timeout = user->play_tick - now > 0 ? user->play_tick - now : 0;
+      }
+
+      continue;
+    }
+
+    if (uring_capture_interval(user) != 0 && now < slot->next_tick)
+    {
+      if (slot->next_tick - now < timeout) { timeout = slot->next_tick - now; }
+
+      continue;
+    }
+
+    // Files and capture devices are sent as fast as the socket takes
+    // them.
+    channel = user->channel;
+
+    if (channel == NULL ||
+        __atomic_load_n(&channel->sequence, __ATOMIC_ACQUIRE) != slot->sequence)
+    {
+      return 0;
+    }
+
+    next_tick = __atomic_load_n(&channel->next_tick, __ATOMIC_ACQUIRE);
+
+    if (next_tick - now < timeout)
+    {
+      timeout = next_tick - now > 0 ? next_tick - now : 0;
+    }
+  }
+
+  return timeout;
+}
+
+static void uring_reap(UringWorker *worker)
+{
+  Uring *ring = &worker->ring;
+  struct io_uring_cqe *cqe;
+  uint32_t head, tail;
+  uint64_t data;
+  uint32_t flags;
+  int res;
+
+  head = *ring->cq_head;
+  tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+  while (head != tail)
+  {
+    cqe = &ring->cqes[head & ring->cq_mask];
+    data = cqe->user_data;
+    res = cqe->res;
+    flags = cqe->flags;
+
+    head++;
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    switch (URING_DATA_OP(data))
+    {
+      case URING_OP_NEW:
+        uring_adopt(worker, URING_DATA_ID(data), URING_DATA_SERIAL(data));
+        break;
+      case URING_OP_RECV:
+        uring_recv_done(worker, URING_DATA_ID(data), res, flags);
+        break;
+      case URING_OP_SEND:
+        uring_send_done(worker, URING_DATA_ID(data), res);
+        break;
+      case URING_OP_BUFFERS:
+#ifdef DEBUG
+        if (debug == 1 && res < 0) { printf("Can't provide buffers %d\n", res); }
+#endif
+        break;
+      default:
+        break;
+    }
+
+    if (head == tail)
+    {
+      tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    }
+  }
+}
+
+int uring_server_init(Config *config)
+{
+  UringWorker *worker;
+  int n;
+
+  memset(workers, 0, sizeof(workers));
+
+  for (n = 0; n < MAX_USER_THREADS; n++) { workers[n].ring.fd = -1; }
+
+  if (uring_setup(&accept_ring, 64) != 0) { return -1; }
+
+  if (uring_probe(&accept_ring) != 0)
+  {
+    uring_close(&accept_ring);
+    return -1;
+  }
+
+  for (n = 0; n < MAX_USER_THREADS; n++)
+  {
+    worker = &workers[n];
+
+    worker->slot_count = config->maxconn / MAX_USER_THREADS + 1;
+    worker->buffer_count = worker->slot_count + 1;
+    worker->slots = (UringSlot *)calloc(worker->slot_count, sizeof(UringSlot));
+    worker->buffers = (uint8_t *)malloc(worker->buffer_count * URING_BUFFER_SIZE);
+    worker->idle_timeout.tv_sec = config->max_idle_time;
+
+    if (worker->slots == NULL || worker->buffers == NULL ||
+        uring_setup(&worker->ring, URING_ENTRIES) != 0)
+    {
+      break;
+    }
+  }
+
+  if (n == MAX_USER_THREADS) { return 0; }
+
+  for (n = 0; n < MAX_USER_THREADS; n++)
+  {
+    worker = &workers[n];
+
+    if (worker->ring.fd != -1) { uring_close(&worker->ring); }
+
+    free(worker->slots);
+    free(worker->buffers);
+  }
+
+  uring_close(&accept_ring);
+
+  return -1;
+}
+
+void uring_server_thread(ThreadContext *thread_context)
+{
+  UringWorker *worker = &workers[thread_context->thread_num];
+  struct __kernel_timespec ts;
+  int64_t timeout;
+  int gc_time, snapshot_time;
+
+  worker->thread_context = thread_context;
+  gc_time = time(NULL);
+  snapshot_time = 0;
+
+  uring_provide(worker, 0, worker->buffer_count);
+
+  thread_context->config = reload_enter(thread_context->thread_num);
+
+  while (1)
+  {
+    server_checkpoint(thread_context);
+    worker->idle_timeout.tv_sec = thread_context->config->max_idle_time;
+
+    // max_idle_time is handled by the timeouts linked to each recv.
+    if (time(NULL) - gc_time > GC_TIME)
+    {
+      server_gc(thread_context, 0);
+      gc_time = time(NULL);
+    }
+
+    if (time(NULL) != snapshot_time)
+    {
+      stats_snapshot(thread_context);
+      adaptive_check(thread_context);
+      snapshot_time = time(NULL);
+    }
+
+    timeout = uring_stream(worker);
+
+    ts.tv_sec = timeout / 1000000000;
+    ts.tv_nsec = timeout % 1000000000;
+
+    uring_submit(&worker->ring, 1, &ts);
+    uring_reap(worker);
+  }
+}
+
+static void uring_arm_accept(int sockfd, int multishot)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(&accept_ring);
+
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = sockfd;
+  sqe->ioprio = multishot == 1 ? IORING_ACCEPT_MULTISHOT : 0;
+  sqe->user_data = URING_DATA(URING_OP_ACCEPT, 0, 0);
+}
+
+// Wakes the worker that owns a new connection with a completion on its
+// own ring.
+static void uring_wake_worker(int id)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(&accept_ring);
+
+  sqe->opcode = IORING_OP_MSG_RING;
+  sqe->fd = workers[id % MAX_USER_THREADS].ring.fd;
+  sqe->off = URING_DATA(URING_OP_NEW, id, users[id]->connection);
+  sqe->user_data = URING_DATA(URING_OP_MSG_RING, id, 0);
+}
+
+// For connections added before uring_server_accept() runs (handed over
+// by an upgrade) on the same thread.
+void uring_server_add(int id)
+{
+  uring_wake_worker(id);
+  uring_submit(&accept_ring, 0, NULL);
+
+  // Nothing is done with MSG_RING completions.
+  __atomic_store_n(accept_ring.cq_head,
+    __atomic_load_n(accept_ring.cq_tail, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+}
+
+int uring_server_accept(Config *config, int sockfd)
+{
+  struct io_uring_cqe *cqe;
+  struct sockaddr_in cli_addr;
+  socklen_t clilen;
+  uint32_t head, tail;
+  uint64_t data;
+  int multishot = 1;
+  int rearm, res, id;
+
+  uring_arm_accept(sockfd, multishot);
+
+  while (1)
+  {
+    if (uring_submit(&accept_ring, 1, NULL) != 0) { return -1; }
+
+    rearm = 0;
+    head = *accept_ring.cq_head;
+    tail = __atomic_load_n(accept_ring.cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail)
+    {
+      cqe = &accept_ring.cqes[head & accept_ring.cq_mask];
+      data = cqe->user_data;
+      res = cqe->res;
+
+      if (URING_DATA_OP(data) == URING_OP_ACCEPT)
+      {
+        if ((cqe->flags & IORING_CQE_F_MORE) == 0) { rearm = 1; }
+
+        // Multishot accept needs Linux 5.19.
+        if (res == -EINVAL && multishot == 1) { multishot = 0; }
+      }
+
+      head++;
+      __atomic_store_n(accept_ring.cq_head, head, __ATOMIC_RELEASE);
+
+      if (URING_DATA_OP(data) != URING_OP_ACCEPT) { continue; }
+
+      if (res < 0)
+      {
+#ifdef DEBUG
+        if (debug == 1) { printf("server accept error.\n"); }
+#endif
+        continue;
+      }
+
+#ifdef DEBUG
+      if (debug == 1)
+      {
+        printf("New socket accepted\n");
+        fflush(stdout);
+      }
+#endif
+
+      clilen = sizeof(cli_addr);
+      memset(&cli_addr, 0, sizeof(cli_addr));
+      getpeername(res, (struct sockaddr *)&cli_addr, &clilen);
+
+      // During an upgrade the new server gets it.
+      if (upgrade_forward(res) == 0) { continue; }
+
+      config = reload_enter(RELOAD_ACCEPT_SLOT);
+      id = user_connect(config, res, &cli_addr);
+      reload_exit(RELOAD_ACCEPT_SLOT);
+
+      if (id < 0) { continue; }
+
+      uring_wake_worker(id);
+    }
+
+    // Once the socket is shut down nothing is accepted again and this
+    // waits for the reload thread to exit.
+    if (rearm == 1 && server_stopping() == 0)
+    {
+      uring_arm_accept(sockfd, multishot);
+    }
+  }
+
+  return 0;
+}
+
+// Called from send_frame() instead of writev(). The frame and the
+// iovec are kept in the slot until the send completes so 0 is always
+// returned, the frame is finished from uring_send_done().
+int uring_server_send(User *user, struct iovec *iov, int count)
+{
+  UringWorker *worker = &workers[user->id % MAX_USER_THREADS];
+  UringSlot *slot = uring_slot(worker, user->id);
+  struct io_uring_sqe *sqe;
+  int n;
+
+  if (slot->send_armed == 1) { return 0; }
+
+  for (n = 0; n < count; n++) { slot->iov[n] = iov[n]; }
+
+  // The first header lives in the User which may be reused before a
+  // cancelled send finishes.
+  if (count == 2)
+  {
+    memcpy(slot->header, iov[0].iov_base, iov[0].iov_len);
+    slot->iov[0].iov_base = slot->header;
+  }
+
+  memset(&slot->msg, 0, sizeof(slot->msg));
+  slot->msg.msg_iov = slot->iov;
+  slot->msg.msg_iovlen = count;
+
+  slot->send_frame = user->frame;
+  __atomic_add_fetch(&user->frame->ref_count, 1, __ATOMIC_RELAXED);
+
+  sqe = uring_get_sqe(&worker->ring);
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = user->socketid;
+  sqe->addr = (uint64_t)(uintptr_t)&slot->msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = URING_DATA(URING_OP_SEND, user->id, slot->serial);
+
+  slot->send_armed = 1;
+
+  return 0;
+}
+
+// Called by upgrade_hand_off() on the connection's worker. A recv left
+// on the ring would take whatever the client sends after the new server
+// has the socket, so it's cancelled first. Returns 0 once nothing is
+// queued for the connection and -1 until the cancel has come back.
+int uring_server_release(User *user)
+{
+  UringWorker *worker = &workers[user->id % MAX_USER_THREADS];
+  UringSlot *slot = uring_slot(worker, user->id);
+
+  if (slot->recv_armed == 0 && slot->send_armed == 0) { return 0; }
+
+  if (slot->recv_armed == 1 && slot->releasing == 0)
+  {
+    uring_cancel(worker, URING_DATA(URING_OP_RECV, user->id, slot->serial));
+    slot->releasing = 1;
+  }
+
+  return -1;
+}
+
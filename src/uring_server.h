@@ -0,0 +1,29 @@
+/*
+
+  mjpeg_webserver - Web server optimized for JPEGs from a webcam or AVI file.
+
+  Copyright 2004-2024 - Michael Kohn (mike@mikekohn.net)
+  https://www.mikekohn.net/
+
+  This program falls under the GPLv3 license.
+
+*/
+
+#ifndef URING_SERVER_H
+#define URING_SERVER_H
+
+#include <sys/uio.h>
+
+#include "config.h"
+#include "server.h"
+#include "user.h"
+
+int uring_server_init(Config *config);
+void uring_server_thread(ThreadContext *thread_context);
+int uring_server_accept(Config *config, int sockfd);
+void uring_server_add(int id);
+int uring_server_send(User *user, struct iovec *iov, int count);
+int uring_server_release(User *user);
+
+#endif
+
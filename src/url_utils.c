@@ -17,7 +17,10 @@
 #include "alias.h"
 #include "globals.h"
 #include "functions.h"
+#include "general.h"
+#include "url_utils.h"
 #include "user.h"
+#include "video.h"
 
 // URL decode without allocating any new memory.
 
@@ -133,8 +136,15 @@ int parse_querystring(User *user, char *filename, Alias *curr_alias)
         if (curr_alias->port_param != 0 &&
             strcasecmp(name,curr_alias->port_param) == 0)
         {
-          // This might be a problem.
-          user->video_num = atoi(value) - 1; }
+          if (conv_num(value) != -1)
+          {
+            user->video_num = atoi(value) - 1;
+          }
+            else
+          {
+            user->video_num = video_find(value);
+          }
+        }
           else
         if (curr_alias->fps_param != 0 &&
             strcasecmp(name,curr_alias->fps_param) == 0)
@@ -164,6 +174,73 @@ int parse_querystring(User *user, char *filename, Alias *curr_alias)
   return 0;
 }
 
+// Map a request path to a source, either by name as in /lobby or by
+// position in the config file as in /0.
+int get_video_num(const char *path)
+{
+  char name[128];
+  int n = 0, video_num;
+
+  while (path[n] != ' ' && path[n] != '?' && path[n] != 0 &&
+         n < (int)sizeof(name) - 1)
+  {
+    name[n] = path[n];
+    n++;
+  }
+
+  name[n] = 0;
+
+  if (n != 0)
+  {
+    video_num = video_find(name);
+
+    if (video_num != -1) { return video_num; }
+  }
+
+  return conv_num(path);
+}
+
+// Looks for name= in the query string of a request path (which ends at
+// a space or the end of the string), as in /lobby?t=-5s or t=-500ms,
+// and puts it in time in nanoseconds. Returns -1 if there isn't one.
+int get_time_param(const char *path, const char *name, int64_t *time)
+{
+  const char *query;
+  char *end;
+  double value;
+  int length = strlen(name);
+
+  for (query = path; *query != '?'; query++)
+  {
+    if (*query == ' ' || *query == 0) { return -1; }
+  }
+
+  while (*query != ' ' && *query != 0)
+  {
+    query++;
+
+    if (strncmp(query, name, length) == 0 && query[length] == '=')
+    {
+      value = strtod(query + length + 1, &end);
+
+      if (end[0] == 'm' && end[1] == 's')
+      {
+        *time = value * 1000000;
+      }
+        else
+      {
+        *time = value * 1000000000;
+      }
+
+      return 0;
+    }
+
+    while (*query != '&' && *query != ' ' && *query != 0) { query++; }
+  }
+
+  return -1;
+}
+
 int check_valid_file(const char *s)
 {
   int ptr, c;
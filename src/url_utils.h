@@ -20,6 +20,8 @@
 int url_decode(uint8_t *s);
 char *get_querystring(char *filename);
 int parse_querystring(User *user, char *filename, Alias *curr_alias);
+int get_video_num(const char *path);
+int get_time_param(const char *path, const char *name, int64_t *time);
 int check_valid_file(const char *s);
 
 #endif
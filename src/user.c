@@ -21,9 +21,11 @@
 #include "general.h"
 #include "globals.h"
 #include "network_io.h"
+#include "stats.h"
 #include "user.h"
 
 User **users;
+static uint32_t connection_count = 0;
 
 void user_init(User *user, int id, int socketid)
 {
@@ -40,6 +42,31 @@ void user_init(User *user, int id, int socketid)
   user->video_num = -1;
   user->in = -1;
   user->pin = NULL;
+  user->channel = NULL;
+  user->frame = NULL;
+  user->send_blocked = 0;
+  user->connection =
+    __atomic_add_fetch(&connection_count, 1, __ATOMIC_RELAXED);
+  user->io_uring = 0;
+#ifdef ZEROCOPY
+  user->zerocopy = 0;
+  user->zerocopy_next = 0;
+  user->zerocopy_head = 0;
+  user->zerocopy_count = 0;
+#endif
+  user->frames_sent = 0;
+  user->frames_skipped = 0;
+  user->stats_flags = 0;
+  user->request_time = 0;
+  user->send_start = 0;
+  user->bytes_sent = 0;
+  user->snapshot_bytes = 0;
+  user->snapshot_frames = 0;
+  user->snapshot_time = get_time_ns();
+  user->client_limit = NULL;
+  user->limited_sequence = 0;
+  adaptive_init(user);
+  websocket_init(user);
   user->inuse = 1;
   user->state = STATE_IDLE;
 #ifdef ENABLE_PLUGINS
@@ -77,6 +104,7 @@ int user_connect(Config *config, int socketid, struct sockaddr_in *cli_addr)
 #endif
     send_data(socketid, fullmessage, strlen(fullmessage));
     socketdie(socketid);
+    STATS_ADD(stats_thread(STATS_ACCEPT_SLOT), connections_refused, 1);
     return -1;
   }
 
@@ -85,7 +113,9 @@ int user_connect(Config *config, int socketid, struct sockaddr_in *cli_addr)
 #ifdef DEBUG
     if (debug == 1) { printf("Allocing new user %d\n",r); }
 #endif
-    users[r] = malloc(sizeof(User));
+    // Zeroed since a capture viewer's JPEG buffer stays with the User
+    // from one connection to the next.
+    users[r] = calloc(1, sizeof(User));
   }
 
 #ifdef DEBUG
@@ -139,6 +169,12 @@ int user_connect(Config *config, int socketid, struct sockaddr_in *cli_addr)
 
   user_init(users[id], id, socketid);
 
+  users[id]->client_limit = rate_limit_client_get(
+    config->client_limits,
+    ntohl(cli_addr->sin_addr.s_addr));
+
+  STATS_ADD(stats_thread(STATS_ACCEPT_SLOT), connections, 1);
+
 #if 0
   users[id]->socketfd = fdopen(socketid, "rb+");
 
@@ -147,6 +183,18 @@ int user_connect(Config *config, int socketid, struct sockaddr_in *cli_addr)
 
   set_nonblocking(users[id]->socketid);
 
+#ifdef ZEROCOPY
+  if (config->zerocopy > 0)
+  {
+    int value = 1;
+
+    if (setsockopt(socketid, SOL_SOCKET, SO_ZEROCOPY, &value, sizeof(value)) == 0)
+    {
+      users[id]->zerocopy = config->zerocopy;
+    }
+  }
+#endif
+
 #if 0
   if (setsockopt(sockfd, SOL_SOCKET, SO_RCVLOWAT, &sopt, sizeof(sopt)))
   {
@@ -167,7 +215,7 @@ if (debug == 1)
 }
 #endif
 
-  return 0;
+  return id;
 }
 
 void user_disconnect(User *user)
@@ -199,7 +247,43 @@ void user_disconnect(User *user)
     file_close(user);
   }
 
+  user_leave_channel(user);
+
+  rate_limit_client_put(user->client_limit);
+  user->client_limit = NULL;
+
+#ifdef ZEROCOPY
+  zerocopy_release(user);
+#endif
+
+  STATS_ADD(stats_user(user), disconnects, 1);
+
   user->inuse = 0;
   user->idletime = time(NULL);
 }
 
+void user_leave_channel(User *user)
+{
+#ifdef DEBUG
+  if (debug == 1 && user->channel != NULL)
+  {
+    printf("User %d: frames_sent=%u frames_skipped=%u\n",
+      user->id, user->frames_sent, user->frames_skipped);
+  }
+#endif
+
+  user->send_blocked = 0;
+
+  if (user->frame != NULL)
+  {
+    frame_release(user->frame);
+    user->frame = NULL;
+  }
+
+  if (user->channel != NULL)
+  {
+    channel_unsubscribe(user->channel);
+    user->channel = NULL;
+  }
+}
+
@@ -14,11 +14,24 @@
 
 #include <stdint.h>
 #include <netdb.h>
+#ifndef WINDOWS
+#include <sys/socket.h>
+#endif
 
+#include "adaptive.h"
+#include "channel.h"
 #include "config.h"
 #include "plugin.h"
+#include "rate_limit.h"
+#include "websocket.h"
 
 #define BUFFER_SIZE 514
+#define HEADER_BUFFER_SIZE 512
+
+#if !defined(WINDOWS) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define ZEROCOPY
+#define ZEROCOPY_MAX_PENDING 16
+#endif
 
 #define STATE_IDLE 0
 #define STATE_HEADERS 1
@@ -33,12 +46,25 @@ User Flags
 
 */
 
+#ifdef ZEROCOPY
+// A MSG_ZEROCOPY send the kernel hasn't finished with. The frame is
+// held until the completion for id shows up on the socket's error queue.
+typedef struct ZerocopyPending
+{
+  uint32_t id;
+  Frame *frame;
+} ZerocopyPending;
+#endif
+
 typedef struct User
 {
   uint8_t location[64];
   char out_buffer[BUFFER_SIZE];
   uint8_t in_buffer[BUFFER_SIZE];
   int id, r;
+  // Changes every time the slot is reused for a new connection.
+  uint32_t connection;
+  int io_uring;
   int logontime, idletime;
   char inuse;
   int socketid;
@@ -47,9 +73,23 @@ typedef struct User
   int curr_frame;
   FILE *pin;
   int in;
-#ifdef WITH_MMAP
-  long offset;
+  Channel *channel;
+  Frame *frame;
+  int frame_ptr;
+  char header_buffer[HEADER_BUFFER_SIZE];
+  const char *header;
+  int header_len;
+  int header_ptr;
+#ifdef ZEROCOPY
+  int zerocopy;
+  uint32_t zerocopy_next;
+  int zerocopy_head;
+  int zerocopy_count;
+  ZerocopyPending zerocopy_pending[ZEROCOPY_MAX_PENDING];
 #endif
+  int send_blocked;
+  uint32_t frames_sent;
+  uint32_t frames_skipped;
   int video_num;
   int mime_type;
   int content_length;
@@ -61,6 +101,31 @@ typedef struct User
   uint32_t flags;
   int frame_rate;
   int method;
+  int stats_flags;
+  // get_time_ns() when the request came in and when the current frame
+  // started going out, for the latency histograms.
+  int64_t request_time;
+  int64_t send_start;
+  // Bytes sent on this connection and what the counters were at the
+  // last stats_snapshot() so it can work out the rates.
+  uint64_t bytes_sent;
+  uint64_t snapshot_bytes;
+  uint32_t snapshot_frames;
+  int64_t snapshot_time;
+  // Shared with other connections from the same address, or NULL.
+  RateLimit *client_limit;
+  // The last frame dropped by a rate limit so it's only counted once.
+  uint32_t limited_sequence;
+  // get_time_ns() of the frame a snapshot asked for with ?t=, 0 for
+  // the current one.
+  int64_t history_time;
+  // Viewers of a file that asked for ?start= play it from there on
+  // their own: get_time_ns() when frame 0 would have been sent (0 to
+  // follow the source) and when the frame after the current one is due.
+  int64_t play_start;
+  int64_t play_tick;
+  AdaptiveState adaptive;
+  WebSocketState websocket;
 #ifdef ENABLE_PLUGINS
   char querystring[QUERY_STRING_SIZE];
   Plugin *plugin;
@@ -69,7 +134,6 @@ typedef struct User
   uint8_t *jpeg;
   int jpeg_len;
   int jpeg_quality;
-  int jpeg_ptr;
 #endif
 } User;
 
@@ -77,6 +141,7 @@ void user_init(User *user, int id, int socketid);
 void user_destroy(User *user);
 int user_connect(Config *config, int socketid, struct sockaddr_in *cli_addr);
 void user_disconnect(User *user);
+void user_leave_channel(User *user);
 
 extern User **users;
 
@@ -18,9 +18,12 @@
 #include <string.h>
 #include <errno.h>
 
+#include "adaptive.h"
 #include "capture.h"
+#include "general.h"
 #include "globals.h"
 #include "jpeg_compress.h"
+#include "stats.h"
 
 void bgr2rgb(CaptureInfo *capture_info)
 {
@@ -148,6 +151,13 @@ int open_capture(CaptureInfo *capture_info, char *dev_name)
 
   printf("Video Device: %s\n", dev_name);
 
+  pthread_mutex_init(&capture_info->lock, NULL);
+
+  if (strncmp(dev_name, "synthetic:", 10) == 0)
+  {
+    return synthetic_open(capture_info, dev_name);
+  }
+
   // video_fd = open(dev_name, O_RDONLY, 0);
   // video_fd = open(dev_name, O_RDWR | O_NONBLOCK, 0);
 
@@ -313,6 +323,11 @@ int read_frame(CaptureInfo *capture_info, uint8_t *buffer, int len)
   c = 0;
   n = 0;
 
+  if (capture_info->synthetic == 1)
+  {
+    return synthetic_read(capture_info, buffer, len);
+  }
+
   if ((capture_info->vid_cap.capabilities&V4L2_CAP_READWRITE) != 0)
   {
     while (c<len)
@@ -354,28 +369,32 @@ printf("v4l2 read()=%d error.  errno=%d  buffer=%d/%d\n", n, errno, c, len);
   return c;
 }
 
-int capture_image(CaptureInfo *capture_info, int id)
+// Captures one frame into jpeg. stats and source can be NULL when the
+// capture isn't for a viewer.
+static int capture_frame(
+  CaptureInfo *capture_info,
+  uint8_t *jpeg,
+  int jpeg_len,
+  int quality,
+  ThreadStats *stats,
+  SourceStats *source)
 {
   uint8_t *cap_buffer = 0;
+  int64_t start, done;
+  int length;
 
-  if (users[id]->jpeg_len == 0)
-  {
-    // FIXME: This should be dynamic instead of wasting memory.. easy to fix
-    // also need a way to deallocate this crap.
-
-    // users[id]->jpeg_len = 20480;
-    users[id]->jpeg_len = 128000;
-    users[id]->jpeg = (uint8_t *)malloc(users[id]->jpeg_len);
-  }
+  if (stats != NULL) { STATS_ADD(stats, captures, 1); }
 
   if (capture_info->vid_fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_MJPEG)
   {
-    return read_frame(capture_info, users[id]->jpeg, capture_info->buffer_len);
+    return read_frame(capture_info, jpeg, jpeg_len);
   }
 
   read_frame(capture_info, capture_info->buffer, capture_info->buffer_len);
   cap_buffer = capture_info->buffer;
 
+  start = get_time_ns();
+
   if (capture_info->vid_fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_BGR24)
   {
     bgr2rgb(capture_info);
@@ -391,20 +410,87 @@ int capture_image(CaptureInfo *capture_info, int id)
     cap_buffer=convert_yuyv(capture_info);
   }
 
-
-  return jpeg_compress(
+  length = jpeg_compress(
     cap_buffer,
-    video[users[id]->video_num].capture_info->buffer_len,
+    capture_info->buffer_len,
+    jpeg,
+    jpeg_len,
+    capture_info->width,
+    capture_info->height,
+    3,
+    quality);
+
+  done = get_time_ns();
+
+  if (stats != NULL) { STATS_ADD(stats, encode_ns, done - start); }
+
+  // MJPEG frames are ready as soon as they're read so only the formats
+  // compressed here are timed.
+  if (source != NULL) { histogram_add(&source->capture, done - start); }
+
+  return length;
+}
+
+int capture_image(CaptureInfo *capture_info, int id)
+{
+  int length;
+
+  if (users[id]->jpeg_len == 0)
+  {
+    // FIXME: This should be dynamic instead of wasting memory.. easy to fix
+    // also need a way to deallocate this crap.
+
+    // users[id]->jpeg_len = 20480;
+    users[id]->jpeg_len = 128000;
+
+    // Big frames can take more than that even at normal quality.
+    if (users[id]->jpeg_len < capture_info->width * capture_info->height)
+    {
+      users[id]->jpeg_len = capture_info->width * capture_info->height;
+    }
+
+    users[id]->jpeg = (uint8_t *)malloc(users[id]->jpeg_len);
+  }
+
+  // Viewers on different threads share the device and its buffers.
+  pthread_mutex_lock(&capture_info->lock);
+
+  length = capture_frame(
+    capture_info,
     users[id]->jpeg,
     users[id]->jpeg_len,
-    video[users[id]->video_num].capture_info->width,
-    video[users[id]->video_num].capture_info->height,
-    3,
-    users[id]->jpeg_quality);
+    adaptive_quality(users[id], users[id]->jpeg_quality),
+    stats_user(users[id]),
+    stats_source(users[id]));
+
+  pthread_mutex_unlock(&capture_info->lock);
+
+  return length;
+}
+
+// Same as capture_image() but into a buffer that doesn't belong to a
+// connection (the HLS packager's).
+int capture_jpeg(CaptureInfo *capture_info, uint8_t *jpeg, int jpeg_len, int quality)
+{
+  int length;
+
+  pthread_mutex_lock(&capture_info->lock);
+  length = capture_frame(capture_info, jpeg, jpeg_len, quality, NULL, NULL);
+  pthread_mutex_unlock(&capture_info->lock);
+
+  return length;
 }
 
 int close_capture(CaptureInfo *capture_info)
 {
+  pthread_mutex_destroy(&capture_info->lock);
+
+  if (capture_info->synthetic == 1)
+  {
+    synthetic_close(capture_info);
+    return 0;
+  }
+
   free(capture_info->buffer);
 
   if (capture_info->picture != NULL)
@@ -17,6 +17,7 @@
 // #include <winuser.h>
 #include <vfw.h>
 
+#include "adaptive.h"
 #include "capture.h"
 #include "globals.h"
 #include "jpeg_compress.h"
@@ -223,11 +224,11 @@ fflush(stdout);
 printf("capture_image: exit %d %p %d %p %d  %d %d %d\n",
   count,
   capture_info->buffer,
-  video[users[id]->video_num].capture_info->buffer_len,
+  video[users[id]->video_num]->capture_info->buffer_len,
   users[id]->jpeg,
   users[id]->jpeg_len,
-  video[users[id]->video_num].capture_info->width,
-  video[users[id]->video_num].capture_info->height,
+  video[users[id]->video_num]->capture_info->width,
+  video[users[id]->video_num]->capture_info->height,
   users[id]->jpeg_quality);
 fflush(stdout);
 #endif
@@ -236,13 +237,13 @@ fflush(stdout);
 
   return jpeg_compress(
     capture_info->buffer,
-    video[users[id]->video_num].capture_info->buffer_len,
+    video[users[id]->video_num]->capture_info->buffer_len,
     users[id]->jpeg,
     users[id]->jpeg_len,
-    video[users[id]->video_num].capture_info->width,
-    video[users[id]->video_num].capture_info->height,
+    video[users[id]->video_num]->capture_info->width,
+    video[users[id]->video_num]->capture_info->height,
     3,
-    users[id]->jpeg_quality);
+    adaptive_quality(users[id], users[id]->jpeg_quality));
 }
 
 int close_capture(CaptureInfo *capture_info)
@@ -0,0 +1,280 @@
+/*
+
+  mjpeg_webserver - Web server optimized for JPEGs from a webcam or AVI file.
+
+  Copyright 2004-2024 - Michael Kohn (mike@mikekohn.net)
+  https://www.mikekohn.net/
+
+  This program falls under the GPLv3 license.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#ifndef WINDOWS
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+#ifdef WITH_MMAP
+#ifndef WINDOWS
+#include <sys/mman.h>
+#endif
+#endif
+
+#ifdef ENABLE_CAPTURE
+#include "capture.h"
+#endif
+
+#include "channel.h"
+#include "frame_ring.h"
+#include "hls.h"
+#include "rate_limit.h"
+#ifdef V4L2
+#include "recorder.h"
+#endif
+#include "reload.h"
+#include "video.h"
+
+int video_count = 0;
+Video **video = NULL;
+
+static int video_alloc = 0;
+
+// Open addressing hash table mapping a source name to its video_num.
+// Slots hold video_num + 1 so a zeroed slot is empty. The table is
+// kept at most half full so probe chains stay short. Lookups don't
+// lock: a name is only ever added by filling an empty slot, anything
+// else builds a new table, swaps it in and retires the old one.
+typedef struct NameMap
+{
+  int len;
+  int count;
+  int *slots;
+} NameMap;
+
+static NameMap *name_map = NULL;
+
+static uint32_t hash_name(const char *name)
+{
+  uint32_t hash = 2166136261u;
+
+  while (*name != 0)
+  {
+    hash = (hash ^ (uint8_t)*name++) * 16777619u;
+  }
+
+  return hash;
+}
+
+static void name_map_insert(NameMap *map, int video_num)
+{
+  uint32_t mask = map->len - 1;
+  uint32_t n = hash_name(video[video_num]->name) & mask;
+
+  while (map->slots[n] != 0) { n = (n + 1) & mask; }
+
+  __atomic_store_n(&map->slots[n], video_num + 1, __ATOMIC_RELEASE);
+  map->count++;
+}
+
+// Builds a table of the named sources that haven't been removed with
+// room for extra more.
+static int name_map_build(int extra)
+{
+  NameMap *map;
+  int len = 64;
+  int count = extra;
+  int n;
+
+  for (n = 0; n < video_count; n++)
+  {
+    if (video[n]->name != NULL && video[n]->removed == 0) { count++; }
+  }
+
+  while (count * 2 > len) { len = len * 2; }
+
+  map = (NameMap *)calloc(1, sizeof(NameMap) + sizeof(int) * len);
+
+  if (map == NULL) { return -1; }
+
+  map->len = len;
+  map->slots = (int *)(map + 1);
+
+  for (n = 0; n < video_count; n++)
+  {
+    if (video[n]->name != NULL && video[n]->removed == 0)
+    {
+      name_map_insert(map, n);
+    }
+  }
+
+  if (name_map != NULL) { reload_retire(name_map); }
+
+  __atomic_store_n(&name_map, map, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+Video *video_new()
+{
+  return (Video *)calloc(1, sizeof(Video));
+}
+
+// Lets go of everything the source has open, but not the Video. This
+// is only done once nothing can be using it: at exit, or when a reload
+// took the source out and its viewers are gone.
+void video_close(Video *curr_video)
+{
+#ifdef V4L2
+  // Finishes the file being recorded before the device goes away.
+  recorder_destroy(curr_video->recorder);
+  curr_video->recorder = NULL;
+#endif
+  hls_destroy(curr_video->hls);
+  curr_video->hls = NULL;
+
+#ifdef ENABLE_CAPTURE
+  if (curr_video->capture_info != NULL)
+  {
+    if (curr_video->handed_over == 0) { close_capture(curr_video->capture_info); }
+    free(curr_video->capture_info);
+    curr_video->capture_info = NULL;
+  }
+#endif
+
+  if (curr_video->channel != NULL)
+  {
+    channel_destroy(curr_video->channel);
+    curr_video->channel = NULL;
+  }
+
+  rate_limit_destroy(curr_video->rate_limit);
+  frame_ring_destroy(curr_video->ring);
+  curr_video->rate_limit = NULL;
+  curr_video->ring = NULL;
+
+#ifdef WITH_MMAP
+  if (curr_video->mem != NULL)
+  {
+#ifndef WINDOWS
+    munmap(curr_video->mem, (size_t)curr_video->file_len);
+    close(curr_video->fd);
+#else
+    UnmapViewOfFile(curr_video->mem);
+    CloseHandle(curr_video->mem_handle);
+    CloseHandle(curr_video->fd);
+#endif
+    curr_video->mem = NULL;
+  }
+#endif
+
+  free(curr_video->index);
+  curr_video->index = NULL;
+}
+
+void video_free(Video *curr_video)
+{
+  video_close(curr_video);
+
+  free(curr_video->name);
+  free(curr_video->filename);
+#ifdef ENABLE_CAPTURE
+  free(curr_video->device);
+#endif
+  free(curr_video);
+}
+
+// Sources are only added by the thread reading the conf file, while
+// workers may be looking at the table. A bigger table is filled in
+// before it's swapped in and the count goes up after the slot is set.
+int video_add(Video *new_video)
+{
+  Video **table = video;
+  int count = video_count;
+
+  if (count == video_alloc)
+  {
+    int length = video_alloc == 0 ? 16 : video_alloc * 2;
+
+    table = (Video **)malloc(sizeof(Video *) * length);
+
+    if (table == NULL) { return -1; }
+
+    if (video != NULL)
+    {
+      memcpy(table, video, sizeof(Video *) * count);
+      reload_retire(video);
+    }
+
+    __atomic_store_n(&video, table, __ATOMIC_RELEASE);
+    video_alloc = length;
+  }
+
+  if (new_video->name != NULL &&
+      (name_map == NULL || (name_map->count + 1) * 2 > name_map->len))
+  {
+    if (name_map_build(1) != 0) { return -1; }
+  }
+
+  table[count] = new_video;
+
+  __atomic_store_n(&video_count, count + 1, __ATOMIC_RELEASE);
+
+  if (new_video->name != NULL) { name_map_insert(name_map, count); }
+
+  return count;
+}
+
+// Requests for the source get a 404 from here on. It's closed once its
+// viewers have been let go.
+void video_remove(int video_num)
+{
+  __atomic_store_n(&video[video_num]->removed, 1, __ATOMIC_RELEASE);
+
+  if (video[video_num]->name != NULL) { name_map_build(0); }
+}
+
+int video_find(const char *name)
+{
+  NameMap *map = __atomic_load_n(&name_map, __ATOMIC_ACQUIRE);
+  uint32_t mask, n;
+  int slot;
+
+  if (map == NULL) { return -1; }
+
+  mask = map->len - 1;
+  n = hash_name(name) & mask;
+
+  while ((slot = __atomic_load_n(&map->slots[n], __ATOMIC_ACQUIRE)) != 0)
+  {
+    if (strcmp(video[slot - 1]->name, name) == 0) { return slot - 1; }
+
+    n = (n + 1) & mask;
+  }
+
+  return -1;
+}
+
+// Names that are only digits would be shadowed by /N so they aren't
+// allowed, and '/', '?' or '&' would make them unreachable in a URL.
+// Names already taken are checked against the conf file by the caller
+// since a reload takes out the old sources after the new ones are read.
+int video_check_name(const char *name)
+{
+  int n, digits = 0;
+
+  if (name[0] == 0) { return -1; }
+
+  for (n = 0; name[n] != 0; n++)
+  {
+    if (name[n] == '/' || name[n] == '?' || name[n] == '&') { return -1; }
+    if (name[n] >= '0' && name[n] <= '9') { digits++; }
+  }
+
+  if (digits == n) { return -1; }
+
+  return 0;
+}
+
@@ -14,19 +14,49 @@
 
 #include <stdint.h>
 
+#ifdef ENABLE_CAPTURE
+#include "capture.h"
+#endif
+
+// Where a frame's JPEG data starts in the file (past the chunk header).
+typedef struct FrameIndex
+{
+  int64_t offset;
+  uint32_t length;
+} FrameIndex;
+
 typedef struct Video
 {
+  char *name;
   char *filename;
-  long *index;
+  FrameIndex *index;
   int fps;
   int total_frames;
-  struct timeval tv_start;
-  struct timeval tv_total;
+  // Playback clock: frame = (now - start_time) * rate / scale where
+  // rate / scale is the dwRate / dwScale pair from the stream header.
+  int64_t start_time;
+  uint32_t rate;
+  uint32_t scale;
+  struct Channel *channel;
+  struct RateLimit *rate_limit;
+  struct Hls *hls;
+  struct FrameRing *ring;
+  // A source taken out by a reload keeps its Video (closed) so numbers
+  // given out for other sources don't change. generation is the last
+  // Config that had it.
+  int removed;
+  int generation;
+  // Set once an upgrade has given the source's device to the new server.
+  int handed_over;
 #ifdef ENABLE_CAPTURE
+  char *device;
   CaptureInfo *capture_info;
 #endif
+#ifdef V4L2
+  struct Recorder *recorder;
+#endif
 #ifdef WITH_MMAP
-  long file_len;
+  int64_t file_len;
   uint8_t *mem;
 #ifndef WINDOWS
   int fd;
@@ -37,14 +67,16 @@ typedef struct Video
 #endif
 } Video;
 
-#ifdef ENABLE_ESP32
-#define MAX_VIDEO_COUNT 8
-#else
-#define MAX_VIDEO_COUNT 100
-#endif
+Video *video_new();
+void video_close(Video *curr_video);
+void video_free(Video *curr_video);
+int video_add(Video *new_video);
+void video_remove(int video_num);
+int video_find(const char *name);
+int video_check_name(const char *name);
 
 extern int video_count;
-extern Video video[MAX_VIDEO_COUNT];
+extern Video **video;
 
 #endif
 
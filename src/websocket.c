@@ -0,0 +1,407 @@
+/*
+
+  mjpeg_webserver - Web server optimized for JPEGs from a webcam or AVI file.
+
+  Copyright 2004-2024 - Michael Kohn (mike@mikekohn.net)
+  https://www.mikekohn.net/
+
+  This program falls under the GPLv3 license.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#ifndef WINDOWS
+#include <strings.h>
+#include <sys/socket.h>
+#else
+#include <windows.h>
+#include <winsock.h>
+#endif
+
+#include "general.h"
+#include "globals.h"
+#include "network_io.h"
+#include "user.h"
+#include "video.h"
+#include "websocket.h"
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+#define OPCODE_CLOSE 0x8
+#define OPCODE_PING 0x9
+
+static uint32_t rotate_left(uint32_t value, int bits)
+{
+  return (value << bits) | (value >> (32 - bits));
+}
+
+// Only used on the handshake key so it doesn't need to be fast.
+static void sha1(const uint8_t *data, int length, uint8_t *digest)
+{
+  uint32_t h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+  uint32_t w[80];
+  uint8_t block[64];
+  uint64_t bits = (uint64_t)length * 8;
+  int blocks = (length + 8) / 64 + 1;
+  int n, k, i;
+
+  for (n = 0; n < blocks; n++)
+  {
+    uint32_t a, b, c, d, e, f, t;
+
+    for (k = 0; k < 64; k++)
+    {
+      i = n * 64 + k;
+
+      if (i < length) { block[k] = data[i]; }
+        else
+      if (i == length) { block[k] = 0x80; }
+        else
+      if (n == blocks - 1 && k >= 56) { block[k] = bits >> ((63 - k) * 8); }
+        else
+      { block[k] = 0; }
+    }
+
+    for (k = 0; k < 16; k++)
+    {
+      w[k] = (block[k * 4] << 24) | (block[k * 4 + 1] << 16) |
+             (block[k * 4 + 2] << 8) | block[k * 4 + 3];
+    }
+
+    for (k = 16; k < 80; k++)
+    {
+      w[k] = rotate_left(w[k - 3] ^ w[k - 8] ^ w[k - 14] ^ w[k - 16], 1);
+    }
+
+    a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+
+    for (k = 0; k < 80; k++)
+    {
+      if (k < 20) { f = ((b & c) | (~b & d)) + 0x5a827999; }
+        else
+      if (k < 40) { f = (b ^ c ^ d) + 0x6ed9eba1; }
+        else
+      if (k < 60) { f = ((b & c) | (b & d) | (c & d)) + 0x8f1bbcdc; }
+        else
+      { f = (b ^ c ^ d) + 0xca62c1d6; }
+
+      t = rotate_left(a, 5) + f + e + w[k];
+      e = d; d = c; c = rotate_left(b, 30); b = a; a = t;
+    }
+
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+  }
+
+  for (n = 0; n < 20; n++)
+  {
+    digest[n] = h[n / 4] >> ((3 - (n % 4)) * 8);
+  }
+}
+
+// base64_encode_() stops at a 0 byte so it can't be used on a digest.
+static void base64_digest(const uint8_t *digest, char *text)
+{
+  const char base64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+    "abcdefghijklmnopqrstuvwxyz"
+    "0123456789+/";
+  uint32_t bits;
+  int n, k = 0;
+
+  for (n = 0; n < 18; n += 3)
+  {
+    bits = (digest[n] << 16) | (digest[n + 1] << 8) | digest[n + 2];
+    text[k++] = base64[(bits >> 18) & 63];
+    text[k++] = base64[(bits >> 12) & 63];
+    text[k++] = base64[(bits >> 6) & 63];
+    text[k++] = base64[bits & 63];
+  }
+
+  bits = (digest[18] << 16) | (digest[19] << 8);
+  text[k++] = base64[(bits >> 18) & 63];
+  text[k++] = base64[(bits >> 12) & 63];
+  text[k++] = base64[(bits >> 6) & 63];
+  text[k++] = '=';
+  text[k] = 0;
+}
+
+static void put_bytes(char *buffer, uint64_t value, int count)
+{
+  int n;
+
+  for (n = 0; n < count; n++)
+  {
+    buffer[n] = value >> ((count - 1 - n) * 8);
+  }
+}
+
+void websocket_init(User *user)
+{
+  WebSocketState *websocket = &user->websocket;
+
+  websocket->upgrade = 0;
+  websocket->key[0] = 0;
+  websocket->pong_len = -1;
+  websocket->partial_len = 0;
+  websocket->skip = 0;
+}
+
+// Picks the upgrade request out of the request headers.
+void websocket_header_line(User *user, const char *line)
+{
+  WebSocketState *websocket = &user->websocket;
+  int n;
+
+  if (strncasecmp(line, "Upgrade:", 8) == 0)
+  {
+    for (line += 8; *line == ' '; line++) { }
+
+    if (strncasecmp(line, "websocket", 9) == 0) { websocket->upgrade = 1; }
+  }
+    else
+  if (strncasecmp(line, "Sec-WebSocket-Key:", 18) == 0)
+  {
+    for (line += 18; *line == ' '; line++) { }
+
+    for (n = 0; line[n] != ' ' && line[n] != 0 && n < (int)sizeof(websocket->key) - 1; n++)
+    {
+      websocket->key[n] = line[n];
+    }
+
+    websocket->key[n] = 0;
+  }
+}
+
+// Answers the upgrade once the request headers are all in. Only a
+// source can be streamed this way, anything else is answered as a
+// normal request. Returns -1 if the connection was dropped.
+int websocket_accept(int id)
+{
+  User *user = users[id];
+  WebSocketState *websocket = &user->websocket;
+  char text[sizeof(websocket->key) + sizeof(WEBSOCKET_GUID)];
+  char response[256];
+  char accept[32];
+  uint8_t digest[20];
+  int length;
+
+  websocket->upgrade = 0;
+
+  if (websocket->key[0] == 0 ||
+      user->video_num < 0 ||
+      user->video_num >= video_count)
+  {
+    return 0;
+  }
+
+  length = snprintf(text, sizeof(text), "%s" WEBSOCKET_GUID, websocket->key);
+  sha1((uint8_t *)text, length, digest);
+  base64_digest(digest, accept);
+
+  length = snprintf(response, sizeof(response),
+    "HTTP/1.1 101 Switching Protocols\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Accept: %s\r\n\r\n",
+    accept);
+
+  if (send_data(user->socketid, response, length) != length)
+  {
+    user_disconnect(user);
+    return -1;
+  }
+
+  user->request_type = REQUEST_WEBSOCKET;
+  user->need_header = NEED_HEADER_YES;
+
+  return 0;
+}
+
+// Reads what the client sent while frames are going out. Pings are
+// answered in front of the next frame, a close closes the connection
+// and anything else is skipped. Returns -1 if the connection should
+// be closed.
+int websocket_read(int id)
+{
+  User *user = users[id];
+  WebSocketState *websocket = &user->websocket;
+  uint8_t *header = websocket->partial;
+  uint64_t length;
+  int need, opcode, masked, n;
+
+  if (user->in_ptr >= user->in_len)
+  {
+#ifdef ENABLE_IO_URING
+    // The io_uring loop fills in_buffer when a recv completes.
+    if (user->io_uring == 1) { return 0; }
+#endif
+
+    user->in_len = recv(user->socketid, (char *)user->in_buffer, BUFFER_SIZE - 2, 0);
+    user->in_ptr = 0;
+
+    if (user->in_len == 0) { return -1; }
+
+    if (user->in_len < 0)
+    {
+      user->in_len = 0;
+
+#ifndef WINDOWS
+      if (errno == EAGAIN || errno == EWOULDBLOCK) { return 0; }
+#endif
+
+      return -1;
+    }
+  }
+
+  while (user->in_ptr < user->in_len)
+  {
+    if (websocket->skip > 0)
+    {
+      n = user->in_len - user->in_ptr;
+
+      if ((uint64_t)n > websocket->skip) { n = websocket->skip; }
+
+      websocket->skip -= n;
+      user->in_ptr += n;
+      continue;
+    }
+
+    // The frame header can be split across reads so it's put together
+    // in partial first.
+    while (1)
+    {
+      need = 2;
+
+      if (websocket->partial_len >= 2)
+      {
+        need += (header[1] & 0x80) != 0 ? 4 : 0;
+
+        if ((header[1] & 0x7f) == 126) { need += 2; }
+        if ((header[1] & 0x7f) == 127) { need += 8; }
+      }
+
+      if (websocket->partial_len >= need) { break; }
+      if (user->in_ptr >= user->in_len) { return 0; }
+
+      header[websocket->partial_len++] = user->in_buffer[user->in_ptr++];
+    }
+
+    websocket->partial_len = 0;
+
+    opcode = header[0] & 0x0f;
+    masked = (header[1] & 0x80) != 0;
+    length = header[1] & 0x7f;
+    n = 2;
+
+    if (length == 126)
+    {
+      length = (header[2] << 8) | header[3];
+      n = 4;
+    }
+      else
+    if (length == 127)
+    {
+      for (length = 0; n < 10; n++) { length = (length << 8) | header[n]; }
+    }
+
+    if (opcode == OPCODE_CLOSE)
+    {
+      // Only answered between frames, a close in the middle of a frame
+      // would corrupt it.
+      if (user->need_header == NEED_HEADER_YES)
+      {
+        send_data_nowait(user->socketid, "\x88\x02\x03\xe8", 4);
+      }
+
+      return -1;
+    }
+
+    if (opcode == OPCODE_PING &&
+        length <= WEBSOCKET_MAX_CONTROL &&
+        (uint64_t)(user->in_len - user->in_ptr) >= length)
+    {
+      uint8_t *mask = header + n;
+      int k;
+
+      for (k = 0; k < (int)length; k++)
+      {
+        websocket->pong[k] = user->in_buffer[user->in_ptr + k] ^
+          (masked ? mask[k & 3] : 0);
+      }
+
+      websocket->pong_len = length;
+      user->in_ptr += length;
+      continue;
+    }
+
+    websocket->skip = length;
+  }
+
+  return 0;
+}
+
+// Builds the start of the binary message for one JPEG into buffer: a
+// pong if one is owed, the WebSocket frame header and this header:
+//
+//   4 bytes  sequence number of the frame from its source
+//   8 bytes  microseconds since 1970 when the frame was ready
+//   2 bytes  source number
+//   2 bytes  length of this header (WEBSOCKET_HEADER_SIZE)
+//
+// all big endian, and then the JPEG. Returns the length.
+int websocket_frame_header(
+  User *user,
+  char *buffer,
+  int source,
+  uint32_t sequence,
+  int64_t ready_time,
+  int length)
+{
+  WebSocketState *websocket = &user->websocket;
+  uint64_t total = (uint64_t)length + WEBSOCKET_HEADER_SIZE;
+  int64_t timestamp;
+  int n = 0;
+
+  if (websocket->pong_len >= 0)
+  {
+    buffer[n++] = 0x8a;
+    buffer[n++] = websocket->pong_len;
+    memcpy(buffer + n, websocket->pong, websocket->pong_len);
+    n += websocket->pong_len;
+    websocket->pong_len = -1;
+  }
+
+  buffer[n++] = 0x82;
+
+  if (total < 126)
+  {
+    buffer[n++] = total;
+  }
+    else
+  if (total < 65536)
+  {
+    buffer[n++] = 126;
+    put_bytes(buffer + n, total, 2);
+    n += 2;
+  }
+    else
+  {
+    buffer[n++] = 127;
+    put_bytes(buffer + n, total, 8);
+    n += 8;
+  }
+
+  timestamp = get_wall_time_us() - (get_time_ns() - ready_time) / 1000;
+
+  put_bytes(buffer + n, sequence, 4);
+  put_bytes(buffer + n + 4, timestamp, 8);
+  put_bytes(buffer + n + 12, source, 2);
+  put_bytes(buffer + n + 14, WEBSOCKET_HEADER_SIZE, 2);
+
+  return n + WEBSOCKET_HEADER_SIZE;
+}
+
@@ -0,0 +1,53 @@
+/*
+
+  mjpeg_webserver - Web server optimized for JPEGs from a webcam or AVI file.
+
+  Copyright 2004-2024 - Michael Kohn (mike@mikekohn.net)
+  https://www.mikekohn.net/
+
+  This program falls under the GPLv3 license.
+
+*/
+
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+#include <stdint.h>
+
+// Every frame goes out as one binary message starting with this many
+// bytes of header (see websocket_frame_header()).
+#define WEBSOCKET_HEADER_SIZE 16
+
+#define WEBSOCKET_MAX_CONTROL 125
+
+struct User;
+
+typedef struct WebSocketState
+{
+  // From the request headers, the upgrade happens when they end.
+  int upgrade;
+  char key[32];
+  // A ping to answer in front of the next frame, -1 if there isn't one.
+  int pong_len;
+  uint8_t pong[WEBSOCKET_MAX_CONTROL];
+  // A client frame header split across reads and how much of a client
+  // message is left to skip.
+  int partial_len;
+  uint8_t partial[14];
+  uint64_t skip;
+} WebSocketState;
+
+void websocket_init(struct User *user);
+void websocket_header_line(struct User *user, const char *line);
+int websocket_accept(int id);
+int websocket_read(int id);
+int websocket_frame_header(
+  struct User *user,
+  char *buffer,
+  int source,
+  uint32_t sequence,
+  int64_t ready_time,
+  int length);
+
+#endif
+